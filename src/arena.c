@@ -0,0 +1,78 @@
+/**
+ * @file arena.c
+ * @brief Bump allocator for objects sharing one lifetime (e.g. a request).
+ */
+
+#include <stdlib.h>
+#include <stdint.h> // SIZE_MAX
+
+#include "error.h"
+#include "arena.h"
+
+/**
+ * @brief Allocates the block of an arena
+ *
+ * @param arena (struct arena*): Given arena to initialize
+ * @param size (size_t): Given size of the block
+ * @return (int): Error code
+ */
+int arena_init(struct arena* arena, size_t size)
+{
+    M_REQUIRE_NON_NULL(arena);
+
+    arena->base = malloc(size);
+    if (arena->base == NULL) {
+        arena->size = arena->used = 0;
+        return ERR_OUT_OF_MEMORY;
+    }
+    arena->size = size;
+    arena->used = 0;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Hands out aligned memory from the arena
+ *
+ * @param arena (struct arena*): Given arena
+ * @param size (size_t): Given number of bytes wanted
+ * @return (void*): The memory, NULL if there is not enough room left
+ */
+void* arena_alloc(struct arena* arena, size_t size)
+{
+    if (arena == NULL || arena->base == NULL || size > SIZE_MAX - ARENA_ALIGN) {
+        return NULL;
+    }
+
+    const size_t start = (arena->used + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    if (start > arena->size || size > arena->size - start) {
+        return NULL;
+    }
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+/**
+ * @brief Takes back everything handed out by the arena
+ *
+ * @param arena (struct arena*): Given arena
+ */
+void arena_reset(struct arena* arena)
+{
+    if (arena != NULL) {
+        arena->used = 0;
+    }
+}
+
+/**
+ * @brief Frees the block of the arena
+ *
+ * @param arena (struct arena*): Given arena
+ */
+void arena_free(struct arena* arena)
+{
+    if (arena != NULL) {
+        free(arena->base);
+        arena->base = NULL;
+        arena->size = arena->used = 0;
+    }
+}
@@ -0,0 +1,59 @@
+/**
+ * @file arena.h
+ * @brief Bump allocator for objects sharing one lifetime (e.g. a request).
+ *
+ * Allocations are carved one after the other from a single block and are
+ * never freed one by one: arena_reset() releases all of them at once.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ARENA_ALIGN 16
+
+struct arena {
+    char* base;  // the block, NULL when not initialized
+    size_t size; // its size, in bytes
+    size_t used; // bytes already handed out (alignment padding included)
+};
+
+/**
+ * @brief Allocates the block of an arena of `size` bytes.
+ *
+ * @param arena The arena to initialize
+ * @param size The size of its block
+ * @return Some error code. 0 if no error.
+ */
+int arena_init(struct arena* arena, size_t size);
+
+/**
+ * @brief Hands out `size` bytes, aligned on ARENA_ALIGN, from the arena.
+ *
+ * @param arena The arena
+ * @param size The number of bytes wanted
+ * @return The memory (not zeroed), NULL if the arena has not enough room left.
+ */
+void* arena_alloc(struct arena* arena, size_t size);
+
+/**
+ * @brief Takes back everything handed out by the arena (the block is kept).
+ *
+ * @param arena The arena
+ */
+void arena_reset(struct arena* arena);
+
+/**
+ * @brief Frees the block of the arena.
+ *
+ * @param arena The arena
+ */
+void arena_free(struct arena* arena);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,126 @@
+/**
+ * @file buf_pool.c
+ * @brief Pool of large buffers (image payloads), recycled by size class.
+ */
+
+#include <stdint.h> // for SIZE_MAX
+#include <stdlib.h>
+
+#include "buf_pool.h"
+
+#define NB_CLASSES (BUF_POOL_MAX_SHIFT - BUF_POOL_MIN_SHIFT + 1)
+
+// a kept buffer stores the link to the next one in its first bytes
+struct free_buf {
+    struct free_buf* next;
+};
+
+struct size_class {
+    struct free_buf* head;
+    size_t count;
+};
+
+static _Thread_local struct size_class classes[NB_CLASSES];
+
+// bytes kept by all the threads, and their bound; only an approximate bound, hence relaxed
+static size_t kept_bytes;
+static size_t budget = SIZE_MAX;
+
+/**
+ * @brief Finds the size class of a buffer size
+ *
+ * @param size (size_t): Given size
+ * @return (int): Index of the class, -1 if size is above BUF_POOL_MAX_SIZE
+ */
+static int class_of(size_t size)
+{
+    if (size > BUF_POOL_MAX_SIZE) {
+        return -1;
+    }
+    int c = 0;
+    while ((BUF_POOL_MIN_SIZE << c) < size) {
+        ++c;
+    }
+    return c;
+}
+
+/**
+ * @brief Gets a buffer of at least `size` bytes
+ *
+ * @param size (size_t): Given number of bytes needed
+ * @return (void*): The buffer, NULL if out of memory
+ */
+void* buf_pool_get(size_t size)
+{
+    const int c = class_of(size);
+    if (c < 0) {
+        return malloc(size);
+    }
+
+    struct size_class* const cls = &classes[c];
+    if (cls->head != NULL) {
+        struct free_buf* const buf = cls->head;
+        cls->head = buf->next;
+        cls->count--;
+        __atomic_sub_fetch(&kept_bytes, BUF_POOL_MIN_SIZE << c, __ATOMIC_RELAXED);
+        return buf;
+    }
+    return malloc(BUF_POOL_MIN_SIZE << c);
+}
+
+/**
+ * @brief Gives back a buffer obtained from buf_pool_get()
+ *
+ * @param buf (void*): Given buffer
+ * @param size (size_t): Given size it was asked for with
+ */
+void buf_pool_put(void* buf, size_t size)
+{
+    if (buf == NULL) {
+        return;
+    }
+
+    const int c = class_of(size);
+    if (c < 0 || classes[c].count == BUF_POOL_KEEP) {
+        free(buf);
+        return;
+    }
+    const size_t class_size = BUF_POOL_MIN_SIZE << c;
+    if (__atomic_add_fetch(&kept_bytes, class_size, __ATOMIC_RELAXED) >
+        __atomic_load_n(&budget, __ATOMIC_RELAXED)) {
+        __atomic_sub_fetch(&kept_bytes, class_size, __ATOMIC_RELAXED);
+        free(buf);
+        return;
+    }
+
+    struct free_buf* const kept = buf;
+    kept->next = classes[c].head;
+    classes[c].head = kept;
+    classes[c].count++;
+}
+
+/**
+ * @brief Frees all the buffers kept by the calling thread
+ */
+void buf_pool_drain(void)
+{
+    for (size_t c = 0; c < NB_CLASSES; ++c) {
+        while (classes[c].head != NULL) {
+            struct free_buf* const buf = classes[c].head;
+            classes[c].head = buf->next;
+            free(buf);
+        }
+        __atomic_sub_fetch(&kept_bytes, classes[c].count * (BUF_POOL_MIN_SIZE << c), __ATOMIC_RELAXED);
+        classes[c].count = 0;
+    }
+}
+
+/**
+ * @brief Bounds the bytes kept by all the threads together
+ *
+ * @param bytes (size_t): Given budget
+ */
+void buf_pool_set_budget(size_t bytes)
+{
+    __atomic_store_n(&budget, bytes, __ATOMIC_RELAXED);
+}
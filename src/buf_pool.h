@@ -0,0 +1,59 @@
+/**
+ * @file buf_pool.h
+ * @brief Pool of large buffers (image payloads), recycled by size class.
+ *
+ * Sizes are rounded up to a power of two between BUF_POOL_MIN_SIZE and
+ * BUF_POOL_MAX_SIZE, and a few released buffers of each class are kept for
+ * the next request instead of going back to malloc. The cached buffers
+ * belong to the calling thread, so that threads never share (or wait for)
+ * a free list. Larger buffers are plainly malloc'ed and freed.
+ *
+ * The bytes kept by all the threads together may be bounded (see
+ * buf_pool_set_budget()): a buffer given back beyond it is freed.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BUF_POOL_MIN_SHIFT 12 // 4 KiB
+#define BUF_POOL_MAX_SHIFT 23 // 8 MiB, i.e. MAX_REQUEST_SIZE
+#define BUF_POOL_MIN_SIZE  ((size_t) 1 << BUF_POOL_MIN_SHIFT)
+#define BUF_POOL_MAX_SIZE  ((size_t) 1 << BUF_POOL_MAX_SHIFT)
+#define BUF_POOL_KEEP 4 // buffers kept per size class and thread
+
+/**
+ * @brief Gets a buffer of at least `size` bytes.
+ *
+ * @param size The number of bytes needed
+ * @return The buffer (not zeroed), NULL if out of memory.
+ */
+void* buf_pool_get(size_t size);
+
+/**
+ * @brief Gives back a buffer obtained from buf_pool_get().
+ *
+ * @param buf The buffer (may be NULL)
+ * @param size The size it was asked for with
+ */
+void buf_pool_put(void* buf, size_t size);
+
+/**
+ * @brief Frees all the buffers kept by the calling thread.
+ */
+void buf_pool_drain(void);
+
+/**
+ * @brief Bounds the bytes kept by all the threads together, unbounded by default.
+ *
+ * @param bytes The budget; the buffers already kept above it are not freed
+ */
+void buf_pool_set_budget(size_t bytes);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,207 @@
+/**
+ * @file crc32c.c
+ * @brief CRC-32C, with the CRC32 instructions of the CPU when it has them.
+ *
+ * The functions below work on the raw state of the CRC (crc32c() does the
+ * usual inversions before and after). The state after some bytes is linear
+ * in the state before them: the CRC of three consecutive stripes can thus
+ * be computed as three independent CRCs, the first two being then "shifted"
+ * over the stripes after them by a table lookup. The three dependency chains
+ * keep the CRC32 unit busy, where a single one waits for each result.
+ */
+
+#include <pthread.h>
+#include <string.h> // memcpy
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h> // _mm_crc32_u64
+#elif defined(__aarch64__)
+#include <arm_acle.h>  // __crc32cd
+#include <sys/auxv.h>  // getauxval
+#include <asm/hwcap.h> // HWCAP_CRC32
+#endif
+
+#define POLY 0x82F63B78u // reversed Castagnoli polynomial
+#define STRIPE 2048      // bytes per stripe, a multiple of 8
+
+static uint32_t table[8][256];       // slice-by-8 tables
+static uint32_t shift_table[4][256]; // state after STRIPE zero bytes, per byte of the state before
+
+typedef uint32_t (*update_fn)(uint32_t state, const unsigned char* data, size_t size);
+static update_fn update = NULL;
+static const char* impl_name = "table";
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Reads 8 bytes, whatever their alignment
+ *
+ * @param p (const unsigned char*): Given bytes
+ * @return (uint64_t): Their value, in the byte order of the CPU
+ */
+static inline uint64_t load64(const unsigned char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * @brief Moves a state over STRIPE zero bytes
+ *
+ * @param state (uint32_t): Given state
+ * @return (uint32_t): The state after the zero bytes
+ */
+static inline uint32_t shift(uint32_t state)
+{
+    return shift_table[0][state & 0xff] ^ shift_table[1][(state >> 8) & 0xff] ^
+           shift_table[2][(state >> 16) & 0xff] ^ shift_table[3][state >> 24];
+}
+
+/**
+ * @brief Updates a state with the lookup tables, eight bytes at a time
+ *
+ * @param state (uint32_t): Given state
+ * @param p (const unsigned char*): Given bytes
+ * @param n (size_t): Given number of bytes
+ * @return (uint32_t): The updated state
+ */
+static uint32_t update_table(uint32_t state, const unsigned char* p, size_t n)
+{
+    while (n >= 8) {
+        // the tables are indexed by the bytes in memory order: little-endian only
+        const uint64_t v = load64(p) ^ state;
+        state = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^
+                table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^
+                table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^
+                table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+        p += 8;
+        n -= 8;
+    }
+    while (n--) {
+        state = table[0][(state ^ *p++) & 0xff] ^ (state >> 8);
+    }
+    return state;
+}
+
+/*
+ * Update with the instructions, in three stripes while there is enough data.
+ * CRC64 (resp. CRC8) is the instruction for 8 bytes (resp. one byte).
+ */
+#define DEFINE_UPDATE_HW(NAME, TARGET, CRC64, CRC8)                             \
+    __attribute__((target(TARGET)))                                            \
+    static uint32_t NAME(uint32_t state, const unsigned char* p, size_t n)     \
+    {                                                                          \
+        while (n >= 3 * STRIPE) {                                              \
+            uint64_t a = state, b = 0, c = 0;                                  \
+            for (size_t i = 0; i < STRIPE; i += 8) {                           \
+                a = CRC64(a, load64(p + i));                                   \
+                b = CRC64(b, load64(p + STRIPE + i));                          \
+                c = CRC64(c, load64(p + 2 * STRIPE + i));                      \
+            }                                                                  \
+            state = shift(shift((uint32_t) a) ^ (uint32_t) b) ^ (uint32_t) c;  \
+            p += 3 * STRIPE;                                                   \
+            n -= 3 * STRIPE;                                                   \
+        }                                                                      \
+        uint64_t s = state;                                                    \
+        for (; n >= 8; p += 8, n -= 8) {                                       \
+            s = CRC64(s, load64(p));                                           \
+        }                                                                      \
+        state = (uint32_t) s;                                                  \
+        while (n--) {                                                          \
+            state = CRC8(state, *p++);                                         \
+        }                                                                      \
+        return state;                                                          \
+    }
+
+#if defined(__x86_64__)
+DEFINE_UPDATE_HW(update_hw, "sse4.2", _mm_crc32_u64, _mm_crc32_u8)
+#define HW_NAME "sse4.2"
+#define HAS_HW() __builtin_cpu_supports("sse4.2")
+#elif defined(__aarch64__)
+#ifdef __clang__
+#define TARGET_CRC "crc"
+#else
+#define TARGET_CRC "+crc"
+#endif
+DEFINE_UPDATE_HW(update_hw, TARGET_CRC, __crc32cd, __crc32cb)
+#define HW_NAME "armv8"
+#define HAS_HW() (getauxval(AT_HWCAP) & HWCAP_CRC32)
+#endif
+
+/**
+ * @brief Fills the tables and chooses the implementation; run once
+ */
+static void init(void)
+{
+    for (uint32_t b = 0; b < 256; ++b) {
+        uint32_t crc = b;
+        for (int k = 0; k < 8; ++k) {
+            crc = (crc >> 1) ^ (POLY & (0u - (crc & 1)));
+        }
+        table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; ++b) {
+        for (int t = 1; t < 8; ++t) {
+            table[t][b] = table[0][table[t - 1][b] & 0xff] ^ (table[t - 1][b] >> 8);
+        }
+    }
+
+    update = update_table;
+#ifdef HW_NAME
+    if (HAS_HW()) {
+        update = update_hw;
+        impl_name = HW_NAME;
+    }
+#endif
+
+    // the shift is linear: it is known from its value on each bit of the state
+    static const unsigned char zeros[STRIPE];
+    uint32_t bit_shift[32];
+    for (int j = 0; j < 32; ++j) {
+        bit_shift[j] = update_table(1u << j, zeros, STRIPE);
+    }
+    for (int k = 0; k < 4; ++k) {
+        for (uint32_t b = 0; b < 256; ++b) {
+            uint32_t s = 0;
+            for (int j = 0; j < 8; ++j) {
+                if (b & (1u << j)) {
+                    s ^= bit_shift[8 * k + j];
+                }
+            }
+            shift_table[k][b] = s;
+        }
+    }
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t size)
+{
+    pthread_once(&init_once, init);
+    if (data == NULL) {
+        return crc;
+    }
+    return ~update(~crc, data, size);
+}
+
+void crc32c_put(uint32_t crc, unsigned char* bytes)
+{
+    for (int i = 0; i < CRC32C_BYTES; ++i) {
+        bytes[i] = (unsigned char) (crc >> (8 * i));
+    }
+}
+
+uint32_t crc32c_get(const unsigned char* bytes)
+{
+    uint32_t crc = 0;
+    for (int i = 0; i < CRC32C_BYTES; ++i) {
+        crc |= (uint32_t) bytes[i] << (8 * i);
+    }
+    return crc;
+}
+
+const char* crc32c_impl(void)
+{
+    pthread_once(&init_once, init);
+    return impl_name;
+}
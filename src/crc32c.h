@@ -0,0 +1,60 @@
+/**
+ * @file crc32c.h
+ * @brief CRC-32C (Castagnoli), the checksum of the blobs of an imgFS.
+ *
+ * Computed with the CRC32 instructions of the CPU when it has them
+ * (SSE 4.2 on x86-64, the CRC extension on ARMv8), chosen at run time,
+ * otherwise with lookup tables. Large buffers are cut in three stripes
+ * whose instructions overlap, so that the checksum runs at about the
+ * bandwidth of the memory rather than at the latency of one instruction.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CRC32C_BYTES 4
+
+/**
+ * @brief Updates a CRC-32C with some bytes.
+ *
+ * crc32c(crc32c(0, a, n), b, m) is the CRC of a followed by b.
+ *
+ * @param crc The CRC of the previous bytes (0 to start)
+ * @param data The bytes
+ * @param size Their number
+ * @return The CRC of all the bytes.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+
+/**
+ * @brief Writes a CRC as CRC32C_BYTES little-endian bytes.
+ *
+ * @param crc The CRC
+ * @param bytes Where to write it
+ */
+void crc32c_put(uint32_t crc, unsigned char* bytes);
+
+/**
+ * @brief Reads a CRC written by crc32c_put().
+ *
+ * @param bytes The CRC32C_BYTES bytes
+ * @return The CRC.
+ */
+uint32_t crc32c_get(const unsigned char* bytes);
+
+/**
+ * @brief Tells how crc32c() computes.
+ *
+ * @return "sse4.2", "armv8" or "table".
+ */
+const char* crc32c_impl(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -22,5 +22,7 @@ const char* const ERR_MESSAGES[] = {
     "Existing image ID",
     "Image manipulation library error",
     "Debug",
+    "Server busy, try again later",
+    "Inconsistent imgFS file",
     "no error (shall not be displayed)" // ERR_LAST
 };
@@ -42,6 +42,8 @@ enum error_codes {
     ERR_DUPLICATE_ID,
     ERR_IMGLIB,
     ERR_DEBUG,
+    ERR_BUSY,
+    ERR_CORRUPT_IMGFS,
     ERR_LAST // not an actual error but to have e.g. the total number of errors
 };
 
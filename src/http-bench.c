@@ -0,0 +1,102 @@
+/*
+ * @file http-bench.c
+ * @brief Throughput of the HTTP request parsing (http_parse_message,
+ *        http_get_header and http_get_var) on typical imgFS requests.
+ *
+ * Usage: http-bench [iterations [lines|indexed]]
+ *
+ * "indexed" measures http_parse_message_indexed() instead of the default
+ * line by line http_parse_message().
+ */
+
+#include "error.h"
+#include "util.h" // atouint32
+#include "imgfs.h" // MAX_IMG_ID
+#include "http_prot.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_ITERATIONS 1000000
+
+static const char* const requests[] = {
+    "GET /imgfs/read?res=orig&img_id=pic1 HTTP/1.1" HTTP_LINE_DELIM
+    "Host: localhost:8000" HTTP_LINE_DELIM "User-Agent: curl/8.5.0" HTTP_LINE_DELIM
+    "Accept: */*" HTTP_HDR_END_DELIM,
+
+    "GET /imgfs/read?res=small&img_id=holiday%20picture%2001.jpg HTTP/1.1" HTTP_LINE_DELIM
+    "Host: localhost:8000" HTTP_LINE_DELIM
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0" HTTP_LINE_DELIM
+    "Accept: image/avif,image/webp,*/*" HTTP_LINE_DELIM
+    "Accept-Language: fr,fr-FR;q=0.8,en-US;q=0.5,en;q=0.3" HTTP_LINE_DELIM
+    "Accept-Encoding: gzip, deflate, br" HTTP_LINE_DELIM
+    "Referer: http://localhost:8000/index.html" HTTP_LINE_DELIM
+    "If-None-Match: \"95962b09e0fc9716ee4c2a1cf173f9147758235360d7ac0a73dfa378858b8a10-small\"" HTTP_LINE_DELIM
+    "Connection: keep-alive" HTTP_LINE_DELIM "Sec-Fetch-Dest: image" HTTP_LINE_DELIM
+    "Sec-Fetch-Mode: no-cors" HTTP_LINE_DELIM "Sec-Fetch-Site: same-origin" HTTP_HDR_END_DELIM,
+
+    "GET /imgfs/list?prefix=pic&limit=20 HTTP/1.1" HTTP_LINE_DELIM
+    "Host: localhost:8000" HTTP_LINE_DELIM "Accept: application/json" HTTP_HDR_END_DELIM,
+
+    "POST /imgfs/insert?name=papillon.jpg HTTP/1.1" HTTP_LINE_DELIM
+    "Host: localhost:8000" HTTP_LINE_DELIM "User-Agent: curl/8.5.0" HTTP_LINE_DELIM
+    "Content-Type: application/octet-stream" HTTP_LINE_DELIM
+    "Content-Length: 12" HTTP_HDR_END_DELIM "Hello world!"
+};
+#define NB_REQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+static double elapsed(const struct timespec* start, const struct timespec* stop)
+{
+    return (double) (stop->tv_sec - start->tv_sec) + (double) (stop->tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t iterations = DEFAULT_ITERATIONS;
+    int (*parse)(const char*, size_t, struct http_message*, int*) = http_parse_message;
+    if ((argc > 1 && (iterations = atouint32(argv[1])) == 0) ||
+        (argc > 2 && strcmp(argv[2], "lines") != 0 && strcmp(argv[2], "indexed") != 0)) {
+        fprintf(stderr, "Usage: %s [iterations [lines|indexed]]\n", argv[0]);
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (argc > 2 && strcmp(argv[2], "indexed") == 0) {
+        parse = http_parse_message_indexed;
+    }
+
+    size_t lengths[NB_REQUESTS];
+    for (size_t i = 0; i < NB_REQUESTS; ++i) {
+        lengths[i] = strlen(requests[i]);
+    }
+
+    struct http_message msg;
+    char value[MAX_IMG_ID + 1];
+    size_t bytes = 0;
+    size_t checksum = 0; // keeps the compiler from dropping the work
+
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t n = 0; n < iterations; ++n) {
+        const size_t i = n % NB_REQUESTS;
+        int content_len = 0;
+        if (parse(requests[i], lengths[i], &msg, &content_len) != 1) {
+            fprintf(stderr, "Failed to parse request %zu\n", i);
+            return ERR_RUNTIME;
+        }
+        const struct http_string* host = http_get_header(&msg, "host");
+        const int var_len = http_get_var(&msg.uri, i == 3 ? "name" : "img_id", value, MAX_IMG_ID);
+        checksum += msg.num_headers + (host != NULL ? host->len : 0) + (size_t) (var_len > 0 ? var_len : 0);
+        bytes += lengths[i];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    const double seconds = elapsed(&start, &stop);
+    printf("requests: %u\n", iterations);
+    printf("time: %.3f s\n", seconds);
+    printf("throughput: %.0f requests/s, %.1f MB/s\n",
+           iterations / seconds, (double) bytes / seconds / 1e6);
+    printf("ns/request: %.1f\n", seconds * 1e9 / iterations);
+    printf("(checksum %zu)\n", checksum);
+
+    return ERR_NONE;
+}
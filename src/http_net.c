@@ -5,19 +5,32 @@
  * @author Konstantinos Prasopoulos
  */
 
+#define _GNU_SOURCE // pthread_setaffinity_np()
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sched.h> // cpu_set_t
 
 #include "http_net.h"
 #include "socket_layer.h"
 #include "error.h"
 #include "http_prot.h"
+#include "arena.h"
+#include "buf_pool.h"
 
 static int passive_socket = -1;
 static EventCallback cb;
+// see http_set_indexed_parser()
+static int (*parse)(const char*, size_t, struct http_message*, int*) = http_parse_message;
 
 #define MK_OUR_ERR(X) \
 static int our_ ## X = X
@@ -27,73 +40,146 @@ MK_OUR_ERR(ERR_INVALID_ARGUMENT);
 MK_OUR_ERR(ERR_OUT_OF_MEMORY);
 MK_OUR_ERR(ERR_IO);
 
+#define EXPECT_CONTINUE "100-continue"
+#define CONTINUE_REPLY HTTP_PROTOCOL_ID " 100 Continue" HTTP_HDR_END_DELIM
+
+static int send_all(int connection, const char* buf, size_t len);
+
+// Bytes sent by the calling thread, see http_sent_bytes()
+static _Thread_local size_t sent_bytes;
+
+// Memory of the request being handled, taken back once it is answered
+#define REQUEST_ARENA_SIZE 65536
+static _Thread_local struct arena request_arena;
+
 /*******************************************************************
- * Handle connection
+ * Allocate request-scoped memory
  */
-static void *handle_connection(void *arg)
+void* http_alloc(size_t size)
 {
-    char* rcvbuf = calloc(MAX_HEADER_SIZE, sizeof(char));
-    int content_len = 0;
-    struct http_message msg = {0};
-    int connection = *(int *) arg;
+    if (request_arena.base == NULL &&
+        arena_init(&request_arena, REQUEST_ARENA_SIZE) != ERR_NONE) {
+        return NULL;
+    }
+    return arena_alloc(&request_arena, size);
+}
 
-    int bytes_received = (int) tcp_read(connection, rcvbuf, MAX_HEADER_SIZE);
-    if (bytes_received == -1) {
-        free(rcvbuf);
-        rcvbuf = NULL;
-        return &our_ERR_IO;
+/*******************************************************************
+ * Close a connection without losing the reply to a reset:
+ * the unread part of the request (e.g. a rejected upload) is drained first
+ */
+#define LINGER_TIMEOUT_SEC 1
+#define LINGER_BUF_SIZE 4096
 
-    } else if (!bytes_received) {
-        free(rcvbuf);
-        rcvbuf = NULL;
-        close(connection);
-        return &our_ERR_NONE;
+static void lingering_close(int connection)
+{
+    if (shutdown(connection, SHUT_WR) == 0) {
+        const struct timeval timeout = { .tv_sec = LINGER_TIMEOUT_SEC, .tv_usec = 0 };
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        char buf[LINGER_BUF_SIZE];
+        size_t drained = 0;
+        ssize_t n = 0;
+        while (drained < MAX_REQUEST_SIZE && (n = tcp_read(connection, buf, sizeof(buf))) > 0) {
+            drained += (size_t) n;
+        }
     }
+    close(connection);
+}
 
-    int ret = http_parse_message(rcvbuf, bytes_received, &msg, &content_len);
+/*******************************************************************
+ * Handle connection
+ */
+// a client silent for that long is given up, so that it never holds its thread (nor a lock)
+#define RECEIVE_TIMEOUT_SEC 10
 
-    if (ret == -1) {
-        free(rcvbuf);
-        rcvbuf = NULL;
-        return &our_ERR_IO;
+static void *handle_connection(void *arg)
+{
+    // one more byte so that the headers always end with a '\0' for the parser
+    char* const rcvbuf = http_alloc(MAX_HEADER_SIZE + 1);
+    if (rcvbuf == NULL) {
+        close(*(int *) arg);
+        return &our_ERR_OUT_OF_MEMORY;
     }
-
-    // the body was only partially filled, so we extend size of rcvbuf one time
-    if (!ret) {
-        char* new_rcvbuf = realloc(rcvbuf, MAX_HEADER_SIZE + content_len);
-        if (!new_rcvbuf) {
-            free(new_rcvbuf);
-            new_rcvbuf = NULL;
-            return &our_ERR_OUT_OF_MEMORY;
+    rcvbuf[0] = '\0';
+    int content_len = 0;
+    struct http_message msg = {0};
+    int connection = *(int *) arg;
+    int* result = &our_ERR_NONE;
+
+    const struct timeval timeout = { .tv_sec = RECEIVE_TIMEOUT_SEC, .tv_usec = 0 };
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // Read until the headers are complete; the body is left to the callback
+    // when it does not come along with them, so that it can be streamed
+    size_t bytes_received = 0;
+    int ret = 0;
+    while (ret == 0 && content_len == 0 && bytes_received < MAX_HEADER_SIZE) {
+        const ssize_t n = tcp_read(connection, rcvbuf + bytes_received,
+                                   MAX_HEADER_SIZE - bytes_received);
+        if (n <= 0) {
+            close(connection);
+            arena_reset(&request_arena);
+            return n == 0 && bytes_received == 0 ? &our_ERR_NONE : &our_ERR_IO;
         }
-        rcvbuf = new_rcvbuf;
-
-        // we increase pointer to receive new bytes
-        char* body = rcvbuf;
-        body += MAX_HEADER_SIZE + content_len;
+        bytes_received += (size_t) n;
+        rcvbuf[bytes_received] = '\0';
 
-        ret = (int) tcp_read(connection, body, content_len);
+        ret = parse(rcvbuf, bytes_received, &msg, &content_len);
+    }
 
-        if(ret == -1) {
-            free(rcvbuf);
-            rcvbuf = NULL;
-            return &our_ERR_IO;
+    if (ret < 0 || (ret == 0 && content_len == 0)) {
+        // malformed request, or headers larger than MAX_HEADER_SIZE
+        http_reply(connection, HTTP_BAD_REQUEST, "", NULL, 0);
+        result = &our_ERR_INVALID_ARGUMENT;
+    } else if (content_len > MAX_REQUEST_SIZE) {
+        http_reply(connection, "413 Content Too Large", "", NULL, 0);
+    } else {
+        // the client waits for our go before sending a large body
+        const struct http_string* expect = http_get_header(&msg, "Expect");
+        if (ret == 0 && expect != NULL && expect->len == strlen(EXPECT_CONTINUE) &&
+            !strncasecmp(expect->val, EXPECT_CONTINUE, expect->len)) {
+            send_all(connection, CONTINUE_REPLY, strlen(CONTINUE_REPLY));
+        }
+        if (cb(&msg, connection) == HTTP_CONNECTION_KEPT) { //EventCallback
+            // answered later by the callback, which then calls http_end()
+            arena_reset(&request_arena);
+            return result;
         }
-
     }
 
-    if (ret > 0) {
-        cb(&msg, connection); //EventCallback
-        free(rcvbuf);
-        rcvbuf = NULL;
-        content_len = 0;
-        return &our_ERR_NONE;
-    }
+    // the request is answered: all its memory goes back at once
+    arena_reset(&request_arena);
+    lingering_close(connection);
+    return result;
+}
+
+
+/*******************************************************************
+ * Count the bytes sent by the calling thread
+ */
+size_t http_sent_bytes(void)
+{
+    return sent_bytes;
+}
 
-    // required arguments may be null
-    return &our_ERR_INVALID_ARGUMENT;
+/*******************************************************************
+ * End a connection kept by its callback
+ */
+void http_end(int connection)
+{
+    arena_reset(&request_arena);
+    lingering_close(connection);
 }
 
+/*******************************************************************
+ * Free the memory of the calling thread
+ */
+void http_thread_cleanup(void)
+{
+    arena_free(&request_arena);
+    buf_pool_drain();
+}
 
 /*******************************************************************
  * Init connection
@@ -106,6 +192,14 @@ int http_init(uint16_t port, EventCallback callback)
     return passive_socket;
 }
 
+/*******************************************************************
+ * Pick the parser of the requests
+ */
+void http_set_indexed_parser(int on)
+{
+    parse = on ? http_parse_message_indexed : http_parse_message;
+}
+
 /*******************************************************************
  * Close connection
  */
@@ -117,6 +211,7 @@ void http_close(void)
         else
             passive_socket = -1;
     }
+    http_thread_cleanup();
 }
 
 /*******************************************************************
@@ -126,11 +221,104 @@ int http_receive(void)
 {
     int connection = tcp_accept(passive_socket);
     if (connection == -1) {
-        return ERR_IO;
+        return errno == EINTR || errno == ECONNABORTED ? ERR_NONE : ERR_IO;
     }
 
-    int ret = *(int *) handle_connection(&connection);
+    // a silent, gone or bad client only ends its own connection, as in shard_loop()
+    handle_connection(&connection);
+    return ERR_NONE;
+}
 
+/*******************************************************************
+ * Shards: threads with their own listener on the same port
+ */
+struct shard {
+    pthread_t thread;
+    int listener;
+    long cpu; // CPU to run on, -1 for any
+    int ret;
+};
+
+static void* shard_loop(void* arg)
+{
+    struct shard* const shard = arg;
+
+    if (shard->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET((size_t) shard->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            fprintf(stderr, "http shard: could not be pinned to CPU %ld\n", shard->cpu);
+        }
+    }
+
+    // a bad request only ends its own connection, never the shard
+    for (;;) {
+        int connection = tcp_accept(shard->listener);
+        if (connection == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            shard->ret = ERR_IO;
+            break;
+        }
+        handle_connection(&connection);
+    }
+
+    http_thread_cleanup();
+    return NULL;
+}
+
+int http_run_shards(uint16_t port, EventCallback callback, size_t nb_shards)
+{
+    M_REQUIRE_NON_NULL(callback);
+    if (nb_shards == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    cb = callback;
+
+    struct shard* const shards = calloc(nb_shards, sizeof(struct shard));
+    if (shards == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    const long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // all the listeners are bound before any thread starts, so that a busy
+    // port is reported at once
+    int ret = ERR_NONE;
+    size_t started = 0;
+    for (size_t i = 0; i < nb_shards && ret == ERR_NONE; ++i) {
+        shards[i].listener = tcp_server_init_shared(port);
+        shards[i].cpu = nb_cpus > 0 ? (long) i % nb_cpus : -1;
+        if (shards[i].listener < 0) {
+            ret = ERR_IO;
+            nb_shards = i;
+        }
+    }
+    for (size_t i = 0; i < nb_shards && ret == ERR_NONE; ++i) {
+        if (pthread_create(&shards[i].thread, NULL, shard_loop, &shards[i]) != 0) {
+            ret = ERR_THREADING;
+        } else {
+            ++started;
+        }
+    }
+
+    if (ret != ERR_NONE) {
+        // makes the accept() of the running shards fail, so that they stop
+        for (size_t i = 0; i < started; ++i) {
+            shutdown(shards[i].listener, SHUT_RDWR);
+        }
+    }
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(shards[i].thread, NULL);
+        if (ret == ERR_NONE) {
+            ret = shards[i].ret;
+        }
+    }
+    for (size_t i = 0; i < nb_shards; ++i) {
+        close(shards[i].listener);
+    }
+    free(shards);
     return ret;
 }
 
@@ -161,7 +349,7 @@ int http_serve_file(int connection, const char* filename)
     const size_t file_size = (size_t) pos;
 
     // read file content
-    char* const buffer = calloc(file_size + 1, 1);
+    char* const buffer = buf_pool_get(file_size);
     if (buffer == NULL) {
         fprintf(stderr, "http_serve_file(): Failed to allocate memory to serve \"%s\"\n", filename);
         fclose(file);
@@ -172,6 +360,7 @@ int http_serve_file(int connection, const char* filename)
     if (bytes_read != file_size) {
         fprintf(stderr, "http_serve_file(): Failed to read \"%s\"\n", filename);
         fclose(file);
+        buf_pool_put(buffer, file_size);
         return ERR_IO;
     }
 
@@ -182,52 +371,206 @@ int http_serve_file(int connection, const char* filename)
 
     // garbage collecting
     fclose(file);
-    free(buffer);
+    buf_pool_put(buffer, file_size);
     return ret;
 }
 
+/*******************************************************************
+ * Send a whole buffer, even when the socket only takes part of it
+ */
+static int send_all(int connection, const char* buf, size_t len)
+{
+    while (len > 0) {
+        const ssize_t sent = tcp_send(connection, buf, len);
+        if (sent <= 0) {
+            return ERR_IO;
+        }
+        sent_bytes += (size_t) sent;
+        buf += sent;
+        len -= (size_t) sent;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Format the status line and headers of a reply
+ */
+#define CONTENT_LENGTH_TXT "Content-Length: "
+#define MAX_SIZE_T_DIGITS 20
+#define HEAD_MAX(status, headers) \
+    (strlen(HTTP_PROTOCOL_ID) + 1 + strlen(status) + strlen(HTTP_LINE_DELIM) \
+     + strlen(headers) + strlen(CONTENT_LENGTH_TXT) \
+     + MAX_SIZE_T_DIGITS + strlen(HTTP_HDR_END_DELIM) + 1)
+
+static int format_head(char* buf, size_t buf_len, const char* status, const char* headers, size_t body_len)
+{
+    // a 304 carries no body, hence no Content-Length (RFC 7232, 4.1)
+    int head_len = 0;
+    if (!strcmp(status, HTTP_NOT_MODIFIED)) {
+        head_len = snprintf(buf, buf_len, "%s %s%s%s%s",
+                            HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, HTTP_LINE_DELIM);
+    } else {
+#define BUFFER_FORMAT "%s %s%s%s%s%zu%s"
+        head_len = snprintf(buf, buf_len, BUFFER_FORMAT,
+                            HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers,
+                            CONTENT_LENGTH_TXT, body_len, HTTP_HDR_END_DELIM);
+    }
+    if (head_len < 0 || (size_t) head_len >= buf_len) {
+        return ERR_IO;
+    }
+    return head_len;
+}
+
+/*******************************************************************
+ * Send a slice of a file without copying it to user space
+ */
+static FileSender file_sender = NULL;
+
+void http_set_file_sender(FileSender sender)
+{
+    file_sender = sender;
+}
+
+static int send_file_slice(int connection, int fd, off_t offset, size_t len)
+{
+    if (file_sender != NULL) {
+        const int ret = file_sender(connection, fd, offset, len);
+        if (ret == ERR_NONE) {
+            sent_bytes += len;
+        }
+        return ret;
+    }
+    while (len > 0) {
+        const ssize_t sent = sendfile(connection, fd, &offset, len);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return ERR_IO;
+        }
+        sent_bytes += (size_t) sent;
+        len -= (size_t) sent;
+    }
+    return ERR_NONE;
+}
+
 /*******************************************************************
  * Create and send HTTP reply
  */
 int http_reply(int connection, const char* status, const char* headers, const char *body, size_t body_len)
 {
-#define CONTENT_LENGTH_TXT "Content-Length: "
-    size_t buf_len = strlen(HTTP_PROTOCOL_ID) + strlen(status) + strlen(HTTP_LINE_DELIM)
-                     + strlen(headers) +strlen(CONTENT_LENGTH_TXT)
-                     + sizeof(size_t) + strlen(HTTP_HDR_END_DELIM) + 1;
+    M_REQUIRE_NON_NULL(status);
+    M_REQUIRE_NON_NULL(headers);
+    if (body_len) {
+        M_REQUIRE_NON_NULL(body);
+    }
 
-    char* buf = calloc(buf_len, sizeof(char));
+    const size_t head_max = HEAD_MAX(status, headers);
+    char* buf = buf_pool_get(head_max + body_len);
     if (buf == NULL) {
         return ERR_OUT_OF_MEMORY;
     }
 
-#define BUFFER_FORMAT "%s %s%s%s%s%zu%s"
-    int ret = sprintf(buf, BUFFER_FORMAT,
-                      HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers,
-                      CONTENT_LENGTH_TXT, body_len, HTTP_HDR_END_DELIM);
-    if (ret < 0) {
-        free(buf);
-        buf = NULL;
-        return ERR_IO;
+    const int head_len = format_head(buf, head_max, status, headers, body_len);
+    if (head_len < 0) {
+        buf_pool_put(buf, head_max + body_len);
+        return head_len;
     }
 
-    if (!body_len) {
-        tcp_send(connection, buf, buf_len);
-    } else {
-        char* new_buf = realloc(buf, buf_len + body_len + strlen(HTTP_LINE_DELIM) + 1);
-        if (new_buf == NULL) {
-            free(new_buf);
-            new_buf = NULL;
-            return ERR_OUT_OF_MEMORY;
+    // the body may be binary (images): copy it with its length, not as a string
+    if (body_len) {
+        memcpy(buf + head_len, body, body_len);
+    }
+
+    const int ret = send_all(connection, buf, (size_t) head_len + body_len);
+
+    buf_pool_put(buf, head_max + body_len);
+    return ret;
+}
+
+/*******************************************************************
+ * Create and send HTTP reply whose body is a slice of a file
+ */
+int http_reply_file(int connection, const char* status, const char* headers,
+                    int fd, off_t offset, size_t len)
+{
+    M_REQUIRE_NON_NULL(status);
+    M_REQUIRE_NON_NULL(headers);
+
+    const size_t head_max = HEAD_MAX(status, headers);
+    char* const head = http_alloc(head_max);
+    if (head == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int ret = format_head(head, head_max, status, headers, len);
+    if (ret >= 0) {
+        ret = send_all(connection, head, (size_t) ret);
+    }
+
+    return ret == ERR_NONE ? send_file_slice(connection, fd, offset, len) : ret;
+}
+
+/*******************************************************************
+ * Create and send a 206 reply made of several ranges of a file
+ */
+#define BYTERANGES_BOUNDARY "imgfs-byteranges-6b1f0e3d"
+#define PART_HEAD_FORMAT HTTP_LINE_DELIM "--" BYTERANGES_BOUNDARY HTTP_LINE_DELIM \
+    "Content-Type: %s" HTTP_LINE_DELIM "Content-Range: bytes %zu-%zu/%zu" HTTP_HDR_END_DELIM
+#define PARTS_END HTTP_LINE_DELIM "--" BYTERANGES_BOUNDARY "--" HTTP_LINE_DELIM
+#define PART_HEAD_MAX 256
+
+int http_reply_ranges(int connection, const char* headers, const char* content_type,
+                      int fd, off_t offset, size_t size,
+                      const struct http_range* ranges, size_t nb_ranges)
+{
+    M_REQUIRE_NON_NULL(headers);
+    M_REQUIRE_NON_NULL(content_type);
+    M_REQUIRE_NON_NULL(ranges);
+
+    char part_head[PART_HEAD_MAX];
+    if (strlen(content_type) > PART_HEAD_MAX / 2) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // the Content-Length has to be known before sending the first part
+    size_t body_len = strlen(PARTS_END);
+    for (size_t i = 0; i < nb_ranges; ++i) {
+        const int n = snprintf(part_head, PART_HEAD_MAX, PART_HEAD_FORMAT, content_type,
+                               ranges[i].start, ranges[i].start + ranges[i].len - 1, size);
+        if (n < 0) {
+            return ERR_IO;
         }
-        buf = new_buf;
-        strcat(buf, body);
-        strcat(buf, HTTP_LINE_DELIM);
+        body_len += (size_t) n + ranges[i].len;
+    }
 
-        tcp_send(connection, buf, strlen(buf));
+#define BYTERANGES_TYPE "Content-Type: multipart/byteranges; boundary=" BYTERANGES_BOUNDARY HTTP_LINE_DELIM
+    const size_t all_headers_len = strlen(headers) + strlen(BYTERANGES_TYPE) + 1;
+    char* const all_headers = http_alloc(all_headers_len);
+    if (all_headers == NULL) {
+        return ERR_OUT_OF_MEMORY;
     }
+    snprintf(all_headers, all_headers_len, "%s%s", BYTERANGES_TYPE, headers);
 
-    free(buf);
-    buf = NULL;
-    return ERR_NONE;
+    const size_t head_max = HEAD_MAX(HTTP_PARTIAL, all_headers);
+    char* const head = http_alloc(head_max);
+    if (head == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int ret = format_head(head, head_max, HTTP_PARTIAL, all_headers, body_len);
+    if (ret >= 0) {
+        ret = send_all(connection, head, (size_t) ret);
+    }
+
+    for (size_t i = 0; i < nb_ranges && ret == ERR_NONE; ++i) {
+        const int n = snprintf(part_head, PART_HEAD_MAX, PART_HEAD_FORMAT, content_type,
+                               ranges[i].start, ranges[i].start + ranges[i].len - 1, size);
+        ret = send_all(connection, part_head, (size_t) n);
+        if (ret == ERR_NONE) {
+            ret = send_file_slice(connection, fd, offset + (off_t) ranges[i].start, ranges[i].len);
+        }
+    }
+
+    return ret == ERR_NONE ? send_all(connection, PARTS_END, strlen(PARTS_END)) : ret;
 }
@@ -8,20 +8,114 @@
 #pragma once
 
 #include <stdint.h>
+#include <sys/types.h> // off_t
 #include "http_prot.h" // for structs
 
 #define MAX_REQUEST_SIZE 8388608 // 2^23 -> to handle images up to 8MB
 #define MAX_HEADER_SIZE    16384 // 2^14 -> to handle http headers
 
 
+/**
+ * @brief Handler of one request on a connection.
+ *
+ * The body of the message may be partial (see http_parse_message()): the
+ * missing Content-Length - body.len bytes are still to be read from the
+ * connection, which lets large uploads be streamed. The connection is
+ * closed once the handler returns, unless it returns HTTP_CONNECTION_KEPT:
+ * it then answers later (e.g. from another thread) and calls http_end().
+ */
 typedef int (*EventCallback)(struct http_message*, int);
 
+#define HTTP_CONNECTION_KEPT 1
+
+/**
+ * @brief Closes a connection kept by its handler, once it is answered, and
+ *        takes back the request memory of the calling thread.
+ */
+void http_end(int connection);
+
+/**
+ * @brief Gives how many bytes the calling thread sent so far, all replies
+ *        included: the difference around a reply is its size.
+ */
+size_t http_sent_bytes(void);
+
+/**
+ * @brief Frees the request memory and buffers kept by the calling thread,
+ *        for threads that answered requests and are about to end.
+ */
+void http_thread_cleanup(void);
+
 int http_init(uint16_t port, EventCallback cb);
 
+/**
+ * @brief Picks the parser of the requests: http_parse_message() (0, the
+ *        default) or http_parse_message_indexed() (non-zero).
+ *
+ * To be called before any request is received.
+ */
+void http_set_indexed_parser(int on);
+
+/**
+ * @brief Accepts one connection and handles its request.
+ *
+ * @return ERR_IO if no connection could be accepted. Whatever happens to the
+ *         request (a client silent for too long, gone, or malformed) only
+ *         ends its connection: ERR_NONE.
+ */
 int http_receive(void);
 
+/**
+ * @brief Serves `port` with `nb_shards` threads, the i-th one pinned to CPU
+ *        i modulo the number of CPUs.
+ *
+ * Each thread accepts on its own SO_REUSEPORT listener, so the kernel spreads
+ * the connections among them without a shared accept queue or lock, and
+ * handles its connections one after the other. `callback` may thus be
+ * called from several threads at once.
+ *
+ * Returns once every thread stopped, i.e. when accepting fails.
+ */
+int http_run_shards(uint16_t port, EventCallback callback, size_t nb_shards);
+
 int http_serve_file(int connection, const char* filename);
 
+/**
+ * @brief Sender of `size` bytes at `offset` of file `fd` on a socket.
+ */
+typedef int (*FileSender)(int socket, int fd, off_t offset, size_t size);
+
+/**
+ * @brief Has the file slices of the replies sent by `sender` instead of
+ *        sendfile() (NULL to go back to it). To be set before serving.
+ */
+void http_set_file_sender(FileSender sender);
+
+/**
+ * @brief Allocates `size` bytes of request-scoped memory.
+ *
+ * The memory comes from a per-thread arena and must not be freed: it is all
+ * taken back at once when the current request has been answered.
+ *
+ * @return the memory (not zeroed), NULL if the request used up its arena.
+ */
+void* http_alloc(size_t size);
+
 int http_reply(int connection, const char* status, const char* headers, const char* body, size_t body_len);
 
+/**
+ * @brief Replies with `len` bytes of file `fd` starting at `offset` as body,
+ *        sent straight from the file to the socket (no copy to user space).
+ */
+int http_reply_file(int connection, const char* status, const char* headers,
+                    int fd, off_t offset, size_t len);
+
+/**
+ * @brief Replies "206 Partial Content" with a multipart/byteranges body
+ *        made of the given ranges of the `size` bytes at `offset` in file `fd`.
+ */
+int http_reply_ranges(int connection, const char* headers, const char* content_type,
+                      int fd, off_t offset, size_t size,
+                      const struct http_range* ranges, size_t nb_ranges);
+
 void http_close(void);
@@ -1,79 +1,144 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> // strncasecmp
+#include <stdint.h>  // SIZE_MAX
+#include <limits.h>  // INT_MAX
 
 #include "error.h"
 #include "util.h" // atouint16
 #include "http_prot.h"
+#include "http_scan.h"
+
+#define SKIP_BLANKS(cur, end) \
+    while ((cur) < (end) && (*(cur) == ' ' || *(cur) == '\t')) ++(cur)
 
 /**
- * @brief Extracts first substring before a delimiter
+ * @brief Finds the end of the line starting at `cur`, without reading past `end`
  *
- * @param message (const char*): Given message
- * @param delimiter (const char*): Given delimiter
- * @param output (struct http_string*): Given pointer to a http_string struct to write the value prior the delimiter
- * @return (const char*): Pointer after the first delimiter if there's a success, otherwise NULL
+ * @param cur (const char*): Given start of the line
+ * @param end (const char*): Given end of the received bytes
+ * @return (const char*): Pointer to the '\n' ending the line, NULL if the line is incomplete
  */
-static const char* get_next_token(const char* message, const char* delimiter, struct http_string* output)
+static const char* find_eol(const char* cur, const char* end)
 {
-    if (message == NULL || delimiter == NULL) {
-        return NULL;
-    }
+    return memchr(cur, '\n', (size_t) (end - cur));
+}
 
-    const char* ret = strstr(message, delimiter);
-    if (ret == NULL) {
-        return NULL;
+/**
+ * @brief Makes a view of [start, stop), without its trailing CR and blanks
+ *
+ * @param start (const char*): Given start of the view
+ * @param stop (const char*): Given end of the view (excluded)
+ * @return (struct http_string): The view
+ */
+static struct http_string make_view(const char* start, const char* stop)
+{
+    while (stop > start && (stop[-1] == '\r' || stop[-1] == ' ' || stop[-1] == '\t')) {
+        --stop;
     }
+    const struct http_string view = { .val = start, .len = (size_t) (stop - start) };
+    return view;
+}
 
-    size_t out_len = ret - message;
-
-    if(output != NULL) {
-        // http string is non-null terminated
-        output->val = message;
-        output->len = out_len;
+/**
+ * @brief Parses the request line: method, URI and protocol version
+ *
+ * @param line (const char*): Given start of the line
+ * @param eol (const char*): Given end of the line
+ * @param out (struct http_message*): Given pointer to a http_message struct to fill
+ * @return (int): Error code
+ */
+static int parse_request_line(const char* line, const char* eol, struct http_message* out)
+{
+    const char* const method_end = memchr(line, ' ', (size_t) (eol - line));
+    if (method_end == NULL || method_end == line) {
+        return ERR_IO;
+    }
+    const char* const uri = method_end + 1;
+    const char* const uri_end = memchr(uri, ' ', (size_t) (eol - uri));
+    if (uri_end == NULL || uri_end == uri) {
+        return ERR_IO;
     }
 
-    ret += strlen(delimiter);
+#define HTTP_VERSION_PREFIX "HTTP/1."
+    const struct http_string version = make_view(uri_end + 1, eol);
+    if (version.len < strlen(HTTP_VERSION_PREFIX) ||
+        strncmp(version.val, HTTP_VERSION_PREFIX, strlen(HTTP_VERSION_PREFIX))) {
+        return ERR_IO;
+    }
 
-    return ret;
+    out->method.val = line;
+    out->method.len = (size_t) (method_end - line);
+    out->uri.val = uri;
+    out->uri.len = (size_t) (uri_end - uri);
+    return ERR_NONE;
 }
 
-
 /**
- * @brief Fills all headers key-value pairs in an array
+ * @brief Parses one "key: value" header line
  *
- * @param header_start (const char*): Given header
- * @param output (struct http_message*): Given pointer to a http_message struct to write the header
- * @return (const char*): Pointer after header if there's a success, otherwise NULL
+ * @param line (const char*): Given start of the line
+ * @param colon (const char*): Given first ':' of the line (NULL if there is none)
+ * @param eol (const char*): Given end of the line
+ * @param header (struct http_header*): Given pointer to the header to fill
+ * @return (int): Error code
  */
-static const char* http_parse_headers(const char* header_start, struct http_message* output)
+static int parse_header_line(const char* line, const char* colon, const char* eol,
+                             struct http_header* header)
 {
-    if (header_start == NULL || output == NULL) return NULL;
+    if (colon == NULL || colon == line) {
+        return ERR_IO;
+    }
 
-    size_t i = 0;
+    header->key.val = line;
+    header->key.len = (size_t) (colon - line);
 
-    do {
-        // Extract key
-        header_start = get_next_token(header_start, HTTP_HDR_KV_DELIM, &output->headers[i].key);
-        if (header_start == NULL) return NULL;
+    const char* value = colon + 1;
+    SKIP_BLANKS(value, eol);
+    header->value = make_view(value, eol);
+    return ERR_NONE;
+}
 
-        // Extract value
-        header_start = get_next_token(header_start, HTTP_LINE_DELIM, &output->headers[i].value);
-        if (header_start == NULL) return NULL;
+#define IS_EMPTY_LINE(line, eol) ((eol) == (line) || ((eol) == (line) + 1 && *(line) == '\r'))
 
-        i++;
-    } while((int)strncmp(header_start, HTTP_LINE_DELIM, strlen(HTTP_LINE_DELIM)));
+static int trace_enabled = 0;
 
-    // Ensure we didn't reach MAX_HEADERS
-    if (i == MAX_HEADERS) {
-        return NULL;
-    }
+/**
+ * @brief Turns the tracing of the request handling on or off
+ *
+ * @param on (int): Given 0 to turn it off, anything else to turn it on
+ */
+void http_set_trace(int on)
+{
+    trace_enabled = on != 0;
+}
 
-    // Move past the line delimiter
-    header_start += strlen(HTTP_HDR_KV_DELIM);
-    output->num_headers = i;
+/**
+ * @brief Tells whether the request handling is traced
+ *
+ * @return (int): 1 if it is, 0 otherwise
+ */
+int http_trace_enabled(void)
+{
+    return trace_enabled;
+}
 
-    return header_start;
+/**
+ * @brief Gives the path part of a request URI, i.e. what precedes the '?'
+ *
+ * @param uri (const struct http_string*): Given request URI
+ * @return (struct http_string): The path (empty if uri is NULL)
+ */
+struct http_string http_uri_path(const struct http_string* uri)
+{
+    struct http_string path = { NULL, 0 };
+    if (uri != NULL && uri->val != NULL) {
+        const char* const query = memchr(uri->val, '?', uri->len);
+        path.val = uri->val;
+        path.len = query == NULL ? uri->len : (size_t) (query - uri->val);
+    }
+    return path;
 }
 
 /**
@@ -93,10 +158,10 @@ int http_match_uri(const struct http_message* message, const char* target_uri)
         return 0;
     }
     if (!strncmp(uri.val, target_uri, strlen(target_uri))) {
-        printf(" \"%s\" match uri \"%.*s\"\n", target_uri, (int) uri.len, uri.val);
+        http_trace_printf(" \"%s\" match uri \"%.*s\"\n", target_uri, (int) uri.len, uri.val);
         return 1;
     } else {
-        printf(" \"%s\" does not match uri \"%.*s\"\n", target_uri, (int) uri.len, uri.val);
+        http_trace_printf(" \"%s\" does not match uri \"%.*s\"\n", target_uri, (int) uri.len, uri.val);
         return 0;
     }
 
@@ -116,18 +181,75 @@ int http_match_verb(const struct http_string* method, const char* verb)
     }
 
     if(method->len == strlen(verb) &&!strncmp(verb, method->val, method->len)) {
-        printf("{val = \"%.*s\", len = %d} match verb \"%s\"\n",
-               (int) method->len, method->val, (int) method->len, verb);
+        http_trace_printf("{val = \"%.*s\", len = %d} match verb \"%s\"\n",
+                          (int) method->len, method->val, (int) method->len, verb);
         return 1;
     } else {
-        printf("{val = \"%.*s\", len = %d} does not match verb \"%s\"\n",
-               (int) method->len, method->val, (int) method->len, verb);
+        http_trace_printf("{val = \"%.*s\", len = %d} does not match verb \"%s\"\n",
+                          (int) method->len, method->val, (int) method->len, verb);
         return 0;
     }
 }
 
 /**
- * @brief Writes the value of parameter `name` from URL in message to buffer out.
+ * @brief Reads the value of a hexadecimal digit
+ *
+ * @param c (char): Given character
+ * @return (int): Value of the digit, -1 if c is not one
+ */
+static int hex_value(char c)
+{
+    if ('0' <= c && c <= '9') return c - '0';
+    if ('a' <= c && c <= 'f') return c - 'a' + 10;
+    if ('A' <= c && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * @brief Percent-decodes `in` into the caller's buffer `out`.
+ *
+ * @param in (const struct http_string*): Given encoded string
+ * @param out (char*): Given buffer to write the decoded string to
+ * @param out_len (size_t): Given size of out
+ * @return (int): Length of the decoded string or error code
+ */
+int http_url_decode(const struct http_string* in, char* out, size_t out_len)
+{
+    M_REQUIRE_NON_NULL(in);
+    M_REQUIRE_NON_NULL(out);
+    if (in->len) {
+        M_REQUIRE_NON_NULL(in->val);
+    }
+
+    const char* cur = in->val;
+    const char* const end = in->val + in->len;
+    size_t len = 0;
+    while (cur < end) {
+        char c = *cur++;
+        if (c == '%') {
+            const int high = cur < end ? hex_value(cur[0]) : -1;
+            const int low = cur + 1 < end ? hex_value(cur[1]) : -1;
+            // a NUL byte would silently cut the decoded string
+            if (high < 0 || low < 0 || (high == 0 && low == 0)) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            c = (char) (16 * high + low);
+            cur += 2;
+        }
+        if (len == out_len) {
+            return ERR_RUNTIME;
+        }
+        out[len++] = c;
+    }
+
+    if (len < out_len) {
+        out[len] = '\0';
+    }
+    return (int) len;
+}
+
+/**
+ * @brief Writes the (decoded) value of parameter `name` from URL in message to buffer out.
  *
  * @param url (http_string*): Given pointer to a http_string struct of the 'url'
  * @param name (const char*): Given name to find in the url
@@ -144,68 +266,232 @@ int http_get_var(const struct http_string* url, const char* name, char* out, siz
     if (out_len <= 0 ) {
         return ERR_INVALID_ARGUMENT;
     }
+    if (url->val == NULL) {
+        return 0;
+    }
 
-    char* param = calloc(strlen(name)+2, sizeof(char));
-    if (param == NULL) return ERR_OUT_OF_MEMORY;
+    const char* const end = url->val + url->len;
+    const char* param = memchr(url->val, '?', url->len);
+    if (param == NULL) {
+        return 0;
+    }
 
-    strcpy(param, name);
-    strcat(param, "=");
+    // walk the "name=value" parameters separated by '&'
+    const size_t name_len = strlen(name);
+    while (param < end) {
+        ++param; // skips the '?' or '&'
+        const char* param_end = memchr(param, '&', (size_t) (end - param));
+        if (param_end == NULL) {
+            param_end = end;
+        }
 
-    char* name_found = NULL;
-    // we look for the parameter name
-    if ((name_found = strnstr(url->val, param, url->len)) == NULL) {
-        free(param);
-        param = NULL;
-        return 0;
+        if ((size_t) (param_end - param) > name_len && param[name_len] == '=' &&
+            !strncmp(param, name, name_len)) {
+            const struct http_string value = {
+                .val = param + name_len + 1,
+                .len = (size_t) (param_end - param) - name_len - 1
+            };
+            return http_url_decode(&value, out, out_len);
+        }
+        param = param_end;
     }
-    name_found += strlen(param);
 
-    size_t remaining_size = url->len - (name_found - url->val);
+    return 0;
+}
 
+/**
+ * @brief Looks for the header named `key` (case-insensitive) in `message`.
+ *
+ * @param message (const struct http_message*): Given pointer to a parsed http_message struct
+ * @param key (const char*): Given header name
+ * @return (const struct http_string*): Value of the header, NULL if it is not found
+ */
+const struct http_string* http_get_header(const struct http_message* message, const char* key)
+{
+    if (message == NULL || key == NULL) {
+        return NULL;
+    }
 
-    // we look if there is an ampersand after the string
-    char* end = NULL;
-    size_t name_size;
-    if ((end = strnstr(name_found, "&", remaining_size)) == NULL) {
-        name_size = remaining_size;
-        if (name_size > out_len) {
-            free(param);
-            param = NULL;
-            return ERR_RUNTIME;
+    const size_t key_len = strlen(key);
+    for (size_t i = 0; i < message->num_headers; ++i) {
+        const struct http_string* name = &message->headers[i].key;
+        if (name->len == key_len && !strncasecmp(name->val, key, key_len)) {
+            return &message->headers[i].value;
         }
-    } else {
-        name_size = end - name_found;
-        if (name_size > out_len) {
-            free(param);
-            param = NULL;
-            return ERR_RUNTIME;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reads a decimal number at the start of a non null-terminated string
+ *
+ * @param cur (const char*): Given start of the number
+ * @param end (const char*): Given end of the string
+ * @param value (size_t*): Location of the read number
+ * @return (const char*): Pointer after the number, NULL if there is no (valid) number
+ */
+static const char* parse_size(const char* cur, const char* end, size_t* value)
+{
+    if (cur == end || *cur < '0' || *cur > '9') {
+        return NULL;
+    }
+
+    size_t v = 0;
+    while (cur < end && '0' <= *cur && *cur <= '9') {
+        const size_t digit = (size_t) (*cur - '0');
+        if (v > (SIZE_MAX - digit) / 10) {
+            return NULL;
         }
+        v = 10 * v + digit;
+        ++cur;
+    }
+
+    *value = v;
+    return cur;
+}
+
+/**
+ * @brief Parses the value of a "Range: bytes=" header against a content of `size` bytes.
+ *
+ * @param value (const struct http_string*): Given value of the Range header
+ * @param size (size_t): Given size of the whole content
+ * @param ranges (struct http_range*): Given array to write the satisfiable ranges to
+ * @param max_ranges (size_t): Given size of the ranges array
+ * @return (int): Number of satisfiable ranges, or a negative error if the header is invalid
+ */
+int http_parse_range(const struct http_string* value, size_t size,
+                     struct http_range* ranges, size_t max_ranges)
+{
+    M_REQUIRE_NON_NULL(value);
+    M_REQUIRE_NON_NULL(ranges);
+
+#define RANGE_UNIT "bytes="
+    const size_t unit_len = strlen(RANGE_UNIT);
+    if (value->len < unit_len || strncasecmp(value->val, RANGE_UNIT, unit_len)) {
+        return ERR_INVALID_ARGUMENT;
     }
 
-    strncpy(out, name_found, name_size);
+    const char* cur = value->val + unit_len;
+    const char* const end = value->val + value->len;
+    size_t nb_specs = 0;
+    size_t nb_ranges = 0;
+
+    while (cur < end) {
+        SKIP_BLANKS(cur, end);
+        if (cur < end && *cur == ',') {
+            ++cur;
+            continue;
+        }
+        if (cur == end) {
+            break;
+        }
+
+        // too many ranges: the whole content will be served instead
+        if (++nb_specs > max_ranges) {
+            return ERR_INVALID_ARGUMENT;
+        }
+
+        size_t first = 0;
+        size_t last = 0;
+        const int has_first = *cur != '-';
+        if (has_first && (cur = parse_size(cur, end, &first)) == NULL) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        if (cur == end || *cur != '-') {
+            return ERR_INVALID_ARGUMENT;
+        }
+        ++cur;
 
-    free(param);
-    param = NULL;
-    return (int) name_size;
+        const int has_last = cur < end && '0' <= *cur && *cur <= '9';
+        if (has_last && (cur = parse_size(cur, end, &last)) == NULL) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        SKIP_BLANKS(cur, end);
+        if ((cur < end && *cur != ',') || (!has_first && !has_last) ||
+            (has_first && has_last && last < first)) {
+            return ERR_INVALID_ARGUMENT;
+        }
+
+        if (!has_first) {
+            // suffix range: the last `last` bytes
+            if (last == 0 || size == 0) {
+                continue;
+            }
+            first = size - MIN(last, size);
+            last = size - 1;
+        } else {
+            if (first >= size) {
+                continue;
+            }
+            if (!has_last || last >= size) {
+                last = size - 1;
+            }
+        }
+
+        ranges[nb_ranges].start = first;
+        ranges[nb_ranges].len = last - first + 1;
+        nb_ranges++;
+    }
+
+    return nb_specs ? (int) nb_ranges : ERR_INVALID_ARGUMENT;
 }
 
 /**
  * @brief Find Content Length in headers array
  *
- * @param verb (const char*): Given pointer to a verb found in the message
- * @return (int): Content Length if it is in the array, 0 if it is not or an error
+ * @param out (struct http_message*): Given parsed message
+ * @return (int): Content Length if it is in the array, 0 if it is not, or a negative error if it is not a number
  */
 int http_content_len(struct http_message *out)
 {
     M_REQUIRE_NON_NULL(out);
 
-    int ret = 0;
-    for (size_t i = 0; i < out->num_headers; ++i) {
-        if (!strncmp(out->headers[i].key.val, "Content-Length", out->headers[i].key.len)) {
-            return atoi(out->headers[i].value.val);
+    const struct http_string* value = http_get_header(out, "Content-Length");
+    if (value == NULL) {
+        return 0;
+    }
+
+    size_t len = 0;
+    const char* const end = value->val + value->len;
+    const char* cur = parse_size(value->val, end, &len);
+    if (cur != end || len > INT_MAX) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    return (int) len;
+}
+
+/**
+ * @brief Fills the body of a message whose headers end at `body`
+ *
+ * @param body (const char*): Given end of the headers
+ * @param end (const char*): Given end of the received bytes
+ * @param out (struct http_message*): Given pointer to the message
+ * @param content_len (int*): Given pointer to write the Content-Length to
+ * @return (int): Same as http_parse_message()
+ */
+static int parse_body(const char* body, const char* end, struct http_message* out, int* content_len)
+{
+    // Extract Content Length and put it in buffer
+    *content_len = http_content_len(out);
+    if (*content_len < 0) {
+        return *content_len;
+    }
+
+    out->body.val = NULL;
+    out->body.len = 0;
+    if (*content_len != 0) {
+        const size_t remaining_bytes = (size_t) (end - body);
+
+        // the headers are complete: expose what was already received of the body
+        out->body.val = body;
+        out->body.len = MIN(remaining_bytes, (size_t) *content_len);
+
+        if ((size_t) *content_len > remaining_bytes) {
+            return 0;
         }
     }
-    return ret;
+
+    return 1;
 }
 
 /**
@@ -228,46 +514,112 @@ int http_parse_message(const char *stream, size_t bytes_received, struct http_me
     M_REQUIRE_NON_NULL(out);
     M_REQUIRE_NON_NULL(content_len);
 
-    // Check if headers are completely received
-    if ((strnstr(stream, HTTP_HDR_END_DELIM, bytes_received)) == NULL) {
+    // One pass over the received bytes, line by line; nothing is copied
+    const char* const end = stream + bytes_received;
+    const char* eol = find_eol(stream, end);
+    if (eol == NULL) {
         return 0;
     }
+    int ret = parse_request_line(stream, eol, out);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
 
-    // Parse the request line
-#define TOKEN_DELIMITER " "
-    const char* token = get_next_token(stream, TOKEN_DELIMITER, &out->method);
-    if (token == NULL) {
-        return ERR_IO;
+    out->num_headers = 0;
+    const char* line = eol + 1;
+    while ((eol = find_eol(line, end)) != NULL) {
+        if (IS_EMPTY_LINE(line, eol)) {
+            break; // end of the headers
+        }
+        if (out->num_headers == MAX_HEADERS) {
+            return ERR_IO;
+        }
+        ret = parse_header_line(line, memchr(line, ':', (size_t) (eol - line)), eol,
+                                &out->headers[out->num_headers]);
+        if (ret != ERR_NONE) {
+            return ret;
+        }
+        out->num_headers++;
+        line = eol + 1;
     }
-    token = get_next_token(token, TOKEN_DELIMITER, &out->uri);
-    if (token == NULL) {
-        return ERR_IO;
+    if (eol == NULL) {
+        return 0; // headers not completely received
     }
 
-    // we check that the third token is valid
-#define HTTP_TOKEN "HTTP/1.1"
-    struct http_string http_check = {0};
-    if (((token = get_next_token(token, HTTP_LINE_DELIM, &http_check)) == NULL) &&
-        !strncpy((char *) http_check.val, HTTP_TOKEN, http_check.len)) {
-        return ERR_IO;
-    }
+    return parse_body(eol + 1, end, out, content_len);
+}
+
+/**
+ * @brief Same as http_parse_message(), from the positions of the delimiters
+ *
+ * The delimiters of the headers are first found in one vectorized pass
+ * (see http_scan.h), then the message is filled from their positions only.
+ *
+ * @param stream (const char*): Given received bytes
+ * @param bytes_received (size_t): Given number of received bytes
+ * @param out (struct http_message*): Given pointer to the message to fill
+ * @param content_len (int*): Given pointer to write the Content-Length to
+ * @return (int): Same as http_parse_message()
+ */
+int http_parse_message_indexed(const char *stream, size_t bytes_received, struct http_message *out, int *content_len)
+{
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(content_len);
 
-    // Parse headers
-    const char* body = http_parse_headers(token, out);
+    struct http_delims delims;
+    http_scan_delims(HTTP_SCAN_AUTO, stream, bytes_received, &delims);
+    if (delims.truncated) {
+        // unusually many delimiters: let the line by line parser deal with them
+        return http_parse_message(stream, bytes_received, out, content_len);
+    }
 
-    // Extract Content Length and put it in buffer
-    *content_len = http_content_len(out);
+    const uint32_t* const pos = delims.pos;
+    const size_t count = delims.count;
+    size_t k = 0;
 
-    if (*content_len != 0) {
-        size_t remaining_bytes = bytes_received - (body - stream);
+    // Request line
+    while (k < count && (pos[k] & HTTP_DELIM_COLON)) {
+        ++k;
+    }
+    if (k == count) {
+        return 0;
+    }
+    const char* eol = stream + pos[k++];
+    int ret = parse_request_line(stream, eol, out);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
 
-        if (*content_len > remaining_bytes) {
-            return 0;
+    // Headers: each line ends at the next LF, and its key at its first colon
+    out->num_headers = 0;
+    const char* line = eol + 1;
+    for (;;) {
+        const char* colon = NULL;
+        if (k < count && (pos[k] & HTTP_DELIM_COLON)) {
+            colon = stream + (pos[k] & HTTP_DELIM_POS);
+            do {
+                ++k;
+            } while (k < count && (pos[k] & HTTP_DELIM_COLON));
+        }
+        if (k == count) {
+            return 0; // headers not completely received
         }
+        eol = stream + pos[k++];
 
-        out->body.val = body;
-        out->body.len = *content_len;
+        if (IS_EMPTY_LINE(line, eol)) {
+            break; // end of the headers
+        }
+        if (out->num_headers == MAX_HEADERS) {
+            return ERR_IO;
+        }
+        ret = parse_header_line(line, colon, eol, &out->headers[out->num_headers]);
+        if (ret != ERR_NONE) {
+            return ret;
+        }
+        out->num_headers++;
+        line = eol + 1;
     }
 
-    return 1;
+    return parse_body(eol + 1, stream + bytes_received, out, content_len);
 }
@@ -8,15 +8,21 @@
 #pragma once
 
 #define MAX_HEADERS 40
+#define MAX_RANGES  16
 
 #define HTTP_HDR_KV_DELIM  ": "
 #define HTTP_LINE_DELIM    "\r\n"
 #define HTTP_HDR_END_DELIM HTTP_LINE_DELIM HTTP_LINE_DELIM
 #define HTTP_PROTOCOL_ID   "HTTP/1.1"
 #define HTTP_OK            "200 OK"
+#define HTTP_PARTIAL       "206 Partial Content"
+#define HTTP_NOT_MODIFIED  "304 Not Modified"
 #define HTTP_BAD_REQUEST   "400 Bad Request"
+#define HTTP_RANGE_NOT_SATISFIABLE "416 Range Not Satisfiable"
+#define HTTP_UNAVAILABLE   "503 Service Unavailable"
 
 #include <stddef.h>
+#include <stdio.h> // for http_trace_printf
 
 struct http_string {
     const char *val; // Warning! This is *NOT* null-terminated (thus len field below)
@@ -28,6 +34,11 @@ struct http_header {
     struct http_string value;
 };
 
+struct http_range {
+    size_t start; // first byte of the range
+    size_t len;   // number of bytes of the range
+};
+
 struct http_message {
     struct http_string method;
     struct http_string uri;
@@ -39,7 +50,8 @@ struct http_message {
 /**
  * @brief Find Content Length in headers array
  *
- * Returns: Content Length if it is in the array, 0 if it is not or an error
+ * Returns: Content Length if it is in the array, 0 if it is not,
+ * a negative int if its value is not a valid length
  */
 int http_content_len(struct http_message *out);
 
@@ -59,6 +71,8 @@ int http_match_uri(const struct http_message *message, const char *target_uri);
  * Places the complete HTTP message in out.
  * Also writes the content of header "Content Length" to content_len upon parsing the header in the stream.
  * content_len can be used by the caller to allocate memory to receive the whole HTTP message.
+ * When the headers are complete but not the body, out->body holds the part of the body
+ * received so far (content_len - out->body.len bytes are missing).
  *
  * Returns:
  *  a negative int if there was an error
@@ -67,15 +81,83 @@ int http_match_uri(const struct http_message *message, const char *target_uri);
  */
 int http_parse_message(const char *stream, size_t bytes_received, struct http_message *out, int *content_len);
 
+/**
+ * @brief Same as http_parse_message(), but the delimiters of the headers are
+ *        first found in one vectorized pass (see http_scan.h) and the message
+ *        is then filled from their positions.
+ *
+ * Falls back to http_parse_message() on unusually delimiter-heavy headers.
+ */
+int http_parse_message_indexed(const char *stream, size_t bytes_received, struct http_message *out, int *content_len);
+
 /**
  * @brief Writes the value of parameter `name` from URL in message to buffer out.
  *
+ * The value is percent-decoded, and null-terminated if shorter than out_len.
+ *
  * Return the length of the value.
  * 0 or negative return values indicate an error.
  */
 int http_get_var(const struct http_string* url, const char* name, char* out, size_t out_len);
 
+/**
+ * @brief Percent-decodes `in` into the caller's buffer `out` of size `out_len`.
+ *
+ * The result is null-terminated if shorter than out_len.
+ *
+ * Returns:
+ *  the length of the decoded string
+ *  ERR_RUNTIME if it does not fit in out_len
+ *  ERR_INVALID_ARGUMENT on a malformed escape (or an encoded NUL)
+ */
+int http_url_decode(const struct http_string* in, char* out, size_t out_len);
+
+/**
+ * @brief Looks for the header named `key` (case-insensitive) in `message`.
+ *
+ * Returns: the value of the header, NULL if there is no such header.
+ */
+const struct http_string* http_get_header(const struct http_message* message, const char* key);
+
+/**
+ * @brief Parses the value of a "Range: bytes=" header against a content of `size` bytes.
+ *
+ * Open ("500-") and suffix ("-500") ranges are resolved against `size`,
+ * and ranges starting after the end of the content are dropped.
+ *
+ * Returns:
+ *  a negative int if the header is not a valid byte range set (it shall then be ignored)
+ *  0 if none of the ranges can be satisfied
+ *  the number of ranges written to `ranges` otherwise
+ */
+int http_parse_range(const struct http_string* value, size_t size,
+                     struct http_range* ranges, size_t max_ranges);
+
 /**
  * @brief Compare method with verb and return 1 if they are equal, 0 otherwise
  */
 int http_match_verb(const struct http_string* method, const char* verb);
+
+/**
+ * @brief Returns the path part of the request URI `uri`, i.e. what precedes the '?'.
+ */
+struct http_string http_uri_path(const struct http_string* uri);
+
+/**
+ * @brief Turns the tracing of the request handling on stderr on (non-zero) or off (0).
+ *
+ * Off by default, so that nothing is written on the request path.
+ */
+void http_set_trace(int on);
+
+/**
+ * @brief Returns 1 if the request handling is traced, 0 otherwise.
+ */
+int http_trace_enabled(void);
+
+#define http_trace_printf(fmt, ...) \
+    do { \
+        if (http_trace_enabled()) { \
+            fprintf(stderr, fmt, __VA_ARGS__); \
+        } \
+    } while (0)
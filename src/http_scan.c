@@ -0,0 +1,223 @@
+#include <pthread.h> // pthread_once
+#include <string.h> // memcpy
+
+#include "http_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HTTP_SCAN_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Records the delimiters flagged in `mask` and tells whether the scan is over
+ *
+ * @param delims (struct http_delims*): Given recorded positions
+ * @param count (size_t*): Given number of recorded positions (kept out of delims to stay in a register)
+ * @param buf (const char*): Given received bytes
+ * @param base (size_t): Given position of bit 0 of the mask
+ * @param mask (uint32_t): Given bit mask of the LF and ':' characters from base on
+ * @return (int): 1 if the headers end or if there is no more room, 0 otherwise
+ */
+static inline int record_mask(struct http_delims* delims, size_t* count,
+                              const char* buf, size_t base, uint32_t mask)
+{
+    while (mask) {
+        const size_t i = base + (size_t) __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        if (*count == HTTP_MAX_DELIMS) {
+            delims->truncated = 1;
+            return 1;
+        }
+        if (buf[i] != '\n') {
+            delims->pos[(*count)++] = (uint32_t) i | HTTP_DELIM_COLON;
+            continue;
+        }
+        delims->pos[(*count)++] = (uint32_t) i;
+
+        // an empty line ("\n" or "\r\n" right after a LF) ends the headers
+        if (i > 0 && (buf[i - 1] == '\n' || (buf[i - 1] == '\r' && i > 1 && buf[i - 2] == '\n'))) {
+            delims->head_end = i + 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#define IS_DELIM(c) ((c) == '\n' || (c) == ':')
+
+/**
+ * @brief Byte-by-byte scan
+ *
+ * @param buf (const char*): Given received bytes
+ * @param len (size_t): Given number of received bytes
+ * @param delims (struct http_delims*): Given recorded positions
+ */
+static void scan_scalar(const char* buf, size_t len, struct http_delims* delims)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (IS_DELIM(buf[i]) && record_mask(delims, &count, buf, i, 1)) {
+            break;
+        }
+    }
+    delims->count = count;
+}
+
+#ifdef HTTP_SCAN_X86
+/**
+ * @brief Scan of 16 bytes at a time, with the SSE4.2 string comparison
+ *
+ * @param buf (const char*): Given received bytes
+ * @param len (size_t): Given number of received bytes
+ * @param delims (struct http_delims*): Given recorded positions
+ */
+__attribute__((target("sse4.2")))
+static void scan_sse42(const char* buf, size_t len, struct http_delims* delims)
+{
+#define SSE_BLOCK 16
+    const __m128i set = _mm_setr_epi8('\n', ':', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    size_t count = 0;
+    for (size_t i = 0; i < len; i += SSE_BLOCK) {
+        __m128i chunk;
+        if (i + SSE_BLOCK <= len) {
+            chunk = _mm_loadu_si128((const __m128i*) (const void*) (buf + i));
+        } else {
+            // last partial block: padded with NULs, which match no delimiter
+            char tail[SSE_BLOCK] = {0};
+            memcpy(tail, buf + i, len - i);
+            chunk = _mm_loadu_si128((const __m128i*) (const void*) tail);
+        }
+        const __m128i found = _mm_cmpestrm(set, 2, chunk, SSE_BLOCK,
+                                           _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK);
+        if (record_mask(delims, &count, buf, i, (uint32_t) _mm_cvtsi128_si32(found))) {
+            break;
+        }
+    }
+    delims->count = count;
+}
+
+/**
+ * @brief Scan of 32 bytes at a time, with AVX2 comparisons
+ *
+ * @param buf (const char*): Given received bytes
+ * @param len (size_t): Given number of received bytes
+ * @param delims (struct http_delims*): Given recorded positions
+ */
+__attribute__((target("avx2")))
+static void scan_avx2(const char* buf, size_t len, struct http_delims* delims)
+{
+#define AVX_BLOCK 32
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i colon = _mm256_set1_epi8(':');
+    size_t count = 0;
+    for (size_t i = 0; i < len; i += AVX_BLOCK) {
+        __m256i chunk;
+        if (i + AVX_BLOCK <= len) {
+            chunk = _mm256_loadu_si256((const __m256i*) (const void*) (buf + i));
+        } else {
+            char tail[AVX_BLOCK] = {0};
+            memcpy(tail, buf + i, len - i);
+            chunk = _mm256_loadu_si256((const __m256i*) (const void*) tail);
+        }
+        const __m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, lf),
+                                              _mm256_cmpeq_epi8(chunk, colon));
+        if (record_mask(delims, &count, buf, i, (uint32_t) _mm256_movemask_epi8(found))) {
+            break;
+        }
+    }
+    delims->count = count;
+}
+#endif
+
+/**
+ * @brief Tells whether the CPU can run the given scanner
+ *
+ * @param isa (enum http_scan_isa): Given scanner
+ * @return (int): 1 if it can, 0 otherwise
+ */
+int http_scan_supported(enum http_scan_isa isa)
+{
+    switch (isa) {
+    case HTTP_SCAN_SCALAR:
+    case HTTP_SCAN_AUTO:
+        return 1;
+#ifdef HTTP_SCAN_X86
+    case HTTP_SCAN_SSE42:
+        return __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    case HTTP_SCAN_AVX2:
+        return __builtin_cpu_supports("avx2") ? 1 : 0;
+#endif
+    default:
+        return 0;
+    }
+}
+
+static enum http_scan_isa best = HTTP_SCAN_SCALAR;
+static pthread_once_t best_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Picks the best scanner supported by the CPU
+ */
+static void pick_best(void)
+{
+    best = http_scan_supported(HTTP_SCAN_AVX2) ? HTTP_SCAN_AVX2
+           : http_scan_supported(HTTP_SCAN_SSE42) ? HTTP_SCAN_SSE42
+           : HTTP_SCAN_SCALAR;
+}
+
+/**
+ * @brief Gives the best scanner supported by the CPU, picked once
+ *
+ * @return (enum http_scan_isa): The scanner
+ */
+static enum http_scan_isa best_isa(void)
+{
+    pthread_once(&best_once, pick_best);
+    return best;
+}
+
+/**
+ * @brief Records the delimiters of the header block starting at `buf`
+ *
+ * @param isa (enum http_scan_isa): Given scanner
+ * @param buf (const char*): Given received bytes
+ * @param len (size_t): Given number of received bytes
+ * @param delims (struct http_delims*): Given recorded positions
+ */
+void http_scan_delims(enum http_scan_isa isa, const char* buf, size_t len,
+                      struct http_delims* delims)
+{
+    if (delims == NULL) {
+        return;
+    }
+    delims->count = 0;
+    delims->head_end = 0;
+    delims->truncated = 0;
+    if (buf == NULL) {
+        return;
+    }
+
+    // positions are 31 bits wide; headers are far shorter anyway
+    if (len > HTTP_DELIM_POS) {
+        len = HTTP_DELIM_POS;
+    }
+
+    if (isa == HTTP_SCAN_AUTO || !http_scan_supported(isa)) {
+        isa = best_isa();
+    }
+
+    switch (isa) {
+#ifdef HTTP_SCAN_X86
+    case HTTP_SCAN_AVX2:
+        scan_avx2(buf, len, delims);
+        break;
+    case HTTP_SCAN_SSE42:
+        scan_sse42(buf, len, delims);
+        break;
+#endif
+    default:
+        scan_scalar(buf, len, delims);
+        break;
+    }
+}
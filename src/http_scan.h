@@ -0,0 +1,64 @@
+/**
+ * @file http_scan.h
+ * @brief Vectorized scan of the delimiters of an HTTP header block.
+ *
+ * A single pass over the received bytes records the positions of all the
+ * LF and ':' characters until the empty line ending the headers, so
+ * that the parser then only visits those positions. The scan uses AVX2 or
+ * SSE4.2 when the CPU has them, and plain C otherwise.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HTTP_MAX_DELIMS 1024
+
+#define HTTP_DELIM_COLON 0x80000000u // set in a position when it is a ':', not a LF
+#define HTTP_DELIM_POS   0x7fffffffu // mask of the offset in a position
+
+enum http_scan_isa {
+    HTTP_SCAN_SCALAR,
+    HTTP_SCAN_SSE42,
+    HTTP_SCAN_AVX2,
+    HTTP_SCAN_AUTO // best one supported by the CPU
+};
+
+struct http_delims {
+    uint32_t pos[HTTP_MAX_DELIMS]; // offsets of the LF and ':' characters, in order
+    size_t count;                  // number of used entries in pos
+    size_t head_end;               // offset right after the empty line, 0 if not received yet
+    int truncated;                 // 1 if pos filled up before the end of the headers
+};
+
+/**
+ * @brief Tells whether the CPU can run the given scanner.
+ *
+ * @param isa The scanner
+ * @return 1 if it can, 0 otherwise.
+ */
+int http_scan_supported(enum http_scan_isa isa);
+
+/**
+ * @brief Records the delimiters of the header block starting at `buf`.
+ *
+ * The scan stops at the LF of the empty line ending the headers (its
+ * position is the last one recorded), at the end of the buffer, or when
+ * HTTP_MAX_DELIMS positions were recorded.
+ *
+ * @param isa The scanner to use; falls back to a supported one if needed
+ * @param buf The received bytes
+ * @param len The number of received bytes
+ * @param delims Where to record the positions
+ */
+void http_scan_delims(enum http_scan_isa isa, const char* buf, size_t len,
+                      struct http_delims* delims);
+
+#ifdef __cplusplus
+}
+#endif
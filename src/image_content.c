@@ -1,8 +1,178 @@
 #include <stdlib.h>
+#include <string.h> // memcmp
 #include <vips/vips.h>
 #include "image_content.h"
+#include "buf_pool.h"
+#include "imgfs_lock.h"
+#include "storage.h"
 
 
+/**
+ * @brief Creates the JPEG of an image at the given size
+ *
+ * @param orig (const void*): Given original JPEG
+ * @param orig_size (size_t): Given size of the original JPEG
+ * @param width (uint16_t): Given maximal width of the result
+ * @param height (uint16_t): Given maximal height of the result
+ * @param resized (void**): Given pointer to write the resized JPEG to
+ * @param resized_size (size_t*): Given pointer to write its size to
+ * @return (int): Error code
+ */
+int create_resized_img(const void* orig, size_t orig_size, uint16_t width, uint16_t height,
+                       void** resized, size_t* resized_size)
+{
+    M_REQUIRE_NON_NULL(orig);
+    M_REQUIRE_NON_NULL(resized);
+    M_REQUIRE_NON_NULL(resized_size);
+
+    // Initializing VIPS original and resized image
+    VipsImage* orig_img = NULL;
+    VipsImage* resized_img = NULL;
+
+    // Loading the image from the given buffer, which libvips only reads
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    int ret = vips_jpegload_buffer((void*) orig, orig_size, &orig_img, NULL);
+#pragma GCC diagnostic pop
+    if (ret == -1) {
+        return ERR_IMGLIB;
+    }
+
+    // Resizing the image with the desired parameters
+    ret = vips_thumbnail_image(orig_img, &resized_img, width, "height", height, NULL);
+    if (ret == -1) {
+        g_object_unref(VIPS_OBJECT(orig_img));
+        orig_img = NULL;
+        return ERR_IMGLIB;
+    }
+
+    *resized = NULL;
+    *resized_size = 0;
+    ret = vips_jpegsave_buffer(resized_img, resized, resized_size, NULL);
+
+    g_object_unref(VIPS_OBJECT(orig_img));
+    orig_img = NULL;
+    g_object_unref(VIPS_OBJECT(resized_img));
+    resized_img = NULL;
+
+    return ret == -1 ? ERR_IMGLIB : ERR_NONE;
+}
+
+/**
+ * @brief Frees a JPEG made by create_resized_img()
+ *
+ * @param resized (void*): Given JPEG
+ */
+void free_resized_img(void* resized)
+{
+    g_free(resized);
+}
+
+/**
+ * @brief Reads the original of an image and creates its JPEG at a resolution
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @param orig (const struct img_metadata*): Given copy of the metadata of the image
+ * @param resolution (int): Given resolution
+ * @param resized (void**): Given pointer to write the resized JPEG to
+ * @param resized_size (size_t*): Given pointer to write its size to
+ * @return (int): Error code
+ */
+int resize_original(struct imgfs_file* imgfs_file, const struct img_metadata* orig, int resolution,
+                    void** resized, size_t* resized_size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(orig);
+    M_REQUIRE_NON_NULL(resized);
+    M_REQUIRE_NON_NULL(resized_size);
+    if (resolution < 0 || ORIG_RES <= resolution) {
+        return ERR_RESOLUTIONS;
+    }
+
+    // the original and its CRC, at once
+    const size_t orig_size = orig->size[ORIG_RES];
+    const size_t footprint = (size_t) blob_footprint(&imgfs_file->header, orig_size);
+    void* buf_orig = buf_pool_get(footprint);
+    if (buf_orig == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int ret = storage_read(imgfs_file, orig->offset[ORIG_RES], buf_orig, footprint);
+    if (ret == ERR_NONE) {
+        ret = check_blob(&imgfs_file->header, buf_orig, orig_size);
+    }
+    if (ret == ERR_NONE) {
+        ret = create_resized_img(buf_orig, orig_size,
+                                 imgfs_file->header.resized_res[2 * resolution],
+                                 imgfs_file->header.resized_res[2 * resolution + 1],
+                                 resized, resized_size);
+    }
+    buf_pool_put(buf_orig, footprint);
+    return ret;
+}
+
+/**
+ * @brief Appends a resized image to the file and writes the metadata
+ *        pointing to it on disk, leaving the in-memory metadata untouched.
+ *        If another process created the resolution meanwhile, its blob is
+ *        used instead (a resize does not change the version of the imgFS,
+ *        see imgfs_lock.h).
+ *
+ * @param resolution (int): Given resolution of the resized image
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @param index (size_t): Given image index in the corresponding database
+ * @param resized (const void*): Given resized image
+ * @param resized_size (size_t): Given size of the resized image
+ * @param updated (struct img_metadata*): Given pointer to write the new metadata to
+ * @return (int): Error code
+ */
+int store_resized_img(int resolution, struct imgfs_file* imgfs_file, size_t index,
+                      const void* resized, size_t resized_size, struct img_metadata* updated)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(resized);
+    M_REQUIRE_NON_NULL(updated);
+    if (resolution < 0 || ORIG_RES <= resolution) {
+        return ERR_RESOLUTIONS;
+    }
+    if (imgfs_file->header.max_files <= index) {
+        return ERR_INVALID_IMGID;
+    }
+
+    int ret = imgfs_write_lock(imgfs_file, NULL, NULL);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+
+    // what the file has now, which an insert or delete of another process may have changed
+    struct img_metadata stored;
+    ret = read_metadata(imgfs_file, (uint32_t) index, &stored);
+    if (ret == ERR_NONE && (!stored.is_valid ||
+                            memcmp(stored.SHA, imgfs_file->metadata[index].SHA, SHA256_DIGEST_LENGTH))) {
+        ret = ERR_IMAGE_NOT_FOUND;
+    }
+    if (ret != ERR_NONE || stored.offset[resolution]) {
+        *updated = stored;
+        imgfs_write_unlock(imgfs_file);
+        return ret;
+    }
+
+    // Appending the resized image (and its CRC, if any) at the end of the file
+    uint64_t res_offset = 0;
+    ret = append_blob(imgfs_file, resized, resized_size, &res_offset);
+    if (ret == ERR_NONE) {
+        // Updating image metadata
+        *updated = stored;
+        updated->size[resolution] = (uint32_t) resized_size;
+        updated->offset[resolution] = res_offset;
+
+        // Writing the image metadata at its place
+        ret = write_metadata(imgfs_file, (uint32_t) index, updated);
+    }
+
+    imgfs_write_unlock(imgfs_file);
+    return ret;
+}
+
 /**
  * @brief Resize the corresponding image at the index in the requested resolution
  *
@@ -22,124 +192,34 @@ int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index)
         return ERR_INVALID_IMGID;
     }
 
-    int ret = ERR_NONE; // Initializing the return value
-
     struct imgfs_header* header = &(imgfs_file->header);
     struct img_metadata* metadata = imgfs_file->metadata;
 
-#define RES_ALREADY_IMAGE metadata[index].offset[resolution]
     // If the image already exist in the requested resolution, we do nothing
-    if (resolution == ORIG_RES || RES_ALREADY_IMAGE) {
-        return ret;
+    if (resolution == ORIG_RES || metadata[index].offset[resolution]) {
+        return ERR_NONE;
     }
     if (header->nb_files > max_files) {
         return ERR_INVALID_IMGID;
     }
 
-#define SIZE_IMAGE metadata[index].size[ORIG_RES]
-    void* buf_orig = calloc(1, SIZE_IMAGE); // Initializing the original image buffer
-    if (buf_orig == NULL) {
-        return ERR_OUT_OF_MEMORY;
-    }
-
-#define OFFSET_ORIG_IMAGE metadata[index].offset[ORIG_RES]
-    // Seeking the file to the corresponding origin image
-    fseek(imgfs_file->file,(long)OFFSET_ORIG_IMAGE,SEEK_SET);
-
-    ret = (int) fread(buf_orig, SIZE_IMAGE, 1, imgfs_file->file); // Reading the original image
-    if (ret != 1) {
-        free(buf_orig);
-        buf_orig = NULL;
-        return ERR_IO;
-    }
-
-    // Initializing VIPS original and resized image
-    VipsImage* orig_img = NULL;
-    VipsImage* resized_img = NULL;
-
-    ret = vips_jpegload_buffer(buf_orig, SIZE_IMAGE, &orig_img, NULL); // Loading the image from the corresponding buffer define above
-    if (ret == -1) {
-        g_object_unref(VIPS_OBJECT(orig_img));
-        orig_img = NULL;
-        g_object_unref(VIPS_OBJECT(resized_img));
-        resized_img = NULL;
-        free(buf_orig);
-        buf_orig = NULL;
-        return ERR_IMGLIB;
-    }
-
-#define WIDTH_RES_IMAGE header->resized_res[2 * resolution]
-#define HEIGHT_RES_IMAGE header->resized_res[2 * resolution + 1]
-
-    // Resizing the image with the desired parameters
-
-    ret = vips_thumbnail_image(orig_img, &resized_img, WIDTH_RES_IMAGE,
-                               "height", HEIGHT_RES_IMAGE,
-                               NULL);
-
-    if (ret == -1) {
-        g_object_unref(VIPS_OBJECT(orig_img));
-        orig_img = NULL;
-        g_object_unref(VIPS_OBJECT(resized_img));
-        resized_img = NULL;
-        free(buf_orig);
-        buf_orig = NULL;
-        return ERR_IMGLIB;
-    }
-
-    void* buf_resized = NULL; // Initializing the resized image buffer
-
+    void* buf_resized = NULL;
     size_t len = 0;
-
-    ret = vips_jpegsave_buffer(resized_img, &buf_resized, &len, NULL); // Saving the image from the corresponding buffer define above
-    if (ret == -1) {
-        g_object_unref(VIPS_OBJECT(orig_img));
-        orig_img = NULL;
-        g_object_unref(VIPS_OBJECT(resized_img));
-        resized_img = NULL;
-        free(buf_orig);
-        buf_orig = NULL;
-        return ERR_IMGLIB;
+    int ret = resize_original(imgfs_file, &metadata[index], resolution, &buf_resized, &len);
+    if (ret != ERR_NONE) {
+        return ret;
     }
 
-    // Seeking the file to the end of the file
-    fseek(imgfs_file->file, 0, SEEK_END);
-    long res_offset = ftell(imgfs_file->file); // Storing the resized image offset value
-
-    ret = (int) fwrite(buf_resized, len, 1, imgfs_file->file); // Writing the resized image
-    if (ret != 1) {
-        g_object_unref(VIPS_OBJECT(orig_img));
-        orig_img = NULL;
-        g_object_unref(VIPS_OBJECT(resized_img));
-        resized_img = NULL;
-        free(buf_orig);
-        buf_orig = NULL;
-        g_free(buf_resized);
-        buf_resized = NULL;
-        return ERR_IO;
+    struct img_metadata updated;
+    ret = store_resized_img(resolution, imgfs_file, index, buf_resized, len, &updated);
+    if (ret == ERR_NONE) {
+        metadata[index] = updated;
     }
 
-    // Updating image metadata
-    metadata[index].size[resolution] = len;
-    metadata[index].offset[resolution] = res_offset;
-
-    // Seeking the file to the corresponding image metadata
-    fseek(imgfs_file->file, sizeof(struct imgfs_header) + index * sizeof(struct img_metadata), SEEK_SET);
-
-    ret = (int) fwrite(&metadata[index], sizeof(struct img_metadata),
-                       1, imgfs_file->file); // Writing the image new metadata
-
-    // Freeing every pointer
-    g_object_unref(VIPS_OBJECT(orig_img));
-    orig_img = NULL;
-    g_object_unref(VIPS_OBJECT(resized_img));
-    resized_img = NULL;
-    free(buf_orig);
-    buf_orig = NULL;
-    g_free(buf_resized);
+    free_resized_img(buf_resized);
     buf_resized = NULL;
 
-    return ret != 1 ? ERR_IO : ERR_NONE;
+    return ret;
 }
 
 /**
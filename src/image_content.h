@@ -26,6 +26,56 @@ extern "C" {
  */
 int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer, size_t image_size);
 
+/**
+ * @brief Creates the JPEG of an image at the given size.
+ *
+ * @param orig The original JPEG
+ * @param orig_size Its size
+ * @param width The maximal width of the result
+ * @param height The maximal height of the result
+ * @param resized Where to put the resized JPEG, to be freed with free_resized_img()
+ * @param resized_size Where to put its size
+ * @return Some error code. 0 if no error.
+ */
+int create_resized_img(const void* orig, size_t orig_size, uint16_t width, uint16_t height,
+                       void** resized, size_t* resized_size);
+
+/**
+ * @brief Frees a JPEG made by create_resized_img().
+ */
+void free_resized_img(void* resized);
+
+/**
+ * @brief Reads the original of an image (checked against its CRC, if any)
+ *        and creates its JPEG at a resolution. The original is never
+ *        rewritten in place: it is read without any lock.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param orig A copy of the metadata of the image
+ * @param resolution The resolution to create
+ * @param resized Where to put the resized JPEG, to be freed with free_resized_img()
+ * @param resized_size Where to put its size
+ * @return Some error code. 0 if no error.
+ */
+int resize_original(struct imgfs_file* imgfs_file, const struct img_metadata* orig, int resolution,
+                    void** resized, size_t* resized_size);
+
+/**
+ * @brief Appends a resized image to the file and writes on disk the metadata
+ *        pointing to it. The in-memory metadata is left untouched: the caller
+ *        publishes `updated` when it sees fit.
+ *
+ * @param resolution The resolution of the resized image
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @param resized The resized image
+ * @param resized_size Its size
+ * @param updated Where to put the new metadata of the image
+ * @return Some error code. 0 if no error.
+ */
+int store_resized_img(int resolution, struct imgfs_file* imgfs_file, size_t index,
+                      const void* resized, size_t resized_size, struct img_metadata* updated);
+
 /**
  * @brief Calls the create_resized_img function and updates the metadata on the disk
  *
@@ -0,0 +1,551 @@
+/*
+ * @file imgfs-bench.c
+ * @brief Microbenchmarks of the imgFS library operations on a synthetic store.
+ *
+ * Usage: imgfs-bench <image.jpg> [slots [fill [dedup [iterations [csv|json]]]]]
+ *
+ * A store of `slots` metadata slots is generated with synth_store.c, as
+ * imgfs-gen does, of which the share `fill` holds an image; the share `dedup`
+ * of these images have the content of an earlier one. All the images are
+ * copies of the given JPEG, made distinct by a trailer, so that the store is
+ * written without encoding anything whatever its size. Then every operation is run
+ * `iterations` times (do_open and do_list less, as they go over the whole
+ * store), each run being timed on its own. do_list is run in both modes,
+ * stdout going to /dev/null for the time of the STDOUT runs.
+ *
+ * One line per operation is written to stdout, as CSV (default) or JSON:
+ * runs per second, latency percentiles and what the imgFS code allocated
+ * (calls to malloc, calloc and realloc from the libraries of this project,
+ * counted by wrapping them at link time, see the Makefile).
+ */
+
+#include "error.h"
+#include "util.h" // atouint32
+#include "imgfs.h"
+#include "imgfs_index.h"
+#include "image_content.h"
+#include "crc32c.h"
+#include "synth_store.h"
+
+#include <fcntl.h>  // open
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h> // dup, dup2
+#include <vips/vips.h>
+
+#define DEFAULT_SLOTS 1000
+#define DEFAULT_FILL 0.9
+#define DEFAULT_DEDUP 0.1
+#define DEFAULT_ITERATIONS 1000
+#define MAX_WHOLE_STORE_RUNS 10 // do_open and do_list go over the whole store
+#define PAGE_LIMIT 100
+#define BATCH_SIZE 50 // thumbnails of a gallery page, see bench_read_many()
+
+#define STORE_FILE "imgfs-bench.imgfs"
+
+/**********************************************************************
+ * Allocations of the imgFS code, see -Wl,--wrap in the Makefile.
+ ********************************************************************** */
+static size_t nb_allocs;
+static size_t alloc_bytes;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void* __wrap_malloc(size_t size);
+void* __wrap_calloc(size_t nmemb, size_t size);
+void* __wrap_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    ++nb_allocs;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+    ++nb_allocs;
+    alloc_bytes += nmemb * size;
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    ++nb_allocs;
+    alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+/**********************************************************************
+ * Measures of one operation.
+ ********************************************************************** */
+struct bench {
+    const char* op;
+    uint64_t* ns;        // latency of each run
+    size_t runs;
+    size_t max_runs;
+    double seconds;      // total of the runs
+    size_t nb_allocs;    // at the start, then during the runs
+    size_t alloc_bytes;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static int bench_start(struct bench* bench, const char* op, size_t max_runs)
+{
+    bench->op = op;
+    bench->ns = calloc(max_runs ? max_runs : 1, sizeof(*bench->ns));
+    bench->runs = 0;
+    bench->max_runs = max_runs;
+    bench->seconds = 0;
+    bench->nb_allocs = nb_allocs;
+    bench->alloc_bytes = alloc_bytes;
+    return bench->ns == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+}
+
+static void bench_add(struct bench* bench, uint64_t start_ns)
+{
+    const uint64_t ns = now_ns() - start_ns;
+    bench->ns[bench->runs++] = ns;
+    bench->seconds += (double) ns * 1e-9;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*) a;
+    const uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const struct bench* bench, double quantile)
+{
+    if (bench->runs == 0) {
+        return 0;
+    }
+    size_t rank = (size_t) (quantile * (double) bench->runs + 0.5);
+    rank = rank == 0 ? 1 : (rank > bench->runs ? bench->runs : rank);
+    return (double) bench->ns[rank - 1] * 1e-3;
+}
+
+/**********************************************************************
+ * Output, one line per operation.
+ ********************************************************************** */
+struct config {
+    uint32_t slots;
+    double fill;
+    double dedup;
+    uint32_t iterations;
+    int json;
+};
+
+static void bench_report(struct bench* bench, const struct config* config, int* first)
+{
+    const size_t allocs = nb_allocs - bench->nb_allocs;
+    const size_t bytes = alloc_bytes - bench->alloc_bytes;
+    qsort(bench->ns, bench->runs, sizeof(*bench->ns), compare_u64);
+
+    const double runs = bench->runs ? (double) bench->runs : 1;
+    const double ops_per_s = bench->seconds > 0 ? (double) bench->runs / bench->seconds : 0;
+    if (config->json) {
+        printf("%s  {\"op\": \"%s\", \"slots\": %u, \"fill\": %g, \"dedup\": %g, \"runs\": %zu, "
+               "\"ops_per_s\": %.1f, \"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, "
+               "\"p999_us\": %.2f, \"max_us\": %.2f, \"allocs_per_op\": %.1f, \"bytes_per_op\": %.1f}",
+               *first ? "" : ",\n", bench->op, config->slots, config->fill, config->dedup, bench->runs,
+               ops_per_s, percentile_us(bench, 0.5), percentile_us(bench, 0.9), percentile_us(bench, 0.99),
+               percentile_us(bench, 0.999), percentile_us(bench, 1.0),
+               (double) allocs / runs, (double) bytes / runs);
+    } else {
+        printf("%s,%u,%g,%g,%zu,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f,%.1f,%.1f\n",
+               bench->op, config->slots, config->fill, config->dedup, bench->runs,
+               ops_per_s, percentile_us(bench, 0.5), percentile_us(bench, 0.9), percentile_us(bench, 0.99),
+               percentile_us(bench, 0.999), percentile_us(bench, 1.0),
+               (double) allocs / runs, (double) bytes / runs);
+    }
+    *first = 0;
+    free(bench->ns);
+    bench->ns = NULL;
+}
+
+/**********************************************************************
+ * The benchmarks.
+ ********************************************************************** */
+// the img_ids are drawn by synth_generate(): they are taken from the metadata
+static void copy_img_id(const struct imgfs_file* store, uint32_t slot, char* img_id)
+{
+    memcpy(img_id, store->metadata[slot].img_id, MAX_IMG_ID + 1);
+}
+
+static int read_jpeg(const char* path, char** jpeg, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return ERR_IO;
+    }
+    int ret = ERR_IO;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        const long len = ftell(file);
+        if (len > 0 && fseek(file, 0, SEEK_SET) == 0) {
+            *size = (size_t) len;
+            // room for the suffix making inserted images distinct
+            *jpeg = malloc(*size + sizeof(uint64_t));
+            ret = *jpeg == NULL ? ERR_OUT_OF_MEMORY
+                  : fread(*jpeg, *size, 1, file) == 1 ? ERR_NONE : ERR_IO;
+        }
+    }
+    fclose(file);
+    return ret;
+}
+
+static int bench_open(const struct config* config, int* first)
+{
+    struct bench bench;
+    const size_t runs = MIN(config->iterations, MAX_WHOLE_STORE_RUNS);
+    int ret = bench_start(&bench, "do_open", runs);
+    while (ret == ERR_NONE && bench.runs < runs) {
+        struct imgfs_file store = {0};
+        const uint64_t start = now_ns();
+        ret = do_open(STORE_FILE, "rb", &store);
+        bench_add(&bench, start);
+        do_close(&store);
+    }
+    if (ret == ERR_NONE) {
+        bench_report(&bench, config, first);
+    }
+    free(bench.ns);
+    return ret;
+}
+
+static int bench_read(const struct config* config, struct imgfs_file* store, int res,
+                      const uint32_t* filled, uint32_t nb_warm, int* first)
+{
+    static const char* const names[NB_RES] = { "do_read_thumb", "do_read_small", "do_read_orig" };
+    struct bench bench;
+    int ret = bench_start(&bench, names[res], config->iterations);
+    char img_id[MAX_IMG_ID + 1];
+    while (ret == ERR_NONE && bench.runs < config->iterations && nb_warm > 0) {
+        copy_img_id(store, filled[synth_rng_next() % nb_warm], img_id);
+        char* image = NULL;
+        uint32_t size = 0;
+        const uint64_t start = now_ns();
+        ret = do_read(img_id, res, &image, &size, store);
+        bench_add(&bench, start);
+        free(image);
+    }
+    if (ret == ERR_NONE) {
+        bench_report(&bench, config, first);
+    }
+    free(bench.ns);
+    return ret;
+}
+
+static int bench_read_many(const struct config* config, struct imgfs_file* store,
+                           const uint32_t* filled, uint32_t nb_warm, int* first)
+{
+    struct bench bench;
+    int ret = bench_start(&bench, "do_read_many_thumb_x50", config->iterations);
+    static char img_ids[BATCH_SIZE][MAX_IMG_ID + 1];
+    struct batch_image images[BATCH_SIZE];
+    while (ret == ERR_NONE && bench.runs < config->iterations && nb_warm > 0) {
+        for (size_t i = 0; i < BATCH_SIZE; ++i) {
+            copy_img_id(store, filled[synth_rng_next() % nb_warm], img_ids[i]);
+            images[i].img_id = img_ids[i];
+        }
+        char* buffer = NULL;
+        const uint64_t start = now_ns();
+        ret = do_read_many(images, BATCH_SIZE, THUMB_RES, store, &buffer);
+        bench_add(&bench, start);
+        free(buffer);
+    }
+    if (ret == ERR_NONE) {
+        bench_report(&bench, config, first);
+    }
+    free(bench.ns);
+    return ret;
+}
+
+static int bench_crc(const struct config* config, const char* jpeg, size_t jpeg_size, int* first)
+{
+    struct bench bench;
+    int ret = bench_start(&bench, "crc32c_orig", config->iterations);
+    volatile uint32_t crc = 0; // kept, not to be optimised away
+    while (ret == ERR_NONE && bench.runs < config->iterations) {
+        const uint64_t start = now_ns();
+        crc = crc32c(0, jpeg, jpeg_size);
+        bench_add(&bench, start);
+    }
+    (void) crc;
+    if (ret == ERR_NONE) {
+        bench_report(&bench, config, first);
+    }
+    free(bench.ns);
+    return ret;
+}
+
+static int bench_list(const struct config* config, struct imgfs_file* store,
+                      enum do_list_mode mode, int* first)
+{
+    struct bench bench;
+    const size_t runs = MIN(config->iterations, MAX_WHOLE_STORE_RUNS);
+    int ret = bench_start(&bench, mode == JSON ? "do_list_json" : "do_list_stdout", runs);
+
+    // the listing is written, and flushed, but not to the report
+    int saved_stdout = -1;
+    if (ret == ERR_NONE && mode == STDOUT) {
+        fflush(stdout);
+        saved_stdout = dup(STDOUT_FILENO);
+        const int null = open("/dev/null", O_WRONLY);
+        if (saved_stdout < 0 || null < 0 || dup2(null, STDOUT_FILENO) < 0) {
+            ret = ERR_IO;
+        }
+        if (null >= 0) {
+            close(null);
+        }
+    }
+    while (ret == ERR_NONE && bench.runs < runs) {
+        char* json = NULL;
+        const uint64_t start = now_ns();
+        ret = do_list(store, mode, &json);
+        if (mode == STDOUT) {
+            fflush(stdout);
+        }
+        bench_add(&bench, start);
+        free(json);
+    }
+    if (saved_stdout >= 0) {
+        fflush(stdout);
+        if (dup2(saved_stdout, STDOUT_FILENO) < 0) {
+            ret = ERR_IO;
+        }
+        close(saved_stdout);
+    }
+
+    if (ret == ERR_NONE) {
+        bench_report(&bench, config, first);
+    }
+    free(bench.ns);
+    return ret;
+}
+
+static int bench_list_page(const struct config* config, struct imgfs_file* store,
+                           const uint32_t* filled, uint32_t nb_filled, int* first)
+{
+    struct bench bench;
+    int ret = bench_start(&bench, "index_build", 1);
+    struct imgfs_index index;
+    if (ret == ERR_NONE) {
+        const uint64_t start = now_ns();
+        ret = index_build(store, &index);
+        bench_add(&bench, start);
+    }
+    if (ret != ERR_NONE) {
+        free(bench.ns);
+        return ret;
+    }
+    bench_report(&bench, config, first);
+
+    ret = bench_start(&bench, "do_list_page", config->iterations);
+    char cursor[MAX_IMG_ID + 1] = "";
+    while (ret == ERR_NONE && bench.runs < config->iterations) {
+        if (nb_filled > 0) {
+            copy_img_id(store, filled[synth_rng_next() % nb_filled], cursor);
+        }
+        const struct list_page page = { .prefix = NULL, .cursor = cursor, .limit = PAGE_LIMIT };
+        char* json = NULL;
+        const uint64_t start = now_ns();
+        ret = do_list_page(store, &index, JSON, &page, &json);
+        bench_add(&bench, start);
+        free(json);
+    }
+    if (ret == ERR_NONE) {
+        bench_report(&bench, config, first);
+    }
+    free(bench.ns);
+    index_free(&index);
+    return ret;
+}
+
+static int bench_resize(const struct config* config, struct imgfs_file* store,
+                        const uint32_t* filled, uint32_t nb_filled, uint32_t nb_cold, int* first)
+{
+    struct bench bench;
+    int ret = bench_start(&bench, "lazily_resize", nb_cold);
+    for (uint32_t n = 0; ret == ERR_NONE && n < nb_cold; ++n) {
+        const uint64_t start = now_ns();
+        ret = lazily_resize(SMALL_RES, store, filled[nb_filled - 1 - n]);
+        bench_add(&bench, start);
+    }
+    if (ret == ERR_NONE) {
+        bench_report(&bench, config, first);
+    }
+    free(bench.ns);
+    return ret;
+}
+
+static int bench_insert(const struct config* config, struct imgfs_file* store,
+                        char* jpeg, size_t jpeg_size, int* first)
+{
+    struct bench bench;
+    const size_t runs = MIN(config->iterations, store->header.max_files - store->header.nb_files);
+    int ret = bench_start(&bench, "do_insert", runs);
+    char img_id[MAX_IMG_ID + 1];
+    for (uint64_t n = 0; ret == ERR_NONE && n < runs; ++n) {
+        snprintf(img_id, sizeof(img_id), "new%09lu", (unsigned long) n);
+        // a suffix after the end of the JPEG makes a distinct content
+        size_t size = jpeg_size;
+        if (synth_rng_unit() >= config->dedup) {
+            memcpy(jpeg + jpeg_size, &n, sizeof(n));
+            size += sizeof(n);
+        }
+        const uint64_t start = now_ns();
+        ret = do_insert(jpeg, size, img_id, store);
+        bench_add(&bench, start);
+    }
+    if (ret == ERR_NONE) {
+        bench_report(&bench, config, first);
+    }
+    free(bench.ns);
+    return ret;
+}
+
+static int bench_delete(const struct config* config, struct imgfs_file* store,
+                        uint32_t* filled, uint32_t nb_warm, int* first)
+{
+    struct bench bench;
+    const size_t runs = MIN(config->iterations, nb_warm);
+    int ret = bench_start(&bench, "do_delete", runs);
+    char img_id[MAX_IMG_ID + 1];
+    for (uint32_t n = 0; ret == ERR_NONE && n < runs; ++n) {
+        // each image once: picked among the ones not deleted yet
+        const uint32_t pick = n + (uint32_t) (synth_rng_next() % (nb_warm - n));
+        const uint32_t slot = filled[pick];
+        filled[pick] = filled[n];
+        filled[n] = slot;
+        copy_img_id(store, slot, img_id);
+
+        const uint64_t start = now_ns();
+        ret = do_delete(img_id, store);
+        bench_add(&bench, start);
+    }
+    if (ret == ERR_NONE) {
+        bench_report(&bench, config, first);
+    }
+    free(bench.ns);
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    struct config config = { DEFAULT_SLOTS, DEFAULT_FILL, DEFAULT_DEDUP, DEFAULT_ITERATIONS, 0 };
+    if (argc < 2 ||
+        (argc > 2 && (config.slots = atouint32(argv[2])) == 0) ||
+        (argc > 3 && synth_parse_share(argv[3], &config.fill) != ERR_NONE) ||
+        (argc > 4 && synth_parse_share(argv[4], &config.dedup) != ERR_NONE) ||
+        (argc > 5 && (config.iterations = atouint32(argv[5])) == 0) ||
+        (argc > 6 && strcmp(argv[6], "csv") != 0 && strcmp(argv[6], "json") != 0)) {
+        fprintf(stderr, "Usage: %s <image.jpg> [slots [fill [dedup [iterations [csv|json]]]]]\n", argv[0]);
+        return ERR_INVALID_ARGUMENT;
+    }
+    config.json = argc > 6 && strcmp(argv[6], "json") == 0;
+
+    if (VIPS_INIT(argv[0])) {
+        return ERR_IMGLIB;
+    }
+
+    char* jpeg = NULL;
+    size_t jpeg_size = 0;
+    int ret = read_jpeg(argv[1], &jpeg, &jpeg_size);
+    uint32_t* filled = calloc(config.slots, sizeof(*filled));
+    if (ret == ERR_NONE && filled == NULL) {
+        ret = ERR_OUT_OF_MEMORY;
+    }
+
+    // the last images are the ones lazily_resize is measured on
+    struct synth_config synth = {
+        .slots = config.slots, .fill = config.fill, .dedup = config.dedup,
+        .id_min = SYNTH_ID_MIN, .id_max = SYNTH_ID_MAX, .created = { 1, 1 }, .seed = 1,
+        .nb_cold = MIN(config.iterations, (uint32_t) (config.slots * config.fill / 2))
+    };
+    struct imgfs_header header;
+    synth_header(&synth, &header);
+    struct synth_model model;
+    if (ret == ERR_NONE) {
+        ret = synth_prepare_model(argv[1], &header, &synth, &model);
+        uint64_t bytes = 0;
+        if (ret == ERR_NONE) {
+            ret = synth_generate(&synth, &header, &model, STORE_FILE, &bytes);
+        }
+        synth_free_model(&model);
+    }
+
+    int first = 1;
+    if (config.json) {
+        printf("[\n");
+    } else {
+        printf("op,slots,fill,dedup,runs,ops_per_s,p50_us,p90_us,p99_us,p999_us,max_us,allocs_per_op,bytes_per_op\n");
+    }
+
+    if (ret == ERR_NONE) {
+        ret = bench_open(&config, &first);
+    }
+    struct imgfs_file store = {0};
+    if (ret == ERR_NONE) {
+        ret = do_open(STORE_FILE, "rb+", &store);
+    }
+    uint32_t nb_filled = 0;
+    for (uint32_t i = 0; ret == ERR_NONE && i < store.header.max_files; ++i) {
+        if (store.metadata[i].is_valid == NON_EMPTY) {
+            filled[nb_filled++] = i;
+        }
+    }
+    const uint32_t nb_cold_filled = MIN(synth.nb_cold, nb_filled);
+    const uint32_t nb_warm = nb_filled - nb_cold_filled;
+    for (int res = THUMB_RES; ret == ERR_NONE && res < NB_RES; ++res) {
+        ret = bench_read(&config, &store, res, filled, nb_warm, &first);
+    }
+    if (ret == ERR_NONE) {
+        ret = bench_read_many(&config, &store, filled, nb_warm, &first);
+    }
+    if (ret == ERR_NONE) {
+        ret = bench_crc(&config, jpeg, jpeg_size, &first);
+    }
+    if (ret == ERR_NONE) {
+        ret = bench_list(&config, &store, JSON, &first);
+    }
+    if (ret == ERR_NONE) {
+        ret = bench_list(&config, &store, STDOUT, &first);
+    }
+    if (ret == ERR_NONE) {
+        ret = bench_list_page(&config, &store, filled, nb_filled, &first);
+    }
+    if (ret == ERR_NONE) {
+        ret = bench_resize(&config, &store, filled, nb_filled, nb_cold_filled, &first);
+    }
+    if (ret == ERR_NONE) {
+        ret = bench_insert(&config, &store, jpeg, jpeg_size, &first);
+    }
+    if (ret == ERR_NONE) {
+        ret = bench_delete(&config, &store, filled, nb_warm, &first);
+    }
+    if (config.json) {
+        printf("\n]\n");
+    }
+
+    do_close(&store);
+    remove(STORE_FILE);
+    free(filled);
+    free(jpeg);
+    vips_shutdown();
+
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MSG(ret));
+    }
+    return ret;
+}
@@ -0,0 +1,154 @@
+/*
+ * @file imgfs-gen.c
+ * @brief Writes large synthetic imgFS files, for the benchmarks and the
+ *        load tests, straight to disk: the blobs one after the other, then
+ *        the header and the metadata, without going through do_insert().
+ *
+ * Usage: imgfs-gen [options] <image.jpg> <output.imgfs>
+ *   -n slots       max_files of the store (default 1000000)
+ *   -f fill        share of the slots ever written (default 0.9)
+ *   -x deleted     share of the written slots deleted since (default 0)
+ *   -d dedup       share of the images with the content of an earlier one
+ *                  (default 0)
+ *   -l min:max     length of the img_ids, uniformly drawn (default 8:32)
+ *   -v thumb:small share of the images with that resolution already
+ *                  created (default 1:1)
+ *   -s seed        of the pseudo-random choices (default 1)
+ *   -c             store a CRC-32C after each blob (IMGFS_CRC32C)
+ *
+ * The writer itself is in synth_store.c, shared with imgfs-bench.
+ */
+
+#include "error.h"
+#include "util.h" // atouint32
+#include "imgfs.h"
+#include "synth_store.h"
+
+#include <inttypes.h> // PRIu64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h> // getopt
+#include <vips/vips.h>
+
+#define DEFAULT_SLOTS 1000000
+#define DEFAULT_FILL 0.9
+
+/**********************************************************************
+ * Options.
+ ********************************************************************** */
+static int parse_id_lengths(const char* arg, struct synth_config* config)
+{
+    char* end = NULL;
+    const unsigned long min = strtoul(arg, &end, 10);
+    if (end == arg || *end != ':') {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const char* max_arg = end + 1;
+    const unsigned long max = strtoul(max_arg, &end, 10);
+    if (end == max_arg || *end != '\0' || min == 0 || min > max || max > MAX_IMG_ID) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    config->id_min = (uint32_t) min;
+    config->id_max = (uint32_t) max;
+    return ERR_NONE;
+}
+
+static int parse_created(const char* arg, struct synth_config* config)
+{
+    char thumb[32];
+    const char* colon = strchr(arg, ':');
+    if (colon == NULL || (size_t) (colon - arg) >= sizeof(thumb)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    memcpy(thumb, arg, (size_t) (colon - arg));
+    thumb[colon - arg] = '\0';
+    return synth_parse_share(thumb, &config->created[THUMB_RES]) != ERR_NONE ||
+           synth_parse_share(colon + 1, &config->created[SMALL_RES]) != ERR_NONE ? ERR_INVALID_ARGUMENT : ERR_NONE;
+}
+
+static int parse_options(int argc, char* argv[], struct synth_config* config)
+{
+    const struct synth_config defaults = {
+        DEFAULT_SLOTS, DEFAULT_FILL, 0, 0, SYNTH_ID_MIN, SYNTH_ID_MAX, { 1, 1 }, 1, 0, 0
+    };
+    *config = defaults;
+
+    int c = 0;
+    while ((c = getopt(argc, argv, "n:f:x:d:l:v:s:c")) != -1) {
+        int ret = ERR_NONE;
+        switch (c) {
+        case 'n':
+            ret = (config->slots = atouint32(optarg)) == 0 ? ERR_INVALID_ARGUMENT : ERR_NONE;
+            break;
+        case 'f':
+            ret = synth_parse_share(optarg, &config->fill);
+            break;
+        case 'x':
+            ret = synth_parse_share(optarg, &config->deleted);
+            break;
+        case 'd':
+            ret = synth_parse_share(optarg, &config->dedup);
+            break;
+        case 'l':
+            ret = parse_id_lengths(optarg, config);
+            break;
+        case 'v':
+            ret = parse_created(optarg, config);
+            break;
+        case 's':
+            ret = (config->seed = atouint32(optarg)) == 0 ? ERR_INVALID_ARGUMENT : ERR_NONE;
+            break;
+        case 'c':
+            config->crc = 1;
+            break;
+        default:
+            ret = ERR_INVALID_ARGUMENT;
+        }
+        if (ret != ERR_NONE) {
+            return ret;
+        }
+    }
+    return optind == argc - 2 ? ERR_NONE : ERR_NOT_ENOUGH_ARGUMENTS;
+}
+
+int main(int argc, char* argv[])
+{
+    struct synth_config config;
+    if (parse_options(argc, argv, &config) != ERR_NONE) {
+        fprintf(stderr, "Usage: %s [-n slots] [-f fill] [-x deleted] [-d dedup] [-l min:max]\n"
+                "       [-v thumb:small] [-s seed] [-c] <image.jpg> <output.imgfs>\n", argv[0]);
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (VIPS_INIT(argv[0])) {
+        return ERR_IMGLIB;
+    }
+
+    struct imgfs_header header;
+    synth_header(&config, &header);
+
+    struct synth_model model;
+    int ret = synth_prepare_model(argv[optind], &header, &config, &model);
+
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t bytes = 0;
+    if (ret == ERR_NONE) {
+        ret = synth_generate(&config, &header, &model, argv[optind + 1], &bytes);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    if (ret == ERR_NONE) {
+        const double seconds = (double) (stop.tv_sec - start.tv_sec) + (double) (stop.tv_nsec - start.tv_nsec) * 1e-9;
+        printf("%s: %u slots, %u images, %" PRIu64 " bytes in %.1f s (%.1f MB/s)\n",
+               argv[optind + 1], header.max_files, header.nb_files, bytes, seconds,
+               seconds > 0 ? (double) bytes / seconds / 1e6 : 0);
+    } else {
+        fprintf(stderr, "%s\n", ERR_MSG(ret));
+    }
+
+    synth_free_model(&model);
+    vips_shutdown();
+    return ret;
+}
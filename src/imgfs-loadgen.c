@@ -0,0 +1,726 @@
+/*
+ * @file imgfs-loadgen.c
+ * @brief Load generator for the imgFS server: a mix of list, read, insert
+ *        and delete requests sent by concurrent clients, with the throughput
+ *        and the latency percentiles of every operation.
+ *
+ * Usage: imgfs-loadgen [options] <port>
+ *   -c clients     concurrent clients, each on its own thread (default 8)
+ *   -d seconds     duration of the run (default 10)
+ *   -r rate        total requests per second, 0 for as fast as possible
+ *                  (default 0)
+ *   -m l:r:i:d     weights of list, read, insert and delete (default 1:90:5:4)
+ *   -s exponent    Zipf exponent of the image popularity, 0 for uniform
+ *                  (default 1)
+ *   -R resolution  thumb, small, orig or mix (default mix)
+ *   -i image.jpg   the image inserted (required for inserts and seeding)
+ *   -n images      images inserted beforehand if the store has fewer
+ *
+ * The server closes every connection once it has replied, so each request
+ * is made on a connection of its own (and the connect is part of its
+ * latency).
+ *
+ * With a rate, every client sends on a fixed schedule, and latencies are
+ * taken from the time the request was due instead of the time it was
+ * sent: a stalled server then shows in the percentiles instead of merely
+ * pausing the clients (coordinated omission). The service times, from the
+ * actual send, are reported alongside.
+ */
+
+#include "error.h"
+#include "util.h" // atouint16, atouint32
+#include "imgfs.h" // MAX_IMG_ID
+#include "http_prot.h"
+#include "socket_layer.h"
+#include "stats.h"
+
+#include <inttypes.h> // PRIu32, PRIu64
+#include <json-c/json.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_SECONDS 10
+#define OWN_IMAGES 64 // inserted images a client remembers, to delete them
+#define REPLY_CHUNK 65536
+
+enum loadgen_op { OP_LIST, OP_READ, OP_INSERT, OP_DELETE, NB_OPS };
+
+static const char* const res_names[NB_RES] = { "thumb", "small", "orig" };
+#define RES_MIX NB_RES // a resolution drawn at random for every read
+
+struct options {
+    uint16_t port;
+    uint32_t clients;
+    uint32_t seconds;
+    double rate;
+    uint32_t mix[NB_OPS];
+    double zipf;
+    size_t res;
+    const char* image_path;
+    uint32_t seed_images;
+};
+
+// what the clients share, read-only once they run
+struct load {
+    struct options opt;
+    char** ids;          // the images of the store, in decreasing popularity
+    size_t nb_ids;
+    double* cdf;         // cumulated Zipf probabilities of `ids`
+    char* image;         // the body of inserts
+    size_t image_size;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    struct stats latency; // from the scheduled send (corrected)
+    struct stats service; // from the actual send
+};
+
+struct client {
+    pthread_t thread;
+    uint32_t num;
+    uint64_t rng;
+    uint32_t inserted;                        // inserts so far, to name them
+    char own[OWN_IMAGES][MAX_IMG_ID + 1];     // ring of images to delete
+    size_t own_first;
+    size_t own_count;
+    struct load* load;
+};
+
+struct reply {
+    int status;
+    char* body;      // only kept when asked for
+    size_t size;     // everything received, headers included
+    size_t body_off;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+    const struct timespec ts = { (time_t) (ns / 1000000000u), (long) (ns % 1000000000u) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+        // interrupted, sleep again
+    }
+}
+
+// xorshift64*: clients draw their numbers independently
+static uint64_t next_random(uint64_t* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717u;
+}
+
+static double next_uniform(uint64_t* state)
+{
+    return (double) (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * @brief Percent-encodes an image id for a query string
+ *
+ * @param in (const char*): Given id
+ * @param out (char*): Given buffer, of at least 3 * MAX_IMG_ID + 1 chars
+ */
+static void url_encode(const char* in, char* out)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    for (; *in != '\0'; ++in) {
+        const unsigned char c = (unsigned char) *in;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+            c == '-' || c == '_' || c == '.') {
+            *out++ = (char) c;
+        } else {
+            *out++ = '%';
+            *out++ = hex[c >> 4];
+            *out++ = hex[c & 0xF];
+        }
+    }
+    *out = '\0';
+}
+
+/**
+ * @brief Sends one request on a new connection and reads the whole reply
+ *
+ * @param port (uint16_t): Given port of the server
+ * @param head (const char*): Given request line and headers
+ * @param body (const char*): Given body, NULL if none
+ * @param body_size (size_t): Given size of the body
+ * @param reply (struct reply*): Given reply to fill; its body is kept if
+ *        `reply->body` is not NULL on entry (it is then reallocated)
+ * @return (int): Error code
+ */
+static int exchange(uint16_t port, const char* head, const char* body, size_t body_size,
+                    struct reply* reply)
+{
+    const int keep = reply->body != NULL;
+    reply->status = 0;
+    reply->size = reply->body_off = 0;
+
+    const int sock = tcp_client_init(port);
+    if (sock < 0) {
+        return ERR_IO;
+    }
+
+    int err = ERR_NONE;
+    const size_t head_size = strlen(head);
+    if (send(sock, head, head_size, MSG_NOSIGNAL) != (ssize_t) head_size) {
+        err = ERR_IO;
+    }
+    for (size_t sent = 0; err == ERR_NONE && body != NULL && sent < body_size; ) {
+        const ssize_t n = send(sock, body + sent, body_size - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            err = ERR_IO;
+        } else {
+            sent += (size_t) n;
+        }
+    }
+
+    // the server closes once it has replied: read up to the end of stream
+    char chunk[REPLY_CHUNK];
+    char start[64] = "";
+    size_t capacity = 0;
+    while (err == ERR_NONE) {
+        const ssize_t n = recv(sock, chunk, sizeof(chunk), 0);
+        if (n < 0) {
+            err = ERR_IO;
+        } else if (n == 0) {
+            break;
+        } else {
+            if (reply->size < sizeof(start) - 1) {
+                const size_t len = (size_t) n < sizeof(start) - 1 - reply->size ?
+                                   (size_t) n : sizeof(start) - 1 - reply->size;
+                memcpy(start + reply->size, chunk, len);
+                start[reply->size + len] = '\0';
+            }
+            if (keep) {
+                if (reply->size + (size_t) n + 1 > capacity) {
+                    capacity = 2 * (reply->size + (size_t) n + 1);
+                    char* grown = realloc(reply->body, capacity);
+                    if (grown == NULL) {
+                        err = ERR_OUT_OF_MEMORY;
+                        break;
+                    }
+                    reply->body = grown;
+                }
+                memcpy(reply->body + reply->size, chunk, (size_t) n);
+                reply->body[reply->size + (size_t) n] = '\0';
+            }
+            reply->size += (size_t) n;
+        }
+    }
+    close(sock);
+
+    if (err == ERR_NONE) {
+        // "HTTP/1.1 200 OK"
+        const char* code = strchr(start, ' ');
+        reply->status = code == NULL ? 0 : atoi(code + 1);
+        if (reply->status == 0) {
+            err = ERR_IO;
+        } else if (keep) {
+            const char* end = strstr(reply->body, HTTP_HDR_END_DELIM);
+            reply->body_off = end == NULL ? reply->size :
+                              (size_t) (end - reply->body) + strlen(HTTP_HDR_END_DELIM);
+        }
+    }
+    return err;
+}
+
+static int status_error(int status)
+{
+    if (status >= 200 && status < 400) {
+        return ERR_NONE;
+    }
+    return status == 503 ? ERR_BUSY : ERR_RUNTIME;
+}
+
+/**
+ * @brief Inserts the image of the run under the given name
+ *
+ * @param load (const struct load*): Given run
+ * @param name (const char*): Given name (only unreserved characters)
+ * @param reply (struct reply*): Given reply to fill
+ * @return (int): Error code
+ */
+static int send_insert(const struct load* load, const char* name, struct reply* reply)
+{
+    char head[256];
+    snprintf(head, sizeof(head),
+             "POST /imgfs/insert?name=%s HTTP/1.1" HTTP_LINE_DELIM
+             "Host: localhost" HTTP_LINE_DELIM
+             "Content-Length: %zu" HTTP_HDR_END_DELIM, name, load->image_size);
+    const int err = exchange(load->opt.port, head, load->image, load->image_size, reply);
+    return err != ERR_NONE ? err : status_error(reply->status);
+}
+
+/**
+ * @brief Gets the ids of the images of the store
+ *
+ * @param load (struct load*): Given run, whose ids are (re)set
+ * @return (int): Error code
+ */
+static int fetch_ids(struct load* load)
+{
+    struct reply reply = { 0, malloc(1), 0, 0 };
+    if (reply.body == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int err = exchange(load->opt.port, "GET /imgfs/list HTTP/1.1" HTTP_LINE_DELIM
+                       "Host: localhost" HTTP_HDR_END_DELIM, NULL, 0, &reply);
+    if (err == ERR_NONE) {
+        err = status_error(reply.status);
+    }
+
+    struct json_object* root = err == ERR_NONE ? json_tokener_parse(reply.body + reply.body_off) : NULL;
+    struct json_object* images = NULL;
+    if (err == ERR_NONE && (root == NULL || !json_object_object_get_ex(root, "Images", &images) ||
+                            !json_object_is_type(images, json_type_array))) {
+        err = ERR_RUNTIME;
+    }
+
+    const size_t nb = err == ERR_NONE ? json_object_array_length(images) : 0;
+    char** ids = nb > 0 ? calloc(nb, sizeof(char*)) : NULL;
+    if (nb > 0 && ids == NULL) {
+        err = ERR_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; err == ERR_NONE && i < nb; ++i) {
+        const char* id = json_object_get_string(json_object_array_get_idx(images, i));
+        ids[i] = strdup(id == NULL ? "" : id);
+        if (ids[i] == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        }
+    }
+
+    if (err == ERR_NONE) {
+        load->ids = ids;
+        load->nb_ids = nb;
+    } else if (ids != NULL) {
+        for (size_t i = 0; i < nb; ++i) {
+            free(ids[i]);
+        }
+        free(ids);
+    }
+    json_object_put(root);
+    free(reply.body);
+    return err;
+}
+
+/**
+ * @brief Computes the Zipf distribution of the popularity of the images:
+ *        the k-th image of the list is read with a probability proportional
+ *        to 1 / k^s.
+ *
+ * @param load (struct load*): Given run
+ * @return (int): Error code
+ */
+static int build_cdf(struct load* load)
+{
+    if (load->nb_ids == 0) {
+        return ERR_NONE;
+    }
+    load->cdf = calloc(load->nb_ids, sizeof(double));
+    if (load->cdf == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    double sum = 0;
+    for (size_t k = 0; k < load->nb_ids; ++k) {
+        sum += 1.0 / pow((double) (k + 1), load->opt.zipf);
+        load->cdf[k] = sum;
+    }
+    for (size_t k = 0; k < load->nb_ids; ++k) {
+        load->cdf[k] /= sum;
+    }
+    return ERR_NONE;
+}
+
+static const char* pick_image(const struct load* load, uint64_t* rng)
+{
+    const double u = next_uniform(rng);
+    size_t lo = 0;
+    size_t hi = load->nb_ids - 1;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (load->cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return load->ids[lo];
+}
+
+static enum loadgen_op pick_op(const struct options* opt, uint64_t* rng)
+{
+    uint32_t total = 0;
+    for (size_t i = 0; i < NB_OPS; ++i) {
+        total += opt->mix[i];
+    }
+    uint64_t draw = next_random(rng) % total;
+    for (size_t i = 0; i < NB_OPS; ++i) {
+        if (draw < opt->mix[i]) {
+            return (enum loadgen_op) i;
+        }
+        draw -= opt->mix[i];
+    }
+    return OP_READ;
+}
+
+/**
+ * @brief Sends one request of the given operation
+ *
+ * @param c (struct client*): Given client
+ * @param op (enum loadgen_op): Given operation; may be changed when it
+ *        cannot be done (no image of its own to delete, no image to read)
+ * @param stats_op (enum stats_op*): Given place for the operation accounted
+ * @param bytes_in (size_t*): Given place for the size of the request body
+ * @param bytes_out (size_t*): Given place for the size of the reply
+ * @return (int): Error code
+ */
+static int run_op(struct client* c, enum loadgen_op op, enum stats_op* stats_op,
+                  size_t* bytes_in, size_t* bytes_out)
+{
+    const struct load* load = c->load;
+    struct reply reply = { 0, NULL, 0, 0 };
+    char head[256 + 3 * MAX_IMG_ID];
+    char encoded[3 * MAX_IMG_ID + 1];
+    int err = ERR_NONE;
+
+    if (op == OP_DELETE && c->own_count == 0) {
+        op = OP_INSERT;
+    }
+    if (op == OP_READ && load->nb_ids == 0) {
+        op = OP_LIST;
+    }
+    if (op == OP_INSERT && load->image == NULL) {
+        op = OP_LIST;
+    }
+    *bytes_in = 0;
+
+    switch (op) {
+    case OP_LIST:
+        *stats_op = STATS_LIST;
+        err = exchange(load->opt.port, "GET /imgfs/list HTTP/1.1" HTTP_LINE_DELIM
+                       "Host: localhost" HTTP_HDR_END_DELIM, NULL, 0, &reply);
+        break;
+
+    case OP_READ: {
+        const size_t res = load->opt.res == RES_MIX ? (size_t) (next_random(&c->rng) % NB_RES) : load->opt.res;
+        *stats_op = (enum stats_op) (STATS_READ_THUMB + res);
+        url_encode(pick_image(load, &c->rng), encoded);
+        snprintf(head, sizeof(head), "GET /imgfs/read?res=%s&img_id=%s HTTP/1.1" HTTP_LINE_DELIM
+                 "Host: localhost" HTTP_HDR_END_DELIM, res_names[res], encoded);
+        err = exchange(load->opt.port, head, NULL, 0, &reply);
+        break;
+    }
+
+    case OP_INSERT: {
+        *stats_op = STATS_INSERT;
+        char name[MAX_IMG_ID + 1];
+        // the pid keeps the names of successive runs apart
+        snprintf(name, sizeof(name), "lg-%ld-%" PRIu32 "-%" PRIu32, (long) getpid(), c->num, c->inserted++);
+        *bytes_in = load->image_size;
+        err = send_insert(load, name, &reply);
+        if (err == ERR_NONE) {
+            // the oldest image is forgotten (and left in the store) when the ring is full
+            const size_t slot = (c->own_first + c->own_count) % OWN_IMAGES;
+            strcpy(c->own[slot], name);
+            if (c->own_count < OWN_IMAGES) {
+                ++c->own_count;
+            } else {
+                c->own_first = (c->own_first + 1) % OWN_IMAGES;
+            }
+        }
+        *bytes_out = reply.size;
+        return err;
+    }
+
+    case OP_DELETE:
+    default:
+        *stats_op = STATS_DELETE;
+        url_encode(c->own[c->own_first], encoded);
+        c->own_first = (c->own_first + 1) % OWN_IMAGES;
+        --c->own_count;
+        snprintf(head, sizeof(head), "GET /imgfs/delete?img_id=%s HTTP/1.1" HTTP_LINE_DELIM
+                 "Host: localhost" HTTP_HDR_END_DELIM, encoded);
+        err = exchange(load->opt.port, head, NULL, 0, &reply);
+        break;
+    }
+
+    *bytes_out = reply.size;
+    return err != ERR_NONE ? err : status_error(reply.status);
+}
+
+static void* client_loop(void* arg)
+{
+    struct client* c = arg;
+    struct load* load = c->load;
+
+    // with a rate, the clients take turns evenly over every interval
+    const uint64_t interval = load->opt.rate > 0 ?
+                              (uint64_t) (1e9 * load->opt.clients / load->opt.rate) : 0;
+    uint64_t due = load->start_ns + interval * c->num / load->opt.clients;
+
+    for (;;) {
+        if (interval > 0) {
+            if (due >= load->end_ns) {
+                break;
+            }
+            sleep_until(due);
+        }
+        const uint64_t sent = now_ns();
+        if (interval == 0) {
+            if (sent >= load->end_ns) {
+                break;
+            }
+            due = sent;
+        }
+
+        enum stats_op op = STATS_OTHER;
+        size_t bytes_in = 0;
+        size_t bytes_out = 0;
+        const int err = run_op(c, pick_op(&load->opt, &c->rng), &op, &bytes_in, &bytes_out);
+        const uint64_t done = now_ns();
+
+        stats_record(&load->latency, op, (done - due) / 1000, bytes_in, bytes_out, err);
+        stats_record(&load->service, op, (done - sent) / 1000, bytes_in, bytes_out, err);
+        due += interval;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Gives a percentile of the latencies of an operation, in milliseconds
+ *
+ * @param stats (const struct stats*): Given latencies
+ * @param op (enum stats_op): Given operation
+ * @param quantile (double): Given share of the requests
+ * @return (double): The latency in milliseconds
+ */
+static double percentile_ms(const struct stats* stats, enum stats_op op, double quantile)
+{
+    const uint64_t us = stats_percentile(stats, op, quantile);
+    return (double) us / 1e3;
+}
+
+static void print_report(const struct load* load, double seconds)
+{
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    for (size_t op = 0; op < NB_STATS_OPS; ++op) {
+        requests += load->latency.ops[op].requests;
+        errors += load->latency.ops[op].errors;
+    }
+    printf("%" PRIu32 " clients, %.1f s, %" PRIu64 " requests, %.1f req/s, %" PRIu64 " errors",
+           load->opt.clients, seconds, requests, (double) requests / seconds, errors);
+    if (load->opt.rate > 0) {
+        printf(" (target %.1f req/s)", load->opt.rate);
+    }
+    printf("\n");
+    for (int err = ERR_FIRST; err < ERR_LAST; ++err) {
+        const uint64_t n = load->latency.errors_by_code[err - ERR_FIRST];
+        if (n > 0) {
+            printf("  %8" PRIu64 " x %s\n", n, ERR_MSG(err));
+        }
+    }
+
+    printf("\n%-11s %9s %7s %9s | %9s %9s %9s %9s | %9s %9s\n", "op", "requests", "errors", "req/s",
+           "p50 ms", "p99 ms", "p99.9 ms", "max ms", "svc p50", "svc p99");
+    for (size_t op = 0; op < NB_STATS_OPS; ++op) {
+        const struct stats_counters* lat = &load->latency.ops[op];
+        if (lat->requests == 0) {
+            continue;
+        }
+        const enum stats_op o = (enum stats_op) op;
+        printf("%-11s %9" PRIu64 " %7" PRIu64 " %9.1f | %9.3f %9.3f %9.3f %9.3f | %9.3f %9.3f\n",
+               stats_op_name(o), lat->requests, lat->errors, (double) lat->requests / seconds,
+               percentile_ms(&load->latency, o, 0.5), percentile_ms(&load->latency, o, 0.99),
+               percentile_ms(&load->latency, o, 0.999), (double) lat->latency_max / 1e3,
+               percentile_ms(&load->service, o, 0.5), percentile_ms(&load->service, o, 0.99));
+    }
+}
+
+/**
+ * @brief Reads the image inserted by the run
+ *
+ * @param load (struct load*): Given run
+ * @return (int): Error code
+ */
+static int read_image(struct load* load)
+{
+    FILE* file = fopen(load->opt.image_path, "rb");
+    if (file == NULL) {
+        return ERR_IO;
+    }
+    int err = ERR_NONE;
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET) != 0) {
+        err = ERR_IO;
+    } else if ((load->image = malloc((size_t) size)) == NULL) {
+        err = ERR_OUT_OF_MEMORY;
+    } else if (fread(load->image, 1, (size_t) size, file) != (size_t) size) {
+        err = ERR_IO;
+    } else {
+        load->image_size = (size_t) size;
+    }
+    fclose(file);
+    return err;
+}
+
+static int parse_mix(const char* arg, uint32_t mix[NB_OPS])
+{
+    unsigned long values[NB_OPS];
+    char* end = NULL;
+    for (size_t i = 0; i < NB_OPS; ++i) {
+        values[i] = strtoul(arg, &end, 10);
+        if (end == arg || *end != (i + 1 < NB_OPS ? ':' : '\0') || values[i] > UINT16_MAX) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        arg = end + 1;
+    }
+    uint32_t total = 0;
+    for (size_t i = 0; i < NB_OPS; ++i) {
+        mix[i] = (uint32_t) values[i];
+        total += mix[i];
+    }
+    return total == 0 ? ERR_INVALID_ARGUMENT : ERR_NONE;
+}
+
+static int parse_options(int argc, char* argv[], struct options* opt)
+{
+    const struct options defaults = {
+        0, DEFAULT_CLIENTS, DEFAULT_SECONDS, 0, { 1, 90, 5, 4 }, 1.0, RES_MIX, NULL, 0
+    };
+    *opt = defaults;
+
+    int c = 0;
+    while ((c = getopt(argc, argv, "c:d:r:m:s:R:i:n:")) != -1) {
+        char* end = NULL;
+        switch (c) {
+        case 'c':
+            if ((opt->clients = atouint32(optarg)) == 0) return ERR_INVALID_ARGUMENT;
+            break;
+        case 'd':
+            if ((opt->seconds = atouint32(optarg)) == 0) return ERR_INVALID_ARGUMENT;
+            break;
+        case 'r':
+            opt->rate = strtod(optarg, &end);
+            if (*end != '\0' || opt->rate < 0) return ERR_INVALID_ARGUMENT;
+            break;
+        case 'm':
+            if (parse_mix(optarg, opt->mix) != ERR_NONE) return ERR_INVALID_ARGUMENT;
+            break;
+        case 's':
+            opt->zipf = strtod(optarg, &end);
+            if (*end != '\0' || opt->zipf < 0) return ERR_INVALID_ARGUMENT;
+            break;
+        case 'R':
+            for (opt->res = 0; opt->res < NB_RES && strcmp(optarg, res_names[opt->res]) != 0; ++opt->res);
+            if (opt->res == NB_RES && strcmp(optarg, "mix") != 0) return ERR_INVALID_ARGUMENT;
+            break;
+        case 'i':
+            opt->image_path = optarg;
+            break;
+        case 'n':
+            opt->seed_images = atouint32(optarg);
+            break;
+        default:
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+    if (optind != argc - 1 || (opt->port = atouint16(argv[optind])) == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (opt->image_path == NULL && (opt->mix[OP_INSERT] > 0 || opt->seed_images > 0)) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+    return ERR_NONE;
+}
+
+int main(int argc, char* argv[])
+{
+    static struct load load; // the histograms are too large for the stack
+    int err = parse_options(argc, argv, &load.opt);
+    if (err != ERR_NONE) {
+        fprintf(stderr, "Usage: %s [-c clients] [-d seconds] [-r rate] [-m list:read:insert:delete]\n"
+                "       [-s zipf] [-R thumb|small|orig|mix] [-i image.jpg [-n images]] <port>\n", argv[0]);
+        return err;
+    }
+
+    if (load.opt.image_path != NULL && (err = read_image(&load)) != ERR_NONE) {
+        fprintf(stderr, "%s: %s\n", load.opt.image_path, ERR_MSG(err));
+        return err;
+    }
+
+    err = fetch_ids(&load);
+    for (uint32_t n = 0; err == ERR_NONE && load.nb_ids + n < load.opt.seed_images; ++n) {
+        char name[MAX_IMG_ID + 1];
+        struct reply reply = { 0, NULL, 0, 0 };
+        snprintf(name, sizeof(name), "lg-seed-%ld-%" PRIu32, (long) getpid(), n);
+        err = send_insert(&load, name, &reply);
+    }
+    if (err == ERR_NONE && load.nb_ids < load.opt.seed_images) {
+        for (size_t i = 0; i < load.nb_ids; ++i) {
+            free(load.ids[i]);
+        }
+        free(load.ids);
+        load.ids = NULL;
+        err = fetch_ids(&load);
+    }
+    if (err == ERR_NONE) {
+        err = build_cdf(&load);
+    }
+    if (err != ERR_NONE) {
+        fprintf(stderr, "Preparing the store: %s\n", ERR_MSG(err));
+        free(load.image);
+        return err;
+    }
+
+    struct client* clients = calloc(load.opt.clients, sizeof(struct client));
+    if (clients == NULL) {
+        free(load.image);
+        return ERR_OUT_OF_MEMORY;
+    }
+    load.start_ns = now_ns();
+    load.end_ns = load.start_ns + (uint64_t) load.opt.seconds * 1000000000u;
+    uint32_t started = 0;
+    for (; started < load.opt.clients; ++started) {
+        struct client* c = &clients[started];
+        c->num = started;
+        c->rng = load.start_ns ^ (0x9E3779B97F4A7C15u * (started + 1));
+        c->load = &load;
+        if (pthread_create(&c->thread, NULL, client_loop, c) != 0) {
+            fprintf(stderr, "Only %" PRIu32 " clients could be started\n", started);
+            break;
+        }
+    }
+    for (uint32_t i = 0; i < started; ++i) {
+        pthread_join(clients[i].thread, NULL);
+    }
+    const double seconds = (double) (now_ns() - load.start_ns) * 1e-9;
+
+    if (started > 0) {
+        print_report(&load, seconds);
+    }
+
+    free(clients);
+    for (size_t i = 0; i < load.nb_ids; ++i) {
+        free(load.ids[i]);
+    }
+    free(load.ids);
+    free(load.cdf);
+    free(load.image);
+    return started > 0 ? ERR_NONE : ERR_THREADING;
+}
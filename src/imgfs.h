@@ -20,6 +20,7 @@
                     * but we provide it here, as it is required by
                     * all the functions of this lib.
                     */
+#include <openssl/evp.h>   // for EVP_MD_CTX
 #include <openssl/sha.h>   // for SHA256_DIGEST_LENGTH
 #include <stdint.h>        // for uint32_t, uint64_t
 #include <stdio.h>         // for FILE
@@ -40,6 +41,10 @@
 #define ORIG_RES  2
 #define NB_RES    3
 
+// For flags in imgfs_header
+#define IMGFS_CRC32C 0x1 // every blob is followed by the CRC-32C of its content
+#define IMGFS_CHANGELOG 0x4 // the metadata is followed by the slots of the last changes (see imgfs_lock.h)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -51,7 +56,7 @@ struct imgfs_header {
     uint32_t max_files;
     uint16_t resized_res[2*(NB_RES-1)];
     uint32_t unused_32;
-    uint64_t unused_64;
+    uint64_t flags; // IMGFS_* format options, set at creation
 };
 
 struct img_metadata {
@@ -102,6 +107,75 @@ int do_open(const char* imgfs_filename,
  */
 void do_close(struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Size taken in the file by a blob, with its CRC if the imgFS has them.
+ *
+ * @param header The imgFS header
+ * @param size The size of the blob content
+ * @return The number of bytes from the offset of the blob to its end.
+ */
+uint64_t blob_footprint(const struct imgfs_header* header, uint64_t size);
+
+/**
+ * @brief Appends a blob at the end of the imgFS file, followed by its CRC
+ *        if the imgFS has them (see IMGFS_CRC32C).
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param blob The content
+ * @param size Its size
+ * @param offset Where to write the offset of the blob
+ * @return Some error code. 0 if no error.
+ */
+int append_blob(struct imgfs_file* imgfs_file, const void* blob, size_t size, uint64_t* offset);
+
+/**
+ * @brief Reads a blob from the imgFS file, and checks it against its CRC
+ *        if the imgFS has them.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param offset The offset of the blob
+ * @param size Its size
+ * @param blob Where to read it, of at least size bytes
+ * @return Some error code (ERR_CORRUPT_IMGFS if the CRC does not match). 0 if no error.
+ */
+int read_blob(struct imgfs_file* imgfs_file, uint64_t offset, size_t size, void* blob);
+
+/**
+ * @brief Checks a blob read with its CRC, i.e. blob_footprint(header, size) bytes.
+ *
+ * @param header The imgFS header
+ * @param blob The content, followed by its CRC if the imgFS has them
+ * @param size The size of the content
+ * @return ERR_CORRUPT_IMGFS if the CRC does not match, ERR_NONE otherwise
+ *         (always for an imgFS without CRC).
+ */
+int check_blob(const struct imgfs_header* header, const void* blob, size_t size);
+
+/**
+ * @brief One image of a batch read, see do_read_many().
+ */
+struct batch_image {
+    const char* img_id;  // given
+    uint64_t offset;     // where its blob is
+    uint32_t size;       // the size of its content
+    int err;             // ERR_NONE, or why it could not be read
+    const char* content; // its content, in the buffer of the batch (NULL on error)
+};
+
+/**
+ * @brief Reads the blobs of a batch, in the order of the file: the blobs
+ *        close to one another are read at once, and checked against their
+ *        CRC if the imgFS has them.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param images The images, whose offset and size are given unless their err is set
+ * @param nb_images Their number
+ * @param buffer Where to write the buffer holding all the contents, to be freed
+ * @return Some error code (of the whole batch). 0 if no error.
+ */
+int read_batch(struct imgfs_file* imgfs_file, struct batch_image* images, size_t nb_images,
+               char** buffer);
+
 /**
  * @brief List of possible output modes for do_list()
  *
@@ -125,6 +199,35 @@ enum do_list_mode {
 int do_list(const struct imgfs_file* imgfs_file,
             enum do_list_mode output_mode, char** json);
 
+struct imgfs_index; // see imgfs_index.h
+
+/**
+ * @brief Selection of one page of images for do_list_page()
+ */
+struct list_page {
+    const char* prefix; // only list img_ids starting with prefix (NULL or "" for all)
+    const char* cursor; // only list img_ids after cursor (NULL or "" from the start)
+    uint32_t limit;     // max. number of listed images (0 for no limit)
+};
+
+/**
+ * @brief Displays one page of the valid images, ordered by img_id.
+ *
+ * The cost is the one of a binary search in the index plus the page size,
+ * whatever the size of the imgFS. When more images match after the page,
+ * the last listed img_id is reported as the cursor of the next page.
+ *
+ * @param imgfs_file In memory structure with header and metadata.
+ * @param index Ordered index built on imgfs_file (see imgfs_index.h).
+ * @param output_mode What style to use for displaying infos.
+ * @param page Which images to list.
+ * @param json A pointer to a string containing the page in JSON format if output_mode is JSON.
+ *      It will be dynamically allocated by the function. Ignored for other output modes.
+ * @return some error code.
+ */
+int do_list_page(const struct imgfs_file* imgfs_file, const struct imgfs_index* index,
+                 enum do_list_mode output_mode, const struct list_page* page, char** json);
+
 /**
  * @brief Creates the imgFS called imgfs_filename. Writes the header and the
  *        preallocated empty metadata array to imgFS file.
@@ -170,6 +273,23 @@ int resolution_atoi(const char* resolution);
 int do_read(const char* img_id, int resolution, char** image_buffer,
             uint32_t* image_size, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Reads several images from a imgFS at once.
+ *
+ * All the images are looked up in a single pass over the metadata, the
+ * missing resolutions are created, then the blobs are read by read_batch().
+ * An image which cannot be read only has its own err set.
+ *
+ * @param images The images, whose img_id is given
+ * @param nb_images Their number
+ * @param resolution The desired resolution for all of them
+ * @param imgfs_file The main in-memory data structure
+ * @param buffer Where to write the buffer holding all the contents, to be freed
+ * @return Some error code (of the whole batch). 0 if no error.
+ */
+int do_read_many(struct batch_image* images, size_t nb_images, int resolution,
+                 struct imgfs_file* imgfs_file, char** buffer);
+
 /**
  * @brief Insert image in the imgFS file
  *
@@ -181,6 +301,62 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
 int do_insert(const char* image_buffer, size_t image_size,
               const char* img_id, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief State of an image insertion whose content arrives in chunks.
+ *
+ * The content is spooled at the end of the imgFS file while its SHA is
+ * computed, so that it never has to be held in memory as a whole.
+ */
+struct insert_stream {
+    struct imgfs_file* imgfs_file;
+    uint64_t spool_offset; // where the content is being written
+    uint64_t size;         // number of bytes written so far
+    EVP_MD_CTX* sha_ctx;   // incremental SHA-256 of the content
+    uint32_t crc;          // incremental CRC-32C of the content
+};
+
+/**
+ * @brief Starts a streamed insertion.
+ *
+ * No other operation shall be done on imgfs_file until the insertion
+ * is committed or aborted: the write lock of the imgFS (see imgfs_lock.h)
+ * is held until then.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param stream The insertion state to initialize
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_begin(struct imgfs_file* imgfs_file, struct insert_stream* stream);
+
+/**
+ * @brief Appends a chunk of content to a streamed insertion.
+ *
+ * @param stream The insertion state
+ * @param chunk Pointer to the chunk of raw image content
+ * @param chunk_size Size of the chunk
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_chunk(struct insert_stream* stream, const char* chunk, size_t chunk_size);
+
+/**
+ * @brief Ends a streamed insertion: deduplicates the content and writes the metadata,
+ *        exactly as do_insert() would.
+ *
+ * The stream is released whatever the outcome; on error, the spooled content is dropped.
+ *
+ * @param stream The insertion state
+ * @param img_id Image ID
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_commit(struct insert_stream* stream, const char* img_id);
+
+/**
+ * @brief Cancels a streamed insertion and drops the spooled content.
+ *
+ * @param stream The insertion state
+ */
+void do_insert_abort(struct insert_stream* stream);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
@@ -190,6 +366,36 @@ int do_insert(const char* image_buffer, size_t image_size,
  */
 int do_gbcollect(const char* imgfs_path, const char* imgfs_tmp_bkp_path);
 
+/**
+ * @brief What do_verify() found in an imgFS file.
+ */
+struct verify_report {
+    uint32_t nb_valid;      // valid metadata slots
+    uint32_t bad_nb_files;  // 1 if header.nb_files is not nb_valid
+    uint32_t bad_ids;       // empty or unterminated img_ids
+    uint32_t duplicate_ids;
+    uint32_t out_of_bounds; // blobs outside the data part of the file
+    uint32_t overlaps;      // blobs overlapping a blob they do not share by deduplication
+    uint32_t bad_sha;       // originals whose content does not match their SHA
+    uint32_t bad_crc;       // blobs whose content does not match their CRC (IMGFS_CRC32C)
+    uint32_t repaired;      // problems fixed (header counts only)
+    uint64_t bytes_hashed;
+};
+
+/**
+ * @brief Checks that an imgFS file is consistent, printing (on stdout)
+ *        every problem found. The originals (and every blob of an imgFS
+ *        with CRCs) are hashed by `nb_threads` threads, in the order of the file.
+ *
+ * @param imgfs_file The main in-memory structure (opened "rb+" to repair)
+ * @param nb_threads The number of hashing threads
+ * @param repair Whether to fix the header counts
+ * @param report The counts of problems found
+ * @return Some error code. 0 if the checks could run (whatever they found).
+ */
+int do_verify(struct imgfs_file* imgfs_file, size_t nb_threads, int repair,
+              struct verify_report* report);
+
 #ifdef __cplusplus
 }
 #endif
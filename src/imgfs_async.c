@@ -0,0 +1,571 @@
+/**
+ * @file imgfs_async.c
+ * @brief Asynchronous, completion-based access to an imgFS.
+ *
+ * Same locking as the server: lookups hold async->lock shared, changes of
+ * the metadata and index hold it exclusive, and whoever writes to the file
+ * holds async->writer, so that the slow parts of a writer (spooling an
+ * insert, decoding an original) only exclude the other writers. They take
+ * the write lock of the file too (see imgfs_lock.h and lock_writer()), for
+ * the other processes writing to it.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "image_content.h" // resize_original, store_resized_img
+#include "imgfs_async.h"
+#include "imgfs_lock.h"
+#include "storage.h"
+
+enum async_kind { ASYNC_READ, ASYNC_INSERT, ASYNC_DELETE };
+
+struct async_op {
+    struct imgfs_async* async;
+    enum async_kind kind;
+    char img_id[MAX_IMG_ID + 1];
+    int resolution;            // read
+    uint64_t offset;           // read: of the blob, 0 if it is to be created
+    const char* image_buffer;  // insert
+    size_t image_size;
+    AsyncReadCallback read_callback;
+    AsyncDoneCallback done_callback;
+    void* arg;
+    // result
+    int err;
+    char* image;
+    uint32_t result_size;
+    struct async_op* next;
+};
+
+/**
+ * @brief Applies a slot changed by another process (a SlotRefresher, see
+ *        imgfs_lock.h); called holding async->writer
+ *
+ * @param arg (void*): Given asynchronous state
+ * @param slot (uint32_t): Given slot
+ * @param metadata (const struct img_metadata*): Given metadata of the slot in the file
+ */
+static void refresh_slot(void* arg, uint32_t slot, const struct img_metadata* metadata)
+{
+    struct imgfs_async* const async = arg;
+    pthread_rwlock_wrlock(&async->lock);
+    index_refresh_slot(async->imgfs_file, &async->index, slot, metadata);
+    pthread_rwlock_unlock(&async->lock);
+}
+
+/**
+ * @brief Takes async->writer, then the write lock of the file, applying
+ *        what the other processes changed meanwhile
+ *
+ * @param async (struct imgfs_async*): Given asynchronous state
+ * @return (int): Error code; async->writer is not held on error
+ */
+static int lock_writer(struct imgfs_async* async)
+{
+    pthread_mutex_lock(&async->writer);
+    const int ret = imgfs_write_lock(async->imgfs_file, refresh_slot, async);
+    if (ret != ERR_NONE) {
+        pthread_mutex_unlock(&async->writer);
+    }
+    return ret;
+}
+
+/**
+ * @brief Releases what lock_writer() took
+ *
+ * @param async (struct imgfs_async*): Given asynchronous state
+ */
+static void unlock_writer(struct imgfs_async* async)
+{
+    imgfs_write_unlock(async->imgfs_file);
+    pthread_mutex_unlock(&async->writer);
+}
+
+/**
+ * @brief Finds where an image is stored at the given resolution
+ *
+ * @param async (struct imgfs_async*): Given asynchronous state
+ * @param img_id (const char*): Given image ID
+ * @param resolution (int): Given resolution
+ * @param offset (uint64_t*): Given pointer to write the offset of the blob to, 0 if not created yet
+ * @param size (uint32_t*): Given pointer to write the size of the blob to
+ * @return (int): Error code
+ */
+static int find_blob(struct imgfs_async* async, const char* img_id, int resolution,
+                     uint64_t* offset, uint32_t* size)
+{
+    uint32_t slot = 0;
+    pthread_rwlock_rdlock(&async->lock);
+    const int ret = index_find(async->imgfs_file, &async->index, img_id, &slot);
+    if (ret == ERR_NONE) {
+        *offset = async->imgfs_file->metadata[slot].offset[resolution];
+        *size = async->imgfs_file->metadata[slot].size[resolution];
+    }
+    pthread_rwlock_unlock(&async->lock);
+    return ret;
+}
+
+/**
+ * @brief Hands a finished operation over to imgfs_async_complete()
+ *
+ * @param op (struct async_op*): Given operation, with its result
+ */
+static void complete(struct async_op* op)
+{
+    struct imgfs_async* const async = op->async;
+    op->next = NULL;
+
+    pthread_mutex_lock(&async->done_lock);
+    if (async->done_tail != NULL) {
+        async->done_tail->next = op;
+    } else {
+        async->done = op;
+    }
+    async->done_tail = op;
+    pthread_mutex_unlock(&async->done_lock);
+
+    const uint64_t one = 1;
+    while (write(async->event_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+/**
+ * @brief Reads a stored blob in a newly allocated buffer
+ *
+ * @param async (struct imgfs_async*): Given state
+ * @param offset (uint64_t): Given offset of the blob
+ * @param size (uint32_t): Given size of the blob
+ * @param image (char**): Given pointer to write the buffer to (NULL on error)
+ * @return (int): Error code
+ */
+static int read_stored(struct imgfs_async* async, uint64_t offset, uint32_t size, char** image)
+{
+    *image = malloc(size ? size : 1);
+    if (*image == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    // checked against its CRC, if the imgFS has them
+    const int ret = read_blob(async->imgfs_file, offset, size, *image);
+    if (ret != ERR_NONE) {
+        free(*image);
+        *image = NULL;
+    }
+    return ret;
+}
+
+/**
+ * @brief Creates a missing resolution and reads it, as in the server
+ *        (see resize_blob() in imgfs_server_service.c); run by async->pool
+ *
+ * @param op (struct async_op*): Given read operation, whose result is filled
+ */
+static void run_resize(struct async_op* op)
+{
+    struct imgfs_async* const async = op->async;
+    struct imgfs_file* const file = async->imgfs_file;
+    const int res = op->resolution;
+
+    uint32_t slot = 0;
+    struct img_metadata orig;
+    pthread_rwlock_rdlock(&async->lock);
+    op->err = index_find(file, &async->index, op->img_id, &slot);
+    if (op->err == ERR_NONE) {
+        orig = file->metadata[slot];
+    }
+    pthread_rwlock_unlock(&async->lock);
+    if (op->err != ERR_NONE) {
+        return;
+    }
+
+    // without any lock (see resize_original())
+    void* resized = NULL;
+    size_t resized_size = 0;
+    op->err = resize_original(file, &orig, res, &resized, &resized_size);
+    if (op->err != ERR_NONE) {
+        return;
+    }
+
+    // only writers change the metadata: holding the writer lock, it can be read freely
+    op->err = lock_writer(async);
+    if (op->err != ERR_NONE) {
+        free_resized_img(resized);
+        return;
+    }
+    op->err = index_find(file, &async->index, op->img_id, &slot);
+    if (op->err == ERR_NONE && memcmp(file->metadata[slot].SHA, orig.SHA, SHA256_DIGEST_LENGTH) != 0) {
+        op->err = ERR_IMAGE_NOT_FOUND; // replaced by another image in between
+    }
+    const int created = op->err == ERR_NONE && file->metadata[slot].offset[res] == 0;
+    if (created) {
+        struct img_metadata updated;
+        op->err = store_resized_img(res, file, slot, resized, resized_size, &updated);
+        if (op->err == ERR_NONE) {
+            op->err = storage_flush(file);
+        }
+        if (op->err == ERR_NONE) {
+            pthread_rwlock_wrlock(&async->lock);
+            file->metadata[slot] = updated;
+            pthread_rwlock_unlock(&async->lock);
+        }
+    }
+    const uint64_t offset = op->err == ERR_NONE ? file->metadata[slot].offset[res] : 0;
+    const uint32_t size = op->err == ERR_NONE ? file->metadata[slot].size[res] : 0;
+    unlock_writer(async);
+
+    if (op->err == ERR_NONE && created) {
+        // the result is at hand: no need to read it back
+        op->image = malloc(resized_size ? resized_size : 1);
+        if (op->image == NULL) {
+            op->err = ERR_OUT_OF_MEMORY;
+        } else {
+            memcpy(op->image, resized, resized_size);
+            op->result_size = (uint32_t) resized_size;
+        }
+    } else if (op->err == ERR_NONE) {
+        // another operation created it meanwhile
+        op->err = read_stored(async, offset, size, &op->image);
+        op->result_size = size;
+    }
+    free_resized_img(resized);
+}
+
+/**
+ * @brief Reads a stored blob, or looks the image up again if it was not
+ *        found; run by async->readers
+ *
+ * @param op (struct async_op*): Given read operation, whose result is filled
+ * @return (int): 1 if the operation was handed to async->pool instead, 0 otherwise
+ */
+static int run_read(struct async_op* op)
+{
+    struct imgfs_async* const async = op->async;
+
+    // inserted by another process, maybe (a writer at work applies it anyway)
+    if (op->err == ERR_IMAGE_NOT_FOUND && pthread_mutex_trylock(&async->writer) == 0) {
+        do_refresh(async->imgfs_file, refresh_slot, async);
+        pthread_mutex_unlock(&async->writer);
+        op->err = find_blob(async, op->img_id, op->resolution, &op->offset, &op->result_size);
+        if (op->err == ERR_NONE && op->offset == 0) {
+            // not created yet: decoding the original is for the pool
+            op->err = work_queue_submit(&async->pool, op);
+            return op->err == ERR_NONE;
+        }
+    }
+    if (op->err == ERR_NONE) {
+        op->err = read_stored(async, op->offset, op->result_size, &op->image);
+    }
+    return 0;
+}
+
+/**
+ * @brief Inserts an image, spooling its content before taking the lock of the metadata
+ *
+ * @param op (struct async_op*): Given insert operation, whose result is filled
+ */
+static void run_insert(struct async_op* op)
+{
+    struct imgfs_async* const async = op->async;
+
+    op->err = lock_writer(async);
+    if (op->err != ERR_NONE) {
+        return;
+    }
+    struct insert_stream stream;
+    op->err = do_insert_begin(async->imgfs_file, &stream);
+    if (op->err == ERR_NONE) {
+        op->err = do_insert_chunk(&stream, op->image_buffer, op->image_size);
+        if (op->err != ERR_NONE) {
+            do_insert_abort(&stream);
+        }
+    }
+    if (op->err == ERR_NONE) {
+        pthread_rwlock_wrlock(&async->lock);
+        op->err = do_insert_commit(&stream, op->img_id);
+        if (op->err == ERR_NONE) {
+            op->err = index_add(async->imgfs_file, &async->index, op->img_id);
+        }
+        pthread_rwlock_unlock(&async->lock);
+    }
+    if (op->err == ERR_NONE) {
+        op->err = storage_flush(async->imgfs_file);
+    }
+    unlock_writer(async);
+}
+
+/**
+ * @brief Deletes an image
+ *
+ * @param op (struct async_op*): Given delete operation, whose result is filled
+ */
+static void run_delete(struct async_op* op)
+{
+    struct imgfs_async* const async = op->async;
+
+    op->err = lock_writer(async);
+    if (op->err != ERR_NONE) {
+        return;
+    }
+    pthread_rwlock_wrlock(&async->lock);
+    op->err = do_delete(op->img_id, async->imgfs_file);
+    if (op->err == ERR_NONE) {
+        index_remove(async->imgfs_file, &async->index, op->img_id);
+        op->err = storage_flush(async->imgfs_file);
+    }
+    pthread_rwlock_unlock(&async->lock);
+    unlock_writer(async);
+}
+
+/**
+ * @brief Runs a read of async->readers, then hands it over
+ *
+ * @param job (void*): Given read operation
+ */
+static void run_read_op(void* job)
+{
+    struct async_op* const op = job;
+    if (!run_read(op)) {
+        complete(op);
+    }
+}
+
+/**
+ * @brief Runs an operation of the pool, then hands it over
+ *
+ * @param job (void*): Given operation
+ */
+static void run_op(void* job)
+{
+    struct async_op* const op = job;
+    switch (op->kind) {
+    case ASYNC_READ:
+        run_resize(op);
+        break;
+    case ASYNC_INSERT:
+        run_insert(op);
+        break;
+    case ASYNC_DELETE:
+        run_delete(op);
+        break;
+    }
+    complete(op);
+}
+
+/**
+ * @brief Allocates an operation on an image
+ *
+ * @param async (struct imgfs_async*): Given state
+ * @param kind (enum async_kind): Given kind of operation
+ * @param img_id (const char*): Given image ID
+ * @param op (struct async_op**): Given pointer to write the operation to
+ * @return (int): Error code
+ */
+static int new_op(struct imgfs_async* async, enum async_kind kind, const char* img_id,
+                  struct async_op** op)
+{
+    if (strlen(img_id) > MAX_IMG_ID) {
+        return ERR_INVALID_IMGID;
+    }
+    *op = calloc(1, sizeof(struct async_op));
+    if (*op == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    (*op)->async = async;
+    (*op)->kind = kind;
+    strcpy((*op)->img_id, img_id);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Hands an operation to a pool
+ *
+ * @param pool (struct work_queue*): Given pool, async->pool or async->readers
+ * @param op (struct async_op*): Given operation, freed if it is refused
+ * @return (int): Error code, ERR_BUSY if the pool is full
+ */
+static int submit(struct work_queue* pool, struct async_op* op)
+{
+    const int ret = work_queue_submit(pool, op);
+    if (ret != ERR_NONE) {
+        free(op);
+    }
+    return ret;
+}
+
+/**********************************************************************
+ * Life of the state
+ ********************************************************************** */
+int imgfs_async_init(struct imgfs_async* async, struct imgfs_file* imgfs_file,
+                     size_t nb_workers, size_t max_queued)
+{
+    M_REQUIRE_NON_NULL(async);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    if (nb_workers == 0 || max_queued == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    memset(async, 0, sizeof(struct imgfs_async));
+    async->imgfs_file = imgfs_file;
+    async->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (async->event_fd < 0) {
+        return ERR_IO;
+    }
+    int ret = index_build(imgfs_file, &async->index);
+    if (ret != ERR_NONE) {
+        close(async->event_fd);
+        return ret;
+    }
+    if (pthread_rwlock_init(&async->lock, NULL) != 0 ||
+        pthread_mutex_init(&async->writer, NULL) != 0 ||
+        pthread_mutex_init(&async->done_lock, NULL) != 0) {
+        index_free(&async->index);
+        close(async->event_fd);
+        return ERR_THREADING;
+    }
+    ret = work_queue_init(&async->pool, nb_workers, max_queued, run_op, NULL);
+    if (ret == ERR_NONE) {
+        ret = work_queue_init(&async->readers, nb_workers, ASYNC_READS_QUEUED, run_read_op, NULL);
+        if (ret != ERR_NONE) {
+            work_queue_destroy(&async->pool);
+        }
+    }
+    if (ret != ERR_NONE) {
+        pthread_mutex_destroy(&async->done_lock);
+        pthread_mutex_destroy(&async->writer);
+        pthread_rwlock_destroy(&async->lock);
+        index_free(&async->index);
+        close(async->event_fd);
+        return ret;
+    }
+    return ERR_NONE;
+}
+
+void imgfs_async_destroy(struct imgfs_async* async)
+{
+    if (async == NULL || async->imgfs_file == NULL) {
+        return;
+    }
+    // runs the queued operations, the reads first: they may hand some to the pool
+    work_queue_destroy(&async->readers);
+    work_queue_destroy(&async->pool);
+    imgfs_async_complete(async);
+
+    pthread_mutex_destroy(&async->done_lock);
+    pthread_mutex_destroy(&async->writer);
+    pthread_rwlock_destroy(&async->lock);
+    index_free(&async->index);
+    close(async->event_fd);
+    async->event_fd = -1;
+    async->imgfs_file = NULL;
+}
+
+int imgfs_async_fd(const struct imgfs_async* async)
+{
+    return async != NULL ? async->event_fd : -1;
+}
+
+size_t imgfs_async_complete(struct imgfs_async* async)
+{
+    if (async == NULL) {
+        return 0;
+    }
+
+    // resets the counter before taking the list: a later completion makes it readable again
+    uint64_t count = 0;
+    while (read(async->event_fd, &count, sizeof(count)) < 0 && errno == EINTR);
+
+    pthread_mutex_lock(&async->done_lock);
+    struct async_op* op = async->done;
+    async->done = async->done_tail = NULL;
+    pthread_mutex_unlock(&async->done_lock);
+
+    size_t nb_run = 0;
+    while (op != NULL) {
+        struct async_op* const next = op->next;
+        if (op->kind == ASYNC_READ) {
+            op->read_callback(op->arg, op->err, op->image, op->err == ERR_NONE ? op->result_size : 0);
+        } else {
+            op->done_callback(op->arg, op->err);
+        }
+        free(op);
+        op = next;
+        ++nb_run;
+    }
+    return nb_run;
+}
+
+/**********************************************************************
+ * Operations
+ ********************************************************************** */
+int do_read_async(struct imgfs_async* async, const char* img_id, int resolution,
+                  AsyncReadCallback callback, void* arg)
+{
+    M_REQUIRE_NON_NULL(async);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(callback);
+    if (resolution < 0 || resolution >= NB_RES) {
+        return ERR_RESOLUTIONS;
+    }
+
+    struct async_op* op = NULL;
+    int ret = new_op(async, ASYNC_READ, img_id, &op);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    op->resolution = resolution;
+    op->read_callback = callback;
+    op->arg = arg;
+
+    // only the lookup in memory is done here: the disk is for the pools
+    op->err = find_blob(async, img_id, resolution, &op->offset, &op->result_size);
+    if (op->err == ERR_NONE && op->offset == 0) {
+        // not created yet: decoding the original is for the pool
+        return submit(&async->pool, op);
+    }
+    if (op->err != ERR_NONE && op->err != ERR_IMAGE_NOT_FOUND) {
+        complete(op);
+        return ERR_NONE;
+    }
+    return submit(&async->readers, op);
+}
+
+int do_insert_async(struct imgfs_async* async, const char* image_buffer, size_t image_size,
+                    const char* img_id, AsyncDoneCallback callback, void* arg)
+{
+    M_REQUIRE_NON_NULL(async);
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(callback);
+
+    struct async_op* op = NULL;
+    const int ret = new_op(async, ASYNC_INSERT, img_id, &op);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    op->image_buffer = image_buffer;
+    op->image_size = image_size;
+    op->done_callback = callback;
+    op->arg = arg;
+    return submit(&async->pool, op);
+}
+
+int do_delete_async(struct imgfs_async* async, const char* img_id,
+                    AsyncDoneCallback callback, void* arg)
+{
+    M_REQUIRE_NON_NULL(async);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(callback);
+
+    struct async_op* op = NULL;
+    const int ret = new_op(async, ASYNC_DELETE, img_id, &op);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    op->done_callback = callback;
+    op->arg = arg;
+    return submit(&async->pool, op);
+}
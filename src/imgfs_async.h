@@ -0,0 +1,123 @@
+/**
+ * @file imgfs_async.h
+ * @brief Asynchronous, completion-based access to an imgFS.
+ *
+ * The do_*_async() functions start an operation and return at once; its
+ * result is given later to a callback. The callbacks are only ever run by
+ * imgfs_async_complete(), in the thread calling it: an event loop watches
+ * imgfs_async_fd() and calls imgfs_async_complete() when it is readable, so
+ * that its callbacks run in the loop like the handlers of its other events.
+ *
+ * Only the lookup of an image in memory is done by the calling thread:
+ * everything which may wait for the disk or for a lock of the file is run
+ * by internal pools of threads. The reads of stored blobs (and of the images
+ * not found, which first apply what the other processes changed) have a pool
+ * of their own, apart from the slow operations (inserts, deletes and the
+ * creation of a missing resolution, which decodes the original), so that
+ * the slow ones never hold the reads back.
+ */
+
+#pragma once
+
+#include "imgfs.h"       // for struct imgfs_file
+#include "imgfs_index.h" // for struct imgfs_index
+#include "work_queue.h"  // for struct work_queue
+
+#include <pthread.h>
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Completion of a read: `image` (NULL on error) is the caller's to free().
+ */
+typedef void (*AsyncReadCallback)(void* arg, int err, char* image, uint32_t image_size);
+
+/**
+ * @brief Completion of an insert or a delete.
+ */
+typedef void (*AsyncDoneCallback)(void* arg, int err);
+
+struct async_op; // imgfs_async.c
+
+#define ASYNC_READS_QUEUED 1024 // reads are short: many may wait for the readers
+
+struct imgfs_async {
+    struct imgfs_file* imgfs_file;
+    struct imgfs_index index;
+    pthread_rwlock_t lock;    // metadata and index: held shared to look up, exclusive to change
+    pthread_mutex_t writer;   // held by whoever writes to the file
+    struct work_queue pool;   // inserts, deletes and resizes
+    struct work_queue readers; // reads of stored blobs, and of the images not found
+    int event_fd;             // readable when operations completed
+    pthread_mutex_t done_lock;
+    struct async_op* done;    // completed operations, oldest first
+    struct async_op* done_tail;
+};
+
+/**
+ * @brief Starts the asynchronous access to an opened imgFS.
+ *
+ * The imgFS must then only be used through `async`, until imgfs_async_destroy().
+ *
+ * @param async The state to initialise
+ * @param imgfs_file The imgFS, opened for writing ("rb+")
+ * @param nb_workers How many slow operations (and reads) may run at once (at least 1)
+ * @param max_queued How many slow operations may wait for a worker (at least 1);
+ *        up to ASYNC_READS_QUEUED reads may wait besides
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_async_init(struct imgfs_async* async, struct imgfs_file* imgfs_file,
+                     size_t nb_workers, size_t max_queued);
+
+/**
+ * @brief Waits for the operations in flight, runs their callbacks and
+ *        releases the state (not the imgFS).
+ */
+void imgfs_async_destroy(struct imgfs_async* async);
+
+/**
+ * @brief Gives the file descriptor which is readable when some callbacks are to be run.
+ */
+int imgfs_async_fd(const struct imgfs_async* async);
+
+/**
+ * @brief Runs the callbacks of the operations completed so far, without waiting.
+ *
+ * @return The number of callbacks run.
+ */
+size_t imgfs_async_complete(struct imgfs_async* async);
+
+/**
+ * @brief Starts reading an image, creating the resolution if needed.
+ *
+ * @return Some error code: the callback is then not called. ERR_BUSY if too
+ *         many resolutions are being created, or reads waiting. 0 if no error.
+ */
+int do_read_async(struct imgfs_async* async, const char* img_id, int resolution,
+                  AsyncReadCallback callback, void* arg);
+
+/**
+ * @brief Starts inserting an image. `image_buffer` must stay valid until the callback.
+ *
+ * @return Some error code: the callback is then not called. ERR_BUSY if too
+ *         many operations wait for the pool. 0 if no error.
+ */
+int do_insert_async(struct imgfs_async* async, const char* image_buffer, size_t image_size,
+                    const char* img_id, AsyncDoneCallback callback, void* arg);
+
+/**
+ * @brief Starts deleting an image.
+ *
+ * @return Some error code: the callback is then not called. ERR_BUSY if too
+ *         many operations wait for the pool. 0 if no error.
+ */
+int do_delete_async(struct imgfs_async* async, const char* img_id,
+                    AsyncDoneCallback callback, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
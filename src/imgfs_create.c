@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include "imgfs.h"
 #include "error.h"
+#include "imgfs_lock.h" // for CHANGELOG_SIZE
 
 /**
  * @brief Create an empty database and allocate the appropriate memory
@@ -58,6 +59,15 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
         return ERR_IO;
     }
 
+    // an empty change log: no entry has the version it is looked up for
+    if (imgfs_file->header.flags & IMGFS_CHANGELOG) {
+        static const char empty_log[CHANGELOG_SIZE];
+        if (fwrite(empty_log, CHANGELOG_SIZE, 1, pFile) != 1) {
+            do_close(imgfs_file);
+            return ERR_IO;
+        }
+    }
+
     printf("%d item(s) written\n", 1 + ret);
 
     return ERR_NONE;
@@ -0,0 +1,397 @@
+#include <stdlib.h>
+#include <string.h>
+#include "imgfs.h"
+#include "error.h"
+#include "imgfs_index.h"
+
+#define INDEX_ID(i) imgfs_file->metadata[index->slots[i]].img_id
+
+/**
+ * @brief Compares the image identifiers of two metadata pointers (for qsort)
+ *
+ * @param a (const void*): Pointer to a metadata pointer
+ * @param b (const void*): Pointer to a metadata pointer
+ * @return (int): Same convention as strcmp
+ */
+static int cmp_metadata_id(const void* a, const void* b)
+{
+    const struct img_metadata* const* ma = a;
+    const struct img_metadata* const* mb = b;
+    return strncmp((*ma)->img_id, (*mb)->img_id, MAX_IMG_ID);
+}
+
+/**
+ * @brief Makes sure there is room for one more entry in the index
+ *
+ * @param index (struct imgfs_index*): Given index
+ * @return (int): Error code
+ */
+static int index_reserve(struct imgfs_index* index)
+{
+    if (index->nb_slots < index->capacity) {
+        return ERR_NONE;
+    }
+
+#define INDEX_MIN_CAPACITY 16
+    uint32_t new_capacity = index->capacity ? 2 * index->capacity : INDEX_MIN_CAPACITY;
+    uint32_t* new_slots = realloc(index->slots, new_capacity * sizeof(uint32_t));
+    if (new_slots == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    index->slots = new_slots;
+    index->capacity = new_capacity;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Builds the index from all the valid metadata of an imgFS.
+ *
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param index (struct imgfs_index*): Index to be filled
+ * @return (int): Error code
+ */
+int index_build(const struct imgfs_file* imgfs_file, struct imgfs_index* index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(index);
+
+    memset(index, 0, sizeof(struct imgfs_index));
+
+    uint32_t max_files = imgfs_file->header.max_files;
+    uint32_t nb_valid = 0;
+    for (uint32_t i = 0; i < max_files; ++i) {
+        if (imgfs_file->metadata[i].is_valid) {
+            nb_valid++;
+        }
+    }
+
+    index->capacity = nb_valid ? nb_valid : INDEX_MIN_CAPACITY;
+    index->slots = calloc(index->capacity, sizeof(uint32_t));
+    if (index->slots == NULL) {
+        index->capacity = 0;
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (!nb_valid) {
+        return ERR_NONE;
+    }
+
+    // qsort has no context argument: sort the metadata pointers, then turn them back into slots
+    const struct img_metadata** sorted = calloc(nb_valid, sizeof(struct img_metadata*));
+    if (sorted == NULL) {
+        index_free(index);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < max_files && n < nb_valid; ++i) {
+        if (imgfs_file->metadata[i].is_valid) {
+            sorted[n++] = &imgfs_file->metadata[i];
+        }
+    }
+
+    qsort(sorted, nb_valid, sizeof(struct img_metadata*), cmp_metadata_id);
+
+    for (uint32_t i = 0; i < nb_valid; ++i) {
+        index->slots[i] = (uint32_t) (sorted[i] - imgfs_file->metadata);
+    }
+    index->nb_slots = nb_valid;
+
+    free(sorted);
+    sorted = NULL;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Frees the memory held by an index.
+ *
+ * @param index (struct imgfs_index*): Given index
+ */
+void index_free(struct imgfs_index* index)
+{
+    if (index == NULL) {
+        return;
+    }
+
+    free(index->slots);
+    index->slots = NULL;
+    index->nb_slots = 0;
+    index->capacity = 0;
+}
+
+/**
+ * @brief Position of the first entry whose img_id is not less than key.
+ *
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param index (const struct imgfs_index*): Given index
+ * @param key (const char*): Searched image identifier
+ * @return (size_t): Position in the index
+ */
+size_t index_lower_bound(const struct imgfs_file* imgfs_file,
+                         const struct imgfs_index* index, const char* key)
+{
+    size_t low = 0;
+    size_t high = index->nb_slots;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strncmp(INDEX_ID(mid), key, MAX_IMG_ID) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Position of the first entry whose img_id is greater than key.
+ *
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param index (const struct imgfs_index*): Given index
+ * @param key (const char*): Searched image identifier
+ * @return (size_t): Position in the index
+ */
+size_t index_upper_bound(const struct imgfs_file* imgfs_file,
+                         const struct imgfs_index* index, const char* key)
+{
+    size_t low = 0;
+    size_t high = index->nb_slots;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strncmp(INDEX_ID(mid), key, MAX_IMG_ID) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Looks up the metadata slot of a valid image.
+ *
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param index (const struct imgfs_index*): Given index
+ * @param img_id (const char*): Searched image identifier
+ * @param slot (uint32_t*): Location of the found slot
+ * @return (int): Error code
+ */
+int index_find(const struct imgfs_file* imgfs_file, const struct imgfs_index* index,
+               const char* img_id, uint32_t* slot)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(index);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(slot);
+
+    size_t pos = index_lower_bound(imgfs_file, index, img_id);
+    if (pos == index->nb_slots || strncmp(INDEX_ID(pos), img_id, MAX_IMG_ID)) {
+        return ERR_IMAGE_NOT_FOUND;
+    }
+
+    *slot = index->slots[pos];
+    return ERR_NONE;
+}
+
+/**
+ * @brief Gives the index room for every slot of the imgFS.
+ *
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param index (struct imgfs_index*): Given index
+ * @return (int): Error code
+ */
+int index_reserve_all(const struct imgfs_file* imgfs_file, struct imgfs_index* index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(index);
+
+    const uint32_t max_files = imgfs_file->header.max_files;
+    if (index->capacity >= max_files) {
+        return ERR_NONE;
+    }
+    uint32_t* new_slots = realloc(index->slots, max_files * sizeof(uint32_t));
+    if (new_slots == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    index->slots = new_slots;
+    index->capacity = max_files;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Looks up the metadata slot of a valid image, while a writer may
+ *        be changing the index.
+ *
+ * The entries may be shifted meanwhile by index_add() or index_remove():
+ * each one is loaded once and checked to be a slot before it is used, so
+ * that the search stays within the index and the metadata, whatever it
+ * finds. The array itself is never moved, see index_reserve_all().
+ *
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param index (const struct imgfs_index*): Given index
+ * @param img_id (const char*): Searched image identifier
+ * @param slot (uint32_t*): Location of the found slot
+ * @return (int): Error code
+ */
+int index_find_unlocked(const struct imgfs_file* imgfs_file, const struct imgfs_index* index,
+                        const char* img_id, uint32_t* slot)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(index);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(slot);
+
+    const uint32_t max_files = imgfs_file->header.max_files;
+    size_t low = 0;
+    size_t high = __atomic_load_n(&index->nb_slots, __ATOMIC_RELAXED);
+    high = high < index->capacity ? high : index->capacity;
+    uint32_t found = max_files;
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        const uint32_t entry = __atomic_load_n(&index->slots[mid], __ATOMIC_RELAXED);
+        if (entry >= max_files) {
+            return ERR_IMAGE_NOT_FOUND;
+        }
+        const int cmp = strncmp(imgfs_file->metadata[entry].img_id, img_id, MAX_IMG_ID);
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+            found = cmp == 0 ? entry : max_files;
+        }
+    }
+    if (found == max_files) {
+        return ERR_IMAGE_NOT_FOUND;
+    }
+
+    *slot = found;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Adds a freshly inserted image to the index.
+ *
+ * Finding the slot costs a scan of the metadata, which do_insert() already pays anyway.
+ *
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param index (struct imgfs_index*): Given index
+ * @param img_id (const char*): Identifier of the inserted image
+ * @return (int): Error code
+ */
+int index_add(const struct imgfs_file* imgfs_file, struct imgfs_index* index,
+              const char* img_id)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(index);
+    M_REQUIRE_NON_NULL(img_id);
+
+    uint32_t max_files = imgfs_file->header.max_files;
+    uint32_t slot = 0;
+    while (slot < max_files && !(imgfs_file->metadata[slot].is_valid &&
+                                 !strncmp(imgfs_file->metadata[slot].img_id, img_id, MAX_IMG_ID))) {
+        ++slot;
+    }
+    if (slot == max_files) {
+        return ERR_IMAGE_NOT_FOUND;
+    }
+
+    size_t pos = index_lower_bound(imgfs_file, index, img_id);
+    if (pos < index->nb_slots && !strncmp(INDEX_ID(pos), img_id, MAX_IMG_ID)) {
+        return ERR_DUPLICATE_ID;
+    }
+
+    int ret = index_reserve(index);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+
+    memmove(&index->slots[pos + 1], &index->slots[pos],
+            (index->nb_slots - pos) * sizeof(uint32_t));
+    index->slots[pos] = slot;
+    index->nb_slots++;
+
+    return ERR_NONE;
+}
+
+/**
+ * @brief Removes an image from the index.
+ *
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param index (struct imgfs_index*): Given index
+ * @param img_id (const char*): Identifier of the removed image
+ * @return (int): Error code
+ */
+int index_remove(const struct imgfs_file* imgfs_file, struct imgfs_index* index,
+                 const char* img_id)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(index);
+    M_REQUIRE_NON_NULL(img_id);
+
+    size_t pos = index_lower_bound(imgfs_file, index, img_id);
+    if (pos == index->nb_slots || strncmp(INDEX_ID(pos), img_id, MAX_IMG_ID)) {
+        return ERR_IMAGE_NOT_FOUND;
+    }
+
+    memmove(&index->slots[pos], &index->slots[pos + 1],
+            (index->nb_slots - pos - 1) * sizeof(uint32_t));
+    index->nb_slots--;
+
+    return ERR_NONE;
+}
+
+/**
+ * @brief Replaces the metadata of a slot, updating the index accordingly
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @param index (struct imgfs_index*): Given index
+ * @param slot (uint32_t): Given slot
+ * @param metadata (const struct img_metadata*): Given new metadata of the slot
+ * @return (int): Error code
+ */
+int index_refresh_slot(struct imgfs_file* imgfs_file, struct imgfs_index* index,
+                       uint32_t slot, const struct img_metadata* metadata)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(index);
+    M_REQUIRE_NON_NULL(metadata);
+    if (slot >= imgfs_file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // the entry of the former image, unless it already moved to another slot
+    const struct img_metadata* const former = &imgfs_file->metadata[slot];
+    if (former->is_valid) {
+        const size_t pos = index_lower_bound(imgfs_file, index, former->img_id);
+        if (pos < index->nb_slots && index->slots[pos] == slot) {
+            memmove(&index->slots[pos], &index->slots[pos + 1],
+                    (index->nb_slots - pos - 1) * sizeof(uint32_t));
+            index->nb_slots--;
+        }
+    }
+
+    imgfs_file->metadata[slot] = *metadata;
+    if (!metadata->is_valid) {
+        return ERR_NONE;
+    }
+
+    const size_t pos = index_lower_bound(imgfs_file, index, metadata->img_id);
+    if (pos < index->nb_slots && !strncmp(INDEX_ID(pos), metadata->img_id, MAX_IMG_ID)) {
+        // moved from a slot not refreshed yet, whose entry is taken over
+        index->slots[pos] = slot;
+        return ERR_NONE;
+    }
+
+    const int ret = index_reserve(index);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    memmove(&index->slots[pos + 1], &index->slots[pos],
+            (index->nb_slots - pos) * sizeof(uint32_t));
+    index->slots[pos] = slot;
+    index->nb_slots++;
+
+    return ERR_NONE;
+}
@@ -0,0 +1,142 @@
+/**
+ * @file imgfs_index.h
+ * @brief In-memory ordered index on image identifiers.
+ *
+ * The index keeps the metadata slots of all the valid images sorted by
+ * img_id, so that ordered (and paginated) walks over the imgFS only cost
+ * a binary search plus the size of the walk.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct imgfs_index {
+    uint32_t* slots;    // metadata slots of valid images, ordered by img_id
+    uint32_t nb_slots;  // number of used entries in slots
+    uint32_t capacity;  // number of allocated entries in slots
+};
+
+/**
+ * @brief Builds the index from all the valid metadata of an imgFS.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index to be filled. Must be released with index_free().
+ * @return Some error code. 0 if no error.
+ */
+int index_build(const struct imgfs_file* imgfs_file, struct imgfs_index* index);
+
+/**
+ * @brief Frees the memory held by an index.
+ *
+ * @param index The index to be freed
+ */
+void index_free(struct imgfs_index* index);
+
+/**
+ * @brief Adds a freshly inserted (valid) image to the index.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index to be updated
+ * @param img_id The ID of the inserted image
+ * @return Some error code. 0 if no error.
+ */
+int index_add(const struct imgfs_file* imgfs_file, struct imgfs_index* index,
+              const char* img_id);
+
+/**
+ * @brief Removes an image from the index.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index to be updated
+ * @param img_id The ID of the removed image
+ * @return Some error code. 0 if no error.
+ */
+int index_remove(const struct imgfs_file* imgfs_file, struct imgfs_index* index,
+                 const char* img_id);
+
+/**
+ * @brief Replaces the metadata of a slot (by what another process wrote
+ *        there, see imgfs_lock.h), updating the index accordingly.
+ *
+ * The slots may change in any order: an image moved to another slot is
+ * found there, even before its former slot is refreshed.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index to be updated
+ * @param slot The slot changed
+ * @param metadata Its new metadata
+ * @return Some error code. 0 if no error.
+ */
+int index_refresh_slot(struct imgfs_file* imgfs_file, struct imgfs_index* index,
+                       uint32_t slot, const struct img_metadata* metadata);
+
+/**
+ * @brief Looks up the metadata slot of a valid image.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index to search into
+ * @param img_id The searched image ID
+ * @param slot Where to write the slot of the image in imgfs_file->metadata
+ * @return Some error code. 0 if no error.
+ */
+int index_find(const struct imgfs_file* imgfs_file, const struct imgfs_index* index,
+               const char* img_id, uint32_t* slot);
+
+/**
+ * @brief Gives the index room for every slot of the imgFS, so that its
+ *        entries are never moved to another array by index_add().
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index, built by index_build()
+ * @return Some error code. 0 if no error.
+ */
+int index_reserve_all(const struct imgfs_file* imgfs_file, struct imgfs_index* index);
+
+/**
+ * @brief index_find() for readers taking no lock, while a writer may be
+ *        changing the index (see seqlock.h): its result is only meaningful
+ *        if no write happened meanwhile, which the caller has to check.
+ *        The index must have been given its room by index_reserve_all().
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index to search into
+ * @param img_id The searched image ID
+ * @param slot Where to write the slot of the image in imgfs_file->metadata
+ * @return Some error code. 0 if no error.
+ */
+int index_find_unlocked(const struct imgfs_file* imgfs_file, const struct imgfs_index* index,
+                        const char* img_id, uint32_t* slot);
+
+/**
+ * @brief Position of the first entry whose img_id is not less than key.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index to search into
+ * @param key The searched image ID
+ * @return Position in index->slots (index->nb_slots if none).
+ */
+size_t index_lower_bound(const struct imgfs_file* imgfs_file,
+                         const struct imgfs_index* index, const char* key);
+
+/**
+ * @brief Position of the first entry whose img_id is greater than key.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index to search into
+ * @param key The searched image ID
+ * @return Position in index->slots (index->nb_slots if none).
+ */
+size_t index_upper_bound(const struct imgfs_file* imgfs_file,
+                         const struct imgfs_index* index, const char* key);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,24 +1,43 @@
 #include <string.h>
+#include <sys/mman.h>  // for mmap
+#include <unistd.h>    // for ftruncate, sysconf
 #include "imgfs.h"
 #include "error.h"
 #include "image_content.h"
 #include "image_dedup.h"
+#include "crc32c.h"
+#include "imgfs_lock.h"
+#include "storage.h"
 
 /**
- * @brief Insert image in the imgFS file
+ * @brief Marks a filled metadata as valid and writes it on disk, with the updated header
  *
- * @param buffer Pointer to the raw image content
- * @param size Image size
- * @param img_id Image ID
- * @return Some error code. 0 if no error.
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @param i (uint32_t): Index of the new image in the metadata array
+ * @return (int): Error code
  */
-int do_insert(const char* image_buffer, size_t image_size,
-              const char* img_id, struct imgfs_file* imgfs_file)
+static int commit_metadata(struct imgfs_file* imgfs_file, uint32_t i)
 {
-    M_REQUIRE_NON_NULL(image_buffer);
-    M_REQUIRE_NON_NULL(img_id);
-    M_REQUIRE_NON_NULL(imgfs_file);
+    struct img_metadata* metadata = imgfs_file->metadata;
+
+    metadata[i].is_valid = NON_EMPTY;
 
+    // Writing the image new metadata at its place, before the header announces it (see imgfs_lock.h)
+    return write_change(imgfs_file, i);
+}
+
+/**
+ * @brief Inserts an image, holding the write lock of the imgFS
+ *
+ * @param image_buffer (const char*): Given raw image content
+ * @param image_size (size_t): Given image size
+ * @param img_id (const char*): Given image ID
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @return (int): Error code
+ */
+static int insert_image(const char* image_buffer, size_t image_size,
+                        const char* img_id, struct imgfs_file* imgfs_file)
+{
     if (imgfs_file->header.nb_files >= imgfs_file->header.max_files) {
         return ERR_IMGFS_FULL;
     }
@@ -45,37 +64,272 @@ int do_insert(const char* image_buffer, size_t image_size,
                 return ret;
             }
 
-            fseek(imgfs_file->file, 0, SEEK_END);
-            long res_offset = ftell(imgfs_file->file); // Storing the image offset value
             if (!metadata[i].offset[ORIG_RES]) {
-
-                ret = (int) fwrite(image_buffer, image_size, 1, imgfs_file->file); // Writing the resized image
-                if (ret != 1) {
-                    return ERR_IO;
+                // Writing the image at the end of the file, updating its offset
+                ret = append_blob(imgfs_file, image_buffer, image_size, &metadata[i].offset[ORIG_RES]);
+                if (ret != ERR_NONE) {
+                    return ret;
                 }
-                // Updating image offset value
-                metadata[i].offset[ORIG_RES] = res_offset;
             }
 
             // Updating image metadata
             metadata[i].size[ORIG_RES] = image_size;
-            metadata[i].is_valid = NON_EMPTY;
 
-            header->version++; header->nb_files++;
-            fseek(imgfs_file->file, 0, SEEK_SET);
-            ret = (int) fwrite(header, sizeof(struct imgfs_header), 1, imgfs_file->file); // Writing the image new header
-            if (ret != 1) {
-                return ERR_IO;
-            }
+            return commit_metadata(imgfs_file, (uint32_t) i);
+        }
+    }
+
+    return ERR_IMGFS_FULL;
+}
+
+/**
+ * @brief Insert image in the imgFS file
+ *
+ * @param buffer Pointer to the raw image content
+ * @param size Image size
+ * @param img_id Image ID
+ * @return Some error code. 0 if no error.
+ */
+int do_insert(const char* image_buffer, size_t image_size,
+              const char* img_id, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    int ret = imgfs_write_lock(imgfs_file, NULL, NULL);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    ret = insert_image(image_buffer, image_size, img_id, imgfs_file);
+    imgfs_write_unlock(imgfs_file);
+    return ret;
+}
+
+/**
+ * @brief Starts a streamed insertion: the content will be spooled at the end of the file
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @param stream (struct insert_stream*): Insertion state to initialize
+ * @return (int): Error code
+ */
+int do_insert_begin(struct imgfs_file* imgfs_file, struct insert_stream* stream)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(stream);
+
+    memset(stream, 0, sizeof(struct insert_stream));
+
+    // held until the commit (or the abort): nobody else appends meanwhile
+    int ret = imgfs_write_lock(imgfs_file, NULL, NULL);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+
+    // Fails early rather than after the whole content was received
+    uint64_t spool_offset = 0;
+    if (imgfs_file->header.nb_files >= imgfs_file->header.max_files) {
+        ret = ERR_IMGFS_FULL;
+    } else {
+        ret = storage_end(imgfs_file, &spool_offset);
+    }
+
+    if (ret == ERR_NONE) {
+        stream->sha_ctx = EVP_MD_CTX_new();
+        ret = stream->sha_ctx == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+    }
+    if (ret == ERR_NONE && EVP_DigestInit_ex(stream->sha_ctx, EVP_sha256(), NULL) != 1) {
+        EVP_MD_CTX_free(stream->sha_ctx);
+        stream->sha_ctx = NULL;
+        ret = ERR_RUNTIME;
+    }
+    if (ret != ERR_NONE) {
+        imgfs_write_unlock(imgfs_file);
+        return ret;
+    }
+
+    stream->imgfs_file = imgfs_file;
+    stream->spool_offset = spool_offset;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Appends a chunk of content to a streamed insertion
+ *
+ * @param stream (struct insert_stream*): Given insertion state
+ * @param chunk (const char*): Given chunk of raw image content
+ * @param chunk_size (size_t): Size of the chunk
+ * @return (int): Error code
+ */
+int do_insert_chunk(struct insert_stream* stream, const char* chunk, size_t chunk_size)
+{
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(stream->imgfs_file);
+    M_REQUIRE_NON_NULL(stream->sha_ctx);
+
+    if (!chunk_size) {
+        return ERR_NONE;
+    }
+    M_REQUIRE_NON_NULL(chunk);
+
+    // metadata sizes are 32 bits wide
+    if (stream->size + chunk_size > UINT32_MAX) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const int ret = storage_write(stream->imgfs_file, stream->spool_offset + stream->size, chunk, chunk_size);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    if (EVP_DigestUpdate(stream->sha_ctx, chunk, chunk_size) != 1) {
+        return ERR_RUNTIME;
+    }
+    stream->crc = crc32c(stream->crc, chunk, chunk_size);
+
+    stream->size += chunk_size;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Reads the resolution of the spooled content, mapping it instead of reading it back
+ *
+ * @param stream (const struct insert_stream*): Given insertion state
+ * @param metadata (struct img_metadata*): Metadata whose orig_res is to be filled
+ * @return (int): Error code
+ */
+static int spooled_resolution(const struct insert_stream* stream, struct img_metadata* metadata)
+{
+    FILE* file = stream->imgfs_file->file;
+    int ret = storage_flush(stream->imgfs_file);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+
+    // mmap() wants an offset aligned on pages
+    const uint64_t page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+    const uint64_t map_offset = stream->spool_offset - stream->spool_offset % page_size;
+    const size_t map_size = (size_t) (stream->spool_offset - map_offset + stream->size);
+
+    void* map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fileno(file), (off_t) map_offset);
+    if (map == MAP_FAILED) {
+        return ERR_IO;
+    }
+
+    const char* content = (const char*) map + (stream->spool_offset - map_offset);
+    ret = get_resolution(&metadata->orig_res[1], &metadata->orig_res[0],
+                             content, (size_t) stream->size);
+
+    munmap(map, map_size);
+    return ret;
+}
 
-#define OFFSET_METADATA_IMAGE sizeof(struct imgfs_header) + i * sizeof(struct img_metadata)
-            // Seeking the file to the corresponding image metadata
-            fseek(imgfs_file->file, OFFSET_METADATA_IMAGE, SEEK_SET);
-            ret = (int) fwrite(&metadata[i], sizeof(struct img_metadata), 1, imgfs_file->file); // Writing the image new metadata
+/**
+ * @brief Cuts the spooled content off the file, the write lock being still held
+ *
+ * @param stream (struct insert_stream*): Given insertion state
+ */
+static void drop_spool(struct insert_stream* stream)
+{
+    EVP_MD_CTX_free(stream->sha_ctx);
+    stream->sha_ctx = NULL;
 
-            return ret != 1 ? ERR_IO : ERR_NONE;
+    if (stream->imgfs_file != NULL && stream->imgfs_file->file != NULL) {
+        FILE* file = stream->imgfs_file->file;
+        storage_flush(stream->imgfs_file);
+        if (ftruncate(fileno(file), (off_t) stream->spool_offset)) {
+            // Nothing references the spooled bytes: they are only wasted space
+            fprintf(stderr, "Could not drop the spooled content of an aborted insertion\n");
         }
     }
+}
 
-    return ERR_IMGFS_FULL;
+/**
+ * @brief Ends a streamed insertion, with the same deduplication as do_insert()
+ *
+ * @param stream (struct insert_stream*): Given insertion state (released in all cases)
+ * @param img_id (const char*): Given image identifier
+ * @return (int): Error code
+ */
+int do_insert_commit(struct insert_stream* stream, const char* img_id)
+{
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(stream->imgfs_file);
+    M_REQUIRE_NON_NULL(stream->sha_ctx);
+
+    struct imgfs_file* imgfs_file = stream->imgfs_file;
+    struct img_metadata* metadata = imgfs_file->metadata;
+
+    if (img_id == NULL || !stream->size) {
+        do_insert_abort(stream);
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (strlen(img_id) > MAX_IMG_ID) {
+        do_insert_abort(stream);
+        return ERR_INVALID_IMGID;
+    }
+
+    uint32_t i = 0;
+    while (i < imgfs_file->header.max_files && metadata[i].is_valid) {
+        ++i;
+    }
+    if (i == imgfs_file->header.max_files) {
+        do_insert_abort(stream);
+        return ERR_IMGFS_FULL;
+    }
+
+    memset(&metadata[i], 0, sizeof(struct img_metadata));
+    strcpy(metadata[i].img_id, img_id);
+    if (EVP_DigestFinal_ex(stream->sha_ctx, metadata[i].SHA, NULL) != 1) {
+        do_insert_abort(stream);
+        return ERR_RUNTIME;
+    }
+
+    int ret = spooled_resolution(stream, &metadata[i]);
+    if (ret == ERR_NONE) {
+        ret = do_name_and_content_dedup(imgfs_file, i);
+    }
+    if (ret != ERR_NONE) {
+        do_insert_abort(stream);
+        return ret;
+    }
+
+    if (metadata[i].offset[ORIG_RES]) {
+        // Same content already stored: the spooled copy is useless
+        drop_spool(stream);
+    } else {
+        // the CRC follows the spooled content, where the file ends
+        if (imgfs_file->header.flags & IMGFS_CRC32C) {
+            unsigned char crc[CRC32C_BYTES];
+            crc32c_put(stream->crc, crc);
+            ret = storage_write(imgfs_file, stream->spool_offset + stream->size, crc, CRC32C_BYTES);
+            if (ret != ERR_NONE) {
+                do_insert_abort(stream);
+                return ret;
+            }
+        }
+        metadata[i].offset[ORIG_RES] = stream->spool_offset;
+        EVP_MD_CTX_free(stream->sha_ctx);
+        stream->sha_ctx = NULL;
+    }
+    metadata[i].size[ORIG_RES] = (uint32_t) stream->size;
+
+    ret = commit_metadata(imgfs_file, i);
+    imgfs_write_unlock(imgfs_file);
+    return ret;
+}
+
+/**
+ * @brief Cancels a streamed insertion and cuts the spooled content off the file
+ *
+ * @param stream (struct insert_stream*): Given insertion state
+ */
+void do_insert_abort(struct insert_stream* stream)
+{
+    if (stream == NULL) {
+        return;
+    }
+
+    drop_spool(stream);
+    imgfs_write_unlock(stream->imgfs_file);
 }
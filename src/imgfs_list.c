@@ -2,6 +2,8 @@
 #include "util.h"
 #include "error.h"
 #include "http_prot.h"
+#include "imgfs_index.h"
+#include "imgfs_shards.h"
 #include <json-c/json.h>
 #include <string.h>
 
@@ -65,5 +67,189 @@ int do_list(const struct imgfs_file* imgfs_file,
     return ERR_NONE;
 }
 
+/**
+ * @brief Displays one page of the valid images, ordered by img_id
+ *
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param index (const struct imgfs_index*): Given ordered index on the database
+ * @param output_mode (enum do_list_mode): Given output mode
+ * @param page (const struct list_page*): Given page selection
+ * @param json (char**): Location of the JSON string (JSON mode only)
+ * @return (int): Error code
+ */
+int do_list_page(const struct imgfs_file* imgfs_file, const struct imgfs_index* index,
+                 enum do_list_mode output_mode, const struct list_page* page, char** json)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(index);
+    M_REQUIRE_NON_NULL(page);
+
+    if (output_mode >= NB_DO_LIST_MODES) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (output_mode == JSON) {
+        M_REQUIRE_NON_NULL(json);
+    }
+
+    const char* prefix = page->prefix != NULL ? page->prefix : "";
+    size_t prefix_len = strlen(prefix);
+
+    // Starts right after the cursor, or at the first img_id having the prefix
+    size_t pos = index_lower_bound(imgfs_file, index, prefix);
+    if (page->cursor != NULL && page->cursor[0] != '\0') {
+        pos = MAX(pos, index_upper_bound(imgfs_file, index, page->cursor));
+    }
+
+#define PAGE_ID(i) imgfs_file->metadata[index->slots[i]].img_id
+#define HAS_PREFIX(i) !strncmp(PAGE_ID(i), prefix, prefix_len)
+    size_t end = pos;
+    while (end < index->nb_slots && HAS_PREFIX(end) &&
+           (!page->limit || end - pos < page->limit)) {
+        ++end;
+    }
+    const int has_more = end > pos && end < index->nb_slots && HAS_PREFIX(end);
+
+    if (output_mode == STDOUT) {
+        print_header(&imgfs_file->header);
+        if (end == pos) {
+            printf(EMPTY_PRINT);
+        }
+        for (size_t i = pos; i < end; ++i) {
+            print_metadata(&imgfs_file->metadata[index->slots[i]]);
+        }
+        if (has_more) {
+            printf("NEXT CURSOR: %s\n", PAGE_ID(end - 1));
+        }
+        return ERR_NONE;
+    }
+
+    struct json_object* img_id_array = json_object_new_array();
+    for (size_t i = pos; i < end; ++i) {
+        json_object_array_add(img_id_array, json_object_new_string(PAGE_ID(i)));
+    }
+
+    struct json_object* json_obj = json_object_new_object();
+    if (json_object_object_add(json_obj, "Images", img_id_array) < 0) {
+        json_object_put(json_obj);
+        return ERR_RUNTIME;
+    }
+    if (has_more && json_object_object_add(json_obj, "next_cursor",
+                                           json_object_new_string(PAGE_ID(end - 1))) < 0) {
+        json_object_put(json_obj);
+        return ERR_RUNTIME;
+    }
+
+    *json = strdup(json_object_to_json_string(json_obj));
+    json_object_put(json_obj);
+
+    return *json == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+}
+
+
+/**
+ * @brief Displays one page of the valid images of several imgFS files,
+ *        merged and ordered by img_id
+ *
+ * @param files (const struct imgfs_file* const*): Given databases
+ * @param indexes (const struct imgfs_index* const*): Given ordered indexes on them
+ * @param nb_files (size_t): Given number of databases
+ * @param output_mode (enum do_list_mode): Given output mode
+ * @param page (const struct list_page*): Given page selection
+ * @param json (char**): Location of the JSON string (JSON mode only)
+ * @return (int): Error code
+ */
+int do_list_shards(const struct imgfs_file* const* files, const struct imgfs_index* const* indexes,
+                   size_t nb_files, enum do_list_mode output_mode, const struct list_page* page,
+                   char** json)
+{
+    M_REQUIRE_NON_NULL(files);
+    M_REQUIRE_NON_NULL(indexes);
+    M_REQUIRE_NON_NULL(page);
+
+    if (output_mode >= NB_DO_LIST_MODES || nb_files == 0 || nb_files > MAX_SHARDS) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (output_mode == JSON) {
+        M_REQUIRE_NON_NULL(json);
+    }
+
+    const char* prefix = page->prefix != NULL ? page->prefix : "";
+    size_t prefix_len = strlen(prefix);
+
+    // the page of each file, as do_list_page() finds it: the page of the set is within them
+    size_t pos[MAX_SHARDS];
+    for (size_t f = 0; f < nb_files; ++f) {
+        M_REQUIRE_NON_NULL(files[f]);
+        M_REQUIRE_NON_NULL(indexes[f]);
+        pos[f] = index_lower_bound(files[f], indexes[f], prefix);
+        if (page->cursor != NULL && page->cursor[0] != '\0') {
+            pos[f] = MAX(pos[f], index_upper_bound(files[f], indexes[f], page->cursor));
+        }
+    }
+
+#define SHARD_ID(f) files[f]->metadata[indexes[f]->slots[pos[f]]].img_id
+#define SHARD_HAS_NEXT(f) (pos[f] < indexes[f]->nb_slots && \
+                           !strncmp(SHARD_ID(f), prefix, prefix_len))
+    struct json_object* img_id_array = output_mode == JSON ? json_object_new_array() : NULL;
+    if (output_mode == STDOUT) {
+        for (size_t f = 0; f < nb_files; ++f) {
+            print_header(&files[f]->header);
+        }
+    }
+
+    // merged: the smallest next img_id of the files, until the limit
+    size_t listed = 0;
+    const char* last = NULL;
+    int has_more = 0;
+    while (1) {
+        size_t next = nb_files;
+        for (size_t f = 0; f < nb_files; ++f) {
+            if (SHARD_HAS_NEXT(f) && (next == nb_files || strcmp(SHARD_ID(f), SHARD_ID(next)) < 0)) {
+                next = f;
+            }
+        }
+        if (next == nb_files) {
+            break;
+        }
+        if (page->limit && listed == page->limit) {
+            has_more = 1;
+            break;
+        }
 
+        const struct img_metadata* const metadata = &files[next]->metadata[indexes[next]->slots[pos[next]]];
+        if (output_mode == STDOUT) {
+            print_metadata(metadata);
+        } else {
+            json_object_array_add(img_id_array, json_object_new_string(metadata->img_id));
+        }
+        last = metadata->img_id;
+        ++listed;
+        ++pos[next];
+    }
 
+    if (output_mode == STDOUT) {
+        if (listed == 0) {
+            printf(EMPTY_PRINT);
+        }
+        if (has_more) {
+            printf("NEXT CURSOR: %s\n", last);
+        }
+        return ERR_NONE;
+    }
+
+    struct json_object* json_obj = json_object_new_object();
+    if (json_object_object_add(json_obj, "Images", img_id_array) < 0) {
+        json_object_put(json_obj);
+        return ERR_RUNTIME;
+    }
+    if (has_more && json_object_object_add(json_obj, "next_cursor",
+                                           json_object_new_string(last)) < 0) {
+        json_object_put(json_obj);
+        return ERR_RUNTIME;
+    }
+
+    *json = strdup(json_object_to_json_string(json_obj));
+    json_object_put(json_obj);
+
+    return *json == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+}
@@ -0,0 +1,429 @@
+/**
+ * @file imgfs_lock.c
+ * @brief Coordination of the processes sharing an imgFS file.
+ */
+
+#define _GNU_SOURCE // F_OFD_SETLKW
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "imgfs_lock.h"
+#include "storage.h"
+
+#ifdef F_OFD_SETLKW
+#define IMGFS_SETLKW F_OFD_SETLKW // held by the open file, see imgfs_lock.h
+#else
+#define IMGFS_SETLKW F_SETLKW     // held by the process
+#endif
+
+#define SLOT_OFFSET(slot) (sizeof(struct imgfs_header) + (uint64_t) (slot) * sizeof(struct img_metadata))
+#define CHANGELOG_OFFSET(max_files) SLOT_OFFSET(max_files)
+
+// the write lock taken by this thread, and how many times (see imgfs_write_lock())
+static _Thread_local const struct imgfs_file* held_file;
+static _Thread_local unsigned held_depth;
+
+/**
+ * @brief Locks (or unlocks) a range of bytes of the file, waiting for it
+ *
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param start (uint64_t): Given first byte of the range
+ * @param len (uint64_t): Given length of the range, 0 for up to the end (and beyond)
+ * @param type (short): Given F_RDLCK, F_WRLCK or F_UNLCK
+ * @return (int): Error code
+ */
+static int lock_range(const struct imgfs_file* imgfs_file, uint64_t start, uint64_t len, short type)
+{
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock)); // l_pid must be 0 for F_OFD_SETLKW
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = (off_t) start;
+    lock.l_len = (off_t) len;
+
+    int ret = 0;
+    do {
+        ret = fcntl(fileno(imgfs_file->file), IMGFS_SETLKW, &lock);
+    } while (ret == -1 && errno == EINTR);
+    return ret == -1 ? ERR_IO : ERR_NONE;
+}
+
+/**
+ * @brief Applies a slot read from the file to the in-memory copy, if it changed
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @param slot (uint32_t): Given slot
+ * @param metadata (const struct img_metadata*): Given metadata of the slot in the file
+ * @param refresher (SlotRefresher): Given callback for the changed slots, NULL to copy them
+ * @param arg (void*): Given argument of the callback
+ */
+static void apply_slot(struct imgfs_file* imgfs_file, uint32_t slot, const struct img_metadata* metadata,
+                       SlotRefresher refresher, void* arg)
+{
+    // only the slots which changed are given to the refresher
+    if (!memcmp(metadata, &imgfs_file->metadata[slot], sizeof(struct img_metadata))) {
+        return;
+    }
+    if (refresher != NULL) {
+        refresher(arg, slot, metadata);
+    } else {
+        imgfs_file->metadata[slot] = *metadata;
+    }
+}
+
+/**
+ * @brief Finds in the change log the slots changed since the version of the copy
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @param header (const struct imgfs_header*): Given header of the file
+ * @param slots (uint32_t*): Given array of CHANGELOG_ENTRIES slots to write them to
+ * @return (int): Their number, -1 if the log does not go back that far
+ */
+static int logged_slots(struct imgfs_file* imgfs_file, const struct imgfs_header* header, uint32_t* slots)
+{
+    const uint32_t behind = header->version - imgfs_file->header.version;
+    if (!(header->flags & IMGFS_CHANGELOG) || behind >= CHANGELOG_ENTRIES) {
+        return -1;
+    }
+
+    struct changelog_entry log[CHANGELOG_ENTRIES];
+    if (storage_read(imgfs_file, CHANGELOG_OFFSET(header->max_files), log, sizeof(log)) != ERR_NONE) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < behind; ++i) {
+        const uint32_t version = imgfs_file->header.version + 1 + i;
+        const struct changelog_entry* entry = &log[version % CHANGELOG_ENTRIES];
+        // overwritten by a later change: the log is too short
+        if (entry->version != version || entry->slot >= header->max_files) {
+            return -1;
+        }
+        slots[i] = entry->slot;
+    }
+    return (int) behind;
+}
+
+/**
+ * @brief Brings the in-memory copy up to date with a header just read;
+ *        the caller holds what makes the metadata stable
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @param header (const struct imgfs_header*): Given header of the file
+ * @param refresher (SlotRefresher): Given callback for the changed slots, NULL to copy them
+ * @param arg (void*): Given argument of the callback
+ * @return (int): Error code
+ */
+static int refresh(struct imgfs_file* imgfs_file, const struct imgfs_header* header,
+                   SlotRefresher refresher, void* arg)
+{
+    if (header->version == imgfs_file->header.version) {
+        return ERR_NONE;
+    }
+    // not the same imgFS anymore
+    if (header->max_files != imgfs_file->header.max_files || header->flags != imgfs_file->header.flags) {
+        return ERR_CORRUPT_IMGFS;
+    }
+
+    // the slots logged since, if the log goes back that far
+    uint32_t slots[CHANGELOG_ENTRIES];
+    const int nb_logged = logged_slots(imgfs_file, header, slots);
+    if (nb_logged >= 0) {
+        int ret = ERR_NONE;
+        for (int i = 0; ret == ERR_NONE && i < nb_logged; ++i) {
+            struct img_metadata metadata;
+            ret = storage_read(imgfs_file, SLOT_OFFSET(slots[i]), &metadata, sizeof(metadata));
+            if (ret == ERR_NONE) {
+                apply_slot(imgfs_file, slots[i], &metadata, refresher, arg);
+            }
+        }
+        if (ret == ERR_NONE) {
+            imgfs_file->header = *header;
+        }
+        return ret;
+    }
+
+    // the whole metadata otherwise
+    const uint32_t max_files = header->max_files;
+    struct img_metadata* const metadata = calloc(max_files ? max_files : 1, sizeof(struct img_metadata));
+    if (metadata == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int ret = storage_read(imgfs_file, SLOT_OFFSET(0), metadata, max_files * sizeof(struct img_metadata));
+    if (ret == ERR_NONE) {
+        for (uint32_t slot = 0; slot < max_files; ++slot) {
+            apply_slot(imgfs_file, slot, &metadata[slot], refresher, arg);
+        }
+        imgfs_file->header = *header;
+    }
+
+    free(metadata);
+    return ret;
+}
+
+/**
+ * @brief Takes the write lock of the imgFS, then reads the header and, if
+ *        it changed, the metadata
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @param mapped (int): Given whether the metadata is the file itself (only the header is copied)
+ * @param refresher (SlotRefresher): Given callback for the changed slots, NULL to copy them
+ * @param arg (void*): Given argument of the callback
+ * @return (int): Error code
+ */
+static int write_lock(struct imgfs_file* imgfs_file, int mapped, SlotRefresher refresher, void* arg)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    // already held by this thread, which is not writing meanwhile: the copy is up to date
+    if (held_depth > 0 && held_file == imgfs_file) {
+        ++held_depth;
+        return ERR_NONE;
+    }
+
+    int ret = lock_range(imgfs_file, SLOT_OFFSET(imgfs_file->header.max_files), 0, F_WRLCK);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    if (held_depth == 0) {
+        held_file = imgfs_file;
+        held_depth = 1;
+    }
+
+    // the other writers are excluded: the header and metadata are not changing
+    struct imgfs_header header;
+    ret = storage_read(imgfs_file, 0, &header, sizeof(header));
+    if (ret == ERR_NONE && mapped) {
+        imgfs_file->header = header;
+    } else if (ret == ERR_NONE) {
+        ret = refresh(imgfs_file, &header, refresher, arg);
+    }
+    if (ret != ERR_NONE) {
+        imgfs_write_unlock(imgfs_file);
+    }
+    return ret;
+}
+
+/**
+ * @brief Takes the write lock of the imgFS, and brings the copy up to date
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @param refresher (SlotRefresher): Given callback for the changed slots, NULL to copy them
+ * @param arg (void*): Given argument of the callback
+ * @return (int): Error code
+ */
+int imgfs_write_lock(struct imgfs_file* imgfs_file, SlotRefresher refresher, void* arg)
+{
+    return write_lock(imgfs_file, 0, refresher, arg);
+}
+
+/**
+ * @brief Takes the write lock of an imgFS whose metadata is the file, mapped
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @return (int): Error code
+ */
+int imgfs_write_lock_mapped(struct imgfs_file* imgfs_file)
+{
+    return write_lock(imgfs_file, 1, NULL, NULL);
+}
+
+/**
+ * @brief Releases the write lock of the imgFS
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ */
+void imgfs_write_unlock(struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file == NULL || imgfs_file->file == NULL) {
+        return;
+    }
+    if (held_depth > 0 && held_file == imgfs_file) {
+        if (--held_depth > 0) {
+            return;
+        }
+        held_file = NULL;
+    }
+    lock_range(imgfs_file, SLOT_OFFSET(imgfs_file->header.max_files), 0, F_UNLCK);
+}
+
+/**
+ * @brief Takes the read lock of the header and metadata
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @return (int): Error code
+ */
+int imgfs_read_lock(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    return lock_range(imgfs_file, 0, SLOT_OFFSET(imgfs_file->header.max_files), F_RDLCK);
+}
+
+/**
+ * @brief Releases the read lock of the header and metadata
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ */
+void imgfs_read_unlock(struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file == NULL || imgfs_file->file == NULL) {
+        return;
+    }
+    lock_range(imgfs_file, 0, SLOT_OFFSET(imgfs_file->header.max_files), F_UNLCK);
+}
+
+/**
+ * @brief Brings the in-memory copy up to date, if another process changed the file
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @param refresher (SlotRefresher): Given callback for the changed slots, NULL to copy them
+ * @param arg (void*): Given argument of the callback
+ * @return (int): Error code
+ */
+int do_refresh(struct imgfs_file* imgfs_file, SlotRefresher refresher, void* arg)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    // a look without lock first: the version only grows, a torn one only costs a locked read
+    struct imgfs_header header;
+    int ret = storage_read(imgfs_file, 0, &header, sizeof(header));
+    if (ret != ERR_NONE || header.version == imgfs_file->header.version) {
+        return ret;
+    }
+
+    ret = imgfs_read_lock(imgfs_file);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    ret = storage_read(imgfs_file, 0, &header, sizeof(header));
+    if (ret == ERR_NONE) {
+        ret = refresh(imgfs_file, &header, refresher, arg);
+    }
+    imgfs_read_unlock(imgfs_file);
+    return ret;
+}
+
+/**
+ * @brief Writes the in-memory header to the file, under its lock
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @return (int): Error code
+ */
+int write_header(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    int ret = lock_range(imgfs_file, 0, sizeof(struct imgfs_header), F_WRLCK);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    ret = storage_write(imgfs_file, 0, &imgfs_file->header, sizeof(struct imgfs_header));
+    if (ret == ERR_NONE) {
+        // visible to the other processes before the lock is released
+        ret = storage_flush(imgfs_file);
+    }
+    lock_range(imgfs_file, 0, sizeof(struct imgfs_header), F_UNLCK);
+    return ret;
+}
+
+/**
+ * @brief Writes the metadata of a slot an insert or a delete just changed,
+ *        then the header one version further, logging the change
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database, whose write lock is held
+ * @param slot (uint32_t): Given slot, valid if inserted, not if deleted
+ * @return (int): Error code
+ */
+int write_change(struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    int ret = write_metadata(imgfs_file, slot, &imgfs_file->metadata[slot]);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+
+    struct imgfs_header* const header = &imgfs_file->header;
+    header->version++;
+    if (imgfs_file->metadata[slot].is_valid) {
+        header->nb_files++;
+    } else {
+        header->nb_files--;
+    }
+
+    // logged before the header announces it; the readers check the version of the entry
+    if (header->flags & IMGFS_CHANGELOG) {
+        const struct changelog_entry entry = { .version = header->version, .slot = slot };
+        ret = storage_write(imgfs_file, CHANGELOG_OFFSET(header->max_files) +
+                            (header->version % CHANGELOG_ENTRIES) * sizeof(entry), &entry, sizeof(entry));
+        if (ret != ERR_NONE) {
+            return ret;
+        }
+    }
+    return write_header(imgfs_file);
+}
+
+/**
+ * @brief Writes the metadata of a slot to the file, under its lock
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @param slot (uint32_t): Given slot
+ * @param metadata (const struct img_metadata*): Given metadata to write there
+ * @return (int): Error code
+ */
+int write_metadata(struct imgfs_file* imgfs_file, uint32_t slot, const struct img_metadata* metadata)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(metadata);
+    if (slot >= imgfs_file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    int ret = lock_range(imgfs_file, SLOT_OFFSET(slot), sizeof(struct img_metadata), F_WRLCK);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    ret = storage_write(imgfs_file, SLOT_OFFSET(slot), metadata, sizeof(struct img_metadata));
+    if (ret == ERR_NONE) {
+        ret = storage_flush(imgfs_file);
+    }
+    lock_range(imgfs_file, SLOT_OFFSET(slot), sizeof(struct img_metadata), F_UNLCK);
+    return ret;
+}
+
+/**
+ * @brief Reads the metadata of a slot from the file, under its lock
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @param slot (uint32_t): Given slot
+ * @param metadata (struct img_metadata*): Given pointer to read the metadata to
+ * @return (int): Error code
+ */
+int read_metadata(struct imgfs_file* imgfs_file, uint32_t slot, struct img_metadata* metadata)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(metadata);
+    if (slot >= imgfs_file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    int ret = lock_range(imgfs_file, SLOT_OFFSET(slot), sizeof(struct img_metadata), F_RDLCK);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    ret = storage_read(imgfs_file, SLOT_OFFSET(slot), metadata, sizeof(struct img_metadata));
+    lock_range(imgfs_file, SLOT_OFFSET(slot), sizeof(struct img_metadata), F_UNLCK);
+    return ret;
+}
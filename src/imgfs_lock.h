@@ -0,0 +1,142 @@
+/**
+ * @file imgfs_lock.h
+ * @brief Coordination of the processes sharing an imgFS file.
+ *
+ * Several processes may have the same imgFS open (e.g. imgfs_server, and
+ * `imgfscmd insert` run against its file), each with its own in-memory copy
+ * of the header and metadata. They coordinate with locks on byte ranges of
+ * the file (fcntl()):
+ *  - the append region, everything after the metadata, is held exclusive
+ *    by a writer for its whole operation: it serialises the writers, hence
+ *    their allocation of slots and their appends;
+ *  - the header and each metadata slot are held exclusive while they are
+ *    written, and shared while they are read, so that neither is ever read
+ *    half written. A writer writes its slot before the header.
+ *
+ * Every insert and delete bumps header.version. A writer first brings its
+ * copy up to date, under the append lock (see imgfs_write_lock()); any
+ * other process finds the changes of the others by comparing the version
+ * of the file with its own, see do_refresh(). A resize does not change the
+ * version: a writer about to create a resolution reads its slot again
+ * instead, see store_resized_img().
+ *
+ * Finding the changed slots takes a read of the whole metadata, unless
+ * the imgFS has a change log (IMGFS_CHANGELOG): its writers then record
+ * the slot each version changed in a ring of CHANGELOG_ENTRIES entries,
+ * right after the metadata (see write_change()), and a process fewer
+ * versions behind only reads the slots logged since its own version.
+ *
+ * The locks belong to the open file (F_OFD_SETLKW, where available), not
+ * to a thread: the threads of a process share them, and must serialise
+ * their writers themselves. The write lock nests within a thread: a caller
+ * may take it around the library functions which take it too, only its
+ * own release releasing it.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The change log of an imgFS with IMGFS_CHANGELOG: version v is at entry v % CHANGELOG_ENTRIES
+#define CHANGELOG_ENTRIES 512
+struct changelog_entry {
+    uint32_t version; // the version this change made, 0 for none
+    uint32_t slot;    // the slot it inserted or deleted
+};
+#define CHANGELOG_SIZE (CHANGELOG_ENTRIES * sizeof(struct changelog_entry))
+
+/**
+ * @brief Applies a slot changed by another process to a copy of the metadata.
+ *
+ * Called with imgfs_file->metadata[slot] still as it was: it is then the
+ * callback's to copy `metadata` there (and to update what depends on it).
+ */
+typedef void (*SlotRefresher)(void* arg, uint32_t slot, const struct img_metadata* metadata);
+
+/**
+ * @brief Takes the write lock of the imgFS (the append region), then
+ *        brings the in-memory copy up to date with the file.
+ *
+ * @param imgfs_file The imgFS, opened for writing
+ * @param refresher Called for each slot changed in the file, NULL to copy them
+ * @param arg Given to the refresher
+ * @return Some error code (ERR_IO if the file cannot be locked, e.g. if
+ *         read only); the lock is then not held. 0 if no error.
+ */
+int imgfs_write_lock(struct imgfs_file* imgfs_file, SlotRefresher refresher, void* arg);
+
+/**
+ * @brief imgfs_write_lock() for an imgFS whose metadata is the file itself,
+ *        mapped (see imgfs_shared.h): there is nothing to bring up to
+ *        date, but the header.
+ */
+int imgfs_write_lock_mapped(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Releases the write lock of the imgFS.
+ */
+void imgfs_write_unlock(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Takes the read lock of the header and metadata, under which they
+ *        are read as a whole (by do_open() and do_refresh()).
+ *
+ * @param imgfs_file The imgFS, whose header.max_files is known
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_read_lock(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Releases the read lock of the header and metadata.
+ */
+void imgfs_read_unlock(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Brings the in-memory copy of the imgFS up to date, if another
+ *        process changed the file (its header.version advanced).
+ *
+ * Costs a read of the header when nothing changed, and with a change log,
+ * a read of the slots changed only. Must not be called while this imgFS is
+ * being written (by the same open file).
+ *
+ * @param imgfs_file The imgFS
+ * @param refresher Called for each slot changed in the file, NULL to copy them
+ * @param arg Given to the refresher
+ * @return Some error code. 0 if no error.
+ */
+int do_refresh(struct imgfs_file* imgfs_file, SlotRefresher refresher, void* arg);
+
+/**
+ * @brief Writes the in-memory header to the file, under its lock.
+ */
+int write_header(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Writes the metadata of a slot an insert or a delete just changed,
+ *        then the header, one version further and with its image count
+ *        updated, logging the change if the imgFS has a change log. The
+ *        write lock is held.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int write_change(struct imgfs_file* imgfs_file, uint32_t slot);
+
+/**
+ * @brief Writes the metadata of a slot to the file, under its lock.
+ */
+int write_metadata(struct imgfs_file* imgfs_file, uint32_t slot, const struct img_metadata* metadata);
+
+/**
+ * @brief Reads the metadata of a slot from the file, under its lock.
+ */
+int read_metadata(struct imgfs_file* imgfs_file, uint32_t slot, struct img_metadata* metadata);
+
+#ifdef __cplusplus
+}
+#endif
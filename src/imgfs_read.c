@@ -3,6 +3,7 @@
 #include "imgfs.h"
 #include "error.h"
 #include "image_content.h"
+#include "storage.h"
 
 /**
  * @brief Reads the content of an image from a imgFS.
@@ -57,19 +58,18 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
     }
 
 
-    fseek(imgfs_file->file, (long) imgfs_file->metadata[index].offset[resolution], SEEK_SET);
-
     *image_buffer = calloc(1, imgfs_file->metadata[index].size[resolution]);
     if (*image_buffer == NULL) {
         return ERR_OUT_OF_MEMORY;
     }
 
-
-    ret = (int) fread(*image_buffer, imgfs_file->metadata[index].size[resolution], 1, imgfs_file->file);
-    if (ret != 1) {
+    // checked against its CRC, if the imgFS has them
+    ret = read_blob(imgfs_file, imgfs_file->metadata[index].offset[resolution],
+                    imgfs_file->metadata[index].size[resolution], *image_buffer);
+    if (ret != ERR_NONE) {
         free(*image_buffer);
         *image_buffer = NULL;
-        return ERR_IO;
+        return ret;
     }
 
     *image_size = imgfs_file->metadata[index].size[resolution];
@@ -79,3 +79,181 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
 
 
 
+/**********************************************************************
+ * Batch reads
+ ********************************************************************** */
+#define BATCH_MAX_GAP 4096 // unused bytes read rather than making one more read
+
+// the blob of an image of a batch
+struct batch_extent {
+    uint64_t offset;
+    uint64_t end;    // with its CRC, if any
+    size_t image;    // position in the batch
+};
+
+/**
+ * @brief Compares two extents by offset (for qsort)
+ *
+ * @param a (const void*): Pointer to an extent
+ * @param b (const void*): Pointer to an extent
+ * @return (int): Same convention as strcmp
+ */
+static int cmp_extent_offset(const void* a, const void* b)
+{
+    const struct batch_extent* ea = a;
+    const struct batch_extent* eb = b;
+    return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+}
+
+/**
+ * @brief Compares the image IDs of two batch images (for qsort)
+ *
+ * @param a (const void*): Pointer to a batch image pointer
+ * @param b (const void*): Pointer to a batch image pointer
+ * @return (int): Same convention as strcmp
+ */
+static int cmp_batch_id(const void* a, const void* b)
+{
+    const struct batch_image* const* ia = a;
+    const struct batch_image* const* ib = b;
+    return strcmp((*ia)->img_id, (*ib)->img_id);
+}
+
+int read_batch(struct imgfs_file* imgfs_file, struct batch_image* images, size_t nb_images,
+               char** buffer)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(images);
+    M_REQUIRE_NON_NULL(buffer);
+    *buffer = NULL;
+
+    struct batch_extent* extents = calloc(nb_images ? nb_images : 1, sizeof(struct batch_extent));
+    if (extents == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t nb_extents = 0;
+    for (size_t i = 0; i < nb_images; ++i) {
+        images[i].content = NULL;
+        if (images[i].err == ERR_NONE) {
+            extents[nb_extents].offset = images[i].offset;
+            extents[nb_extents].end = images[i].offset + blob_footprint(&imgfs_file->header, images[i].size);
+            extents[nb_extents].image = i;
+            ++nb_extents;
+        }
+    }
+    qsort(extents, nb_extents, sizeof(struct batch_extent), cmp_extent_offset);
+
+    // the runs of close extents, each one read at once: first their total size
+    uint64_t total = 0;
+    for (size_t i = 0; i < nb_extents; ) {
+        const uint64_t start = extents[i].offset;
+        uint64_t end = extents[i].end;
+        for (++i; i < nb_extents && extents[i].offset <= end + BATCH_MAX_GAP; ++i) {
+            end = extents[i].end > end ? extents[i].end : end;
+        }
+        total += end - start;
+    }
+
+    *buffer = malloc(total ? (size_t) total : 1);
+    if (*buffer == NULL) {
+        free(extents);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int ret = ERR_NONE;
+    char* run_buf = *buffer;
+    for (size_t i = 0; i < nb_extents && ret == ERR_NONE; ) {
+        const size_t first = i;
+        const uint64_t start = extents[i].offset;
+        uint64_t end = extents[i].end;
+        for (++i; i < nb_extents && extents[i].offset <= end + BATCH_MAX_GAP; ++i) {
+            end = extents[i].end > end ? extents[i].end : end;
+        }
+
+        ret = storage_read(imgfs_file, start, run_buf, (size_t) (end - start));
+        for (size_t k = first; k < i && ret == ERR_NONE; ++k) {
+            struct batch_image* const image = &images[extents[k].image];
+            const char* const content = run_buf + (extents[k].offset - start);
+            image->err = check_blob(&imgfs_file->header, content, image->size);
+            image->content = image->err == ERR_NONE ? content : NULL;
+        }
+        run_buf += end - start;
+    }
+
+    free(extents);
+    if (ret != ERR_NONE) {
+        free(*buffer);
+        *buffer = NULL;
+    }
+    return ret;
+}
+
+int do_read_many(struct batch_image* images, size_t nb_images, int resolution,
+                 struct imgfs_file* imgfs_file, char** buffer)
+{
+    M_REQUIRE_NON_NULL(images);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(buffer);
+    if (resolution < 0 || resolution >= NB_RES) {
+        return ERR_RESOLUTIONS;
+    }
+    for (size_t i = 0; i < nb_images; ++i) {
+        M_REQUIRE_NON_NULL(images[i].img_id);
+        images[i].err = ERR_IMAGE_NOT_FOUND;
+    }
+
+    struct batch_image** by_id = calloc(nb_images ? nb_images : 1, sizeof(struct batch_image*));
+    uint32_t* slots = calloc(nb_images ? nb_images : 1, sizeof(uint32_t));
+    if (by_id == NULL || slots == NULL) {
+        free(by_id);
+        free(slots);
+        return ERR_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; i < nb_images; ++i) {
+        by_id[i] = &images[i];
+    }
+    qsort(by_id, nb_images, sizeof(struct batch_image*), cmp_batch_id);
+
+    // a single pass over the metadata, each valid image being searched among the requested ones
+    for (uint32_t slot = 0; slot < imgfs_file->header.max_files; ++slot) {
+        const struct img_metadata* const md = &imgfs_file->metadata[slot];
+        if (!md->is_valid) {
+            continue;
+        }
+        size_t lo = 0, hi = nb_images;
+        while (lo < hi) {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (strcmp(by_id[mid]->img_id, md->img_id) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        // the same image may be requested several times
+        for (; lo < nb_images && !strcmp(by_id[lo]->img_id, md->img_id); ++lo) {
+            by_id[lo]->err = ERR_NONE;
+            slots[by_id[lo] - images] = slot;
+        }
+    }
+    free(by_id);
+
+    int ret = ERR_NONE;
+    for (size_t i = 0; i < nb_images && ret == ERR_NONE; ++i) {
+        if (images[i].err != ERR_NONE) {
+            continue;
+        }
+        const struct img_metadata* const md = &imgfs_file->metadata[slots[i]];
+        if (md->offset[resolution] == 0) {
+            images[i].err = lazily_resize(resolution, imgfs_file, slots[i]);
+            // a failure of the file or of the memory ends the batch, others only concern the image
+            if (images[i].err == ERR_OUT_OF_MEMORY || images[i].err == ERR_IO) {
+                ret = images[i].err;
+            }
+        }
+        images[i].offset = md->offset[resolution];
+        images[i].size = md->size[resolution];
+    }
+    free(slots);
+
+    return ret == ERR_NONE ? read_batch(imgfs_file, images, nb_images, buffer) : ret;
+}
@@ -38,6 +38,13 @@ static void set_signal_handler(void)
         perror("sigaction() in set_signal_handler()");
         abort();
     }
+
+    // a client leaving early must only fail its own reply, not kill the server
+    action.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &action, NULL) < 0) {
+        perror("sigaction() in set_signal_handler()");
+        abort();
+    }
 }
 
 /********************************************************************/
@@ -50,9 +57,9 @@ int main (int argc, char *argv[])
     }
     set_signal_handler();
 
-    while ((err = http_receive()) == ERR_NONE);
+    err = server_run();
 
-    fprintf(stderr, "http_receive() failed\n");
+    fprintf(stderr, "server_run() failed\n");
     fprintf(stderr, "%s\n", ERR_MSG(err));
 
     return err;
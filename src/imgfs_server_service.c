@@ -9,22 +9,539 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h> // uint16_t
+#include <limits.h> // PATH_MAX
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h> // sysconf
+#include <time.h> // clock_gettime
+#include <sys/stat.h>
 
 #include "error.h"
 #include "util.h" // atouint16
 #include "imgfs.h"
+#include "imgfs_index.h"
+#include "imgfs_shared.h"
+#include "imgfs_shards.h"
+#include "imgfs_lock.h"
+#include "seqlock.h"
+#include "image_content.h" // resize_original
+#include "work_queue.h"
+#include "buf_pool.h"
+#include "crc32c.h" // crc32c_impl
+#include "storage.h"
+#include "stats.h"
 #include "http_net.h"
+#include "socket_layer.h" // tcp_read
 #include "imgfs_server_service.h"
 
-// Main in-memory structure for imgFS
-static struct imgfs_file fs_file;
 static uint16_t server_port;
+// Number of threads serving the requests (see http_run_shards())
+static size_t nb_threads = 1;
+
+/*
+ * The imgFS files of a store (see store), its shards: the one given, or
+ * those of the manifest given instead (see imgfs_shards.h), each image
+ * being served by the shard it belongs to (see shard_of()). Everything
+ * below is per shard.
+ *
+ * Requests may be handled by several threads at once:
+ *  - the lookups of an image (reads, batches) take no lock: they are made
+ *    consistent by sequence counters (see seqlock.h and lookup_image()),
+ *    index_seq for the set of images in the index and slot_seq[] for the
+ *    metadata of each slot, so that reads never wait for one another nor
+ *    for a writer, and a resize only makes the readers of its slot retry;
+ *  - the walks over all the metadata (listings) are made under lock held
+ *    shared, the writers holding it exclusive for their changes;
+ *  - writer is held by whoever writes to the file (insert, delete and
+ *    resize): it serialises the allocation of the slots and the appends,
+ *    and the writers of the sequence counters.
+ * Blobs are sent at their offset by the storage backend (sendfile() or
+ * io_uring, see storage.h), which does not use the stdio FILE: readers send
+ * them without any lock. Writers flush their writes (see flush_writes())
+ * before releasing writer, for the blobs to be visible to the readers.
+ * A resize only holds writer to append its result, see resize_blob().
+ *
+ * Other processes may write to the file too (e.g. `imgfscmd insert`), see
+ * imgfs_lock.h: the writers take the write lock of the file along with
+ * writer (see lock_writer()), which first applies the slots the others
+ * changed, and the requests apply them at most every REFRESH_INTERVAL_US
+ * (or when an image is not found), see refresh_from_file(). The locks of
+ * the file belong to the process: they are only taken holding writer.
+ *
+ * Several servers may serve the same file (IMGFS_SHARED): they then share
+ * its metadata, mapped, the sequence counters and a hash table from img_id
+ * to slot instead of index (see imgfs_shared.h), so that an image inserted
+ * by one is at once found by the others. lock then only serialises the
+ * threads of a process: the listings retry instead, like the lookups, when
+ * index_seq changed under them.
+ */
+struct shard {
+    struct imgfs_file file;     // main in-memory structure for imgFS
+    struct imgfs_index index;   // ordered index on img_id, for paginated listing
+    pthread_rwlock_t lock;
+    pthread_mutex_t writer;
+    struct imgfs_shared shared; // attached if IMGFS_SHARED
+    uint32_t own_index_seq;
+    uint32_t* index_seq;        // &own_index_seq, or in the shared segment
+    uint32_t* slot_seq;
+    uint8_t* blob_checked;      // see check_blob_once()
+    uint64_t last_refresh_us;
+};
+
+#define REFRESH_INTERVAL_US 100000
+
+/*
+ * A store is one namespace of images: an imgFS file, or a set of shards.
+ * Shards are only ever added to a manifest (by `imgfscmd addshard`, while
+ * the servers serve): the requests check it every REFRESH_INTERVAL_US, see
+ * reload_manifest(). A new shard is opened before nb_shards, then the ring,
+ * are published: the requests read them without any lock. The rings are
+ * only freed at shutdown, one per manifest loaded.
+ *
+ * Several stores may be served at once (argv[1] being "name=file,..."),
+ * each under its own prefix, URI_ROOT "/<name>/read" and so on, the first
+ * one under URI_ROOT too (see mounted_store()). They share the threads,
+ * the connections, resize_queue and the buffers of buf_pool (within
+ * IMGFS_CACHE_BUDGET), and each has its metrics besides those of the
+ * whole server.
+ */
+#define MAX_STORES 16
+#define MAX_STORE_NAME 31
+
+struct store {
+    char name[MAX_STORE_NAME + 1];  // empty for the single store of an imgFS given alone
+    struct shard shards[MAX_SHARDS];
+    size_t nb_shards;
+    struct imgfs_shards rings[MAX_SHARDS];
+    size_t nb_rings;
+    const struct imgfs_shards* ring; // NULL for a single imgFS
+    const char* manifest;            // NULL for a single imgFS
+    struct stat manifest_stat;       // as last loaded
+    pthread_mutex_t manifest_lock;
+    uint64_t last_reload_us;
+    struct stats stats;
+};
+
+static struct store stores[MAX_STORES];
+static size_t nb_stores;
+
+// whether the writes are made durable before the reply (IMGFS_SYNC), not only flushed
+static int sync_writes;
+
+/*
+ * Reads of a resolution not created yet decode the original with libvips,
+ * which takes hundreds of times longer than sending a stored blob. So that
+ * a burst of them cannot hold every thread, they are handed to resize_queue
+ * with their connection: its workers (about one per two serving threads)
+ * create the resolution and answer, while the serving threads go on with
+ * the cheap reads. When too many resizes already wait, the request is shed
+ * with a 503 and a Retry-After instead.
+ */
+static struct work_queue resize_queue;
+#define RESIZE_QUEUED_PER_WORKER 2
+#define RETRY_AFTER_SECONDS "1"
+
+/*
+ * Metrics of the requests, served by /imgfs/stats. Each request is
+ * accounted once answered, to the operation its handler chose (a read is
+ * only known to be a resize once the blob is looked up), with the first
+ * error replied, if any.
+ */
+static struct stats server_stats;
+static _Thread_local enum stats_op request_op;
+static _Thread_local int request_error;
+static _Thread_local uint64_t request_start_us;
+
+// the store a request is for, and whether it was named in its path (see mounted_store())
+static _Thread_local struct store* request_store;
+static _Thread_local int request_mounted;
+
+/**
+ * @brief Reads the monotonic clock
+ *
+ * @return (uint64_t): The time, in microseconds
+ */
+static uint64_t now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000u + (uint64_t) now.tv_nsec / 1000u;
+}
+
+/**
+ * @brief Accounts a request answered, to the whole server and to its store
+ *        (see stats_record())
+ *
+ * @param st (struct store*): Given store of the request
+ * @param op (enum stats_op): Given operation
+ * @param latency_us (uint64_t): Given time from dispatch to answer
+ * @param bytes_in (size_t): Given bytes of the request body
+ * @param bytes_out (size_t): Given bytes of the reply
+ * @param error (int): Given error of the request, ERR_NONE if none
+ */
+static void record_request(struct store* st, enum stats_op op, uint64_t latency_us,
+                           size_t bytes_in, size_t bytes_out, int error)
+{
+    stats_record(&server_stats, op, latency_us, bytes_in, bytes_out, error);
+    stats_record(&st->stats, op, latency_us, bytes_in, bytes_out, error);
+}
+
+/*
+ * In an imgFS with CRCs (IMGFS_CRC32C), a blob is checked the first time
+ * it is sent: sendfile() never brings its bytes to user space, so they are
+ * read once more for the check. Its success is remembered in the
+ * blob_checked of its shard, one bit per resolution of each slot, which is
+ * cleared when the image of the slot is deleted. Later reads of the blob
+ * are sent without any check: a corruption of the disk after its first
+ * read goes unnoticed until the server restarts (or `imgfscmd verify`).
+ */
 
 #define URI_ROOT "/imgfs"
 
+static int check_routes(void);
+static void run_resize_job(void* arg);
+
+/**
+ * @brief Frees what open_lookups() set up
+ *
+ * @param sh (struct shard*): Given shard
+ */
+static void close_lookups(struct shard* sh)
+{
+    if (sh->shared.segment != NULL) {
+        imgfs_shared_detach(&sh->shared, &sh->file);
+    } else {
+        free(sh->blob_checked);
+        free(sh->slot_seq);
+    }
+    sh->blob_checked = NULL;
+    sh->slot_seq = NULL;
+    index_free(&sh->index);
+}
+
+/**
+ * @brief Sets up what the lookups without lock need: shared with the other
+ *        servers of the file if asked (IMGFS_SHARED) and possible, of this
+ *        process otherwise
+ *
+ * @param sh (struct shard*): Given shard, whose file is open
+ * @return (int): Error code
+ */
+static int open_lookups(struct shard* sh)
+{
+    if (getenv("IMGFS_SHARED") != NULL) {
+        const int ret = imgfs_shared_attach(&sh->shared, &sh->file);
+        if (ret == ERR_NONE) {
+            sh->index_seq = sh->shared.index_seq;
+            sh->slot_seq = sh->shared.slot_seq;
+            sh->blob_checked = (sh->file.header.flags & IMGFS_CRC32C) ? sh->shared.blob_checked : NULL;
+            printf("metadata shared with the other servers\n");
+            return ERR_NONE;
+        }
+        fprintf(stderr, "metadata not shared (%s): using a copy\n", ERR_MSG(ret));
+    }
+
+    sh->index_seq = &sh->own_index_seq;
+    int ret = index_build(&sh->file, &sh->index);
+    if (ret == ERR_NONE) {
+        // the lookups without lock need an index which never moves
+        ret = index_reserve_all(&sh->file, &sh->index);
+    }
+    if (ret == ERR_NONE) {
+        sh->slot_seq = calloc(sh->file.header.max_files, sizeof(uint32_t));
+        ret = sh->slot_seq == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+    }
+    if (ret == ERR_NONE && (sh->file.header.flags & IMGFS_CRC32C)) {
+        sh->blob_checked = calloc(sh->file.header.max_files, sizeof(uint8_t));
+        ret = sh->blob_checked == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+    }
+    if (ret != ERR_NONE) {
+        close_lookups(sh);
+    }
+    return ret;
+}
+
+/**
+ * @brief Opens the imgFS file of a shard, and sets up its lookups
+ *
+ * @param sh (struct shard*): Given shard
+ * @param filename (const char*): Given imgFS file name
+ * @return (int): Error code
+ */
+static int open_shard(struct shard* sh, const char* filename)
+{
+    memset(sh, 0, sizeof(*sh));
+    int ret = do_open(filename, "rb+", &sh->file);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    print_header(&sh->file.header);
+
+    ret = open_lookups(sh);
+    if (ret != ERR_NONE) {
+        do_close(&sh->file);
+        return ret;
+    }
+    pthread_rwlock_init(&sh->lock, NULL);
+    pthread_mutex_init(&sh->writer, NULL);
+    if (sh->blob_checked != NULL) {
+        printf("blobs checked against their CRC-32C (%s)\n", crc32c_impl());
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Closes what open_shard() opened
+ *
+ * @param sh (struct shard*): Given shard
+ */
+static void close_shard(struct shard* sh)
+{
+    close_lookups(sh);
+    do_close(&sh->file);
+    pthread_rwlock_destroy(&sh->lock);
+    pthread_mutex_destroy(&sh->writer);
+}
+
+/**
+ * @brief Closes all the shards of a store, and frees their rings
+ *
+ * @param st (struct store*): Given store
+ */
+static void close_shards(struct store* st)
+{
+    for (size_t i = 0; i < st->nb_shards; ++i) {
+        close_shard(&st->shards[i]);
+    }
+    st->nb_shards = 0;
+    for (size_t i = 0; i < st->nb_rings; ++i) {
+        shards_free(&st->rings[i]);
+    }
+    st->nb_rings = 0;
+    st->ring = NULL;
+}
+
+/**
+ * @brief Opens the shards of a store: the file itself, or those of its manifest
+ *
+ * @param st (struct store*): Given store
+ * @param filename (const char*): Given imgFS file, or manifest of shards
+ * @return (int): Error code
+ */
+static int open_shards(struct store* st, const char* filename)
+{
+    if (!shards_is_manifest(filename)) {
+        const int ret = open_shard(&st->shards[0], filename);
+        st->nb_shards = ret == ERR_NONE ? 1 : 0;
+        return ret;
+    }
+
+    st->manifest = filename;
+    if (stat(st->manifest, &st->manifest_stat) != 0) {
+        return ERR_IO;
+    }
+    int ret = shards_load(st->manifest, &st->rings[0]);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    st->nb_rings = 1;
+    for (size_t i = 0; ret == ERR_NONE && i < st->rings[0].nb_shards; ++i) {
+        ret = open_shard(&st->shards[i], st->rings[0].paths[i]);
+        if (ret == ERR_NONE) {
+            ++st->nb_shards;
+        }
+    }
+    if (ret != ERR_NONE) {
+        close_shards(st);
+        return ret;
+    }
+    st->ring = &st->rings[0];
+    printf("%zu shards, of %s\n", st->nb_shards, st->manifest);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Opens the shards added to the manifest of a store since it was
+ *        last loaded, unless it was checked less than REFRESH_INTERVAL_US ago
+ *
+ * @param st (struct store*): Given store
+ * @param forced (int): Given whether to ignore the interval
+ */
+static void reload_manifest(struct store* st, int forced)
+{
+    const uint64_t now = now_us();
+    if (st->manifest == NULL ||
+        (!forced && now - __atomic_load_n(&st->last_reload_us, __ATOMIC_RELAXED) < REFRESH_INTERVAL_US) ||
+        pthread_mutex_trylock(&st->manifest_lock) != 0) {
+        return;
+    }
+    __atomic_store_n(&st->last_reload_us, now, __ATOMIC_RELAXED);
+
+    struct stat current;
+    if (stat(st->manifest, &current) != 0 ||
+        (current.st_size == st->manifest_stat.st_size &&
+         current.st_mtim.tv_sec == st->manifest_stat.st_mtim.tv_sec &&
+         current.st_mtim.tv_nsec == st->manifest_stat.st_mtim.tv_nsec)) {
+        pthread_mutex_unlock(&st->manifest_lock);
+        return;
+    }
+    st->manifest_stat = current;
+
+    struct imgfs_shards* const ring = &st->rings[st->nb_rings];
+    int ret = st->nb_rings < MAX_SHARDS ? shards_load(st->manifest, ring) : ERR_MAX_FILES;
+    if (ret == ERR_NONE && ring->nb_shards <= st->nb_shards) {
+        // only the shards appended are taken into account
+        shards_free(ring);
+        pthread_mutex_unlock(&st->manifest_lock);
+        return;
+    }
+
+    size_t opened = st->nb_shards;
+    while (ret == ERR_NONE && opened < ring->nb_shards) {
+        ret = open_shard(&st->shards[opened], ring->paths[opened]);
+        if (ret == ERR_NONE) {
+            ++opened;
+        }
+    }
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "shards of %s not reloaded: %s\n", st->manifest, ERR_MSG(ret));
+        while (opened > st->nb_shards) {
+            close_shard(&st->shards[--opened]);
+        }
+        if (st->nb_rings < MAX_SHARDS) {
+            shards_free(ring);
+        }
+        pthread_mutex_unlock(&st->manifest_lock);
+        return;
+    }
+
+    // registered before any request can reach them, and kept open until the backend is released
+    for (size_t i = st->nb_shards; i < opened; ++i) {
+        (void) storage_register(&st->shards[i].file);
+    }
+    // the shards first: the ring may lead to any of them
+    ++st->nb_rings;
+    __atomic_store_n(&st->nb_shards, opened, __ATOMIC_RELEASE);
+    __atomic_store_n(&st->ring, ring, __ATOMIC_RELEASE);
+    printf("%zu shards, of %s\n", opened, st->manifest);
+    pthread_mutex_unlock(&st->manifest_lock);
+}
+
+/**
+ * @brief Gives the number of shards of a store, as published
+ */
+static size_t served_shards(struct store* st)
+{
+    return __atomic_load_n(&st->nb_shards, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Gives the shard an image belongs to (see imgfs_shards.h)
+ *
+ * @param st (struct store*): Given store
+ * @param img_id (const char*): Given image ID
+ * @return (struct shard*): Its shard
+ */
+static struct shard* shard_of(struct store* st, const char* img_id)
+{
+    const struct imgfs_shards* const ring = __atomic_load_n(&st->ring, __ATOMIC_ACQUIRE);
+    return &st->shards[ring == NULL ? 0 : shards_locate(ring, img_id)];
+}
+
+/**
+ * @brief Closes all the stores
+ */
+static void close_stores(void)
+{
+    for (size_t i = 0; i < nb_stores; ++i) {
+        close_shards(&stores[i]);
+        pthread_mutex_destroy(&stores[i].manifest_lock);
+    }
+    nb_stores = 0;
+}
+
+/**
+ * @brief Tells whether a store name is valid: letters, digits, '-' and '_'
+ *
+ * @param name (const char*): Given name
+ * @return (int): 1 if it is, 0 otherwise
+ */
+static int valid_store_name(const char* name)
+{
+    const size_t len = strlen(name);
+    if (len == 0 || len > MAX_STORE_NAME) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        const char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+              c == '-' || c == '_')) {
+            return 0;
+        }
+    }
+    for (size_t i = 0; i < nb_stores; ++i) {
+        if (!strcmp(stores[i].name, name)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Opens the stores of argv[1]: an imgFS file (or manifest) alone,
+ *        or "name=file,name=file,..."; argv[1] is cut into its parts
+ *
+ * @param spec (char*): Given argv[1]
+ * @return (int): Error code
+ */
+static int open_stores(char* spec)
+{
+    int ret = ERR_NONE;
+    char* item = spec;
+    while (ret == ERR_NONE && item != NULL) {
+        char* const comma = strchr(item, ',');
+        if (comma != NULL) {
+            *comma = '\0';
+        }
+        char* filename = strchr(item, '=');
+        if (filename != NULL) {
+            *filename++ = '\0';
+        }
+
+        // a name for each, unless there is only one
+        if (nb_stores == MAX_STORES) {
+            ret = ERR_MAX_FILES;
+        } else if (filename == NULL ? comma != NULL || item != spec : !valid_store_name(item)) {
+            ret = ERR_INVALID_ARGUMENT;
+        } else {
+            struct store* const st = &stores[nb_stores];
+            memset(st, 0, sizeof(*st));
+            if (filename != NULL) {
+                strcpy(st->name, item);
+                printf("store \"%s\", under " URI_ROOT "/%s\n", st->name, st->name);
+            }
+            pthread_mutex_init(&st->manifest_lock, NULL);
+            ret = open_shards(st, filename != NULL ? filename : item);
+            if (ret == ERR_NONE) {
+                ++nb_stores;
+            } else {
+                pthread_mutex_destroy(&st->manifest_lock);
+            }
+        }
+        item = comma != NULL ? comma + 1 : NULL;
+    }
+    if (ret != ERR_NONE) {
+        close_stores();
+    }
+    return ret;
+}
+
 /********************************************************************//**
  * Startup function. Create imgFS file and load in-memory structure.
- * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2]
+ * Pass the imgFS file name (or a manifest of shards) as argv[1], or
+ * several of them as "name=file,name=file,...", optionnaly port number
+ * as argv[2]
+ * and number of threads as argv[3] (0 for one per CPU, 1 by default)
  ********************************************************************** */
 int server_startup (int argc, char **argv)
 {
@@ -33,11 +550,20 @@ int server_startup (int argc, char **argv)
     }
     int ret = ERR_NONE;
 
-    ret = do_open(argv[1], "rb", &fs_file);
+    ret = check_routes();
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    // tracing of the request handling, off by default
+    http_set_trace(getenv("IMGFS_TRACE") != NULL);
+    // the parser of the headers: the line one by default, or IMGFS_HTTP_PARSER=indexed (see http_scan.h)
+    const char* parser = getenv("IMGFS_HTTP_PARSER");
+    http_set_indexed_parser(parser != NULL && !strcmp(parser, "indexed"));
+
+    ret = open_stores(argv[1]);
     if (ret != ERR_NONE) {
         return ret;
     }
-    print_header(&fs_file.header);
 
     if (argv[2] != NULL) {
         server_port = atouint16(argv[2]);
@@ -47,19 +573,81 @@ int server_startup (int argc, char **argv)
         server_port = DEFAULT_LISTENING_PORT;
     }
 
-    ret = http_init(server_port, handle_http_message);
+    if (argc > 3) {
+        nb_threads = atouint16(argv[3]);
+        if (nb_threads == 0 && errno == ERANGE) {
+            close_stores();
+            return ERR_INVALID_ARGUMENT;
+        }
+        if (nb_threads == 0) {
+            const long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            nb_threads = nb_cpus > 0 ? (size_t) nb_cpus : 1;
+        }
+    }
+
+    const size_t nb_resizers = (nb_threads + 1) / 2;
+    ret = work_queue_init(&resize_queue, nb_resizers, nb_resizers * RESIZE_QUEUED_PER_WORKER,
+                          run_resize_job, http_thread_cleanup);
+    if (ret != ERR_NONE) {
+        close_stores();
+        return ret;
+    }
+
+    // the threads bind their own listeners, in server_run()
+    ret = nb_threads > 1 ? ERR_NONE : http_init(server_port, handle_http_message);
     if (ret < ERR_NONE) {
-        do_close(&fs_file);
+        work_queue_destroy(&resize_queue);
+        close_stores();
         return ret;
     }
 
+    // the storage backend (IMGFS_STORAGE), stdio by default or if the one asked is not available
+    const char* storage = getenv("IMGFS_STORAGE");
+    if (storage != NULL && (ret = storage_use(storage, &stores[0].shards[0].file)) != ERR_NONE) {
+        fprintf(stderr, "storage \"%s\" not available (%s): using stdio\n", storage, ERR_MSG(ret));
+    }
+    // the other files served, those added later by reload_manifest(); only an optimisation
+    for (size_t i = 0; i < nb_stores; ++i) {
+        for (size_t j = 0; j < stores[i].nb_shards; ++j) {
+            (void) storage_register(&stores[i].shards[j].file);
+        }
+    }
+    http_set_file_sender(storage_current()->send);
+    sync_writes = getenv("IMGFS_SYNC") != NULL;
+    printf("storage: %s%s\n", storage_current()->name, sync_writes ? ", synced writes" : "");
+
+    // the buffers kept for the requests of all the stores (IMGFS_CACHE_BUDGET, in MiB), unbounded by default
+    const char* cache_budget = getenv("IMGFS_CACHE_BUDGET");
+    if (cache_budget != NULL) {
+        const uint32_t mib = atouint32(cache_budget);
+        buf_pool_set_budget((size_t) mib << 20);
+        printf("cache budget: %u MiB\n", (unsigned) mib);
+    }
+
     printf("ImgFS server started on http://localhost: %u\n", server_port);
+    if (nb_threads > 1) {
+        printf("with %zu threads\n", nb_threads);
+    }
 
     return ERR_NONE;
 
 
 }
 
+/********************************************************************//**
+ * Serve the requests until the server fails to accept connections.
+ ********************************************************************** */
+int server_run(void)
+{
+    if (nb_threads > 1) {
+        return http_run_shards(server_port, handle_http_message, nb_threads);
+    }
+
+    int err = ERR_NONE;
+    while ((err = http_receive()) == ERR_NONE);
+    return err;
+}
+
 /********************************************************************//**
  * Shutdown function. Free the structures and close the file.
  ********************************************************************** */
@@ -67,7 +655,10 @@ void server_shutdown (void)
 {
     fprintf(stderr, "\nShutting down...\n");
     http_close();
-    do_close(&fs_file);
+    work_queue_destroy(&resize_queue);
+    http_set_file_sender(NULL);
+    storage_release();
+    close_stores();
 }
 
 /**********************************************************************
@@ -75,12 +666,21 @@ void server_shutdown (void)
  ********************************************************************** */
 static int reply_error_msg(int connection, int error)
 {
+    if (request_error == ERR_NONE) {
+        request_error = error;
+    }
 #define ERR_MSG_SIZE 256
     char err_msg[ERR_MSG_SIZE]; // enough for any reasonable err_msg
     if (snprintf(err_msg, ERR_MSG_SIZE, "Error: %s\n", ERR_MSG(error)) < 0) {
         fprintf(stderr, "reply_error_msg(): sprintf() failed...\n");
         return ERR_RUNTIME;
     }
+    // overload is not a failure: the client is told when to come back
+    if (error == ERR_BUSY) {
+        return http_reply(connection, HTTP_UNAVAILABLE,
+                          "Retry-After: " RETRY_AFTER_SECONDS HTTP_LINE_DELIM,
+                          err_msg, strlen(err_msg));
+    }
     return http_reply(connection, "500 Internal Server Error", "",
                       err_msg, strlen(err_msg));
 }
@@ -100,137 +700,1417 @@ static int reply_302_msg(int connection)
 }
 
 /**********************************************************************
- * Simple handling of http message.
+ * Entity tags of the stored images.
  ********************************************************************** */
-int handle_list_call(struct http_message msg, int connection)
-{
-    char **json;
-    int ret = do_list(&fs_file, JSON, json);
-    if (ret < 0) {
-        return reply_error_msg(connection, ret);
-    }
+// A stored variant never changes: caches may keep it for a long time
+#define CACHE_MAX_AGE 31536000
+#define ETAG_SIZE (2 * SHA256_DIGEST_LENGTH + 16)
+#define WEAK_PREFIX "W/"
 
-    ret = http_reply(connection, "200 OK", "Content-Type: application/json" HTTP_LINE_DELIM,
-                     *json, strlen(*json));
-    free(*json);
-    json = NULL;
-    return ret;
-}
+static const char* const resolution_names[NB_RES] = {"thumb", "small", "orig"};
 
-int handle_read_call(struct http_message msg, int connection)
+/**********************************************************************
+ * Writes the entity tag of one resolution of an image: the SHA of its
+ * content, followed by the resolution. Only the original is byte for byte
+ * the same whoever serves it: the resized variants depend on the libvips
+ * that made them, so that their tag is weak.
+ ********************************************************************** */
+static void make_etag(const struct img_metadata* metadata, int resolution,
+                      char* etag, size_t etag_len)
 {
-    char* out = calloc(10, sizeof(char));
-    if (out == NULL) {
-        return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+    size_t n = (size_t) snprintf(etag, etag_len, "%s\"", resolution == ORIG_RES ? "" : WEAK_PREFIX);
+    for (int i = 0; i < SHA256_DIGEST_LENGTH && n < etag_len; ++i) {
+        n += (size_t) snprintf(etag + n, etag_len - n, "%02x", metadata->SHA[i]);
     }
-
-    int ret = http_get_var(&msg.uri, "res", out, 9);
-    if (ret <= 0) {
-        free(out);
-        out = NULL;
-        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+    if (n < etag_len) {
+        snprintf(etag + n, etag_len - n, "-%s\"", resolution_names[resolution]);
     }
+}
 
-    char* img_id = calloc(MAX_IMG_ID + 1, sizeof(char));
-    if (img_id == NULL) {
-        free(out);
-        out = NULL;
-        return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+/**********************************************************************
+ * Checks whether an If-None-Match header value lists the given entity tag.
+ ********************************************************************** */
+static int etag_matches(const struct http_string* if_none_match, const char* etag)
+{
+    const char* cur = if_none_match->val;
+    const char* const end = cur + if_none_match->len;
+    if (!strncmp(etag, WEAK_PREFIX, strlen(WEAK_PREFIX))) {
+        etag += strlen(WEAK_PREFIX);
     }
+    const size_t etag_len = strlen(etag);
 
-    ret = http_get_var(&msg.uri, "img_id", img_id, MAX_IMG_ID);
-    if (ret <= 0) {
-        free(out);
-        free(img_id);
-        img_id = NULL;
-        out = NULL;
-        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
-    }
+    while (cur < end) {
+        while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == ',')) {
+            ++cur;
+        }
 
-    uint32_t image_size = 0;
-    char* buffer;
+        const char* tag_end = cur;
+        while (tag_end < end && *tag_end != ',') {
+            ++tag_end;
+        }
+        const char* next = tag_end;
+        while (tag_end > cur && (tag_end[-1] == ' ' || tag_end[-1] == '\t')) {
+            --tag_end;
+        }
 
-    int res = resolution_atoi(out);
-    if (res == -1) {
-        free(out);
-        free(img_id);
-        img_id = NULL;
-        out = NULL;
-        return reply_error_msg(connection, ERR_RESOLUTIONS);
+        // If-None-Match uses the weak comparison (RFC 7232, 3.2)
+        if (tag_end - cur >= 2 && !strncmp(cur, WEAK_PREFIX, 2)) {
+            cur += 2;
+        }
+
+        const size_t tag_len = (size_t) (tag_end - cur);
+        if ((tag_len == 1 && *cur == '*') ||
+            (tag_len == etag_len && !strncmp(cur, etag, etag_len))) {
+            return 1;
+        }
+        cur = next;
     }
+    return 0;
+}
 
-    ret = do_read(img_id, res, &buffer, &image_size, &fs_file);
-    if (ret != ERR_NONE) {
-        free(out);
-        free(img_id);
-        img_id = NULL;
-        out = NULL;
-        return reply_error_msg(connection, ret);
+/**********************************************************************
+ * Checks whether an If-Range header value is the given entity tag.
+ * If-Range uses the strong comparison (RFC 7233, 3.2): a weak tag
+ * never matches, and the whole content is then sent.
+ ********************************************************************** */
+static int if_range_matches(const struct http_string* if_range, const char* etag)
+{
+    return strncmp(etag, WEAK_PREFIX, strlen(WEAK_PREFIX)) != 0 &&
+           if_range->len == strlen(etag) && !strncmp(if_range->val, etag, if_range->len);
+}
+
+/**
+ * @brief Lists the images of the shards, holding their locks; those of a
+ *        shared imgFS (see shared), which the other servers may change
+ *        meanwhile, are listed again until none did
+ *
+ * @param st (struct store*): Given store
+ * @param count (size_t): Given number of shards
+ * @param page (const struct list_page*): Given page to list, NULL for all the images
+ * @param json (char**): Given pointer to write the listing to
+ * @return (int): Error code
+ */
+static int list_images(struct store* st, size_t count, const struct list_page* page, char** json)
+{
+    // a single imgFS keeps its plain listing, in metadata order
+    if (count == 1 && page == NULL) {
+        struct shard* const sh = &st->shards[0];
+        int ret = ERR_NONE;
+        uint32_t start = 0;
+        do {
+            free(*json);
+            *json = NULL;
+            start = seq_read_begin(sh->index_seq);
+            ret = do_list(&sh->file, JSON, json);
+        } while (sh->shared.segment != NULL && seq_read_retry(sh->index_seq, start));
+        return ret;
     }
-    ret = http_reply(connection, "200 OK", "Content-Type: image/jpeg" HTTP_LINE_DELIM,
-                     buffer, image_size);
 
-    free(out);
-    free(img_id);
-    free(buffer);
-    out = NULL;
-    img_id = NULL;
-    buffer = NULL;
+    const struct list_page all = {0};
+    const struct imgfs_file* files[MAX_SHARDS];
+    const struct imgfs_index* indexes[MAX_SHARDS];
+    struct imgfs_index built[MAX_SHARDS];
+    uint32_t starts[MAX_SHARDS];
+    int ret = ERR_NONE;
+    int retry = 0;
+    do {
+        free(*json);
+        *json = NULL;
+        size_t nb_seen = 0;
+        for (; ret == ERR_NONE && nb_seen < count; ++nb_seen) {
+            struct shard* const sh = &st->shards[nb_seen];
+            starts[nb_seen] = seq_read_begin(sh->index_seq);
+            files[nb_seen] = &sh->file;
+            indexes[nb_seen] = &sh->index;
+            if (sh->shared.segment != NULL) {
+                // the ordered slots of the segment are shared: the page is copied out of them
+                ret = imgfs_shared_page(&sh->shared, &sh->file, page != NULL ? page : &all, &built[nb_seen]);
+                if (ret == ERR_NONE) {
+                    indexes[nb_seen] = &built[nb_seen];
+                }
+            }
+        }
+        if (ret == ERR_NONE) {
+            ret = do_list_shards(files, indexes, count, JSON, page != NULL ? page : &all, json);
+        }
+        retry = 0;
+        for (size_t i = 0; i < nb_seen; ++i) {
+            if (indexes[i] == &built[i]) {
+                index_free(&built[i]);
+                retry |= seq_read_retry(st->shards[i].index_seq, starts[i]);
+            }
+        }
+    } while (ret == ERR_NONE && retry);
     return ret;
 }
 
-int handle_delete_call(struct http_message msg, int connection)
+/**********************************************************************
+ * Simple handling of http message.
+ ********************************************************************** */
+int handle_list_call(struct http_message msg, int connection)
 {
-    char* img_id = calloc(MAX_IMG_ID + 1, sizeof(char));
-    if (img_id == NULL) {
-        return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
-    }
+    char limit[12] = {0};
+    char cursor[MAX_IMG_ID + 1] = {0};
+    char prefix[MAX_IMG_ID + 1] = {0};
 
-    int ret = http_get_var(&msg.uri, "img_id", img_id, MAX_IMG_ID);
-    if (ret <= 0) {
-        free(img_id);
-        img_id = NULL;
-        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+    int has_limit = http_get_var(&msg.uri, "limit", limit, sizeof(limit) - 1);
+    int has_cursor = http_get_var(&msg.uri, "cursor", cursor, MAX_IMG_ID);
+    int has_prefix = http_get_var(&msg.uri, "prefix", prefix, MAX_IMG_ID);
+    if (has_limit < 0 || has_cursor < 0 || has_prefix < 0) {
+        return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
     }
 
+    struct list_page page = { .prefix = prefix, .cursor = cursor };
+    if (has_limit) {
+        page.limit = atouint32(limit);
+        if (!page.limit) {
+            return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+        }
+    }
 
-    ret = do_delete(img_id, &fs_file);
-    if (ret != ERR_NONE) {
-        free(img_id);
-        img_id = NULL;
+    char* json = NULL;
+    struct store* const st = request_store;
+    const size_t count = served_shards(st);
+    for (size_t i = 0; i < count; ++i) {
+        pthread_rwlock_rdlock(&st->shards[i].lock);
+    }
+    int ret = list_images(st, count, has_limit || has_cursor || has_prefix ? &page : NULL, &json);
+    for (size_t i = 0; i < count; ++i) {
+        pthread_rwlock_unlock(&st->shards[i].lock);
+    }
+    if (ret < 0) {
         return reply_error_msg(connection, ret);
     }
 
-    free(img_id);
-    img_id = NULL;
-    return reply_302_msg(connection);
+    ret = http_reply(connection, "200 OK", "Content-Type: application/json" HTTP_LINE_DELIM,
+                     json, strlen(json));
+    free(json);
+    json = NULL;
+    return ret;
 }
 
-int handle_insert_call(int connection)
+/**
+ * @brief Makes the writes of a writer visible to the readers, and durable
+ *        if asked (IMGFS_SYNC); called holding writer
+ *
+ * @param sh (struct shard*): Given shard
+ * @return (int): Error code
+ */
+static int flush_writes(struct shard* sh)
 {
-    return reply_302_msg(connection);
+    return sync_writes ? storage_sync(&sh->file) : storage_flush(&sh->file);
 }
 
-int handle_http_message(struct http_message* msg, int connection)
+/**
+ * @brief Applies a slot changed by another process (a SlotRefresher, see
+ *        imgfs_lock.h); called holding writer
+ *
+ * @param arg (void*): Given shard
+ * @param slot (uint32_t): Given slot
+ * @param metadata (const struct img_metadata*): Given metadata of the slot in the file
+ */
+static void refresh_slot(void* arg, uint32_t slot, const struct img_metadata* metadata)
 {
-    M_REQUIRE_NON_NULL(msg);
-    debug_printf("handle_http_message() on connection %d. URI: %.*s\n",
-                 connection,
-                 (int) msg->uri.len, msg->uri.val);
+    struct shard* const sh = arg;
+    pthread_rwlock_wrlock(&sh->lock);
+    seq_write_begin(sh->index_seq);
+    seq_write_begin(&sh->slot_seq[slot]);
+    index_refresh_slot(&sh->file, &sh->index, slot, metadata);
+    seq_write_end(&sh->slot_seq[slot]);
+    seq_write_end(sh->index_seq);
+    if (sh->blob_checked != NULL) {
+        __atomic_store_n(&sh->blob_checked[slot], 0, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+}
 
-    if (http_match_verb(&msg->uri, "/") || http_match_uri(msg, "/index.html")) {
-        return http_serve_file(connection, BASE_FILE);
+/**
+ * @brief Takes the write lock of the file, holding writer, and applies
+ *        what the other processes changed meanwhile
+ *
+ * @param sh (struct shard*): Given shard
+ * @return (int): Error code; the lock is not held on error
+ */
+static int lock_file(struct shard* sh)
+{
+    if (sh->shared.segment == NULL) {
+        return imgfs_write_lock(&sh->file, refresh_slot, sh);
     }
 
-    if (http_match_uri(msg, URI_ROOT "/list")) {
-        return handle_list_call(*msg, connection);
-    } else if (http_match_uri(msg, URI_ROOT "/insert") && http_match_verb(&msg->method, "POST")) {
-        return handle_insert_call(connection);
-    } else if (http_match_uri(msg, URI_ROOT "/read")) {
-        return handle_read_call(*msg, connection);
-    } else if (http_match_uri(msg, URI_ROOT "/delete")) {
-        return handle_delete_call(*msg, connection);
-    } else {
-        return reply_error_msg(connection, ERR_INVALID_COMMAND);
+    // the other servers changed the table along with the file: only the others are to be applied
+    int ret = imgfs_write_lock_mapped(&sh->file);
+    if (ret == ERR_NONE) {
+        ret = imgfs_shared_sync(&sh->shared, &sh->file);
+        if (ret != ERR_NONE) {
+            imgfs_write_unlock(&sh->file);
+        }
     }
+    return ret;
+}
+
+/**
+ * @brief Takes writer, then the write lock of the file, applying what
+ *        the other processes changed meanwhile
+ *
+ * @param sh (struct shard*): Given shard
+ * @return (int): Error code; writer is not held on error
+ */
+static int lock_writer(struct shard* sh)
+{
+    pthread_mutex_lock(&sh->writer);
+    const int ret = lock_file(sh);
+    if (ret != ERR_NONE) {
+        pthread_mutex_unlock(&sh->writer);
+    }
+    return ret;
+}
+
+/**
+ * @brief Releases what lock_writer() took
+ *
+ * @param sh (struct shard*): Given shard
+ */
+static void unlock_writer(struct shard* sh)
+{
+    imgfs_write_unlock(&sh->file);
+    pthread_mutex_unlock(&sh->writer);
+}
+
+/**
+ * @brief Applies what the other processes changed in the file of a shard,
+ *        unless it was done less than REFRESH_INTERVAL_US ago (or a writer
+ *        is at work, which does it anyway)
+ *
+ * @param sh (struct shard*): Given shard
+ * @param forced (int): Given whether to ignore the interval
+ */
+static void refresh_shard(struct shard* sh, int forced)
+{
+    if (sh->shared.segment != NULL) {
+        // costs no read of the file: the version of its header is mapped
+        if (!imgfs_shared_changed(&sh->shared) || pthread_mutex_trylock(&sh->writer) != 0) {
+            return;
+        }
+        const int ret = lock_file(sh);
+        if (ret == ERR_NONE) {
+            imgfs_write_unlock(&sh->file);
+        } else {
+            debug_printf("refresh failed: %s\n", ERR_MSG(ret));
+        }
+        pthread_mutex_unlock(&sh->writer);
+        return;
+    }
+
+    const uint64_t now = now_us();
+    if (!forced && now - __atomic_load_n(&sh->last_refresh_us, __ATOMIC_RELAXED) < REFRESH_INTERVAL_US) {
+        return;
+    }
+    if (pthread_mutex_trylock(&sh->writer) != 0) {
+        return;
+    }
+    __atomic_store_n(&sh->last_refresh_us, now, __ATOMIC_RELAXED);
+    const int ret = do_refresh(&sh->file, refresh_slot, sh);
+    if (ret != ERR_NONE) {
+        debug_printf("refresh failed: %s\n", ERR_MSG(ret));
+    }
+    pthread_mutex_unlock(&sh->writer);
+}
+
+/**
+ * @brief Applies what the other processes changed in the files (and in
+ *        the manifest, see reload_manifest()), at most every
+ *        REFRESH_INTERVAL_US
+ *
+ * @param st (struct store*): Given store
+ * @param forced (struct shard*): Given shard to refresh whatever the interval (and
+ *        the manifest), NULL for none
+ */
+static void refresh_from_file(struct store* st, struct shard* forced)
+{
+    reload_manifest(st, forced != NULL);
+    const size_t count = served_shards(st);
+    for (size_t i = 0; i < count; ++i) {
+        refresh_shard(&st->shards[i], &st->shards[i] == forced);
+    }
+}
+
+/**
+ * @brief Copies the metadata of a slot without any lock, consistent even
+ *        if a writer changes it (or the image of the slot) meanwhile
+ *
+ * @param sh (struct shard*): Given shard
+ * @param slot (uint32_t): Given slot
+ * @param md (struct img_metadata*): Given pointer to write the copy to
+ */
+static void read_slot(struct shard* sh, uint32_t slot, struct img_metadata* md)
+{
+    uint32_t start = 0;
+    do {
+        start = seq_read_begin(sh->index_seq);
+        seq_read_copy(&sh->slot_seq[slot], md, &sh->file.metadata[slot], sizeof(struct img_metadata));
+    } while (seq_read_retry(sh->index_seq, start));
+}
+
+/**
+ * @brief Looks up the slot of an image; called holding writer
+ *
+ * @param sh (struct shard*): Given shard
+ * @param img_id (const char*): Given image ID
+ * @param slot (uint32_t*): Given pointer to write the slot of the image to
+ * @return (int): Error code
+ */
+static int find_slot(struct shard* sh, const char* img_id, uint32_t* slot)
+{
+    if (sh->shared.segment != NULL) {
+        return imgfs_shared_find(&sh->shared, &sh->file, img_id, slot);
+    }
+    return index_find(&sh->file, &sh->index, img_id, slot);
+}
+
+/**
+ * @brief Looks up an image in a shard without any lock (see lock)
+ *
+ * @param sh (struct shard*): Given shard
+ * @param img_id (const char*): Given image ID
+ * @param slot (uint32_t*): Given pointer to write the slot of the image to
+ * @param md (struct img_metadata*): Given pointer to write a copy of its metadata to
+ * @return (int): Error code
+ */
+static int lookup_image(struct shard* sh, const char* img_id, uint32_t* slot, struct img_metadata* md)
+{
+    int ret = ERR_NONE;
+    uint32_t start = 0;
+    do {
+        start = seq_read_begin(sh->index_seq);
+        ret = sh->shared.segment != NULL ? imgfs_shared_find(&sh->shared, &sh->file, img_id, slot)
+              : index_find_unlocked(&sh->file, &sh->index, img_id, slot);
+        if (ret == ERR_NONE) {
+            seq_read_copy(&sh->slot_seq[*slot], md, &sh->file.metadata[*slot], sizeof(struct img_metadata));
+        }
+    } while (seq_read_retry(sh->index_seq, start));
+    return ret;
+}
+
+/**
+ * @brief Looks up an image without any lock: in the shard it belongs to,
+ *        then in the others, where it may still be while the shards are
+ *        being rebalanced (see shards_add())
+ *
+ * @param st (struct store*): Given store
+ * @param img_id (const char*): Given image ID
+ * @param found (struct shard**): Given pointer to write the shard of the image to
+ * @param slot (uint32_t*): Given pointer to write the slot of the image to
+ * @param md (struct img_metadata*): Given pointer to write a copy of its metadata to
+ * @return (int): Error code
+ */
+static int find_image(struct store* st, const char* img_id, struct shard** found, uint32_t* slot,
+                      struct img_metadata* md)
+{
+    struct shard* const owner = shard_of(st, img_id);
+    *found = owner;
+    int ret = lookup_image(owner, img_id, slot, md);
+    const size_t count = served_shards(st);
+    for (size_t i = 0; ret == ERR_IMAGE_NOT_FOUND && i < count; ++i) {
+        if (&st->shards[i] != owner && lookup_image(&st->shards[i], img_id, slot, md) == ERR_NONE) {
+            *found = &st->shards[i];
+            ret = ERR_NONE;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Creates a resolution of an image that does not exist yet; the
+ *        decoding runs without any lock, only the append is serialised
+ *
+ * @param st (struct store*): Given store
+ * @param img_id (const char*): Given image ID
+ * @param res (int): Given resolution
+ * @param found (struct shard**): Given pointer to write the shard of the image to
+ * @param offset (off_t*): Given pointer to write the offset of the blob to
+ * @param size (size_t*): Given pointer to write the size of the blob to
+ * @return (int): Error code
+ */
+static int resize_blob(struct store* st, const char* img_id, int res, struct shard** found,
+                       off_t* offset, size_t* size)
+{
+    uint32_t slot = 0;
+    struct img_metadata orig;
+    int ret = find_image(st, img_id, found, &slot, &orig);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    struct shard* const sh = *found;
+    struct imgfs_file* const fs_file = &sh->file;
+
+    // without any lock (see resize_original())
+    void* resized = NULL;
+    size_t resized_size = 0;
+    ret = resize_original(fs_file, &orig, res, &resized, &resized_size);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+
+    // Only writers change the metadata: holding writer, it can be read freely
+    ret = lock_writer(sh);
+    if (ret != ERR_NONE) {
+        free_resized_img(resized);
+        return ret;
+    }
+    ret = find_slot(sh, img_id, &slot);
+    if (ret == ERR_NONE && memcmp(fs_file->metadata[slot].SHA, orig.SHA, SHA256_DIGEST_LENGTH) != 0) {
+        ret = ERR_IMAGE_NOT_FOUND; // replaced by another image in between
+    }
+    // another request (or process) may have created it meanwhile
+    if (ret == ERR_NONE && fs_file->metadata[slot].offset[res] == 0) {
+        struct img_metadata updated;
+        // shared, the metadata is the file: its slot changes as it is written
+        if (sh->shared.segment != NULL) {
+            seq_write_begin(&sh->slot_seq[slot]);
+        }
+        ret = store_resized_img(res, fs_file, slot, resized, resized_size, &updated);
+        if (sh->shared.segment != NULL) {
+            seq_write_end(&sh->slot_seq[slot]);
+        }
+        if (ret == ERR_NONE) {
+            ret = flush_writes(sh);
+        }
+        if (ret == ERR_NONE) {
+            pthread_rwlock_wrlock(&sh->lock);
+            seq_write_begin(&sh->slot_seq[slot]);
+            fs_file->metadata[slot] = updated;
+            seq_write_end(&sh->slot_seq[slot]);
+            pthread_rwlock_unlock(&sh->lock);
+        }
+    }
+    if (ret == ERR_NONE) {
+        *offset = (off_t) fs_file->metadata[slot].offset[res];
+        *size = fs_file->metadata[slot].size[res];
+    }
+    unlock_writer(sh);
+
+    free_resized_img(resized);
+    return ret;
+}
+
+/**
+ * @brief Finds where the image is stored at the given resolution
+ *
+ * @param sh (struct shard*): Given shard of the image
+ * @param img_id (const char*): Given image ID
+ * @param res (int): Given resolution
+ * @param slot (uint32_t*): Given pointer to write the slot of the image to
+ * @param offset (off_t*): Given pointer to write the offset of the blob to,
+ *                         0 if that resolution is not created yet
+ * @param size (size_t*): Given pointer to write the size of the blob to
+ * @return (int): Error code
+ */
+static int find_blob(struct shard* sh, const char* img_id, int res, uint32_t* slot,
+                     off_t* offset, size_t* size)
+{
+    struct img_metadata md;
+    const int ret = lookup_image(sh, img_id, slot, &md);
+    if (ret == ERR_NONE) {
+        *offset = (off_t) md.offset[res];
+        *size = md.size[res];
+    }
+    return ret;
+}
+
+/**
+ * @brief Checks a blob against its CRC, unless it already was (see blob_checked)
+ *
+ * @param sh (struct shard*): Given shard of the image
+ * @param slot (uint32_t): Given slot of the image
+ * @param res (int): Given resolution
+ * @param offset (off_t): Given offset of the blob
+ * @param size (size_t): Given size of the blob
+ * @return (int): Error code, ERR_CORRUPT_IMGFS if the content does not match its CRC
+ */
+static int check_blob_once(struct shard* sh, uint32_t slot, int res, off_t offset, size_t size)
+{
+    const uint8_t bit = (uint8_t) (1u << res);
+    if (sh->blob_checked == NULL || (__atomic_load_n(&sh->blob_checked[slot], __ATOMIC_RELAXED) & bit)) {
+        return ERR_NONE;
+    }
+
+    const size_t footprint = (size_t) blob_footprint(&sh->file.header, size);
+    void* buf = buf_pool_get(footprint);
+    if (buf == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int ret = storage_read(&sh->file, (uint64_t) offset, buf, footprint);
+    if (ret == ERR_NONE) {
+        ret = check_blob(&sh->file.header, buf, size);
+    }
+    buf_pool_put(buf, footprint);
+
+    if (ret == ERR_CORRUPT_IMGFS) {
+        fprintf(stderr, "%s blob of slot %u at offset %lld does not match its CRC\n",
+                resolution_names[res], slot, (long long) offset);
+    } else if (ret == ERR_NONE) {
+        // unless the image was deleted (and the slot reused) in between
+        struct img_metadata md;
+        read_slot(sh, slot, &md);
+        if (md.is_valid && md.offset[res] == (uint64_t) offset) {
+            __atomic_fetch_or(&sh->blob_checked[slot], bit, __ATOMIC_RELAXED);
+        }
+    }
+    return ret;
+}
+
+/**********************************************************************
+ * Sends a whole blob of the imgFS file as a JPEG image.
+ ********************************************************************** */
+#define CACHE_HEADERS_SIZE (ETAG_SIZE + 64)
+#define HEADERS_SIZE (CACHE_HEADERS_SIZE + 128)
+
+static int reply_blob(int connection, const struct shard* sh, const char* cache_headers,
+                      off_t offset, size_t size)
+{
+    char headers[HEADERS_SIZE];
+    snprintf(headers, HEADERS_SIZE,
+             "Content-Type: image/jpeg" HTTP_LINE_DELIM "Accept-Ranges: bytes" HTTP_LINE_DELIM "%s",
+             cache_headers);
+    // the content is sent straight from the file descriptor, bypassing stdio buffers
+    return http_reply_file(connection, HTTP_OK, headers, fileno(sh->file.file), offset, size);
+}
+
+/**********************************************************************
+ * A read waiting for its resolution to be created, in resize_queue.
+ ********************************************************************** */
+struct resize_job {
+    struct store* store;
+    int connection;     // -1 for a resolution only to create, for a batch
+    int res;
+    uint64_t start_us;  // when the request was dispatched
+    size_t sent_before; // http_sent_bytes() of the worker before the reply
+    char img_id[MAX_IMG_ID + 1];
+    char cache_headers[CACHE_HEADERS_SIZE];
+};
+
+/**
+ * @brief Creates the resolution of a resize job and answers its request,
+ *        if any; run by the workers of resize_queue
+ *
+ * @param arg (void*): Given job, freed once done
+ */
+static void run_resize_job(void* arg)
+{
+    struct resize_job* const job = arg;
+    job->sent_before = http_sent_bytes();
+    request_error = ERR_NONE;
+
+    struct shard* sh = NULL;
+    off_t offset = 0;
+    size_t size = 0;
+    int ret = resize_blob(job->store, job->img_id, job->res, &sh, &offset, &size);
+    if (job->connection < 0) {
+        // the batch which asked for it was answered already
+        free(job);
+        return;
+    }
+    if (ret != ERR_NONE) {
+        reply_error_msg(job->connection, ret);
+    } else {
+        // a Range is not honoured here: the whole content is a valid answer
+        ret = reply_blob(job->connection, sh, job->cache_headers, offset, size);
+    }
+    record_request(job->store, STATS_RESIZE, now_us() - job->start_us, 0,
+                   http_sent_bytes() - job->sent_before,
+                   request_error != ERR_NONE ? request_error : ret);
+
+    http_end(job->connection);
+    free(job);
+}
+
+/**
+ * @brief Hands the creation of a resolution to resize_queue, without any
+ *        request to answer
+ *
+ * @param st (struct store*): Given store
+ * @param img_id (const char*): Given image ID
+ * @param res (int): Given resolution
+ * @return (int): ERR_BUSY once handed, as the resolution is not ready
+ */
+static int submit_resize(struct store* st, const char* img_id, int res)
+{
+    struct resize_job* const job = calloc(1, sizeof(*job));
+    if (job == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    job->store = st;
+    job->connection = -1;
+    job->res = res;
+    strcpy(job->img_id, img_id);
+
+    if (work_queue_submit(&resize_queue, job) != ERR_NONE) {
+        free(job);
+    }
+    return ERR_BUSY;
+}
+
+int handle_read_call(struct http_message msg, int connection)
+{
+#define MAX_RES_NAME 9
+    char out[MAX_RES_NAME + 1] = {0};
+    char img_id[MAX_IMG_ID + 1] = {0};
+
+    int ret = http_get_var(&msg.uri, "res", out, MAX_RES_NAME);
+    if (ret <= 0) {
+        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+    }
+
+    ret = http_get_var(&msg.uri, "img_id", img_id, MAX_IMG_ID);
+    if (ret <= 0) {
+        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+    }
+
+    int res = resolution_atoi(out);
+    if (res == -1) {
+        return reply_error_msg(connection, ERR_RESOLUTIONS);
+    }
+    request_op = STATS_READ_THUMB + res;
+
+    struct shard* sh = NULL;
+    uint32_t slot = 0;
+    char etag[ETAG_SIZE];
+    struct img_metadata md;
+    struct store* const st = request_store;
+    ret = find_image(st, img_id, &sh, &slot, &md);
+    if (ret == ERR_IMAGE_NOT_FOUND) {
+        // inserted by another process, maybe
+        refresh_from_file(st, shard_of(st, img_id));
+        ret = find_image(st, img_id, &sh, &slot, &md);
+    }
+    if (ret == ERR_NONE) {
+        make_etag(&md, res, etag, sizeof(etag));
+    }
+    if (ret != ERR_NONE) {
+        return reply_error_msg(connection, ret);
+    }
+
+    char cache_headers[CACHE_HEADERS_SIZE];
+    snprintf(cache_headers, CACHE_HEADERS_SIZE,
+             "ETag: %s" HTTP_LINE_DELIM "Cache-Control: public, max-age=%d" HTTP_LINE_DELIM,
+             etag, CACHE_MAX_AGE);
+
+    // the client already has this very content: answer without touching the blob
+    const struct http_string* if_none_match = http_get_header(&msg, "If-None-Match");
+    if (if_none_match != NULL && etag_matches(if_none_match, etag)) {
+        return http_reply(connection, HTTP_NOT_MODIFIED, cache_headers, NULL, 0);
+    }
+
+    off_t blob_offset = 0;
+    size_t blob_size = 0;
+    ret = find_blob(sh, img_id, res, &slot, &blob_offset, &blob_size);
+    if (ret != ERR_NONE) {
+        return reply_error_msg(connection, ret);
+    }
+
+    // Not resized yet: the request (and its connection) goes to resize_queue
+    if (blob_offset == 0) {
+        struct resize_job* const job = calloc(1, sizeof(*job));
+        if (job == NULL) {
+            return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+        }
+        job->store = st;
+        job->connection = connection;
+        job->res = res;
+        job->start_us = request_start_us;
+        strcpy(job->img_id, img_id);
+        strcpy(job->cache_headers, cache_headers);
+
+        ret = work_queue_submit(&resize_queue, job);
+        if (ret != ERR_NONE) {
+            free(job);
+            return reply_error_msg(connection, ret);
+        }
+        return HTTP_CONNECTION_KEPT;
+    }
+
+    ret = check_blob_once(sh, slot, res, blob_offset, blob_size);
+    if (ret != ERR_NONE) {
+        return reply_error_msg(connection, ret);
+    }
+
+    const int fd = fileno(sh->file.file);
+    char headers[HEADERS_SIZE];
+
+    // a Range is only honoured if the client's partial copy is still the current content
+    const struct http_string* range = http_get_header(&msg, "Range");
+    const struct http_string* if_range = http_get_header(&msg, "If-Range");
+    if (range != NULL && (if_range == NULL || if_range_matches(if_range, etag))) {
+        struct http_range ranges[MAX_RANGES];
+        const int nb_ranges = http_parse_range(range, blob_size, ranges, MAX_RANGES);
+
+        if (nb_ranges == 0) {
+            snprintf(headers, HEADERS_SIZE, "Content-Range: bytes */%zu" HTTP_LINE_DELIM, blob_size);
+            return http_reply(connection, HTTP_RANGE_NOT_SATISFIABLE, headers, NULL, 0);
+        } else if (nb_ranges == 1) {
+            snprintf(headers, HEADERS_SIZE,
+                     "Content-Type: image/jpeg" HTTP_LINE_DELIM
+                     "Content-Range: bytes %zu-%zu/%zu" HTTP_LINE_DELIM "%s",
+                     ranges[0].start, ranges[0].start + ranges[0].len - 1, blob_size, cache_headers);
+            return http_reply_file(connection, HTTP_PARTIAL, headers, fd,
+                                   blob_offset + (off_t) ranges[0].start, ranges[0].len);
+        } else if (nb_ranges > 1) {
+            return http_reply_ranges(connection, cache_headers, "image/jpeg", fd,
+                                     blob_offset, blob_size, ranges, (size_t) nb_ranges);
+        }
+        // an invalid Range header is ignored: the whole content is sent
+    }
+
+    return reply_blob(connection, sh, cache_headers, blob_offset, blob_size);
+}
+
+/**********************************************************************
+ * Reads several images at once, e.g. the thumbnails of a gallery page:
+ * GET /imgfs/batch?res=thumb&img_ids=id1,id2,...
+ * The reply is a multipart/mixed body, one part per requested ID (in their
+ * order) with the image, or with the error message if it cannot be read.
+ * A resolution not created yet is not waited for: it is handed to
+ * resize_queue, and its part is an ERR_BUSY one, to ask again for later.
+ ********************************************************************** */
+#define BATCH_MAX_IMAGES 256
+#define BATCH_IDS_MAX (BATCH_MAX_IMAGES * 32) // length of the img_ids parameter
+#define BATCH_BOUNDARY "imgfs-batch-5c2a9e71"
+#define BATCH_PART_HEAD HTTP_LINE_DELIM "--" BATCH_BOUNDARY HTTP_LINE_DELIM \
+        "Content-Type: %s" HTTP_LINE_DELIM "Content-ID: <%s>" HTTP_LINE_DELIM \
+        "Content-Length: %zu" HTTP_HDR_END_DELIM
+#define BATCH_END HTTP_LINE_DELIM "--" BATCH_BOUNDARY "--" HTTP_LINE_DELIM
+#define BATCH_PART_HEAD_MAX (sizeof(BATCH_PART_HEAD) + MAX_IMG_ID + 32)
+
+/**
+ * @brief Writes the part of an image of a batch (or only measures it, if body is NULL)
+ *
+ * @param image (const struct batch_image*): Given image, read or not
+ * @param body (char*): Given buffer to write the part to, NULL to only measure it
+ * @return (size_t): The length of the part
+ */
+static size_t batch_part(const struct batch_image* image, char* body)
+{
+    const char* const content = image->err == ERR_NONE ? image->content : ERR_MSG(image->err);
+    const size_t content_len = image->err == ERR_NONE ? image->size : strlen(content);
+    char head[BATCH_PART_HEAD_MAX];
+    const int head_len = snprintf(head, sizeof(head), BATCH_PART_HEAD,
+                                  image->err == ERR_NONE ? "image/jpeg" : "text/plain",
+                                  image->img_id, content_len);
+    if (body != NULL) {
+        memcpy(body, head, (size_t) head_len);
+        memcpy(body + head_len, content, content_len);
+    }
+    return (size_t) head_len + content_len;
+}
+
+/**
+ * @brief Frees the buffers of read_shard_batches()
+ *
+ * @param buffers (char**): Given buffers, one per shard
+ */
+static void free_shard_batches(char** buffers)
+{
+    for (size_t i = 0; i < MAX_SHARDS; ++i) {
+        free(buffers[i]);
+        buffers[i] = NULL;
+    }
+}
+
+/**
+ * @brief Reads the blobs of a batch, shard by shard (see read_batch())
+ *
+ * @param st (struct store*): Given store
+ * @param images (struct batch_image*): Given images, found or not
+ * @param image_shards (struct shard* const*): Given shard of each image found
+ * @param nb_images (size_t): Given number of images
+ * @param buffers (char**): Given buffers to write those of read_batch() to, one per shard
+ * @return (int): Error code; no buffer is then left
+ */
+static int read_shard_batches(struct store* st, struct batch_image* images,
+                              struct shard* const* image_shards, size_t nb_images, char** buffers)
+{
+    // a single shard reads them all at once
+    const size_t count = served_shards(st);
+    if (count == 1) {
+        return read_batch(&st->shards[0].file, images, nb_images, &buffers[0]);
+    }
+
+    struct batch_image* const subset = http_alloc(BATCH_MAX_IMAGES * sizeof(struct batch_image));
+    if (subset == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int ret = ERR_NONE;
+    for (size_t s = 0; ret == ERR_NONE && s < count; ++s) {
+        size_t nb_subset = 0;
+        for (size_t i = 0; i < nb_images; ++i) {
+            if (images[i].err == ERR_NONE && image_shards[i] == &st->shards[s]) {
+                subset[nb_subset++] = images[i];
+            }
+        }
+        if (nb_subset == 0) {
+            continue;
+        }
+        ret = read_batch(&st->shards[s].file, subset, nb_subset, &buffers[s]);
+        nb_subset = 0;
+        for (size_t i = 0; ret == ERR_NONE && i < nb_images; ++i) {
+            if (images[i].err == ERR_NONE && image_shards[i] == &st->shards[s]) {
+                images[i] = subset[nb_subset++];
+            }
+        }
+    }
+    if (ret != ERR_NONE) {
+        free_shard_batches(buffers);
+    }
+    return ret;
+}
+
+static int handle_batch_call(struct http_message msg, int connection)
+{
+    char out[MAX_RES_NAME + 1] = {0};
+    int ret = http_get_var(&msg.uri, "res", out, MAX_RES_NAME);
+    if (ret <= 0) {
+        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+    }
+    const int res = resolution_atoi(out);
+    if (res == -1) {
+        return reply_error_msg(connection, ERR_RESOLUTIONS);
+    }
+
+    char* const ids = http_alloc(BATCH_IDS_MAX + 1);
+    struct batch_image* const images = http_alloc(BATCH_MAX_IMAGES * sizeof(struct batch_image));
+    if (ids == NULL || images == NULL) {
+        return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+    }
+    memset(ids, 0, BATCH_IDS_MAX + 1);
+    ret = http_get_var(&msg.uri, "img_ids", ids, BATCH_IDS_MAX);
+    if (ret <= 0) {
+        return reply_error_msg(connection, ret < 0 ? ERR_INVALID_ARGUMENT : ERR_NOT_ENOUGH_ARGUMENTS);
+    }
+
+    size_t nb_images = 0;
+    for (char* id = ids; id != NULL; ) {
+        char* const comma = strchr(id, ',');
+        if (comma != NULL) {
+            *comma = '\0';
+        }
+        if (*id == '\0' || strlen(id) > MAX_IMG_ID || nb_images == BATCH_MAX_IMAGES) {
+            return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+        }
+        memset(&images[nb_images], 0, sizeof(struct batch_image));
+        images[nb_images++].img_id = id;
+        id = comma != NULL ? comma + 1 : NULL;
+    }
+
+    // all the slots first
+    struct shard** const image_shards = http_alloc(BATCH_MAX_IMAGES * sizeof(struct shard*));
+    if (image_shards == NULL) {
+        return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+    }
+    for (size_t i = 0; i < nb_images; ++i) {
+        uint32_t slot = 0;
+        struct img_metadata md;
+        images[i].err = find_image(request_store, images[i].img_id, &image_shards[i], &slot, &md);
+        if (images[i].err == ERR_NONE) {
+            images[i].offset = md.offset[res];
+            images[i].size = md.size[res];
+        }
+    }
+
+    // the resolutions not created yet are left to the workers of resize_queue
+    for (size_t i = 0; i < nb_images; ++i) {
+        if (images[i].err == ERR_NONE && images[i].offset == 0) {
+            images[i].err = submit_resize(request_store, images[i].img_id, res);
+        }
+    }
+
+    // then the blobs, in the order of each file and coalesced (checked against their CRC, if any)
+    char* buffers[MAX_SHARDS] = {NULL};
+    ret = read_shard_batches(request_store, images, image_shards, nb_images, buffers);
+    if (ret != ERR_NONE) {
+        return reply_error_msg(connection, ret);
+    }
+
+    size_t body_len = strlen(BATCH_END);
+    for (size_t i = 0; i < nb_images; ++i) {
+        body_len += batch_part(&images[i], NULL);
+    }
+    char* const body = malloc(body_len);
+    if (body == NULL) {
+        free_shard_batches(buffers);
+        return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+    }
+    char* part = body;
+    for (size_t i = 0; i < nb_images; ++i) {
+        part += batch_part(&images[i], part);
+    }
+    memcpy(part, BATCH_END, strlen(BATCH_END));
+    free_shard_batches(buffers);
+
+    ret = http_reply(connection, HTTP_OK,
+                     "Content-Type: multipart/mixed; boundary=" BATCH_BOUNDARY HTTP_LINE_DELIM,
+                     body, body_len);
+    free(body);
+    return ret;
+}
+
+/**
+ * @brief Deletes an image from a shard
+ *
+ * @param sh (struct shard*): Given shard
+ * @param img_id (const char*): Given image ID
+ * @return (int): Error code
+ */
+static int delete_image(struct shard* sh, const char* img_id)
+{
+    int ret = lock_writer(sh);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    pthread_rwlock_wrlock(&sh->lock);
+    uint32_t slot = 0;
+    const int found = find_slot(sh, img_id, &slot) == ERR_NONE;
+    // the slot may be reused by another image, whose blobs are not checked yet
+    if (sh->blob_checked != NULL && found) {
+        __atomic_store_n(&sh->blob_checked[slot], 0, __ATOMIC_RELAXED);
+    }
+    seq_write_begin(sh->index_seq);
+    ret = do_delete(img_id, &sh->file);
+    if (ret == ERR_NONE && sh->shared.segment != NULL) {
+        ret = found ? imgfs_shared_remove(&sh->shared, &sh->file, slot) : ERR_IMAGE_NOT_FOUND;
+    } else if (ret == ERR_NONE) {
+        index_remove(&sh->file, &sh->index, img_id);
+    }
+    seq_write_end(sh->index_seq);
+    if (ret == ERR_NONE) {
+        ret = flush_writes(sh);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    unlock_writer(sh);
+    return ret;
+}
+
+int handle_delete_call(struct http_message msg, int connection)
+{
+    char img_id[MAX_IMG_ID + 1] = {0};
+
+    int ret = http_get_var(&msg.uri, "img_id", img_id, MAX_IMG_ID);
+    if (ret <= 0) {
+        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+    }
+
+    // in the shard it belongs to, or in the one it was not moved from yet
+    struct shard* sh = NULL;
+    uint32_t slot = 0;
+    struct img_metadata md;
+    struct store* const st = request_store;
+    if (find_image(st, img_id, &sh, &slot, &md) != ERR_NONE) {
+        sh = shard_of(st, img_id);
+    }
+    ret = delete_image(sh, img_id);
+
+    // moved meanwhile to its owner (see shards_add()), maybe a shard just
+    // added to the manifest; lock_writer() applies the move there
+    if (ret == ERR_IMAGE_NOT_FOUND && st->manifest != NULL) {
+        refresh_from_file(st, sh);
+        struct shard* const owner = shard_of(st, img_id);
+        if (owner != sh) {
+            ret = delete_image(owner, img_id);
+        }
+    }
+    if (ret != ERR_NONE) {
+        return reply_error_msg(connection, ret);
+    }
+
+    return reply_302_msg(connection);
+}
+
+/**********************************************************************
+ * Insert: the body is first received without any lock, so that a slow
+ * client never holds the writers of the shard (nor, through the lock of
+ * the file, the other processes). What did not come along with the headers
+ * is spooled, INSERT_CHUNK_SIZE bytes at a time, to an unlinked temporary
+ * file: no copy of the whole image is held in memory. Only then, under
+ * lock_writer(), is it streamed into the imgFS file and committed.
+ ********************************************************************** */
+#define INSERT_CHUNK_SIZE 65536
+
+/**
+ * @brief Creates an unlinked temporary file, in TMPDIR if set
+ *
+ * @return (FILE*): The file, NULL on error
+ */
+static FILE* open_spool(void)
+{
+    const char* dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/imgfs-spool-XXXXXX", dir != NULL ? dir : P_tmpdir) >= (int) sizeof(path)) {
+        return NULL;
+    }
+    const int fd = mkstemp(path);
+    if (fd < 0) {
+        return NULL;
+    }
+    unlink(path);
+    FILE* spool = fdopen(fd, "w+b");
+    if (spool == NULL) {
+        close(fd);
+    }
+    return spool;
+}
+
+/**
+ * @brief Receives the rest of the body of a request, past what came along
+ *        with the headers, into a spool file
+ *
+ * @param connection (int): Given connection to receive it from
+ * @param size (size_t): Given number of bytes to receive
+ * @param spool (FILE**): Given pointer to the spool to open, left NULL if size is 0
+ * @return (int): Error code
+ */
+static int spool_body(int connection, size_t size, FILE** spool)
+{
+    *spool = NULL;
+    if (size == 0) {
+        return ERR_NONE;
+    }
+    *spool = open_spool();
+    if (*spool == NULL) {
+        return ERR_IO;
+    }
+
+    char chunk[INSERT_CHUNK_SIZE];
+    size_t received = 0;
+    while (received < size) {
+        const ssize_t n = tcp_read(connection, chunk, MIN(sizeof(chunk), size - received));
+        if (n <= 0 || fwrite(chunk, (size_t) n, 1, *spool) != 1) {
+            return ERR_IO;
+        }
+        received += (size_t) n;
+    }
+    return fflush(*spool) == 0 ? ERR_NONE : ERR_IO;
+}
+
+/**
+ * @brief Streams the content spooled into an insertion
+ *
+ * @param stream (struct insert_stream*): Given insertion
+ * @param spool (FILE*): Given spool, NULL if empty
+ * @return (int): Error code
+ */
+static int insert_spool(struct insert_stream* stream, FILE* spool)
+{
+    if (spool == NULL) {
+        return ERR_NONE;
+    }
+    if (fseeko(spool, 0, SEEK_SET) != 0) {
+        return ERR_IO;
+    }
+    char chunk[INSERT_CHUNK_SIZE];
+    int ret = ERR_NONE;
+    size_t n = 0;
+    while (ret == ERR_NONE && (n = fread(chunk, 1, sizeof(chunk), spool)) > 0) {
+        ret = do_insert_chunk(stream, chunk, n);
+    }
+    return ret == ERR_NONE && ferror(spool) ? ERR_IO : ret;
+}
+
+/**
+ * @brief Inserts an image received; lock_writer() was called
+ *
+ * @param sh (struct shard*): Given shard the image belongs to
+ * @param head (const struct http_string*): Given part of the content received with the headers
+ * @param spool (FILE*): Given rest of the content, NULL if none
+ * @param img_id (const char*): Given name of the image
+ * @return (int): Error code
+ */
+static int insert_content(struct shard* sh, const struct http_string* head, FILE* spool,
+                          const char* img_id)
+{
+    // another request may have inserted it while this one was received
+    uint32_t slot = 0;
+    if (find_slot(sh, img_id, &slot) == ERR_NONE) {
+        return ERR_DUPLICATE_ID;
+    }
+
+    // the content is appended to the file: readers are not concerned until the commit
+    struct insert_stream stream;
+    int ret = do_insert_begin(&sh->file, &stream);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    ret = do_insert_chunk(&stream, head->val, head->len);
+    if (ret == ERR_NONE) {
+        ret = insert_spool(&stream, spool);
+    }
+    if (ret != ERR_NONE) {
+        do_insert_abort(&stream);
+        return ret;
+    }
+
+    // the slot the commit fills is not in the index yet (the delete of its
+    // former image moved index_seq on): the lookups cannot reach it, only
+    // its publication below concerns them
+    pthread_rwlock_wrlock(&sh->lock);
+    ret = do_insert_commit(&stream, img_id);
+    if (ret == ERR_NONE) {
+        // the blob (and its CRC) must be readable before the image can be found:
+        // the readers take no lock
+        ret = storage_flush(&sh->file);
+    }
+    if (ret == ERR_NONE) {
+        seq_write_begin(sh->index_seq);
+        if (sh->shared.segment != NULL) {
+            ret = imgfs_shared_add(&sh->shared, &sh->file, img_id);
+        } else {
+            ret = index_add(&sh->file, &sh->index, img_id);
+        }
+        seq_write_end(sh->index_seq);
+    }
+    if (ret == ERR_NONE) {
+        ret = flush_writes(sh);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    return ret;
+}
+
+int handle_insert_call(struct http_message msg, int connection)
+{
+    char img_id[MAX_IMG_ID + 1] = {0};
+    int ret = http_get_var(&msg.uri, "name", img_id, MAX_IMG_ID);
+    if (ret <= 0) {
+        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+    }
+
+    // rejects a duplicate name before receiving the image; it may still be
+    // in another shard, not moved yet
+    struct shard* sh = NULL;
+    uint32_t slot = 0;
+    struct img_metadata md;
+    struct store* const st = request_store;
+    if (find_image(st, img_id, &sh, &slot, &md) == ERR_NONE) {
+        return reply_error_msg(connection, ERR_DUPLICATE_ID);
+    }
+
+    // at most MAX_REQUEST_SIZE, see handle_connection()
+    const int content_len = http_content_len(&msg);
+    if (content_len <= 0) {
+        return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+    }
+    // first what came along with the headers, then the rest from the connection
+    struct http_string head = msg.body;
+    head.len = MIN(head.len, (size_t) content_len);
+    FILE* spool = NULL;
+    ret = spool_body(connection, (size_t) content_len - head.len, &spool);
+
+    sh = shard_of(st, img_id);
+    if (ret == ERR_NONE) {
+        ret = lock_writer(sh);
+        if (ret == ERR_NONE) {
+            ret = insert_content(sh, &head, spool, img_id);
+            unlock_writer(sh);
+        }
+    }
+    if (spool != NULL) {
+        fclose(spool);
+    }
+    if (ret != ERR_NONE) {
+        return reply_error_msg(connection, ret);
+    }
+
+    return reply_302_msg(connection);
+}
+
+static int handle_index_call(struct http_message msg _unused, int connection)
+{
+    return http_serve_file(connection, BASE_FILE);
+}
+
+/**********************************************************************
+ * Metrics, as JSON or, with format=prometheus, as Prometheus text.
+ ********************************************************************** */
+static int handle_stats_call(struct http_message msg, int connection)
+{
+#define MAX_FORMAT_NAME 10
+    char format[MAX_FORMAT_NAME + 1] = {0};
+    if (http_get_var(&msg.uri, "format", format, MAX_FORMAT_NAME) < 0) {
+        return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+    }
+
+    const int prometheus = !strcmp(format, "prometheus");
+    if (!prometheus && format[0] != '\0' && strcmp(format, "json")) {
+        return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+    }
+
+    // those of its store, under the prefix of a store
+    const struct stats* const stats = request_mounted ? &request_store->stats : &server_stats;
+    char* text = NULL;
+    int ret = prometheus ? stats_to_prometheus(stats, &text) : stats_to_json(stats, &text);
+    if (ret != ERR_NONE) {
+        return reply_error_msg(connection, ret);
+    }
+
+    ret = http_reply(connection, HTTP_OK,
+                     prometheus ? "Content-Type: text/plain; version=0.0.4" HTTP_LINE_DELIM
+                     : "Content-Type: application/json" HTTP_LINE_DELIM,
+                     text, strlen(text));
+    free(text);
+    return ret;
+}
+
+/**
+ * @brief FNV-1a hash of "<method> <path>"
+ *
+ * @param method (const struct http_string*): Given request method
+ * @param path (const struct http_string*): Given request path, without the query
+ * @return (uint32_t): The hash
+ */
+static uint32_t route_hash(const struct http_string* method, const struct http_string* path)
+{
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME  16777619u
+    uint32_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < method->len; ++i) {
+        hash = (hash ^ (unsigned char) method->val[i]) * FNV_PRIME;
+    }
+    hash = (hash ^ (unsigned char) ' ') * FNV_PRIME;
+    for (size_t i = 0; i < path->len; ++i) {
+        hash = (hash ^ (unsigned char) path->val[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+struct route {
+    const char* method;
+    const char* path;
+    int (*handler)(struct http_message msg, int connection);
+    enum stats_op op; // the handler may refine it, see request_op
+};
+
+/*
+ * Routes, each one at slot route_hash(method, path) % ROUTE_SLOTS, so that
+ * one lookup finds the only candidate: the hash is perfect on this set.
+ * The slots were computed offline; server_startup() checks them, so adding
+ * a route means recomputing its slot (and growing ROUTE_SLOTS on a clash).
+ */
+#define ROUTE_SLOTS 16
+static const struct route routes[ROUTE_SLOTS] = {
+    [14] = { "GET",  "/",                  handle_index_call,  STATS_OTHER  },
+    [1]  = { "GET",  "/index.html",        handle_index_call,  STATS_OTHER  },
+    [3]  = { "GET",  URI_ROOT "/list",     handle_list_call,   STATS_LIST   },
+    [10] = { "POST", URI_ROOT "/insert",   handle_insert_call, STATS_INSERT },
+    [15] = { "GET",  URI_ROOT "/read",     handle_read_call,   STATS_READ_ORIG },
+    [8]  = { "GET",  URI_ROOT "/delete",   handle_delete_call, STATS_DELETE },
+    [6]  = { "GET",  URI_ROOT "/stats",    handle_stats_call,  STATS_OTHER  },
+    [13] = { "GET",  URI_ROOT "/batch",    handle_batch_call,  STATS_BATCH  },
+};
+
+/**
+ * @brief Checks that every route is at the slot of its hash
+ *
+ * @return (int): Error code
+ */
+static int check_routes(void)
+{
+    for (size_t i = 0; i < ROUTE_SLOTS; ++i) {
+        if (routes[i].handler == NULL) {
+            continue;
+        }
+        const struct http_string method = { routes[i].method, strlen(routes[i].method) };
+        const struct http_string path = { routes[i].path, strlen(routes[i].path) };
+        if (route_hash(&method, &path) % ROUTE_SLOTS != i) {
+            fprintf(stderr, "Route %s %s is not at its slot\n", routes[i].method, routes[i].path);
+            return ERR_RUNTIME;
+        }
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Tells whether `str` holds exactly the C string `expected`
+ */
+static int same_string(const struct http_string* str, const char* expected)
+{
+    return str->len == strlen(expected) && memcmp(str->val, expected, str->len) == 0;
+}
+
+/**
+ * @brief Finds the store a request path is for: the one named by its
+ *        prefix, URI_ROOT "/<name>/...", the path then being rewritten
+ *        without it, into `buffer`; the first store otherwise
+ *
+ * @param path (struct http_string*): Given request path, rewritten if prefixed
+ * @param buffer (char*): Given buffer to rewrite the path into
+ * @param size (size_t): Given size of the buffer
+ * @return (struct store*): The store of the request
+ */
+static struct store* mounted_store(struct http_string* path, char* buffer, size_t size)
+{
+    request_mounted = 0;
+    const size_t root_len = strlen(URI_ROOT "/");
+    if (path->len <= root_len || strncmp(path->val, URI_ROOT "/", root_len)) {
+        return &stores[0];
+    }
+    const char* const name = path->val + root_len;
+    const char* const end = memchr(name, '/', path->len - root_len);
+    if (end == NULL) {
+        return &stores[0];
+    }
+
+    const size_t name_len = (size_t) (end - name);
+    const size_t rest_len = path->len - root_len - name_len; // with its '/'
+    for (size_t i = 0; i < nb_stores; ++i) {
+        if (stores[i].name[0] != '\0' && strlen(stores[i].name) == name_len &&
+            !strncmp(stores[i].name, name, name_len) && strlen(URI_ROOT) + rest_len < size) {
+            memcpy(buffer, URI_ROOT, strlen(URI_ROOT));
+            memcpy(buffer + strlen(URI_ROOT), end, rest_len);
+            path->val = buffer;
+            path->len = strlen(URI_ROOT) + rest_len;
+            request_mounted = 1;
+            return &stores[i];
+        }
+    }
+    return &stores[0];
+}
+
+int handle_http_message(struct http_message* msg, int connection)
+{
+    M_REQUIRE_NON_NULL(msg);
+    debug_printf("handle_http_message() on connection %d. URI: %.*s\n",
+                 connection,
+                 (int) msg->uri.len, msg->uri.val);
+
+    request_start_us = now_us();
+    const size_t sent_before = http_sent_bytes();
+    request_error = ERR_NONE;
+    int ret = ERR_NONE;
+
+    // the routes are those of URI_ROOT, whatever the store
+#define MAX_ROUTE_PATH 32
+    char route_path[MAX_ROUTE_PATH];
+    struct http_string path = http_uri_path(&msg->uri);
+    request_store = mounted_store(&path, route_path, sizeof(route_path));
+    refresh_from_file(request_store, NULL);
+
+    // exact match on method and path: only one route can be the right one
+    const struct route* const route = &routes[route_hash(&msg->method, &path) % ROUTE_SLOTS];
+    if (route->handler == NULL ||
+        !same_string(&msg->method, route->method) || !same_string(&path, route->path)) {
+        http_trace_printf("no route for %.*s %.*s\n", (int) msg->method.len, msg->method.val,
+                          (int) path.len, path.val);
+        request_op = STATS_OTHER;
+        ret = reply_error_msg(connection, ERR_INVALID_COMMAND);
+    } else {
+        http_trace_printf("%s %s on connection %d\n", route->method, route->path, connection);
+        request_op = route->op;
+        ret = route->handler(*msg, connection);
+    }
+
+    // a request handed over to another thread is accounted there
+    if (ret != HTTP_CONNECTION_KEPT) {
+        const int content_len = http_content_len(msg);
+        record_request(request_store, request_op, now_us() - request_start_us,
+                       content_len > 0 ? (size_t) content_len : 0, http_sent_bytes() - sent_before,
+                       request_error != ERR_NONE ? request_error : ret);
+    }
+    return ret;
 }
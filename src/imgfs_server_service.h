@@ -14,6 +14,13 @@
 
 int server_startup (int argc, char **argv);
 
+/**
+ * @brief Serves the requests, on as many threads as asked at startup.
+ *
+ * Returns when the server can no longer accept connections.
+ */
+int server_run (void);
+
 void server_shutdown (void);
 
 int handle_http_message(struct http_message* msg, int connection);
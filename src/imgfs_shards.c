@@ -0,0 +1,444 @@
+/**
+ * @file imgfs_shards.c
+ * @brief One namespace of images spread over several imgFS files.
+ */
+
+#define _GNU_SOURCE // realpath()
+
+#include <limits.h> // PATH_MAX
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "imgfs_lock.h"
+#include "imgfs_shards.h"
+
+#define MANIFEST_LINE_SIZE (PATH_MAX + 2)
+
+/**
+ * @brief Hashes an image ID (FNV-1a), mixed further (the finalizer of
+ *        MurmurHash3) for its high bits to spread over the ring
+ *
+ * @param img_id (const char*): Given image ID
+ * @return (uint32_t): Its hash
+ */
+static uint32_t ring_hash(const char* img_id)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_IMG_ID && img_id[i] != '\0'; ++i) {
+        hash = (hash ^ (unsigned char) img_id[i]) * 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/**
+ * @brief Orders the points of the ring by hash (then by shard, for ties)
+ */
+static int point_cmp(const void* a, const void* b)
+{
+    const struct shard_point* const first = a;
+    const struct shard_point* const second = b;
+    if (first->hash != second->hash) {
+        return first->hash < second->hash ? -1 : 1;
+    }
+    return first->shard < second->shard ? -1 : first->shard > second->shard;
+}
+
+/**
+ * @brief Builds the ring of the shards of a set
+ *
+ * @param shards (struct imgfs_shards*): Given set, whose nb_shards is known
+ * @return (int): Error code
+ */
+static int build_ring(struct imgfs_shards* shards)
+{
+    shards->ring = calloc(shards->nb_shards * SHARD_POINTS, sizeof(struct shard_point));
+    if (shards->ring == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // the points of a shard only depend on its position
+    char name[32];
+    for (size_t s = 0; s < shards->nb_shards; ++s) {
+        for (size_t k = 0; k < SHARD_POINTS; ++k) {
+            snprintf(name, sizeof(name), "shard-%zu-%zu", s, k);
+            struct shard_point* const point = &shards->ring[s * SHARD_POINTS + k];
+            point->hash = ring_hash(name);
+            point->shard = (uint32_t) s;
+        }
+    }
+    qsort(shards->ring, shards->nb_shards * SHARD_POINTS, sizeof(struct shard_point), point_cmp);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Tells whether a line of a manifest is the magic line
+ *
+ * @param line (const char*): Given line, as read by fgets()
+ * @return (int): 1 if it is, 0 otherwise
+ */
+static int is_magic(const char* line)
+{
+    return !strncmp(line, SHARDS_MAGIC, strlen(SHARDS_MAGIC)) &&
+           (line[strlen(SHARDS_MAGIC)] == '\n' || line[strlen(SHARDS_MAGIC)] == '\0');
+}
+
+int shards_is_manifest(const char* filename)
+{
+    if (filename == NULL) {
+        return 0;
+    }
+    FILE* const file = fopen(filename, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    char line[sizeof(SHARDS_MAGIC) + 1] = {0};
+    const int ret = fgets(line, sizeof(line), file) != NULL && is_magic(line);
+    fclose(file);
+    return ret;
+}
+
+void shards_free(struct imgfs_shards* shards)
+{
+    if (shards == NULL) {
+        return;
+    }
+    for (size_t s = 0; s < shards->nb_shards; ++s) {
+        free(shards->paths[s]);
+        shards->paths[s] = NULL;
+    }
+    free(shards->ring);
+    shards->ring = NULL;
+    shards->nb_shards = 0;
+}
+
+/**
+ * @brief Adds a shard to a set being loaded, given its line in the manifest
+ *
+ * @param shards (struct imgfs_shards*): Given set
+ * @param manifest (const char*): Given file name of the manifest
+ * @param line (char*): Given line, without its end of line
+ * @return (int): Error code
+ */
+static int add_path(struct imgfs_shards* shards, const char* manifest, const char* line)
+{
+    if (shards->nb_shards == MAX_SHARDS) {
+        return ERR_MAX_FILES;
+    }
+
+    // relative to the directory of the manifest
+    const char* const slash = strrchr(manifest, '/');
+    const size_t dir_len = line[0] == '/' || slash == NULL ? 0 : (size_t) (slash - manifest) + 1;
+    char* const path = malloc(dir_len + strlen(line) + 1);
+    if (path == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(path, manifest, dir_len);
+    strcpy(path + dir_len, line);
+    shards->paths[shards->nb_shards++] = path;
+    return ERR_NONE;
+}
+
+int shards_load(const char* manifest, struct imgfs_shards* shards)
+{
+    M_REQUIRE_NON_NULL(manifest);
+    M_REQUIRE_NON_NULL(shards);
+    memset(shards, 0, sizeof(*shards));
+
+    FILE* const file = fopen(manifest, "r");
+    if (file == NULL) {
+        return ERR_IO;
+    }
+
+    char line[MANIFEST_LINE_SIZE];
+    int ret = fgets(line, sizeof(line), file) != NULL && is_magic(line) ? ERR_NONE : ERR_INVALID_FILENAME;
+    while (ret == ERR_NONE && fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] != '\0') {
+            ret = add_path(shards, manifest, line);
+        }
+    }
+    fclose(file);
+
+    if (ret == ERR_NONE && shards->nb_shards == 0) {
+        ret = ERR_INVALID_FILENAME;
+    }
+    if (ret == ERR_NONE) {
+        ret = build_ring(shards);
+    }
+    if (ret != ERR_NONE) {
+        shards_free(shards);
+    }
+    return ret;
+}
+
+size_t shards_locate(const struct imgfs_shards* shards, const char* img_id)
+{
+    if (shards == NULL || img_id == NULL || shards->nb_shards <= 1) {
+        return 0;
+    }
+
+    // the first point at or after the hash, going round
+    const uint32_t hash = ring_hash(img_id);
+    const size_t nb_points = shards->nb_shards * SHARD_POINTS;
+    size_t low = 0;
+    size_t high = nb_points;
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        if (shards->ring[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return shards->ring[low == nb_points ? 0 : low].shard;
+}
+
+void shards_close(struct imgfs_file* files, size_t nb_files)
+{
+    if (files == NULL) {
+        return;
+    }
+    for (size_t s = 0; s < nb_files; ++s) {
+        do_close(&files[s]);
+    }
+}
+
+int shards_open(const struct imgfs_shards* shards, const char* open_mode, struct imgfs_file* files)
+{
+    M_REQUIRE_NON_NULL(shards);
+    M_REQUIRE_NON_NULL(open_mode);
+    M_REQUIRE_NON_NULL(files);
+
+    for (size_t s = 0; s < shards->nb_shards; ++s) {
+        memset(&files[s], 0, sizeof(struct imgfs_file));
+        const int ret = do_open(shards->paths[s], open_mode, &files[s]);
+        if (ret != ERR_NONE) {
+            shards_close(files, s);
+            return ret;
+        }
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Looks up the slot of a valid image in one imgFS
+ *
+ * @param imgfs_file (const struct imgfs_file*): Given imgFS
+ * @param img_id (const char*): Given image ID
+ * @param slot (uint32_t*): Given pointer to write the slot to
+ * @return (int): Error code
+ */
+static int find_in(const struct imgfs_file* imgfs_file, const char* img_id, uint32_t* slot)
+{
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        if (imgfs_file->metadata[i].is_valid &&
+            !strncmp(imgfs_file->metadata[i].img_id, img_id, MAX_IMG_ID)) {
+            *slot = i;
+            return ERR_NONE;
+        }
+    }
+    return ERR_IMAGE_NOT_FOUND;
+}
+
+int shards_find(const struct imgfs_shards* shards, const struct imgfs_file* files,
+                const char* img_id, size_t* shard, uint32_t* slot)
+{
+    M_REQUIRE_NON_NULL(shards);
+    M_REQUIRE_NON_NULL(files);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(shard);
+    M_REQUIRE_NON_NULL(slot);
+
+    const size_t owner = shards_locate(shards, img_id);
+    if (find_in(&files[owner], img_id, slot) == ERR_NONE) {
+        *shard = owner;
+        return ERR_NONE;
+    }
+    // not moved to its owner yet, maybe
+    for (size_t s = 0; s < shards->nb_shards; ++s) {
+        if (s != owner && find_in(&files[s], img_id, slot) == ERR_NONE) {
+            *shard = s;
+            return ERR_NONE;
+        }
+    }
+    return ERR_IMAGE_NOT_FOUND;
+}
+
+/**
+ * @brief Copies an image into its owner then deletes it from its former
+ *        shard; the write locks of both are held
+ *
+ * @param from (struct imgfs_file*): Given shard the image is in
+ * @param to (struct imgfs_file*): Given shard it belongs to
+ * @param img_id (const char*): Given image ID
+ * @return (int): Error code
+ */
+static int copy_then_delete(struct imgfs_file* from, struct imgfs_file* to, const char* img_id)
+{
+    // deleted by another process since the slot was looked at, maybe
+    uint32_t from_slot = 0;
+    if (find_in(from, img_id, &from_slot) != ERR_NONE) {
+        return ERR_IMAGE_NOT_FOUND;
+    }
+
+    char* image = NULL;
+    uint32_t image_size = 0;
+    int ret = do_read(img_id, ORIG_RES, &image, &image_size, from);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    ret = do_insert(image, image_size, img_id, to);
+    free(image);
+
+    // already there, if a former move was interrupted: only the same content is given up
+    uint32_t slot = 0;
+    if (ret == ERR_DUPLICATE_ID && find_in(to, img_id, &slot) == ERR_NONE &&
+        find_in(from, img_id, &from_slot) == ERR_NONE &&
+        !memcmp(to->metadata[slot].SHA, from->metadata[from_slot].SHA, SHA256_DIGEST_LENGTH)) {
+        ret = ERR_NONE;
+    }
+    if (ret == ERR_NONE) {
+        ret = do_delete(img_id, from);
+    }
+    return ret;
+}
+
+/**
+ * @brief Moves an image from a shard to another, under the write locks of
+ *        both (see imgfs_lock.h), taken in the order of the shards: no
+ *        other process may delete it (nor insert it) in the middle
+ *
+ * @param files (struct imgfs_file*): Given files of the shards
+ * @param from (size_t): Given shard the image is in
+ * @param to (size_t): Given shard it belongs to
+ * @param img_id (const char*): Given image ID
+ * @return (int): Error code
+ */
+static int move_image(struct imgfs_file* files, size_t from, size_t to, const char* img_id)
+{
+    struct imgfs_file* const first = &files[from < to ? from : to];
+    struct imgfs_file* const second = &files[from < to ? to : from];
+    int ret = imgfs_write_lock(first, NULL, NULL);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    ret = imgfs_write_lock(second, NULL, NULL);
+    if (ret == ERR_NONE) {
+        ret = copy_then_delete(&files[from], &files[to], img_id);
+        imgfs_write_unlock(second);
+    }
+    imgfs_write_unlock(first);
+    return ret;
+}
+
+/**
+ * @brief Moves every image which is not in its owner there
+ *
+ * @param shards (const struct imgfs_shards*): Given set
+ * @param moved (size_t*): Given pointer to write the number of images moved to
+ * @return (int): Error code
+ */
+static int rebalance(const struct imgfs_shards* shards, size_t* moved)
+{
+    struct imgfs_file* const files = calloc(shards->nb_shards, sizeof(struct imgfs_file));
+    if (files == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int ret = shards_open(shards, "rb+", files);
+    if (ret != ERR_NONE) {
+        free(files);
+        return ret;
+    }
+
+    char img_id[MAX_IMG_ID + 1];
+    for (size_t s = 0; ret == ERR_NONE && s < shards->nb_shards; ++s) {
+        // the metadata is brought up to date by every write: each slot is looked at as it is then
+        for (uint32_t i = 0; ret == ERR_NONE && i < files[s].header.max_files; ++i) {
+            if (!files[s].metadata[i].is_valid) {
+                continue;
+            }
+            strncpy(img_id, files[s].metadata[i].img_id, MAX_IMG_ID);
+            img_id[MAX_IMG_ID] = '\0';
+            const size_t owner = shards_locate(shards, img_id);
+            if (owner != s) {
+                ret = move_image(files, s, owner, img_id);
+                if (ret == ERR_NONE) {
+                    ++*moved;
+                } else if (ret == ERR_IMAGE_NOT_FOUND) {
+                    ret = ERR_NONE; // deleted by another process meanwhile
+                }
+            }
+        }
+    }
+
+    shards_close(files, shards->nb_shards);
+    free(files);
+    return ret;
+}
+
+int shards_add(const char* manifest, const char* imgfs_filename, size_t* moved)
+{
+    M_REQUIRE_NON_NULL(manifest);
+    M_REQUIRE_NON_NULL(imgfs_filename);
+    M_REQUIRE_NON_NULL(moved);
+    *moved = 0;
+
+    // an imgFS, or nothing is added
+    struct imgfs_file imgfs_file;
+    int ret = do_open(imgfs_filename, "rb", &imgfs_file);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    do_close(&imgfs_file);
+
+    char added[PATH_MAX];
+    if (realpath(imgfs_filename, added) == NULL) {
+        return ERR_INVALID_FILENAME;
+    }
+
+    struct imgfs_shards shards;
+    ret = shards_load(manifest, &shards);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    int listed = 0;
+    char path[PATH_MAX];
+    for (size_t s = 0; s < shards.nb_shards && !listed; ++s) {
+        listed = realpath(shards.paths[s], path) != NULL && !strcmp(path, added);
+    }
+    if (!listed && shards.nb_shards == MAX_SHARDS) {
+        ret = ERR_MAX_FILES;
+    }
+
+    if (ret == ERR_NONE && !listed) {
+        FILE* const file = fopen(manifest, "a");
+        if (file == NULL) {
+            ret = ERR_IO;
+        } else {
+            ret = fprintf(file, "%s\n", added) < 0 ? ERR_IO : ERR_NONE;
+            if (fclose(file) != 0) {
+                ret = ERR_IO;
+            }
+        }
+        shards_free(&shards);
+        if (ret == ERR_NONE) {
+            ret = shards_load(manifest, &shards);
+        }
+        if (ret != ERR_NONE) {
+            return ret;
+        }
+    }
+
+    if (ret == ERR_NONE) {
+        ret = rebalance(&shards, moved);
+    }
+    shards_free(&shards);
+    return ret;
+}
@@ -0,0 +1,137 @@
+/**
+ * @file imgfs_shards.h
+ * @brief One namespace of images spread over several imgFS files.
+ *
+ * A set of shards is described by a manifest, a text file whose first line
+ * is SHARDS_MAGIC, followed by the imgFS files of the set, one per line
+ * (relative to the directory of the manifest, unless absolute). imgfscmd
+ * and imgfs_server take a manifest wherever they take an imgFS file.
+ *
+ * Each image belongs to the shard its img_id hashes to on a ring of
+ * consistent hashing, each shard owning SHARD_POINTS points of it: adding
+ * a shard only takes from each other shard its share of the images, the
+ * others stay where they are. The points of a shard only depend on its
+ * position in the manifest, to which shards are only ever appended (see
+ * shards_add()).
+ *
+ * While the images are moved to a new shard, an image may still be in its
+ * former shard: a lookup tries the owner first, then the other shards (see
+ * shards_find()).
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHARDS_MAGIC "imgfs shards"
+#define MAX_SHARDS 64
+#define SHARD_POINTS 128 // points of each shard on the ring
+
+struct shard_point {
+    uint32_t hash;
+    uint32_t shard;
+};
+
+struct imgfs_shards {
+    size_t nb_shards;
+    char* paths[MAX_SHARDS];  // of the imgFS files, as they can be opened
+    struct shard_point* ring; // nb_shards * SHARD_POINTS points, sorted by hash
+};
+
+/**
+ * @brief Tells whether a file is a manifest of shards (and not an imgFS).
+ */
+int shards_is_manifest(const char* filename);
+
+/**
+ * @brief Reads a manifest and builds the ring of its shards.
+ *
+ * @param manifest The file name of the manifest
+ * @param shards The set to initialise, to free with shards_free()
+ * @return Some error code. 0 if no error.
+ */
+int shards_load(const char* manifest, struct imgfs_shards* shards);
+
+/**
+ * @brief Frees what shards_load() allocated.
+ */
+void shards_free(struct imgfs_shards* shards);
+
+/**
+ * @brief Gives the shard an image belongs to.
+ */
+size_t shards_locate(const struct imgfs_shards* shards, const char* img_id);
+
+/**
+ * @brief Opens all the imgFS files of a set, with do_open().
+ *
+ * @param shards The set
+ * @param open_mode As for do_open()
+ * @param files Where to open them, shards->nb_shards of them
+ * @return Some error code; none is then open. 0 if no error.
+ */
+int shards_open(const struct imgfs_shards* shards, const char* open_mode, struct imgfs_file* files);
+
+/**
+ * @brief Closes the files of shards_open().
+ */
+void shards_close(struct imgfs_file* files, size_t nb_files);
+
+/**
+ * @brief Finds the shard and slot of an image, in its owner first.
+ *
+ * @param shards The set
+ * @param files Its files, opened
+ * @param img_id The image
+ * @param shard Where to write the shard of the image
+ * @param slot Where to write its slot in that shard
+ * @return Some error code (ERR_IMAGE_NOT_FOUND). 0 if no error.
+ */
+int shards_find(const struct imgfs_shards* shards, const struct imgfs_file* files,
+                const char* img_id, size_t* shard, uint32_t* slot);
+
+/**
+ * @brief Appends an imgFS file to a manifest (unless already there), then
+ *        moves to their new shard the images which now belong to another one.
+ *
+ * Each image is inserted into its new shard before being deleted from its
+ * former one, both write locks held throughout (see imgfs_lock.h), so that
+ * no delete can come in between: the servers of the set may go on serving
+ * meanwhile. Running it again finishes the
+ * moves it was interrupted in, or the ones of images inserted into their
+ * former shard meanwhile. Only the originals are moved: the other
+ * resolutions are created again when first read.
+ *
+ * @param manifest The file name of the manifest
+ * @param imgfs_filename The imgFS file of the new shard, already created
+ * @param moved Where to write the number of images moved
+ * @return Some error code. 0 if no error.
+ */
+int shards_add(const char* manifest, const char* imgfs_filename, size_t* moved);
+
+/**
+ * @brief Displays one page of the images of several imgFS files, merged and
+ *        ordered by img_id, like do_list_page() for a single one.
+ *
+ * @param files The files
+ * @param indexes Their ordered indexes
+ * @param nb_files How many of them
+ * @param output_mode As for do_list_page()
+ * @param page As for do_list_page()
+ * @param json As for do_list_page()
+ * @return Some error code. 0 if no error.
+ */
+int do_list_shards(const struct imgfs_file* const* files, const struct imgfs_index* const* indexes,
+                   size_t nb_files, enum do_list_mode output_mode, const struct list_page* page,
+                   char** json);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,637 @@
+/**
+ * @file imgfs_shared.c
+ * @brief Metadata and index of an imgFS shared by several processes.
+ */
+
+#define _GNU_SOURCE // F_OFD_SETLK
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "imgfs_index.h"
+#include "imgfs_lock.h"
+#include "imgfs_shared.h"
+#include "seqlock.h"
+
+#ifdef F_OFD_SETLK
+#define SEGMENT_SETLK F_OFD_SETLK
+#define SEGMENT_SETLKW F_OFD_SETLKW
+#else
+#define SEGMENT_SETLK F_SETLK
+#define SEGMENT_SETLKW F_SETLKW
+#endif
+
+#define SEGMENT_MAGIC UINT64_C(0x32534746474d49) // "IMGFGS2"
+#define SEGMENT_NAME_SIZE 64
+#define BUCKET_EMPTY 0u
+#define BUCKET_REMOVED UINT32_MAX
+
+struct imgfs_segment {
+    uint64_t magic;
+    uint32_t max_files;
+    uint32_t nb_buckets;     // a power of two, at least twice max_files
+    uint32_t version;        // header.version of the file the table was built for
+    uint32_t index_seq;
+    uint32_t nb_removed;     // buckets removed, which the lookups go through
+    uint32_t nb_ordered;     // entries of ordered
+    // followed by uint32_t slot_seq[max_files], uint32_t buckets[nb_buckets],
+    // uint32_t ordered[max_files] (the slots of the images, ordered by
+    // img_id, see imgfs_index.h) and uint8_t blob_checked[max_files]
+};
+
+/**
+ * @brief Hashes an image ID (FNV-1a)
+ *
+ * @param img_id (const char*): Given image ID
+ * @return (uint32_t): Its hash
+ */
+static uint32_t hash_id(const char* img_id)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_IMG_ID && img_id[i] != '\0'; ++i) {
+        hash = (hash ^ (unsigned char) img_id[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Locks (or unlocks) the whole segment
+ *
+ * @param fd (int): Given file descriptor of the segment
+ * @param type (short): Given F_RDLCK, F_WRLCK or F_UNLCK
+ * @param wait (int): Given whether to wait for the lock
+ * @return (int): 0 if locked, -1 otherwise
+ */
+static int lock_segment(int fd, short type, int wait)
+{
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock)); // l_pid must be 0 for F_OFD_SETLK
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+
+    int ret = 0;
+    do {
+        ret = fcntl(fd, wait ? SEGMENT_SETLKW : SEGMENT_SETLK, &lock);
+    } while (ret == -1 && errno == EINTR);
+    return ret;
+}
+
+/**
+ * @brief Reads the version in the header of the file, as mapped
+ *
+ * @param shared (const struct imgfs_shared*): Given attached state
+ * @return (uint32_t): The version
+ */
+static uint32_t file_version(const struct imgfs_shared* shared)
+{
+    const struct imgfs_header* const header = shared->table;
+    return __atomic_load_n(&header->version, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Puts a slot into the table, at the first free bucket of its img_id
+ *
+ * @param shared (struct imgfs_shared*): Given attached state
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param slot (uint32_t): Given slot of a valid image
+ */
+static void put_slot(struct imgfs_shared* shared, const struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    const uint32_t mask = shared->segment->nb_buckets - 1;
+    uint32_t bucket = hash_id(imgfs_file->metadata[slot].img_id) & mask;
+    while (shared->buckets[bucket] != BUCKET_EMPTY && shared->buckets[bucket] != BUCKET_REMOVED) {
+        bucket = (bucket + 1) & mask;
+    }
+    if (shared->buckets[bucket] == BUCKET_REMOVED) {
+        --shared->segment->nb_removed;
+    }
+    __atomic_store_n(&shared->buckets[bucket], slot + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Gives the ordered slots of the segment as an index, for the
+ *        functions of imgfs_index.h; the writers then store nb_slots back
+ *
+ * @param shared (const struct imgfs_shared*): Given attached state
+ * @return (struct imgfs_index): The index, with room for every slot
+ */
+static struct imgfs_index ordered_index(const struct imgfs_shared* shared)
+{
+    const struct imgfs_index index = {
+        .slots = shared->ordered,
+        .nb_slots = shared->segment->nb_ordered,
+        .capacity = shared->segment->max_files
+    };
+    return index;
+}
+
+/**
+ * @brief Fills the ordered slots with all the valid images of the file;
+ *        called with index_seq being written
+ *
+ * @param shared (struct imgfs_shared*): Given attached state
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @return (int): Error code
+ */
+static int fill_ordered(struct imgfs_shared* shared, const struct imgfs_file* imgfs_file)
+{
+    struct imgfs_index built;
+    const int ret = index_build(imgfs_file, &built);
+    if (ret != ERR_NONE) {
+        shared->segment->nb_ordered = 0;
+        return ret;
+    }
+    memcpy(shared->ordered, built.slots, built.nb_slots * sizeof(uint32_t));
+    __atomic_store_n(&shared->segment->nb_ordered, built.nb_slots, __ATOMIC_RELAXED);
+    index_free(&built);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Fills the table with all the valid images of the file; called
+ *        with index_seq being written
+ *
+ * @param shared (struct imgfs_shared*): Given attached state
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ */
+static void fill_table(struct imgfs_shared* shared, const struct imgfs_file* imgfs_file)
+{
+    struct imgfs_segment* const segment = shared->segment;
+    memset(shared->buckets, 0, segment->nb_buckets * sizeof(uint32_t));
+    segment->nb_removed = 0;
+    segment->version = file_version(shared);
+
+    uint32_t slot = 0;
+    for (uint32_t i = 0; i < segment->max_files; ++i) {
+        // a slot copied by a process not attached is as good as any
+        if (imgfs_file->metadata[i].is_valid &&
+            imgfs_shared_find(shared, imgfs_file, imgfs_file->metadata[i].img_id, &slot) != ERR_NONE) {
+            put_slot(shared, imgfs_file, i);
+        }
+    }
+}
+
+/**
+ * @brief Builds the table and the ordered slots again; the write lock of
+ *        the file is held, so that an odd counter was left by a writer
+ *        which died
+ *
+ * @param shared (struct imgfs_shared*): Given attached state
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @return (int): Error code
+ */
+static int rebuild(struct imgfs_shared* shared, const struct imgfs_file* imgfs_file)
+{
+    struct imgfs_segment* const segment = shared->segment;
+    for (uint32_t i = 0; i < segment->max_files; ++i) {
+        if (shared->slot_seq[i] & 1) {
+            __atomic_fetch_add(&shared->slot_seq[i], 1, __ATOMIC_RELEASE);
+        }
+        // the image of the slot may have changed
+        __atomic_store_n(&shared->blob_checked[i], 0, __ATOMIC_RELAXED);
+    }
+    if (segment->index_seq & 1) {
+        __atomic_fetch_add(&segment->index_seq, 1, __ATOMIC_RELEASE);
+    }
+
+    seq_write_begin(&segment->index_seq);
+    fill_table(shared, imgfs_file);
+    const int ret = fill_ordered(shared, imgfs_file);
+    seq_write_end(&segment->index_seq);
+    return ret;
+}
+
+/**
+ * @brief Maps the header and metadata of the file
+ *
+ * @param shared (struct imgfs_shared*): Given state being attached
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @return (int): Error code
+ */
+static int map_table(struct imgfs_shared* shared, const struct imgfs_file* imgfs_file)
+{
+    shared->table_size = sizeof(struct imgfs_header) +
+                         (size_t) imgfs_file->header.max_files * sizeof(struct img_metadata);
+    shared->table = mmap(NULL, shared->table_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fileno(imgfs_file->file), 0);
+    if (shared->table == MAP_FAILED) {
+        shared->table = NULL;
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Names the segment of a file after its device and inode
+ *
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param name (char*): Given buffer of SEGMENT_NAME_SIZE bytes to write the name to
+ * @return (int): Error code
+ */
+static int segment_name(const struct imgfs_file* imgfs_file, char* name)
+{
+    struct stat st;
+    if (fstat(fileno(imgfs_file->file), &st) != 0) {
+        return ERR_IO;
+    }
+    snprintf(name, SEGMENT_NAME_SIZE, "/imgfs-%" PRIxMAX "-%" PRIxMAX,
+             (uintmax_t) st.st_dev, (uintmax_t) st.st_ino);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Maps the segment of the file, initialising it if no other
+ *        process is attached
+ *
+ * @param shared (struct imgfs_shared*): Given state being attached
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @return (int): Error code
+ */
+static int map_segment(struct imgfs_shared* shared, const struct imgfs_file* imgfs_file)
+{
+    char name[SEGMENT_NAME_SIZE];
+    const int ret = segment_name(imgfs_file, name);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+
+    const uint32_t max_files = imgfs_file->header.max_files;
+    uint32_t nb_buckets = 16;
+    while (nb_buckets < 2 * max_files) {
+        nb_buckets *= 2;
+    }
+    shared->segment_size = sizeof(struct imgfs_segment) + (size_t) max_files * sizeof(uint32_t) +
+                           (size_t) nb_buckets * sizeof(uint32_t) +
+                           (size_t) max_files * sizeof(uint32_t) + max_files;
+
+    shared->segment_fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (shared->segment_fd == -1) {
+        return ERR_IO;
+    }
+    // alone (the others hold it shared): whatever is there is left from before
+    const int alone = lock_segment(shared->segment_fd, F_WRLCK, 0) == 0;
+    if (lock_segment(shared->segment_fd, F_RDLCK, 1) != 0) {
+        return ERR_IO;
+    }
+    if (alone && (ftruncate(shared->segment_fd, 0) != 0 ||
+                  ftruncate(shared->segment_fd, (off_t) shared->segment_size) != 0)) {
+        return ERR_IO;
+    }
+    struct stat segment_st;
+    if (fstat(shared->segment_fd, &segment_st) != 0) {
+        return ERR_IO;
+    }
+    // not the same imgFS as the other processes: the file was replaced
+    if ((size_t) segment_st.st_size != shared->segment_size) {
+        return ERR_CORRUPT_IMGFS;
+    }
+    void* const segment = mmap(NULL, shared->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                               shared->segment_fd, 0);
+    if (segment == MAP_FAILED) {
+        return ERR_IO;
+    }
+
+    shared->segment = segment;
+    shared->index_seq = &shared->segment->index_seq;
+    shared->slot_seq = (uint32_t*) (shared->segment + 1);
+    shared->buckets = shared->slot_seq + max_files;
+    shared->ordered = shared->buckets + nb_buckets;
+    shared->blob_checked = (uint8_t*) (shared->ordered + max_files);
+
+    if (alone) {
+        shared->segment->magic = SEGMENT_MAGIC;
+        shared->segment->max_files = max_files;
+        shared->segment->nb_buckets = nb_buckets;
+    }
+    if (shared->segment->magic != SEGMENT_MAGIC || shared->segment->max_files != max_files ||
+        shared->segment->nb_buckets != nb_buckets) {
+        return ERR_CORRUPT_IMGFS;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Unmaps what was mapped
+ *
+ * @param shared (struct imgfs_shared*): Given state
+ */
+static void unmap(struct imgfs_shared* shared)
+{
+    if (shared->segment != NULL) {
+        munmap(shared->segment, shared->segment_size);
+    }
+    if (shared->segment_fd != -1) {
+        close(shared->segment_fd); // releases its lock
+    }
+    if (shared->table != NULL) {
+        munmap(shared->table, shared->table_size);
+    }
+    memset(shared, 0, sizeof(*shared));
+    shared->segment_fd = -1;
+}
+
+/**
+ * @brief Attaches an opened imgFS to its shared segment
+ *
+ * @param shared (struct imgfs_shared*): Given state to initialise
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @return (int): Error code
+ */
+int imgfs_shared_attach(struct imgfs_shared* shared, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(shared);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    memset(shared, 0, sizeof(*shared));
+    shared->segment_fd = -1;
+
+    // excludes the writers, and the other processes attaching
+    int ret = imgfs_write_lock(imgfs_file, NULL, NULL);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    ret = map_table(shared, imgfs_file);
+    if (ret == ERR_NONE) {
+        ret = map_segment(shared, imgfs_file);
+    }
+    if (ret == ERR_NONE) {
+        shared->own_metadata = imgfs_file->metadata;
+        imgfs_file->metadata = (struct img_metadata*) ((char*) shared->table + sizeof(struct imgfs_header));
+        ret = rebuild(shared, imgfs_file);
+    }
+    if (ret != ERR_NONE) {
+        if (shared->own_metadata != NULL) {
+            imgfs_file->metadata = shared->own_metadata;
+        }
+        unmap(shared);
+    }
+    imgfs_write_unlock(imgfs_file);
+    return ret;
+}
+
+/**
+ * @brief Detaches from the segment
+ *
+ * @param shared (struct imgfs_shared*): Given attached state
+ * @param imgfs_file (struct imgfs_file*): Given database
+ */
+void imgfs_shared_detach(struct imgfs_shared* shared, struct imgfs_file* imgfs_file)
+{
+    if (shared == NULL || shared->segment == NULL || imgfs_file == NULL) {
+        return;
+    }
+    memcpy(shared->own_metadata, imgfs_file->metadata,
+           imgfs_file->header.max_files * sizeof(struct img_metadata));
+    imgfs_file->metadata = shared->own_metadata;
+
+    // the last one removes the segment; the processes attaching are excluded meanwhile
+    char name[SEGMENT_NAME_SIZE];
+    if (imgfs_write_lock(imgfs_file, NULL, NULL) == ERR_NONE) {
+        if (lock_segment(shared->segment_fd, F_WRLCK, 0) == 0 && segment_name(imgfs_file, name) == ERR_NONE) {
+            shm_unlink(name);
+        }
+        unmap(shared);
+        imgfs_write_unlock(imgfs_file);
+    } else {
+        unmap(shared);
+    }
+}
+
+/**
+ * @brief Tells whether the table has to be built again
+ *
+ * @param shared (const struct imgfs_shared*): Given attached state
+ * @return (int): 1 if so, 0 otherwise
+ */
+int imgfs_shared_changed(const struct imgfs_shared* shared)
+{
+    if (shared == NULL || shared->segment == NULL) {
+        return 0;
+    }
+    return file_version(shared) != __atomic_load_n(&shared->segment->version, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Builds the table again if the file was changed by a process not attached
+ *
+ * @param shared (struct imgfs_shared*): Given attached state
+ * @param imgfs_file (struct imgfs_file*): Given database, whose write lock is held
+ * @return (int): Error code
+ */
+int imgfs_shared_sync(struct imgfs_shared* shared, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(shared);
+    M_REQUIRE_NON_NULL(shared->segment);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    // a writer which died in the middle of its changes left its counter odd
+    if (imgfs_shared_changed(shared) || (__atomic_load_n(shared->index_seq, __ATOMIC_ACQUIRE) & 1)) {
+        return rebuild(shared, imgfs_file);
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Looks up the slot of a valid image, without any lock
+ *
+ * @param shared (const struct imgfs_shared*): Given attached state
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param img_id (const char*): Given image ID
+ * @param slot (uint32_t*): Given pointer to write the slot to
+ * @return (int): Error code
+ */
+int imgfs_shared_find(const struct imgfs_shared* shared, const struct imgfs_file* imgfs_file,
+                      const char* img_id, uint32_t* slot)
+{
+    M_REQUIRE_NON_NULL(shared);
+    M_REQUIRE_NON_NULL(shared->segment);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(slot);
+
+    const uint32_t max_files = shared->segment->max_files;
+    const uint32_t mask = shared->segment->nb_buckets - 1;
+    uint32_t bucket = hash_id(img_id) & mask;
+    // a table being changed may be full of anything: never more than one round
+    for (uint32_t probes = 0; probes <= mask; ++probes) {
+        const uint32_t entry = __atomic_load_n(&shared->buckets[bucket], __ATOMIC_RELAXED);
+        if (entry == BUCKET_EMPTY) {
+            break;
+        }
+        if (entry != BUCKET_REMOVED && entry <= max_files &&
+            imgfs_file->metadata[entry - 1].is_valid &&
+            !strncmp(imgfs_file->metadata[entry - 1].img_id, img_id, MAX_IMG_ID)) {
+            *slot = entry - 1;
+            return ERR_NONE;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+    return ERR_IMAGE_NOT_FOUND;
+}
+
+/**
+ * @brief Copies the ordered slots a page of the listing may show, without
+ *        any lock
+ *
+ * The entries may be shifted meanwhile by a writer: each one is loaded
+ * once, and those which are not a slot end the copy, so that the result
+ * only holds slots, whatever it found. It is only meaningful if index_seq
+ * did not change meanwhile, which the caller has to check.
+ *
+ * @param shared (const struct imgfs_shared*): Given attached state
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param page (const struct list_page*): Given page
+ * @param index (struct imgfs_index*): Given index to fill, to be freed with index_free()
+ * @return (int): Error code
+ */
+int imgfs_shared_page(const struct imgfs_shared* shared, const struct imgfs_file* imgfs_file,
+                      const struct list_page* page, struct imgfs_index* index)
+{
+    M_REQUIRE_NON_NULL(shared);
+    M_REQUIRE_NON_NULL(shared->segment);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(page);
+    M_REQUIRE_NON_NULL(index);
+    memset(index, 0, sizeof(*index));
+
+    // the page starts at the prefix, or right after the cursor: the copy
+    // starts at the greater of the two, and holds what follows the page too
+    const char* from = page->prefix != NULL ? page->prefix : "";
+    if (page->cursor != NULL && strncmp(page->cursor, from, MAX_IMG_ID) > 0) {
+        from = page->cursor;
+    }
+    const uint32_t max_files = shared->segment->max_files;
+    uint32_t nb = __atomic_load_n(&shared->segment->nb_ordered, __ATOMIC_RELAXED);
+    nb = nb < max_files ? nb : max_files;
+
+    size_t low = 0;
+    size_t high = nb;
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        const uint32_t entry = __atomic_load_n(&shared->ordered[mid], __ATOMIC_RELAXED);
+        if (entry < max_files && strncmp(imgfs_file->metadata[entry].img_id, from, MAX_IMG_ID) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    size_t count = nb - low;
+    if (page->limit && count > (size_t) page->limit + 2) {
+        count = (size_t) page->limit + 2; // the cursor itself, the page, and whether it has more
+    }
+
+    index->slots = calloc(count > 0 ? count : 1, sizeof(uint32_t));
+    if (index->slots == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    index->capacity = (uint32_t) (count > 0 ? count : 1);
+    for (size_t i = 0; i < count; ++i) {
+        const uint32_t entry = __atomic_load_n(&shared->ordered[low + i], __ATOMIC_RELAXED);
+        if (entry >= max_files) {
+            break;
+        }
+        index->slots[index->nb_slots++] = entry;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Adds to the table an image just inserted
+ *
+ * @param shared (struct imgfs_shared*): Given attached state
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param img_id (const char*): Given ID of the inserted image
+ * @return (int): Error code
+ */
+int imgfs_shared_add(struct imgfs_shared* shared, const struct imgfs_file* imgfs_file, const char* img_id)
+{
+    M_REQUIRE_NON_NULL(shared);
+    M_REQUIRE_NON_NULL(shared->segment);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(img_id);
+
+    uint32_t slot = 0;
+    if (imgfs_shared_find(shared, imgfs_file, img_id, &slot) == ERR_NONE) {
+        return ERR_DUPLICATE_ID;
+    }
+    const uint32_t max_files = shared->segment->max_files;
+    while (slot < max_files && !(imgfs_file->metadata[slot].is_valid &&
+                                 !strncmp(imgfs_file->metadata[slot].img_id, img_id, MAX_IMG_ID))) {
+        ++slot;
+    }
+    if (slot == max_files) {
+        return ERR_IMAGE_NOT_FOUND;
+    }
+
+    struct imgfs_index ordered = ordered_index(shared);
+    const int ret = index_add(imgfs_file, &ordered, img_id);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    __atomic_store_n(&shared->segment->nb_ordered, ordered.nb_slots, __ATOMIC_RELAXED);
+
+    put_slot(shared, imgfs_file, slot);
+    shared->segment->version = imgfs_file->header.version;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Removes from the table the image of a slot
+ *
+ * @param shared (struct imgfs_shared*): Given attached state
+ * @param imgfs_file (const struct imgfs_file*): Given database
+ * @param slot (uint32_t): Given slot, whose img_id is still there
+ * @return (int): Error code
+ */
+int imgfs_shared_remove(struct imgfs_shared* shared, const struct imgfs_file* imgfs_file, uint32_t slot)
+{
+    M_REQUIRE_NON_NULL(shared);
+    M_REQUIRE_NON_NULL(shared->segment);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    struct imgfs_segment* const segment = shared->segment;
+    if (slot >= segment->max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const uint32_t mask = segment->nb_buckets - 1;
+    uint32_t bucket = hash_id(imgfs_file->metadata[slot].img_id) & mask;
+    for (uint32_t probes = 0; probes <= mask && shared->buckets[bucket] != BUCKET_EMPTY; ++probes) {
+        if (shared->buckets[bucket] == slot + 1) {
+            __atomic_store_n(&shared->buckets[bucket], BUCKET_REMOVED, __ATOMIC_RELAXED);
+            ++segment->nb_removed;
+            break;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+    segment->version = imgfs_file->header.version;
+
+    // the entry of the slot itself: a process not attached may have left its img_id in another too
+    const struct imgfs_index ordered = ordered_index(shared);
+    size_t pos = index_lower_bound(imgfs_file, &ordered, imgfs_file->metadata[slot].img_id);
+    while (pos < ordered.nb_slots && ordered.slots[pos] != slot &&
+           !strncmp(imgfs_file->metadata[ordered.slots[pos]].img_id, imgfs_file->metadata[slot].img_id,
+                    MAX_IMG_ID)) {
+        ++pos;
+    }
+    if (pos < ordered.nb_slots && ordered.slots[pos] == slot) {
+        memmove(&shared->ordered[pos], &shared->ordered[pos + 1],
+                (ordered.nb_slots - pos - 1) * sizeof(uint32_t));
+        __atomic_store_n(&segment->nb_ordered, ordered.nb_slots - 1, __ATOMIC_RELAXED);
+    }
+
+    // the removed buckets lengthen the lookups: past a quarter of them, the table is filled again
+    if (segment->nb_removed > segment->nb_buckets / 4) {
+        fill_table(shared, imgfs_file);
+    }
+    return ERR_NONE;
+}
@@ -0,0 +1,128 @@
+/**
+ * @file imgfs_shared.h
+ * @brief Metadata and index of an imgFS shared by several processes.
+ *
+ * Several servers may serve the same imgFS, to use all the cores without
+ * threads (IMGFS_SHARED, see imgfs_server_service.c). Instead of a copy
+ * each, they then share:
+ *  - the header and metadata of the file itself, mapped (MAP_SHARED): a
+ *    slot written by one process is at once seen by the others;
+ *  - a segment of shared memory (shm_open(), named after the file), with
+ *    the sequence counters of the lookups without lock (see seqlock.h),
+ *    one per slot and one for the set of images, the blobs already checked
+ *    against their CRC, a hash table from the img_id to the slot, and the
+ *    slots ordered by img_id (as in imgfs_index.h), for the listings.
+ *
+ * The writers are serialised by the write lock of the file (see
+ * imgfs_lock.h), under which they change the metadata and the table within
+ * the sequence counters: the readers of every process find an image as
+ * soon as it is published, and never a half written slot. A process which
+ * is not attached (e.g. `imgfscmd insert`) writes to the file as usual:
+ * the version in its header then differs from the one the table was built
+ * for, and imgfs_shared_sync() builds it again.
+ *
+ * The segment lives as long as a process is attached to it: the first one
+ * attaching initialises it (whatever a process which died left there), the
+ * last one detaching removes it.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+#include "imgfs_index.h"
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct imgfs_segment; // imgfs_shared.c
+
+struct imgfs_shared {
+    struct imgfs_segment* segment; // NULL if not attached
+    size_t segment_size;
+    int segment_fd;                // held shared while attached
+    uint32_t* index_seq;           // set of the images (and the table)
+    uint32_t* slot_seq;            // metadata of each slot
+    uint8_t* blob_checked;         // blobs checked against their CRC, one bit per resolution
+    uint32_t* buckets;             // img_id -> slot + 1
+    uint32_t* ordered;             // slots ordered by img_id
+    void* table;                   // header and metadata of the file, mapped
+    size_t table_size;
+    struct img_metadata* own_metadata; // the copy of do_open(), given back by imgfs_shared_detach()
+};
+
+/**
+ * @brief Attaches an opened imgFS to its shared segment: its metadata
+ *        becomes the one of the file, shared with the other processes.
+ *
+ * @param shared The state to initialise
+ * @param imgfs_file The imgFS, opened for writing ("rb+")
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_shared_attach(struct imgfs_shared* shared, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Detaches from the segment: imgfs_file gets back a metadata copy of
+ *        its own, which do_close() frees.
+ */
+void imgfs_shared_detach(struct imgfs_shared* shared, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Tells, without any lock, whether the table has to be built again
+ *        by imgfs_shared_sync() (the file was written by a process not
+ *        attached, or a writer died while writing).
+ */
+int imgfs_shared_changed(const struct imgfs_shared* shared);
+
+/**
+ * @brief Builds the table (and ordered slots) again if imgfs_shared_changed(); the write lock
+ *        of the file must be held.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_shared_sync(struct imgfs_shared* shared, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Looks up the slot of a valid image. Takes no lock: while a writer
+ *        is at work, the result is only meaningful if *index_seq did not
+ *        change meanwhile, which the caller has to check.
+ *
+ * @return Some error code (ERR_IMAGE_NOT_FOUND). 0 if no error.
+ */
+int imgfs_shared_find(const struct imgfs_shared* shared, const struct imgfs_file* imgfs_file,
+                      const char* img_id, uint32_t* slot);
+
+/**
+ * @brief Copies the ordered slots from which do_list_shards() can list a
+ *        page (all of them if page->limit is 0), in a few more than
+ *        page->limit entries. Takes no lock: like imgfs_shared_find(), the
+ *        result is only meaningful if *index_seq did not change meanwhile.
+ *
+ * @param index The copy, to be freed with index_free()
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_shared_page(const struct imgfs_shared* shared, const struct imgfs_file* imgfs_file,
+                      const struct list_page* page, struct imgfs_index* index);
+
+/**
+ * @brief Adds to the table an image just inserted (like index_add()); called
+ *        with *index_seq being written.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_shared_add(struct imgfs_shared* shared, const struct imgfs_file* imgfs_file, const char* img_id);
+
+/**
+ * @brief Removes from the table the image of a slot; called with
+ *        *index_seq being written.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_shared_remove(struct imgfs_shared* shared, const struct imgfs_file* imgfs_file, uint32_t slot);
+
+#ifdef __cplusplus
+}
+#endif
@@ -6,6 +6,9 @@
  */
 
 #include "imgfs.h"
+#include "crc32c.h"
+#include "imgfs_lock.h"
+#include "storage.h"
 #include "util.h"
 
 #include <inttypes.h>      // for PRIxN macros
@@ -44,6 +47,12 @@ THUMBNAIL: %" PRIu16 " x %" PRIu16 "\tSMALL: %" PRIu16 " x %" PRIu16 "\n",
            header->name, header->version, header->nb_files, header->max_files, header->resized_res[THUMB_RES * 2],
            header->resized_res[THUMB_RES * 2 + 1], header->resized_res[SMALL_RES * 2],
            header->resized_res[SMALL_RES * 2 + 1]);
+    if (header->flags & IMGFS_CRC32C) {
+        printf("BLOBS: with CRC-32C\n");
+    }
+    if (header->flags & IMGFS_CHANGELOG) {
+        printf("METADATA: with a change log\n");
+    }
     printf("*********** IMGFS HEADER END ************\n\
 *****************************************\n");
 }
@@ -91,6 +100,12 @@ int do_open(const char* imgfs_filename, const char* open_mode, struct imgfs_file
         return ERR_IO;
     }
 
+    // written by a later version, whose blobs this one cannot read
+    if (imgfs_file->header.flags & ~(uint64_t) (IMGFS_CRC32C | IMGFS_CHANGELOG)) {
+        do_close(imgfs_file);
+        return ERR_CORRUPT_IMGFS;
+    }
+
 #define NB_METADATA imgfs_file->header.max_files
     // Allocating the memory the maximum number of files that can be stored in the database
     imgfs_file->metadata = calloc(NB_METADATA, sizeof(struct img_metadata));
@@ -98,10 +113,21 @@ int do_open(const char* imgfs_filename, const char* open_mode, struct imgfs_file
         do_close(imgfs_file);
         return ERR_OUT_OF_MEMORY;
     }
-    ret = (int) fread(imgfs_file->metadata,
-                      sizeof(struct img_metadata), NB_METADATA, pFile); // Reading the all images metadata
 
-    if (ret != NB_METADATA) {
+    // the header again, with the metadata, as no other process is writing them (see imgfs_lock.h)
+    ret = imgfs_read_lock(imgfs_file);
+    if (ret != ERR_NONE) {
+        do_close(imgfs_file);
+        return ret;
+    }
+    const uint32_t max_files = imgfs_file->header.max_files;
+    int read = fseek(pFile, 0, SEEK_SET) == 0 &&
+               fread(&(imgfs_file->header), sizeof(struct imgfs_header), NB_HEADER, pFile) == NB_HEADER &&
+               imgfs_file->header.max_files == max_files &&
+               fread(imgfs_file->metadata, sizeof(struct img_metadata), NB_METADATA, pFile) == NB_METADATA; // Reading the all images metadata
+    imgfs_read_unlock(imgfs_file);
+
+    if (!read) {
         do_close(imgfs_file);
         return ERR_IO;
     }
@@ -128,6 +154,74 @@ void do_close(struct imgfs_file* imgfs_file)
     imgfs_file = NULL;
 }
 
+/*******************************************************************
+ * Blobs, followed by their CRC-32C in an imgFS with IMGFS_CRC32C.
+ */
+uint64_t blob_footprint(const struct imgfs_header* header, uint64_t size)
+{
+    return size + (header->flags & IMGFS_CRC32C ? CRC32C_BYTES : 0);
+}
+
+int append_blob(struct imgfs_file* imgfs_file, const void* blob, size_t size, uint64_t* offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(blob);
+    M_REQUIRE_NON_NULL(offset);
+
+    uint64_t end = 0;
+    int ret = storage_end(imgfs_file, &end);
+    if (ret == ERR_NONE) {
+        ret = storage_write(imgfs_file, end, blob, size);
+    }
+    if (ret == ERR_NONE && (imgfs_file->header.flags & IMGFS_CRC32C)) {
+        unsigned char crc[CRC32C_BYTES];
+        crc32c_put(crc32c(0, blob, size), crc);
+        ret = storage_write(imgfs_file, end + size, crc, CRC32C_BYTES);
+    }
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+
+    *offset = end;
+    return ERR_NONE;
+}
+
+int read_blob(struct imgfs_file* imgfs_file, uint64_t offset, size_t size, void* blob)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(blob);
+
+    int ret = storage_read(imgfs_file, offset, blob, size);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    if (imgfs_file->header.flags & IMGFS_CRC32C) {
+        unsigned char crc[CRC32C_BYTES];
+        ret = storage_read(imgfs_file, offset + size, crc, CRC32C_BYTES);
+        if (ret != ERR_NONE) {
+            return ret;
+        }
+        if (crc32c(0, blob, size) != crc32c_get(crc)) {
+            return ERR_CORRUPT_IMGFS;
+        }
+    }
+    return ERR_NONE;
+}
+
+int check_blob(const struct imgfs_header* header, const void* blob, size_t size)
+{
+    M_REQUIRE_NON_NULL(header);
+    M_REQUIRE_NON_NULL(blob);
+
+    if (!(header->flags & IMGFS_CRC32C)) {
+        return ERR_NONE;
+    }
+    const unsigned char* crc = (const unsigned char*) blob + size;
+    return crc32c(0, blob, size) == crc32c_get(crc) ? ERR_NONE : ERR_CORRUPT_IMGFS;
+}
+
 int resolution_atoi(const char* str)
 {
     if (str == NULL) {
@@ -0,0 +1,422 @@
+#include <fcntl.h> // posix_fadvise
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h> // pread
+#include "imgfs.h"
+#include "error.h"
+#include "imgfs_index.h"
+#include "crc32c.h"
+#include "imgfs_lock.h"
+#include "storage.h"
+
+#define VERIFY_RUN_SIZE (8u << 20) // bytes read at once by a hashing thread
+#define VERIFY_MAX_GAP  (1u << 20) // unread bytes a run may span between two originals
+
+static const char* const res_names[NB_RES] = { "thumb", "small", "orig" };
+
+// one blob referenced by a metadata slot
+struct extent {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t slot;
+    int res;
+};
+
+// one content, shared by one or more (deduplicated) slots: an original,
+// or any blob of an imgFS with CRCs
+struct blob {
+    uint64_t offset;
+    uint32_t size;
+    size_t first;   // its extents, [first, first + count)
+    size_t count;
+    int is_orig;    // whether its SHA is to be computed
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    int bad_crc;
+    int error;      // of the read
+};
+
+// blobs read with one call, [first, first + count)
+struct run {
+    uint64_t offset;
+    uint64_t size;
+    size_t first;
+    size_t count;
+};
+
+struct hash_job {
+    int fd;
+    uint32_t crc_size; // of the CRC after each blob, 0 if none
+    struct blob* blobs;
+    const struct run* runs;
+    size_t nb_runs;
+    size_t next_run;  // the next run to hash, taken atomically
+    uint64_t bytes;
+};
+
+/**
+ * @brief Orders extents by offset, then size, then slot (for qsort)
+ *
+ * @param a (const void*): Pointer to an extent
+ * @param b (const void*): Pointer to an extent
+ * @return (int): Same convention as strcmp
+ */
+static int cmp_extent(const void* a, const void* b)
+{
+    const struct extent* ea = a;
+    const struct extent* eb = b;
+    if (ea->offset != eb->offset) {
+        return ea->offset < eb->offset ? -1 : 1;
+    }
+    if (ea->size != eb->size) {
+        return ea->size < eb->size ? -1 : 1;
+    }
+    return ea->slot < eb->slot ? -1 : ea->slot > eb->slot;
+}
+
+/**
+ * @brief Reads `size` bytes at `offset`, going on after short reads
+ *
+ * @param fd (int): Given file descriptor
+ * @param buf (char*): Given buffer of at least size bytes
+ * @param size (uint64_t): Given number of bytes
+ * @param offset (uint64_t): Given offset in the file
+ * @return (int): Error code
+ */
+static int read_fully(int fd, char* buf, uint64_t size, uint64_t offset)
+{
+    while (size > 0) {
+        const ssize_t n = pread(fd, buf, size, (off_t) offset);
+        if (n <= 0) {
+            return ERR_IO;
+        }
+        buf += n;
+        size -= (uint64_t) n;
+        offset += (uint64_t) n;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Hashing thread: takes the runs one after the other, reads each
+ *        with one call and hashes its blobs
+ *
+ * @param arg (void*): Given struct hash_job
+ * @return (void*): NULL
+ */
+static void* hash_runs(void* arg)
+{
+    struct hash_job* job = arg;
+    char* buf = NULL;
+    uint64_t buf_size = 0;
+
+    for (;;) {
+        const size_t r = __atomic_fetch_add(&job->next_run, 1, __ATOMIC_RELAXED);
+        if (r >= job->nb_runs) {
+            break;
+        }
+        const struct run* run = &job->runs[r];
+
+        int err = ERR_NONE;
+        if (run->size > buf_size) {
+            char* grown = realloc(buf, run->size);
+            if (grown == NULL) {
+                err = ERR_OUT_OF_MEMORY;
+            } else {
+                buf = grown;
+                buf_size = run->size;
+            }
+        }
+        if (err == ERR_NONE) {
+            err = read_fully(job->fd, buf, run->size, run->offset);
+        }
+
+        uint64_t hashed = 0;
+        for (size_t b = run->first; b < run->first + run->count; ++b) {
+            struct blob* blob = &job->blobs[b];
+            blob->error = err;
+            if (err == ERR_NONE) {
+                const char* content = buf + (blob->offset - run->offset);
+                if (blob->is_orig) {
+                    SHA256((const unsigned char*) content, blob->size, blob->SHA);
+                }
+                if (job->crc_size > 0) {
+                    blob->bad_crc = crc32c(0, content, blob->size) !=
+                                    crc32c_get((const unsigned char*) content + blob->size);
+                }
+                hashed += blob->size;
+            }
+        }
+        __atomic_fetch_add(&job->bytes, hashed, __ATOMIC_RELAXED);
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief Groups the blobs (ordered by offset) into runs of nearby blobs
+ *
+ * @param blobs (const struct blob*): Given blobs
+ * @param nb_blobs (size_t): Given number of blobs
+ * @param crc_size (uint32_t): Given size of the CRC after each blob, 0 if none
+ * @param runs (struct run*): Given array of nb_blobs runs to fill
+ * @return (size_t): The number of runs
+ */
+static size_t make_runs(const struct blob* blobs, size_t nb_blobs, uint32_t crc_size, struct run* runs)
+{
+    size_t nb_runs = 0;
+    for (size_t b = 0; b < nb_blobs; ++b) {
+        const uint64_t end = blobs[b].offset + blobs[b].size + crc_size;
+        struct run* run = nb_runs > 0 ? &runs[nb_runs - 1] : NULL;
+        if (run != NULL && blobs[b].offset <= run->offset + run->size + VERIFY_MAX_GAP &&
+            end - run->offset <= VERIFY_RUN_SIZE) {
+            if (end > run->offset + run->size) {
+                run->size = end - run->offset;
+            }
+            ++run->count;
+        } else {
+            runs[nb_runs++] = (struct run) {
+                blobs[b].offset, end - blobs[b].offset, b, 1
+            };
+        }
+    }
+    return nb_runs;
+}
+
+/**
+ * @brief Hashes all the blobs on nb_threads threads
+ *
+ * @param fd (int): Given file descriptor of the imgFS
+ * @param crc_size (uint32_t): Given size of the CRC after each blob, 0 if none
+ * @param blobs (struct blob*): Given blobs, ordered by offset
+ * @param nb_blobs (size_t): Given number of blobs
+ * @param nb_threads (size_t): Given number of threads
+ * @param bytes (uint64_t*): Given pointer to write the number of bytes hashed to
+ * @return (int): Error code
+ */
+static int hash_blobs(int fd, uint32_t crc_size, struct blob* blobs, size_t nb_blobs,
+                      size_t nb_threads, uint64_t* bytes)
+{
+    struct run* runs = calloc(nb_blobs, sizeof(struct run));
+    pthread_t* threads = calloc(nb_threads, sizeof(pthread_t));
+    if (runs == NULL || threads == NULL) {
+        free(runs);
+        free(threads);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    struct hash_job job = { fd, crc_size, blobs, runs, make_runs(blobs, nb_blobs, crc_size, runs), 0, 0 };
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    size_t started = 0;
+    while (started < nb_threads && pthread_create(&threads[started], NULL, hash_runs, &job) == 0) {
+        ++started;
+    }
+    if (started == 0) {
+        hash_runs(&job); // no thread could start: hash everything here
+    }
+    for (size_t t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+
+    *bytes = job.bytes;
+    free(threads);
+    free(runs);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Checks the blobs of one valid slot against the bounds of the
+ *        data part of the file, and collects those within
+ *
+ * @param md (const struct img_metadata*): Given metadata
+ * @param slot (uint32_t): Given slot of the metadata
+ * @param data_start (uint64_t): Given offset of the first blob
+ * @param file_size (uint64_t): Given size of the file
+ * @param crc_size (uint32_t): Given size of the CRC after each blob, 0 if none
+ * @param extents (struct extent*): Given array to append the blobs to
+ * @param nb_extents (size_t*): Given number of extents in the array
+ * @return (uint32_t): The number of blobs out of bounds
+ */
+static uint32_t collect_extents(const struct img_metadata* md, uint32_t slot, uint64_t data_start,
+                                uint64_t file_size, uint32_t crc_size,
+                                struct extent* extents, size_t* nb_extents)
+{
+    uint32_t out_of_bounds = 0;
+    for (int res = 0; res < NB_RES; ++res) {
+        const uint64_t offset = md->offset[res];
+        const uint32_t size = md->size[res];
+        // originals always exist; the resized images have both or none of their offset and size
+        const int missing = res == ORIG_RES ? offset == 0 || size == 0 : (offset == 0) != (size == 0);
+        if (missing || (size > 0 && (offset < data_start || offset > file_size ||
+                                    (uint64_t) size + crc_size > file_size - offset))) {
+            printf("%.*s: %s blob of %u bytes at offset %lu out of the data\n",
+                   MAX_IMG_ID, md->img_id, res_names[res], size, (unsigned long) offset);
+            ++out_of_bounds;
+        } else if (size > 0) {
+            extents[(*nb_extents)++] = (struct extent) {
+                offset, size, slot, res
+            };
+        }
+    }
+    return out_of_bounds;
+}
+
+/**
+ * @brief Checks that an imgFS file is consistent.
+ *
+ * @param imgfs_file (struct imgfs_file*): Given database
+ * @param nb_threads (size_t): Given number of hashing threads
+ * @param repair (int): Given whether to fix the header counts
+ * @param report (struct verify_report*): Given report to fill
+ * @return (int): Error code
+ */
+int do_verify(struct imgfs_file* imgfs_file, size_t nb_threads, int repair,
+              struct verify_report* report)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(report);
+
+    memset(report, 0, sizeof(*report));
+    const struct img_metadata* metadata = imgfs_file->metadata;
+    const uint32_t max_files = imgfs_file->header.max_files;
+    const int fd = fileno(imgfs_file->file);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return ERR_IO;
+    }
+    const uint64_t file_size = (uint64_t) st.st_size;
+    const uint64_t data_start = sizeof(struct imgfs_header) + (uint64_t) max_files * sizeof(struct img_metadata) +
+                                (imgfs_file->header.flags & IMGFS_CHANGELOG ? CHANGELOG_SIZE : 0);
+    const uint32_t crc_size = (uint32_t) blob_footprint(&imgfs_file->header, 0);
+
+    struct extent* extents = calloc((size_t) max_files * NB_RES, sizeof(struct extent));
+    if (max_files > 0 && extents == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // the metadata slots one by one: ids and bounds
+    size_t nb_extents = 0;
+    for (uint32_t i = 0; i < max_files; ++i) {
+        const struct img_metadata* md = &metadata[i];
+        if (!md->is_valid) {
+            continue;
+        }
+        ++report->nb_valid;
+        if (md->img_id[0] == '\0' || memchr(md->img_id, '\0', sizeof(md->img_id)) == NULL) {
+            printf("slot %u: invalid image ID\n", i);
+            ++report->bad_ids;
+        }
+        report->out_of_bounds += collect_extents(md, i, data_start, file_size, crc_size,
+                                                 extents, &nb_extents);
+    }
+
+    if (imgfs_file->header.nb_files != report->nb_valid) {
+        printf("header: %u files, but %u valid images\n", imgfs_file->header.nb_files, report->nb_valid);
+        report->bad_nb_files = 1;
+        if (repair) {
+            // the count only holds if no other process changed the imgFS since it was read
+            const uint32_t version = imgfs_file->header.version;
+            int ret = imgfs_write_lock(imgfs_file, NULL, NULL);
+            if (ret == ERR_NONE && imgfs_file->header.version == version) {
+                imgfs_file->header.nb_files = report->nb_valid;
+                ret = write_header(imgfs_file);
+                ++report->repaired;
+            } else if (ret == ERR_NONE) {
+                printf("header: changed meanwhile, not repaired\n");
+            }
+            imgfs_write_unlock(imgfs_file);
+            if (ret != ERR_NONE) {
+                free(extents);
+                return ret;
+            }
+        }
+    }
+
+    // the blobs in the order of the file: a blob may only be shared by
+    // images with the same content (deduplication), and never overlap another
+    qsort(extents, nb_extents, sizeof(struct extent), cmp_extent);
+    struct blob* blobs = calloc(nb_extents > 0 ? nb_extents : 1, sizeof(struct blob));
+    if (blobs == NULL) {
+        free(extents);
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t nb_blobs = 0;
+    uint64_t max_end = 0;
+    size_t max_extent = 0;
+    for (size_t first = 0, last = 0; first < nb_extents; first = last) {
+        const struct extent* e = &extents[first];
+        int has_orig = e->res == ORIG_RES;
+        for (last = first + 1; last < nb_extents && extents[last].offset == e->offset &&
+             extents[last].size == e->size; ++last) {
+            const struct extent* other = &extents[last];
+            has_orig |= other->res == ORIG_RES;
+            if (other->res != e->res || memcmp(metadata[other->slot].SHA, metadata[e->slot].SHA, SHA256_DIGEST_LENGTH)) {
+                printf("%.*s: %s blob shared with the %s blob of %.*s\n",
+                       MAX_IMG_ID, metadata[other->slot].img_id, res_names[other->res],
+                       res_names[e->res], MAX_IMG_ID, metadata[e->slot].img_id);
+                ++report->overlaps;
+            }
+        }
+        if (e->offset < max_end) {
+            const struct extent* previous = &extents[max_extent];
+            printf("%.*s: %s blob overlaps the %s blob of %.*s\n",
+                   MAX_IMG_ID, metadata[e->slot].img_id, res_names[e->res],
+                   res_names[previous->res], MAX_IMG_ID, metadata[previous->slot].img_id);
+            ++report->overlaps;
+        }
+        if (e->offset + e->size + crc_size > max_end) {
+            max_end = e->offset + e->size + crc_size;
+            max_extent = first;
+        }
+        if (has_orig || crc_size > 0) {
+            blobs[nb_blobs++] = (struct blob) {
+                e->offset, e->size, first, last - first, has_orig, { 0 }, 0, ERR_NONE
+            };
+        }
+    }
+
+    // the contents of the originals, and of all the blobs with a CRC
+    int ret = nb_blobs > 0 ? hash_blobs(fd, crc_size, blobs, nb_blobs, nb_threads > 0 ? nb_threads : 1,
+                                        &report->bytes_hashed) : ERR_NONE;
+    for (size_t b = 0; ret == ERR_NONE && b < nb_blobs; ++b) {
+        ret = blobs[b].error;
+        if (ret == ERR_NONE && blobs[b].bad_crc) {
+            const struct extent* e = &extents[blobs[b].first];
+            printf("%.*s: %s blob does not match its CRC\n",
+                   MAX_IMG_ID, metadata[e->slot].img_id, res_names[e->res]);
+            ++report->bad_crc;
+        }
+        for (size_t e = blobs[b].first; ret == ERR_NONE && e < blobs[b].first + blobs[b].count; ++e) {
+            const struct img_metadata* md = &metadata[extents[e].slot];
+            if (extents[e].res == ORIG_RES && memcmp(md->SHA, blobs[b].SHA, SHA256_DIGEST_LENGTH)) {
+                printf("%.*s: SHA does not match the content\n", MAX_IMG_ID, md->img_id);
+                ++report->bad_sha;
+            }
+        }
+    }
+    free(blobs);
+    free(extents);
+
+    // the ids, in order: duplicates end up next to each other
+    struct imgfs_index index;
+    if (ret == ERR_NONE) {
+        ret = index_build(imgfs_file, &index);
+    }
+    if (ret == ERR_NONE) {
+        for (uint32_t i = 1; i < index.nb_slots; ++i) {
+            const char* id = metadata[index.slots[i]].img_id;
+            if (!strncmp(metadata[index.slots[i - 1]].img_id, id, MAX_IMG_ID)) {
+                printf("%.*s: duplicate image ID (slots %u and %u)\n", MAX_IMG_ID, id,
+                       index.slots[i - 1], index.slots[i]);
+                ++report->duplicate_ids;
+            }
+        }
+        index_free(&index);
+    }
+    return ret;
+}
@@ -15,8 +15,8 @@
 #include <string.h>
 #include <vips/vips.h>
 
-#define NAME_SIZE 6
-#define CMDS_SIZE 6
+#define NAME_SIZE 8
+#define CMDS_SIZE 8
 
 typedef int (*command)(int argc, char* argv[]);
 
@@ -26,7 +26,8 @@ struct command_mapping {
 } command_mapping;
 
 const struct command_mapping commands[] = {{"list", do_list_cmd}, {"create", do_create_cmd},
-    {"help", help}, {"delete", do_delete_cmd}, {"read", do_read_cmd}, {"insert", do_insert_cmd}
+    {"help", help}, {"delete", do_delete_cmd}, {"read", do_read_cmd}, {"insert", do_insert_cmd},
+    {"verify", do_verify_cmd}, {"addshard", do_addshard_cmd}
 };
 
 
@@ -7,11 +7,14 @@
 
 #include "imgfs.h"
 #include "imgfscmd_functions.h"
+#include "imgfs_index.h"
+#include "imgfs_shards.h"
 #include "util.h"   // for _unused
 
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h> // sysconf
 
 // default values
 static const uint32_t default_max_files = 128;
@@ -27,6 +30,73 @@ static void create_name(const char* img_id, int resolution, char** new_name);
 static int write_disk_image(const char *filename, const char *image_buffer, uint32_t image_size);
 static int read_disk_image(const char *path, char **image_buffer, uint32_t *image_size);
 
+/**********************************************************************
+ * A set of shards (see imgfs_shards.h) is given instead of an imgFS file
+ * by its manifest: the commands then act on the shard of the image.
+ ********************************************************************** */
+struct shard_set {
+    struct imgfs_shards shards;
+    struct imgfs_file files[MAX_SHARDS];
+};
+
+/**********************************************************************
+ * Loads a manifest and opens all its shards.
+ ********************************************************************** */
+static int open_shards(const char* manifest, const char* open_mode, struct shard_set* set)
+{
+    int ret = shards_load(manifest, &set->shards);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    ret = shards_open(&set->shards, open_mode, set->files);
+    if (ret != ERR_NONE) {
+        shards_free(&set->shards);
+    }
+    return ret;
+}
+
+/**********************************************************************
+ * Closes what open_shards() opened.
+ ********************************************************************** */
+static void close_shards(struct shard_set* set)
+{
+    shards_close(set->files, set->shards.nb_shards);
+    shards_free(&set->shards);
+}
+
+/**********************************************************************
+ * Lists a page of the images of a set of shards, merged.
+ ********************************************************************** */
+static int list_shards(const char* manifest, const struct list_page* page)
+{
+    static struct shard_set set;
+    int ret = open_shards(manifest, "rb", &set);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+
+    struct imgfs_index indexes[MAX_SHARDS];
+    const struct imgfs_file* files[MAX_SHARDS];
+    const struct imgfs_index* index_of[MAX_SHARDS];
+    size_t nb_built = 0;
+    while (ret == ERR_NONE && nb_built < set.shards.nb_shards) {
+        ret = index_build(&set.files[nb_built], &indexes[nb_built]);
+        if (ret == ERR_NONE) {
+            files[nb_built] = &set.files[nb_built];
+            index_of[nb_built] = &indexes[nb_built];
+            ++nb_built;
+        }
+    }
+    if (ret == ERR_NONE) {
+        ret = do_list_shards(files, index_of, set.shards.nb_shards, STDOUT, page, NULL);
+    }
+    for (size_t s = 0; s < nb_built; ++s) {
+        index_free(&indexes[s]);
+    }
+    close_shards(&set);
+    return ret;
+}
+
 /**********************************************************************
  * Displays some explanations.
  ********************************************************************** */
@@ -34,7 +104,11 @@ int help()
 {
     printf("imgfscmd [COMMAND] [ARGUMENTS]\n"
            "  help: displays this help.\n"
-           "  list <imgFS_filename>: list imgFS content.\n"
+           "  list <imgFS_filename> [options]: list imgFS content.\n"
+           "      options are:\n"
+           "          -limit <N>: list at most N images, ordered by imgID.\n"
+           "          -cursor <imgID>: list images after imgID (the NEXT CURSOR of the previous page).\n"
+           "          -prefix <PREFIX>: only list imgIDs starting with PREFIX.\n"
            "  create <imgFS_filename> [options]: create a new imgFS.\n"
            "      options are:\n"
            "          -max_files <MAX_FILES>: maximum number of files.\n"
@@ -46,11 +120,19 @@ int help()
            "          -small_res <X_RES> <Y_RES>: resolution for small images.\n"
            "                                  default value is %dx%d\n"
            "                                  maximum value is %dx%d\n"
+           "          -crc32c: store a CRC-32C after each image, checked when read.\n"
+           "          -changelog: log the last changes, for the servers to apply only them.\n"
            "  read   <imgFS_filename> <imgID> [original|orig|thumbnail|thumb|small]:\n"
            "      read an image from the imgFS and save it to a file.\n"
            "      default resolution is \"original\".\n"
            "  insert <imgFS_filename> <imgID> <filename>: insert a new image in the imgFS.\n"
-           "  delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n",
+           "  delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n"
+           "  verify <imgFS_filename> [--repair]: check the consistency of the imgFS.\n"
+           "      --repair: fix the image count of the header.\n"
+           "  addshard <manifest> <imgFS_filename>: add an imgFS to a set of shards,\n"
+           "      and move there the images which now belong to it.\n"
+           "  Every <imgFS_filename> but the one of create may be the manifest of a set of\n"
+           "  shards: a line \"" SHARDS_MAGIC "\", then one imgFS file per line.\n",
            default_max_files, default_thumb_res, default_thumb_res, MAX_THUMB_RES, MAX_THUMB_RES,
            default_small_res, default_small_res, MAX_SMALL_RES, MAX_SMALL_RES);
     return ERR_NONE;
@@ -63,18 +145,68 @@ int do_list_cmd(int argc, char** argv)
 {
     M_REQUIRE_NON_NULL(argv);
 
-    if (argc != 1) {
+    if (argc < 1 || argc % 2 != 1) {
         return ERR_INVALID_COMMAND;
     }
 
     int ret = ERR_NONE;
 
+    // a set of shards is listed by img_id, with or without options
+    if (argc == 1 && shards_is_manifest(argv[0])) {
+        const struct list_page all = {0};
+        return list_shards(argv[0], &all);
+    }
+
+    // without options, keep the plain listing in metadata order
+    if (argc == 1) {
+        struct imgfs_file db = {0};
+        ret = do_open(argv[0], "rb", &db);
+        if (ret == ERR_NONE) {
+            ret = do_list(&db, STDOUT, NULL);
+            do_close(&db);
+        }
+        return ret;
+    }
+
+    const char* filename = argv[0];
+    argc--; argv++;
+
+    struct list_page page = {0};
+    while (argc > 0) {
+        if (!strcmp(argv[0], "-limit")) {
+            page.limit = atouint32(argv[1]);
+            if (!page.limit) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else if (!strcmp(argv[0], "-cursor")) {
+            page.cursor = argv[1];
+        } else if (!strcmp(argv[0], "-prefix")) {
+            page.prefix = argv[1];
+        } else {
+            return ERR_INVALID_COMMAND;
+        }
+
+        // skip flag and its parameter
+        argc -= 2; argv += 2;
+    }
+
+    if (shards_is_manifest(filename)) {
+        return list_shards(filename, &page);
+    }
+
     struct imgfs_file db = {0};
-    ret = do_open(argv[0], "rb", &db);
+    ret = do_open(filename, "rb", &db);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+
+    struct imgfs_index index;
+    ret = index_build(&db, &index);
     if (ret == ERR_NONE) {
-        ret = do_list(&db, STDOUT, NULL);
-        do_close(&db);
+        ret = do_list_page(&db, &index, STDOUT, &page, NULL);
+        index_free(&index);
     }
+    do_close(&db);
     return ret;
 }
 
@@ -175,6 +307,20 @@ int do_create_cmd(int argc, char** argv)
             // skip flag parameter(s)
             argc -= 2; argv += 2;
 
+        } else if (!strcmp(argv[0], "-crc32c")) {
+
+            db.header.flags |= IMGFS_CRC32C;
+
+            // skip flag
+            argc--; argv++;
+
+        } else if (!strcmp(argv[0], "-changelog")) {
+
+            db.header.flags |= IMGFS_CHANGELOG;
+
+            // skip flag
+            argc--; argv++;
+
         } else {
             filename = NULL;
             return ERR_INVALID_ARGUMENT;
@@ -209,13 +355,26 @@ int do_delete_cmd(int argc, char** argv)
         return ERR_INVALID_IMGID;
     }
 
+    if (shards_is_manifest(argv[0])) {
+        static struct shard_set set;
+        ret = open_shards(argv[0], "rb+", &set);
+        size_t shard = 0;
+        uint32_t slot = 0;
+        if (ret == ERR_NONE) {
+            ret = shards_find(&set.shards, set.files, argv[1], &shard, &slot);
+            if (ret == ERR_NONE) {
+                ret = do_delete(argv[1], &set.files[shard]);
+            }
+            close_shards(&set);
+        }
+        return ret;
+    }
+
     struct imgfs_file db;
     ret = do_open(argv[0], "rb+", &db);
     if(ret == ERR_NONE) {
         ret = do_delete(argv[1], &db);
-        if (ret == ERR_NONE) {
-            do_close(&db);
-        }
+        do_close(&db);
     }
     return ret;
 }
@@ -233,15 +392,28 @@ int do_read_cmd(int argc, char **argv)
     const int resolution = (argc == 3) ? resolution_atoi(argv[2]) : ORIG_RES;
     if (resolution == -1) return ERR_RESOLUTIONS;
 
-    struct imgfs_file myfile;
-    zero_init_var(myfile);
-    int error = do_open(argv[0], "rb+", &myfile);
-    if (error != ERR_NONE) return error;
-
     char *image_buffer = NULL;
     uint32_t image_size = 0;
-    error = do_read(img_id, resolution, &image_buffer, &image_size, &myfile);
-    do_close(&myfile);
+    int error = ERR_NONE;
+    if (shards_is_manifest(argv[0])) {
+        static struct shard_set set;
+        error = open_shards(argv[0], "rb+", &set);
+        if (error != ERR_NONE) return error;
+        size_t shard = 0;
+        uint32_t slot = 0;
+        error = shards_find(&set.shards, set.files, img_id, &shard, &slot);
+        if (error == ERR_NONE) {
+            error = do_read(img_id, resolution, &image_buffer, &image_size, &set.files[shard]);
+        }
+        close_shards(&set);
+    } else {
+        struct imgfs_file myfile;
+        zero_init_var(myfile);
+        error = do_open(argv[0], "rb+", &myfile);
+        if (error != ERR_NONE) return error;
+        error = do_read(img_id, resolution, &image_buffer, &image_size, &myfile);
+        do_close(&myfile);
+    }
     if (error != ERR_NONE) {
         return error;
     }
@@ -258,6 +430,34 @@ int do_read_cmd(int argc, char **argv)
 }
 
 
+/********************************************************************
+ * Inserts an image into the shard it belongs to, unless it is in any.
+ *******************************************************************/
+static int insert_into_shards(const char* manifest, const char* img_id, const char* path)
+{
+    static struct shard_set set;
+    int error = open_shards(manifest, "rb+", &set);
+    if (error != ERR_NONE) return error;
+
+    size_t shard = 0;
+    uint32_t slot = 0;
+    error = shards_find(&set.shards, set.files, img_id, &shard, &slot);
+    if (error == ERR_NONE) {
+        error = ERR_DUPLICATE_ID;
+    } else if (error == ERR_IMAGE_NOT_FOUND) {
+        char *image_buffer = NULL;
+        uint32_t image_size;
+        error = read_disk_image(path, &image_buffer, &image_size);
+        if (error == ERR_NONE) {
+            shard = shards_locate(&set.shards, img_id);
+            error = do_insert(image_buffer, image_size, img_id, &set.files[shard]);
+            free(image_buffer);
+        }
+    }
+    close_shards(&set);
+    return error;
+}
+
 /********************************************************************
  * Inserts an image into the imgFS.
  *******************************************************************/
@@ -266,6 +466,10 @@ int do_insert_cmd(int argc, char **argv)
     M_REQUIRE_NON_NULL(argv);
     if (argc != 3) return ERR_NOT_ENOUGH_ARGUMENTS;
 
+    if (shards_is_manifest(argv[0])) {
+        return insert_into_shards(argv[0], argv[1], argv[2]);
+    }
+
     struct imgfs_file myfile;
     zero_init_var(myfile);
     int error = do_open(argv[0], "rb+", &myfile);
@@ -287,6 +491,70 @@ int do_insert_cmd(int argc, char **argv)
 }
 
 
+/********************************************************************
+ * Checks the consistency of an imgFS.
+ *******************************************************************/
+int do_verify_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc < 1) return ERR_NOT_ENOUGH_ARGUMENTS;
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "--repair"))) return ERR_INVALID_ARGUMENT;
+    const int repair = argc == 2;
+
+    // a set of shards is verified shard by shard
+    static struct shard_set set;
+    struct imgfs_file myfile;
+    zero_init_var(myfile);
+    const int sharded = shards_is_manifest(argv[0]);
+    int error = sharded ? open_shards(argv[0], repair ? "rb+" : "rb", &set)
+                : do_open(argv[0], repair ? "rb+" : "rb", &myfile);
+    if (error != ERR_NONE) return error;
+    const size_t nb_files = sharded ? set.shards.nb_shards : 1;
+
+    // one hashing thread per CPU: the reads are large enough to keep the disk busy
+    const long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t problems = 0;
+    uint32_t repaired = 0;
+    for (size_t s = 0; error == ERR_NONE && s < nb_files; ++s) {
+        struct verify_report report;
+        error = do_verify(sharded ? &set.files[s] : &myfile, nb_cpus > 0 ? (size_t) nb_cpus : 1,
+                          repair, &report);
+        if (error != ERR_NONE) break;
+
+        const uint32_t file_problems = report.bad_nb_files + report.bad_ids + report.duplicate_ids +
+                                       report.out_of_bounds + report.overlaps + report.bad_sha +
+                                       report.bad_crc;
+        if (sharded) printf("%s: ", set.shards.paths[s]);
+        printf("%u valid images, %" PRIu64 " bytes hashed: %u problem(s), %u repaired\n",
+               report.nb_valid, report.bytes_hashed, file_problems, report.repaired);
+        problems += file_problems;
+        repaired += report.repaired;
+    }
+    if (sharded) {
+        close_shards(&set);
+    } else {
+        do_close(&myfile);
+    }
+    if (error != ERR_NONE) return error;
+    return problems > repaired ? ERR_CORRUPT_IMGFS : ERR_NONE;
+}
+
+/********************************************************************
+ * Adds a shard to a set, and moves the images which now belong to it.
+ *******************************************************************/
+int do_addshard_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc != 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    size_t moved = 0;
+    const int error = shards_add(argv[0], argv[1], &moved);
+    if (error == ERR_NONE) {
+        printf("%zu image(s) moved\n", moved);
+    }
+    return error;
+}
+
 /********************************************************************
  * Writes name of the file used for image reading in a buffer
  *******************************************************************/
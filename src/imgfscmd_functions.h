@@ -36,3 +36,13 @@ int do_insert_cmd(int argc, char* argv[]);
  * Reads an image from the imgFS.
  *******************************************************************/
 int do_read_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Checks the consistency of an imgFS (and repairs its header counts).
+ *******************************************************************/
+int do_verify_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Adds a shard to a set, and moves the images which now belong to it.
+ *******************************************************************/
+int do_addshard_cmd(int argc, char* argv[]);
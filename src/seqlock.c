@@ -0,0 +1,84 @@
+/**
+ * @file seqlock.c
+ * @brief Sequence counters, for readers which take no lock.
+ */
+
+#include <sched.h>
+#include <string.h>
+
+#include "seqlock.h"
+
+#define SEQ_SPINS 128 // busy waits for a writer before yielding the CPU
+
+/**
+ * @brief Starts a read: waits for no write to be in progress
+ *
+ * @param seq (const uint32_t*): Given sequence counter
+ * @return (uint32_t): The (even) value of the counter
+ */
+uint32_t seq_read_begin(const uint32_t* seq)
+{
+    unsigned spins = 0;
+    uint32_t start = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    while (start & 1) {
+        // writes are short (a few stores): spinning is cheaper than sleeping, for a while
+        if (++spins % SEQ_SPINS == 0) {
+            sched_yield();
+        }
+        start = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    }
+    return start;
+}
+
+/**
+ * @brief Ends a read: tells whether a write happened since seq_read_begin()
+ *
+ * @param seq (const uint32_t*): Given sequence counter
+ * @param start (uint32_t): Given value returned by seq_read_begin()
+ * @return (int): 1 if what was read must be read again, 0 otherwise
+ */
+int seq_read_retry(const uint32_t* seq, uint32_t start)
+{
+    // the reads of the data are not to be moved after the load of the counter
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+/**
+ * @brief Copies data protected by a counter, until the copy is consistent
+ *
+ * @param seq (const uint32_t*): Given sequence counter
+ * @param dst (void*): Given destination of the copy
+ * @param src (const void*): Given data, which writers may be changing
+ * @param size (size_t): Given size of the data
+ */
+void seq_read_copy(const uint32_t* seq, void* dst, const void* src, size_t size)
+{
+    uint32_t start = 0;
+    do {
+        start = seq_read_begin(seq);
+        memcpy(dst, src, size);
+    } while (seq_read_retry(seq, start));
+}
+
+/**
+ * @brief Starts a write, making the counter odd
+ *
+ * @param seq (uint32_t*): Given sequence counter
+ */
+void seq_write_begin(uint32_t* seq)
+{
+    __atomic_store_n(seq, __atomic_load_n(seq, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    // the stores to the data are not to be moved before the counter is odd
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Ends a write, making the counter even again
+ *
+ * @param seq (uint32_t*): Given sequence counter
+ */
+void seq_write_end(uint32_t* seq)
+{
+    __atomic_store_n(seq, __atomic_load_n(seq, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,56 @@
+/**
+ * @file seqlock.h
+ * @brief Sequence counters, for readers which take no lock.
+ *
+ * A writer makes the counter odd while it changes the data it protects,
+ * then even again. A reader copies the data without any lock and keeps
+ * its copy only if the counter was the same even value before and after:
+ * otherwise a writer was in between, and it reads again. Readers thus
+ * never wait for one another nor make writers wait; they only retry,
+ * seldom, when a write happened meanwhile.
+ *
+ * The writers of a counter must be serialised by the caller (e.g. by a
+ * mutex), and the data must stay readable (not freed) during the writes.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Starts a read: waits for no write to be in progress.
+ *
+ * @return The value to give to seq_read_retry().
+ */
+uint32_t seq_read_begin(const uint32_t* seq);
+
+/**
+ * @brief Ends a read: tells whether a write happened since seq_read_begin().
+ *
+ * @return 1 if what was read must be thrown away (and read again), 0 if it is consistent.
+ */
+int seq_read_retry(const uint32_t* seq, uint32_t start);
+
+/**
+ * @brief Copies data protected by `seq`, retrying until the copy is consistent.
+ */
+void seq_read_copy(const uint32_t* seq, void* dst, const void* src, size_t size);
+
+/**
+ * @brief Starts a write: the readers retry until seq_write_end().
+ */
+void seq_write_begin(uint32_t* seq);
+
+/**
+ * @brief Ends a write.
+ */
+void seq_write_end(uint32_t* seq);
+
+#ifdef __cplusplus
+}
+#endif
@@ -5,7 +5,7 @@
 #include "socket_layer.h"
 #include "error.h"
 
-int tcp_server_init(uint16_t port)
+static int server_init(uint16_t port, int shared)
 {
     int tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (tcp_socket == -1) {
@@ -13,6 +13,15 @@ int tcp_server_init(uint16_t port)
         return ERR_IO;
     }
 
+    // every listener of a shared port has to set SO_REUSEPORT before binding
+    const int on = 1;
+    if (shared && (setsockopt(tcp_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+                   setsockopt(tcp_socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)) {
+        perror("sharing stream socket");
+        close(tcp_socket);
+        return ERR_IO;
+    }
+
     struct sockaddr_in sin = {AF_INET, htons(port), htonl(INADDR_LOOPBACK)};
 
     if (bind(tcp_socket, (struct sockaddr *) &sin, sizeof sin) == -1) {
@@ -31,6 +40,42 @@ int tcp_server_init(uint16_t port)
     return tcp_socket;
 }
 
+int tcp_server_init(uint16_t port)
+{
+    return server_init(port, 0);
+}
+
+/**
+ * @brief Same as tcp_server_init(), on a port that other listeners can share
+ */
+int tcp_server_init_shared(uint16_t port)
+{
+    return server_init(port, 1);
+}
+
+/**
+ * @brief Opens a TCP connection to the given port of the loopback interface
+ */
+int tcp_client_init(uint16_t port)
+{
+    int tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (tcp_socket == -1) {
+        return ERR_IO;
+    }
+
+    struct sockaddr_in sin = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr = { .s_addr = htonl(INADDR_LOOPBACK) }
+    };
+
+    if (connect(tcp_socket, (struct sockaddr *) &sin, sizeof sin) == -1) {
+        close(tcp_socket);
+        return ERR_IO;
+    }
+    return tcp_socket;
+}
+
 /**
  * @brief Blocking call that accepts a new TCP connection
  */
@@ -13,6 +13,21 @@
 
 int tcp_server_init(uint16_t port);
 
+/**
+ * @brief Same as tcp_server_init(), but with SO_REUSEPORT: several sockets
+ *        (e.g. one per thread) can listen on the same port, and the kernel
+ *        spreads the incoming connections among them.
+ */
+int tcp_server_init_shared(uint16_t port);
+
+/**
+ * @brief Opens a TCP connection to `port` on the loopback interface.
+ *
+ * @return the connected socket, or ERR_IO (without printing anything, as
+ *         clients may retry).
+ */
+int tcp_client_init(uint16_t port);
+
 /**
  * @brief Blocking call that accepts a new TCP connection
  */
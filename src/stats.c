@@ -0,0 +1,353 @@
+/**
+ * @file stats.c
+ * @brief Request metrics of the server: counters and latency histograms.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h> // PRIu64
+#include <json-c/json.h>
+
+#include "stats.h"
+
+static const char* const op_names[NB_STATS_OPS] = {
+    [STATS_LIST] = "list",
+    [STATS_READ_THUMB] = "read_thumb",
+    [STATS_READ_SMALL] = "read_small",
+    [STATS_READ_ORIG] = "read_orig",
+    [STATS_RESIZE] = "resize",
+    [STATS_INSERT] = "insert",
+    [STATS_DELETE] = "delete",
+    [STATS_BATCH] = "batch",
+    [STATS_OTHER] = "other",
+};
+
+#define ERR_NAME(code) [(code) - ERR_FIRST] = #code
+static const char* const error_names[ERR_LAST - ERR_FIRST] = {
+    ERR_NAME(ERR_IO),
+    ERR_NAME(ERR_RUNTIME),
+    ERR_NAME(ERR_OUT_OF_MEMORY),
+    ERR_NAME(ERR_NOT_ENOUGH_ARGUMENTS),
+    ERR_NAME(ERR_INVALID_FILENAME),
+    ERR_NAME(ERR_INVALID_COMMAND),
+    ERR_NAME(ERR_INVALID_ARGUMENT),
+    ERR_NAME(ERR_THREADING),
+    ERR_NAME(ERR_MAX_FILES),
+    ERR_NAME(ERR_RESOLUTIONS),
+    ERR_NAME(ERR_INVALID_IMGID),
+    ERR_NAME(ERR_IMGFS_FULL),
+    ERR_NAME(ERR_IMAGE_NOT_FOUND),
+    ERR_NAME(NOT_IMPLEMENTED),
+    ERR_NAME(ERR_DUPLICATE_ID),
+    ERR_NAME(ERR_IMGLIB),
+    ERR_NAME(ERR_DEBUG),
+    ERR_NAME(ERR_BUSY),
+    ERR_NAME(ERR_CORRUPT_IMGFS),
+};
+
+#define QUANTILES { 0.5, 0.99, 0.999 }
+static const double quantiles[] = QUANTILES;
+static const char* const quantile_names[] = { "p50", "p99", "p999" };
+#define NB_QUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+#define ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+/**
+ * @brief Gives the histogram bucket of a latency: exact below
+ *        2 * STATS_SUB_BUCKETS, then STATS_SUB_BUCKETS buckets per power of two
+ *
+ * @param value (uint64_t): Given latency
+ * @return (size_t): Its bucket
+ */
+static size_t bucket_of(uint64_t value)
+{
+    if (value < STATS_SUB_BUCKETS) {
+        return (size_t) value;
+    }
+    const int shift = 63 - __builtin_clzll(value);
+    if (shift > STATS_MAX_SHIFT) {
+        return STATS_BUCKETS - 1;
+    }
+    return (size_t) (shift - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS +
+           (size_t) ((value >> (shift - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+}
+
+/**
+ * @brief Gives the highest latency that falls in a bucket
+ *
+ * @param bucket (size_t): Given bucket
+ * @return (uint64_t): The latency
+ */
+static uint64_t bucket_high(size_t bucket)
+{
+    if (bucket < STATS_SUB_BUCKETS) {
+        return bucket;
+    }
+    const size_t group = bucket / STATS_SUB_BUCKETS;
+    const uint64_t low = (uint64_t) (STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << (group - 1);
+    return low + ((uint64_t) 1 << (group - 1)) - 1;
+}
+
+/**
+ * @brief Accounts one request to an operation
+ *
+ * @param stats (struct stats*): Given metrics
+ * @param op (enum stats_op): Given operation
+ * @param latency_us (uint64_t): Given latency of the request, in microseconds
+ * @param bytes_in (size_t): Given size of the request body
+ * @param bytes_out (size_t): Given size of the reply
+ * @param error (int): Given error code of the request
+ */
+void stats_record(struct stats* stats, enum stats_op op, uint64_t latency_us,
+                  size_t bytes_in, size_t bytes_out, int error)
+{
+    if (stats == NULL || op >= NB_STATS_OPS) {
+        return;
+    }
+    struct stats_counters* const counters = &stats->ops[op];
+
+    ADD(counters->requests, 1);
+    ADD(counters->bytes_in, bytes_in);
+    ADD(counters->bytes_out, bytes_out);
+    ADD(counters->latency_sum, latency_us);
+    ADD(counters->latency[bucket_of(latency_us)], 1);
+
+    uint64_t max = LOAD(counters->latency_max);
+    while (latency_us > max &&
+           !__atomic_compare_exchange_n(&counters->latency_max, &max, latency_us, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (error != ERR_NONE) {
+        ADD(counters->errors, 1);
+        if (ERR_FIRST < error && error < ERR_LAST) {
+            ADD(stats->errors_by_code[error - ERR_FIRST], 1);
+        }
+    }
+}
+
+/**
+ * @brief Gives the latency below which the given share of the requests took
+ *
+ * @param stats (const struct stats*): Given metrics
+ * @param op (enum stats_op): Given operation
+ * @param quantile (double): Given share of the requests, between 0 and 1
+ * @return (uint64_t): The latency in microseconds, 0 if there was no request
+ */
+uint64_t stats_percentile(const struct stats* stats, enum stats_op op, double quantile)
+{
+    if (stats == NULL || op >= NB_STATS_OPS) {
+        return 0;
+    }
+    const struct stats_counters* const counters = &stats->ops[op];
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < STATS_BUCKETS; ++i) {
+        total += LOAD(counters->latency[i]);
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t) (quantile * (double) total + 0.5);
+    rank = rank == 0 ? 1 : (rank > total ? total : rank);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_BUCKETS; ++i) {
+        seen += LOAD(counters->latency[i]);
+        if (seen >= rank) {
+            // the bucket bound may exceed what was actually seen
+            const uint64_t high = bucket_high(i);
+            const uint64_t max = LOAD(counters->latency_max);
+            return high < max ? high : max;
+        }
+    }
+    return LOAD(counters->latency_max);
+}
+
+/**
+ * @brief Gives the name of an operation
+ *
+ * @param op (enum stats_op): Given operation
+ * @return (const char*): Its name, "?" if out of range
+ */
+const char* stats_op_name(enum stats_op op)
+{
+    return op < NB_STATS_OPS ? op_names[op] : "?";
+}
+
+/**
+ * @brief Writes the metrics as a JSON object
+ *
+ * @param stats (const struct stats*): Given metrics
+ * @param json (char**): Given pointer to write the text to
+ * @return (int): Error code
+ */
+int stats_to_json(const struct stats* stats, char** json)
+{
+    M_REQUIRE_NON_NULL(stats);
+    M_REQUIRE_NON_NULL(json);
+
+    struct json_object* root = json_object_new_object();
+    struct json_object* ops = json_object_new_object();
+    struct json_object* errors = json_object_new_object();
+    if (root == NULL || ops == NULL || errors == NULL) {
+        json_object_put(root);
+        json_object_put(ops);
+        json_object_put(errors);
+        return ERR_OUT_OF_MEMORY;
+    }
+    json_object_object_add(root, "operations", ops);
+    json_object_object_add(root, "errors", errors);
+
+    for (int op = 0; op < NB_STATS_OPS; ++op) {
+        const struct stats_counters* const counters = &stats->ops[op];
+        struct json_object* const entry = json_object_new_object();
+        struct json_object* const latency = json_object_new_object();
+        if (entry == NULL || latency == NULL) {
+            json_object_put(entry);
+            json_object_put(latency);
+            json_object_put(root);
+            return ERR_OUT_OF_MEMORY;
+        }
+        json_object_object_add(ops, op_names[op], entry);
+
+        json_object_object_add(entry, "requests", json_object_new_int64((int64_t) LOAD(counters->requests)));
+        json_object_object_add(entry, "errors", json_object_new_int64((int64_t) LOAD(counters->errors)));
+        json_object_object_add(entry, "bytes_in", json_object_new_int64((int64_t) LOAD(counters->bytes_in)));
+        json_object_object_add(entry, "bytes_out", json_object_new_int64((int64_t) LOAD(counters->bytes_out)));
+
+        json_object_object_add(entry, "latency_us", latency);
+        for (size_t q = 0; q < NB_QUANTILES; ++q) {
+            json_object_object_add(latency, quantile_names[q],
+                                   json_object_new_int64((int64_t) stats_percentile(stats, (enum stats_op) op,
+                                                                                     quantiles[q])));
+        }
+        json_object_object_add(latency, "max", json_object_new_int64((int64_t) LOAD(counters->latency_max)));
+        json_object_object_add(latency, "sum", json_object_new_int64((int64_t) LOAD(counters->latency_sum)));
+    }
+
+    for (int i = 1; i < ERR_LAST - ERR_FIRST; ++i) {
+        const uint64_t count = LOAD(stats->errors_by_code[i]);
+        if (count > 0 && error_names[i] != NULL) {
+            json_object_object_add(errors, error_names[i], json_object_new_int64((int64_t) count));
+        }
+    }
+
+    *json = strdup(json_object_to_json_string(root));
+    json_object_put(root);
+    return *json == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+}
+
+/**********************************************************************
+ * Prometheus text, appended to a growing buffer.
+ ********************************************************************** */
+struct text {
+    char* buf;
+    size_t len;
+    size_t size;
+    int error;
+};
+
+#define TEXT_INITIAL_SIZE 4096
+
+/**
+ * @brief Appends formatted text, growing the buffer as needed
+ *
+ * @param text (struct text*): Given buffer; its error is set if out of memory
+ * @param fmt (const char*): Given printf format
+ */
+static void text_printf(struct text* text, const char* fmt, ...)
+{
+    while (text->error == ERR_NONE) {
+        va_list args;
+        va_start(args, fmt);
+        const int n = vsnprintf(text->buf + text->len, text->size - text->len, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            text->error = ERR_RUNTIME;
+        } else if ((size_t) n < text->size - text->len) {
+            text->len += (size_t) n;
+            return;
+        } else {
+            const size_t size = 2 * text->size + (size_t) n;
+            char* const buf = realloc(text->buf, size);
+            if (buf == NULL) {
+                text->error = ERR_OUT_OF_MEMORY;
+            } else {
+                text->buf = buf;
+                text->size = size;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Appends one counter of every operation
+ */
+static void text_counter(struct text* text, const struct stats* stats, const char* name,
+                         const char* help, size_t field)
+{
+    text_printf(text, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int op = 0; op < NB_STATS_OPS; ++op) {
+        const uint64_t* const counter = (const uint64_t*) ((const char*) &stats->ops[op] + field);
+        text_printf(text, "%s{op=\"%s\"} %" PRIu64 "\n", name, op_names[op], LOAD(*counter));
+    }
+}
+
+/**
+ * @brief Writes the metrics in the Prometheus text exposition format
+ *
+ * @param stats (const struct stats*): Given metrics
+ * @param out (char**): Given pointer to write the text to
+ * @return (int): Error code
+ */
+int stats_to_prometheus(const struct stats* stats, char** out)
+{
+    M_REQUIRE_NON_NULL(stats);
+    M_REQUIRE_NON_NULL(out);
+
+    struct text text = { malloc(TEXT_INITIAL_SIZE), 0, TEXT_INITIAL_SIZE, ERR_NONE };
+    if (text.buf == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    text_counter(&text, stats, "imgfs_requests_total", "Requests handled.",
+                 offsetof(struct stats_counters, requests));
+    text_counter(&text, stats, "imgfs_request_errors_total", "Requests that failed.",
+                 offsetof(struct stats_counters, errors));
+    text_counter(&text, stats, "imgfs_received_bytes_total", "Bytes of request bodies.",
+                 offsetof(struct stats_counters, bytes_in));
+    text_counter(&text, stats, "imgfs_sent_bytes_total", "Bytes of replies.",
+                 offsetof(struct stats_counters, bytes_out));
+
+#define LATENCY "imgfs_request_latency_microseconds"
+    text_printf(&text, "# HELP " LATENCY " Time to answer a request.\n# TYPE " LATENCY " summary\n");
+    for (int op = 0; op < NB_STATS_OPS; ++op) {
+        for (size_t q = 0; q < NB_QUANTILES; ++q) {
+            text_printf(&text, LATENCY "{op=\"%s\",quantile=\"%g\"} %" PRIu64 "\n", op_names[op], quantiles[q],
+                        stats_percentile(stats, (enum stats_op) op, quantiles[q]));
+        }
+        text_printf(&text, LATENCY "_sum{op=\"%s\"} %" PRIu64 "\n", op_names[op],
+                    LOAD(stats->ops[op].latency_sum));
+        text_printf(&text, LATENCY "_count{op=\"%s\"} %" PRIu64 "\n", op_names[op],
+                    LOAD(stats->ops[op].requests));
+    }
+
+    text_printf(&text, "# HELP imgfs_errors_total Failed requests, by error code.\n"
+                "# TYPE imgfs_errors_total counter\n");
+    for (int i = 1; i < ERR_LAST - ERR_FIRST; ++i) {
+        if (error_names[i] != NULL) {
+            text_printf(&text, "imgfs_errors_total{code=\"%s\"} %" PRIu64 "\n", error_names[i],
+                        LOAD(stats->errors_by_code[i]));
+        }
+    }
+
+    if (text.error != ERR_NONE) {
+        free(text.buf);
+        return text.error;
+    }
+    *out = text.buf;
+    return ERR_NONE;
+}
@@ -0,0 +1,103 @@
+/**
+ * @file stats.h
+ * @brief Request metrics of the server: counters and latency histograms.
+ *
+ * Every request is accounted to one operation. Recording only does relaxed
+ * atomic increments, so that threads never wait on one another for it; a
+ * snapshot taken while requests run may thus be off by the few requests in
+ * flight. Latencies go to log-linear (HDR-style) histograms: STATS_SUB_BITS
+ * bits of precision, i.e. a relative error below 1 / 2^STATS_SUB_BITS.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+
+#include "error.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum stats_op {
+    STATS_LIST,
+    STATS_READ_THUMB, // reads, one per resolution (in the order of THUMB_RES...)
+    STATS_READ_SMALL,
+    STATS_READ_ORIG,
+    STATS_RESIZE,     // reads of a resolution not created yet
+    STATS_INSERT,
+    STATS_DELETE,
+    STATS_BATCH,      // batch reads of several images
+    STATS_OTHER,      // index page, stats, unknown routes
+    NB_STATS_OPS
+};
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_SHIFT 40 // latencies are clamped to 2^40 us (12 days)
+#define STATS_BUCKETS ((STATS_MAX_SHIFT - STATS_SUB_BITS + 2) * STATS_SUB_BUCKETS)
+
+struct stats_counters {
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes_in;   // request bodies
+    uint64_t bytes_out;  // replies, headers included
+    uint64_t latency_sum;                // in microseconds
+    uint64_t latency_max;
+    uint64_t latency[STATS_BUCKETS];     // histogram, in microseconds
+};
+
+struct stats {
+    struct stats_counters ops[NB_STATS_OPS];
+    uint64_t errors_by_code[ERR_LAST - ERR_FIRST];
+};
+
+/**
+ * @brief Accounts one request to operation `op`.
+ *
+ * @param stats The metrics
+ * @param op The operation
+ * @param latency_us How long it took, in microseconds
+ * @param bytes_in The size of the request body
+ * @param bytes_out The size of the reply
+ * @param error Its error code, ERR_NONE if it succeeded
+ */
+void stats_record(struct stats* stats, enum stats_op op, uint64_t latency_us,
+                  size_t bytes_in, size_t bytes_out, int error);
+
+/**
+ * @brief Gives the latency below which `quantile` of the requests of `op` took.
+ *
+ * @return the latency in microseconds (the highest value of its bucket),
+ *         0 if there was no request.
+ */
+uint64_t stats_percentile(const struct stats* stats, enum stats_op op, double quantile);
+
+/**
+ * @brief Gives the name of operation `op` (as in the JSON and Prometheus
+ *        outputs), "?" if out of range.
+ */
+const char* stats_op_name(enum stats_op op);
+
+/**
+ * @brief Writes the metrics as a JSON object.
+ *
+ * @param stats The metrics
+ * @param json Where to put the text, to be freed by the caller
+ * @return Some error code. 0 if no error.
+ */
+int stats_to_json(const struct stats* stats, char** json);
+
+/**
+ * @brief Writes the metrics in the Prometheus text exposition format.
+ *
+ * @param stats The metrics
+ * @param text Where to put the text, to be freed by the caller
+ * @return Some error code. 0 if no error.
+ */
+int stats_to_prometheus(const struct stats* stats, char** text);
+
+#ifdef __cplusplus
+}
+#endif
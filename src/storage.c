@@ -0,0 +1,176 @@
+/**
+ * @file storage.c
+ * @brief Choice of the storage backend, and the stdio one.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h> // pread, fdatasync
+
+#include "error.h"
+#include "storage.h"
+
+static const struct storage_ops* backend = &stdio_storage;
+
+/**********************************************************************
+ * stdio: the writes are buffered by the FILE of the imgFS, which is
+ * flushed before reading from its descriptor: unlike fseek() and fread(),
+ * pread() can be called by several threads at once.
+ ********************************************************************** */
+
+/**
+ * @brief Reads exactly `size` bytes at `offset` of a file descriptor
+ *
+ * @param fd (int): Given file descriptor
+ * @param offset (uint64_t): Given offset in the file
+ * @param buf (void*): Given buffer of at least size bytes
+ * @param size (size_t): Given number of bytes
+ * @return (int): Error code
+ */
+static int pread_fully(int fd, uint64_t offset, void* buf, size_t size)
+{
+    char* dst = buf;
+    while (size > 0) {
+        const ssize_t n = pread(fd, dst, size, (off_t) offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return ERR_IO;
+        }
+        dst += n;
+        size -= (size_t) n;
+        offset += (uint64_t) n;
+    }
+    return ERR_NONE;
+}
+
+static int stdio_read(struct imgfs_file* imgfs_file, uint64_t offset, void* buf, size_t size)
+{
+    if (fflush(imgfs_file->file) != 0) {
+        return ERR_IO;
+    }
+    return pread_fully(fileno(imgfs_file->file), offset, buf, size);
+}
+
+static int stdio_write(struct imgfs_file* imgfs_file, uint64_t offset, const void* buf, size_t size)
+{
+    if (fseeko(imgfs_file->file, (off_t) offset, SEEK_SET) != 0 ||
+        (size > 0 && fwrite(buf, size, 1, imgfs_file->file) != 1)) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+static int stdio_end(struct imgfs_file* imgfs_file, uint64_t* end)
+{
+    if (fseeko(imgfs_file->file, 0, SEEK_END) != 0) {
+        return ERR_IO;
+    }
+    const off_t pos = ftello(imgfs_file->file);
+    if (pos < 0) {
+        return ERR_IO;
+    }
+    *end = (uint64_t) pos;
+    return ERR_NONE;
+}
+
+static int stdio_flush(struct imgfs_file* imgfs_file)
+{
+    return fflush(imgfs_file->file) == 0 ? ERR_NONE : ERR_IO;
+}
+
+static int stdio_sync(struct imgfs_file* imgfs_file)
+{
+    if (fflush(imgfs_file->file) != 0 || fdatasync(fileno(imgfs_file->file)) != 0) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+const struct storage_ops stdio_storage = {
+    "stdio", NULL, NULL, stdio_read, stdio_write, stdio_end, stdio_flush, stdio_sync, NULL, NULL
+};
+
+/**********************************************************************
+ * Choice of the backend.
+ ********************************************************************** */
+int storage_use(const char* name, const struct imgfs_file* imgfs_file)
+{
+    const struct storage_ops* chosen = NULL;
+    if (name == NULL || !strcmp(name, stdio_storage.name)) {
+        chosen = &stdio_storage;
+    } else if (!strcmp(name, uring_storage.name)) {
+        chosen = &uring_storage;
+    } else {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    storage_release();
+    if (chosen->open != NULL) {
+        const int ret = chosen->open(imgfs_file);
+        if (ret != ERR_NONE) {
+            return ret;
+        }
+    }
+    backend = chosen;
+    return ERR_NONE;
+}
+
+int storage_register(const struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    return backend->add_file != NULL ? backend->add_file(imgfs_file) : ERR_NONE;
+}
+
+void storage_release(void)
+{
+    if (backend->close != NULL) {
+        backend->close();
+    }
+    backend = &stdio_storage;
+}
+
+const struct storage_ops* storage_current(void)
+{
+    return backend;
+}
+
+int storage_read(struct imgfs_file* imgfs_file, uint64_t offset, void* buf, size_t size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(buf);
+    return backend->read(imgfs_file, offset, buf, size);
+}
+
+int storage_write(struct imgfs_file* imgfs_file, uint64_t offset, const void* buf, size_t size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(buf);
+    return backend->write(imgfs_file, offset, buf, size);
+}
+
+int storage_end(struct imgfs_file* imgfs_file, uint64_t* end)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(end);
+    return backend->end(imgfs_file, end);
+}
+
+int storage_flush(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    return backend->flush(imgfs_file);
+}
+
+int storage_sync(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    return backend->sync(imgfs_file);
+}
@@ -0,0 +1,127 @@
+/**
+ * @file storage.h
+ * @brief Storage backends: how the blobs and metadata of an imgFS file are
+ *        read and written.
+ *
+ * All the positioned I/O of the library goes through the backend in use,
+ * chosen once for the whole process (before any thread uses it):
+ *  - "stdio" (default): writes through the stdio FILE of the imgFS, reads
+ *    with pread() once that FILE is flushed;
+ *  - "io_uring": one ring shared by all the threads, to which each request
+ *    adds its operations; whichever thread finds the ring idle submits
+ *    everything queued so far with a single system call, so that the I/O
+ *    of concurrent requests goes to the kernel in batches. The imgFS files
+ *    (up to URING_FIXED_FILES of them, the others being used through their
+ *    descriptors) and a pool of buffers are registered with the ring, and
+ *    a blob can be sent on a socket by a read linked to a send, without any
+ *    round trip through the calling thread.
+ */
+
+#pragma once
+
+#include <stddef.h>    // for size_t
+#include <stdint.h>    // for uint64_t
+#include <sys/types.h> // for off_t
+
+#include "imgfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief The operations of a backend. read may be called by several threads
+ *        at once; the writes are the caller's to serialise.
+ */
+struct storage_ops {
+    const char* name;
+    // sets the backend up, with the file most I/O will be on (may be NULL)
+    int (*open)(const struct imgfs_file* imgfs_file);
+    void (*close)(void);
+    int (*read)(struct imgfs_file* imgfs_file, uint64_t offset, void* buf, size_t size);
+    int (*write)(struct imgfs_file* imgfs_file, uint64_t offset, const void* buf, size_t size);
+    int (*end)(struct imgfs_file* imgfs_file, uint64_t* end);
+    // makes the writes visible to readers of the file descriptor
+    int (*flush)(struct imgfs_file* imgfs_file);
+    // and durable
+    int (*sync)(struct imgfs_file* imgfs_file);
+    // sends a slice of the file on a socket, NULL to let the caller use sendfile()
+    int (*send)(int socket, int fd, off_t offset, size_t size);
+    // registers one more file I/O will be on, NULL if the backend has no use for it
+    int (*add_file)(const struct imgfs_file* imgfs_file);
+};
+
+#define URING_FIXED_FILES 1024 // files registered with the io_uring ring, at most
+
+extern const struct storage_ops stdio_storage;  // storage.c
+extern const struct storage_ops uring_storage;  // storage_uring.c
+
+/**
+ * @brief Switches to a backend (closing the previous one).
+ *
+ * @param name "stdio" or "io_uring" (NULL for "stdio")
+ * @param imgfs_file The file most I/O will be on, for the backend to register it (may be NULL)
+ * @return Some error code (ERR_INVALID_ARGUMENT for an unknown name, ERR_IO if
+ *         the system does not provide it); "stdio" is then in use.
+ */
+int storage_use(const char* name, const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Registers one more file with the backend in use (after the one
+ *        given to storage_use()), for its I/O to be cheaper. The file is
+ *        to stay open as long as the backend is in use.
+ *
+ * @return Some error code (ERR_MAX_FILES if the backend cannot take more,
+ *         ERR_IO if the system refused); the file can be used either way.
+ *         0 if no error, or if the backend has nothing to register.
+ */
+int storage_register(const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Closes the backend in use and goes back to "stdio".
+ */
+void storage_release(void);
+
+/**
+ * @brief Gives the backend in use.
+ */
+const struct storage_ops* storage_current(void);
+
+/**
+ * @brief Reads exactly `size` bytes at `offset`.
+ *
+ * @return Some error code (ERR_IO on a short read). 0 if no error.
+ */
+int storage_read(struct imgfs_file* imgfs_file, uint64_t offset, void* buf, size_t size);
+
+/**
+ * @brief Writes `size` bytes at `offset`.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int storage_write(struct imgfs_file* imgfs_file, uint64_t offset, const void* buf, size_t size);
+
+/**
+ * @brief Gives the size of the file, pending writes included (where appends go).
+ *
+ * @return Some error code. 0 if no error.
+ */
+int storage_end(struct imgfs_file* imgfs_file, uint64_t* end);
+
+/**
+ * @brief Makes the writes done so far visible to the readers of the file descriptor.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int storage_flush(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Makes the writes done so far durable (fdatasync()).
+ *
+ * @return Some error code. 0 if no error.
+ */
+int storage_sync(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
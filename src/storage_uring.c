@@ -0,0 +1,657 @@
+/**
+ * @file storage_uring.c
+ * @brief The io_uring storage backend.
+ *
+ * There is a single ring for the whole process. A thread copies its
+ * operations in the submission queue, then waits for them: if no thread is
+ * in the kernel for the ring (the "leader"), it becomes the leader, submits
+ * every operation queued so far and waits for at least one completion; it
+ * then hands the completions to their owners and wakes them up, one of
+ * which leads next. The operations queued while a leader is in the kernel
+ * thus go in with a single io_uring_enter().
+ *
+ * The files are registered in a table of URING_FIXED_FILES slots, set up
+ * empty with the ring and filled as they are added; it is only appended
+ * to, so that the lookups of the operations need no lock. A blob is sent
+ * one piece at a time, each in a registered buffer taken for that piece
+ * only; when all of them are taken (by slow clients), the piece goes with
+ * sendfile() rather than waiting for one.
+ *
+ * liburing is not used: the three system calls are made directly.
+ */
+
+#include "error.h"
+#include "storage.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>   // aligned_alloc
+#include <string.h>   // memset
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>  // struct iovec
+#include <unistd.h>
+
+#ifndef SYS_io_uring_setup
+#define SYS_io_uring_setup 425
+#endif
+#ifndef SYS_io_uring_enter
+#define SYS_io_uring_enter 426
+#endif
+#ifndef SYS_io_uring_register
+#define SYS_io_uring_register 427
+#endif
+
+#define RING_ENTRIES 256
+#define NB_BUFFERS 8
+#define BUFFER_SIZE (256 * 1024) // bytes sent per linked read and send
+#define MAX_IO (1u << 30)        // bytes per read or write operation
+
+// what a thread waits for: the result of one of its operations
+struct uring_op {
+    int res;
+    int done;
+};
+
+static struct {
+    int fd;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    unsigned cq_entries;
+    struct io_uring_cqe* cqes;
+
+    pthread_mutex_t lock;
+    pthread_cond_t reaped;
+    unsigned pending;  // queued, not submitted yet
+    unsigned inflight; // queued, not completed yet
+    int leader;        // a thread is in io_uring_enter()
+    int failed;        // io_uring_enter() failed: the ring is unusable
+
+    int has_files;     // the table of fixed files is registered
+    int fixed_fds[URING_FIXED_FILES]; // the descriptor of each fixed file
+    unsigned nb_fixed; // slots filled, published after their descriptor
+    pthread_mutex_t files_lock;
+
+    char* buffers;     // NB_BUFFERS registered buffers of BUFFER_SIZE bytes, NULL if none
+    unsigned free_buffers; // one bit per free buffer
+    pthread_mutex_t buffers_lock;
+} ring = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .reaped = PTHREAD_COND_INITIALIZER,
+    .files_lock = PTHREAD_MUTEX_INITIALIZER,
+    .buffers_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static int sys_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int) syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int sys_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(SYS_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(unsigned opcode, const void* arg, unsigned nr_args)
+{
+    return (int) syscall(SYS_io_uring_register, ring.fd, opcode, arg, nr_args);
+}
+
+/**
+ * @brief Submits the pending operations and reaps the completions;
+ *        called with the lock held, when there is no leader.
+ */
+static void lead(void)
+{
+    ring.leader = 1;
+    const unsigned to_submit = ring.pending;
+    ring.pending = 0;
+    const unsigned min_complete = ring.inflight > 0 ? 1 : 0;
+
+    pthread_mutex_unlock(&ring.lock);
+    const int submitted = sys_enter(to_submit, min_complete, IORING_ENTER_GETEVENTS);
+    const int error = errno;
+    pthread_mutex_lock(&ring.lock);
+
+    if (submitted >= 0) {
+        ring.pending += to_submit - (unsigned) submitted;
+    } else if (error == EINTR || error == EAGAIN || error == EBUSY) {
+        ring.pending += to_submit;
+    } else {
+        ring.failed = 1;
+    }
+
+    unsigned head = *ring.cq_head;
+    const unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe* cqe = &ring.cqes[head & ring.cq_mask];
+        struct uring_op* op = (struct uring_op*) (uintptr_t) cqe->user_data;
+        op->res = cqe->res;
+        op->done = 1;
+        --ring.inflight;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+    ring.leader = 0;
+    pthread_cond_broadcast(&ring.reaped);
+}
+
+/**
+ * @brief Queues some operations and waits for their completion
+ *
+ * @param sqes (const struct io_uring_sqe*): Given operations, user_data aside
+ * @param ops (struct uring_op*): Given results, one per operation
+ * @param n (unsigned): Given number of operations
+ * @return (int): Error code (ERR_IO if the ring is unusable)
+ */
+static int uring_run(const struct io_uring_sqe* sqes, struct uring_op* ops, unsigned n)
+{
+    pthread_mutex_lock(&ring.lock);
+    for (;;) {
+        const unsigned used = *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        if (ring.failed || (used + n <= ring.sq_entries && ring.inflight + n <= ring.cq_entries)) {
+            break;
+        }
+        if (ring.leader) {
+            pthread_cond_wait(&ring.reaped, &ring.lock);
+        } else {
+            lead();
+        }
+    }
+    if (ring.failed) {
+        pthread_mutex_unlock(&ring.lock);
+        return ERR_IO;
+    }
+
+    unsigned tail = *ring.sq_tail;
+    for (unsigned i = 0; i < n; ++i, ++tail) {
+        struct io_uring_sqe* sqe = &ring.sqes[tail & ring.sq_mask];
+        *sqe = sqes[i];
+        sqe->user_data = (uint64_t) (uintptr_t) &ops[i];
+        ops[i].done = 0;
+    }
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+    ring.pending += n;
+    ring.inflight += n;
+
+    for (;;) {
+        unsigned done = 0;
+        while (done < n && ops[done].done) {
+            ++done;
+        }
+        if (done == n) {
+            break;
+        }
+        if (ring.failed) {
+            // the operations may still complete: their results go nowhere
+            pthread_mutex_unlock(&ring.lock);
+            return ERR_IO;
+        }
+        if (ring.leader) {
+            pthread_cond_wait(&ring.reaped, &ring.lock);
+        } else {
+            lead();
+        }
+    }
+    pthread_mutex_unlock(&ring.lock);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Gives the slot of a descriptor in the table of fixed files
+ *
+ * @param fd (int): Given file descriptor
+ * @return (int): Its slot, -1 if it is not registered
+ */
+static int fixed_slot(int fd)
+{
+    const unsigned n = __atomic_load_n(&ring.nb_fixed, __ATOMIC_ACQUIRE);
+    for (unsigned i = 0; i < n; ++i) {
+        if (ring.fixed_fds[i] == fd) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Prepares an operation on a slice of a file
+ *
+ * @param sqe (struct io_uring_sqe*): Given operation to fill
+ * @param opcode (int): Given IORING_OP_*
+ * @param fd (int): Given file descriptor, the registered one being used as such
+ * @param buf (const void*): Given buffer
+ * @param size (unsigned): Given number of bytes
+ * @param offset (uint64_t): Given offset in the file
+ */
+static void prep_rw(struct io_uring_sqe* sqe, int opcode, int fd, const void* buf, unsigned size,
+                    uint64_t offset)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (__u8) opcode;
+    const int slot = fixed_slot(fd);
+    if (slot >= 0) {
+        sqe->fd = slot;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = fd;
+    }
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = size;
+    sqe->off = offset;
+}
+
+/**
+ * @brief Reads or writes exactly `size` bytes, going on after short transfers
+ *
+ * @param opcode (int): Given IORING_OP_READ or IORING_OP_WRITE
+ * @param fd (int): Given file descriptor
+ * @param offset (uint64_t): Given offset in the file
+ * @param buf (char*): Given buffer
+ * @param size (size_t): Given number of bytes
+ * @return (int): Error code
+ */
+static int uring_rw(int opcode, int fd, uint64_t offset, char* buf, size_t size)
+{
+    while (size > 0) {
+        struct io_uring_sqe sqe;
+        struct uring_op op;
+        prep_rw(&sqe, opcode, fd, buf, size < MAX_IO ? (unsigned) size : MAX_IO, offset);
+        const int ret = uring_run(&sqe, &op, 1);
+        if (ret != ERR_NONE) {
+            return ret;
+        }
+        if (op.res == -EINTR || op.res == -EAGAIN) {
+            continue;
+        }
+        if (op.res <= 0) {
+            return ERR_IO;
+        }
+        buf += op.res;
+        size -= (size_t) op.res;
+        offset += (uint64_t) op.res;
+    }
+    return ERR_NONE;
+}
+
+static int uring_read(struct imgfs_file* imgfs_file, uint64_t offset, void* buf, size_t size)
+{
+    return uring_rw(IORING_OP_READ, fileno(imgfs_file->file), offset, buf, size);
+}
+
+static int uring_write(struct imgfs_file* imgfs_file, uint64_t offset, const void* buf, size_t size)
+{
+    return uring_rw(IORING_OP_WRITE, fileno(imgfs_file->file), offset, (char*) (uintptr_t) buf, size);
+}
+
+static int uring_end(struct imgfs_file* imgfs_file, uint64_t* end)
+{
+    // the writes do not go through the FILE: nothing is buffered there
+    struct stat st;
+    if (fstat(fileno(imgfs_file->file), &st) != 0) {
+        return ERR_IO;
+    }
+    *end = (uint64_t) st.st_size;
+    return ERR_NONE;
+}
+
+static int uring_flush(struct imgfs_file* imgfs_file)
+{
+    (void) imgfs_file; // the writes are complete when uring_write() returns
+    return ERR_NONE;
+}
+
+static int uring_sync(struct imgfs_file* imgfs_file)
+{
+    struct io_uring_sqe sqe;
+    struct uring_op op;
+    prep_rw(&sqe, IORING_OP_FSYNC, fileno(imgfs_file->file), NULL, 0, 0);
+    sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+    const int ret = uring_run(&sqe, &op, 1);
+    return ret != ERR_NONE ? ret : (op.res == 0 ? ERR_NONE : ERR_IO);
+}
+
+/**
+ * @brief Takes a free registered buffer, without waiting for one
+ *
+ * @return (int): Its index, -1 if none is free
+ */
+static int take_buffer(void)
+{
+    pthread_mutex_lock(&ring.buffers_lock);
+    const int index = ring.free_buffers == 0 ? -1 : __builtin_ctz(ring.free_buffers);
+    if (index >= 0) {
+        ring.free_buffers &= ~(1u << index);
+    }
+    pthread_mutex_unlock(&ring.buffers_lock);
+    return index;
+}
+
+static void give_buffer(int index)
+{
+    pthread_mutex_lock(&ring.buffers_lock);
+    ring.free_buffers |= 1u << index;
+    pthread_mutex_unlock(&ring.buffers_lock);
+}
+
+/**
+ * @brief Sends exactly `size` bytes of a file on a socket with sendfile()
+ *
+ * @param socket (int): Given socket
+ * @param fd (int): Given file descriptor
+ * @param offset (off_t): Given offset in the file
+ * @param size (size_t): Given number of bytes
+ * @return (int): Error code
+ */
+static int sendfile_fully(int socket, int fd, off_t offset, size_t size)
+{
+    while (size > 0) {
+        const ssize_t n = sendfile(socket, fd, &offset, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return ERR_IO;
+        }
+        size -= (size_t) n;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Sends a piece of a file on a socket, read in a registered buffer
+ *        by an operation linked to its send
+ *
+ * @param socket (int): Given socket
+ * @param fd (int): Given file descriptor
+ * @param offset (off_t): Given offset in the file
+ * @param len (unsigned): Given number of bytes, at most BUFFER_SIZE
+ * @param index (int): Given registered buffer
+ * @return (int): Error code
+ */
+static int send_piece(int socket, int fd, off_t offset, unsigned len, int index)
+{
+    char* buf = ring.buffers + (size_t) index * BUFFER_SIZE;
+    struct io_uring_sqe sqes[2];
+    struct uring_op ops[2];
+
+    // a short read breaks the link: the send is then cancelled
+    prep_rw(&sqes[0], IORING_OP_READ_FIXED, fd, buf, len, (uint64_t) offset);
+    sqes[0].buf_index = (__u16) index;
+    sqes[0].flags |= IOSQE_IO_LINK;
+
+    memset(&sqes[1], 0, sizeof(sqes[1]));
+    sqes[1].opcode = IORING_OP_SEND;
+    sqes[1].fd = socket;
+    sqes[1].addr = (uint64_t) (uintptr_t) buf;
+    sqes[1].len = len;
+    sqes[1].msg_flags = MSG_NOSIGNAL;
+
+    const int ret = uring_run(sqes, ops, 2);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    if (ops[0].res != (int) len || ops[1].res < 0) {
+        return ERR_IO;
+    }
+    // a short send is finished here
+    for (unsigned sent = (unsigned) ops[1].res; sent < len; ) {
+        const ssize_t n = send(socket, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return ERR_IO;
+        }
+        sent += (unsigned) n;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Sends a slice of a file on a socket, piece by piece: through a
+ *        registered buffer when one is free, with sendfile() otherwise
+ *
+ * @param socket (int): Given socket
+ * @param fd (int): Given file descriptor
+ * @param offset (off_t): Given offset in the file
+ * @param size (size_t): Given number of bytes
+ * @return (int): Error code
+ */
+static int uring_send(int socket, int fd, off_t offset, size_t size)
+{
+    if (ring.buffers == NULL) {
+        // the buffers could not be registered (e.g. RLIMIT_MEMLOCK)
+        return sendfile_fully(socket, fd, offset, size);
+    }
+    int ret = ERR_NONE;
+    while (ret == ERR_NONE && size > 0) {
+        const unsigned len = size < BUFFER_SIZE ? (unsigned) size : BUFFER_SIZE;
+        // held for one piece only: a slow client cannot keep it from the others
+        const int index = take_buffer();
+        if (index < 0) {
+            ret = sendfile_fully(socket, fd, offset, len);
+        } else {
+            ret = send_piece(socket, fd, offset, len, index);
+            give_buffer(index);
+        }
+        offset += len;
+        size -= len;
+    }
+    return ret;
+}
+
+/**
+ * @brief Registers a file in the next free slot of the table of fixed files
+ *
+ * @param imgfs_file (const struct imgfs_file*): Given file
+ * @return (int): Error code
+ */
+static int uring_add_file(const struct imgfs_file* imgfs_file)
+{
+    const int fd = fileno(imgfs_file->file);
+    pthread_mutex_lock(&ring.files_lock);
+    int ret = ERR_NONE;
+    if (!ring.has_files) {
+        ret = ERR_IO;
+    } else if (fixed_slot(fd) >= 0) {
+        ret = ERR_NONE;
+    } else if (ring.nb_fixed >= URING_FIXED_FILES) {
+        ret = ERR_MAX_FILES;
+    } else {
+        struct io_uring_files_update update;
+        memset(&update, 0, sizeof(update));
+        update.offset = ring.nb_fixed;
+        update.fds = (uint64_t) (uintptr_t) &fd;
+        if (sys_register(IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) {
+            ret = ERR_IO;
+        } else {
+            ring.fixed_fds[ring.nb_fixed] = fd;
+            __atomic_store_n(&ring.nb_fixed, ring.nb_fixed + 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&ring.files_lock);
+    return ret;
+}
+
+static void uring_close(void)
+{
+    if (ring.sq_ring != NULL && ring.sq_ring != MAP_FAILED) {
+        munmap(ring.sq_ring, ring.sq_ring_size);
+    }
+    if (ring.cq_ring != NULL && ring.cq_ring != MAP_FAILED && ring.cq_ring != ring.sq_ring) {
+        munmap(ring.cq_ring, ring.cq_ring_size);
+    }
+    if (ring.sqes != NULL && ring.sqes != MAP_FAILED) {
+        munmap(ring.sqes, ring.sqes_size);
+    }
+    if (ring.fd >= 0) {
+        close(ring.fd); // unregisters the file and the buffers
+    }
+    free(ring.buffers);
+
+    ring.fd = -1;
+    ring.sq_ring = ring.cq_ring = NULL;
+    ring.sqes = NULL;
+    ring.pending = ring.inflight = 0;
+    ring.leader = ring.failed = 0;
+    ring.has_files = 0;
+    ring.nb_fixed = 0;
+    ring.buffers = NULL;
+    ring.free_buffers = 0;
+}
+
+/**
+ * @brief Tells whether the kernel has all the operations used here
+ *
+ * @return (int): 1 if so, 0 otherwise
+ */
+static int has_operations(void)
+{
+    static const int needed[] = {
+        IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_SEND, IORING_OP_FSYNC
+    };
+    const size_t nb_ops = 64;
+    struct io_uring_probe* probe = calloc(1, sizeof(*probe) + nb_ops * sizeof(struct io_uring_probe_op));
+    if (probe == NULL) {
+        return 0;
+    }
+    int ok = sys_register(IORING_REGISTER_PROBE, probe, (unsigned) nb_ops) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); ++i) {
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+static int uring_open(const struct imgfs_file* imgfs_file)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = sys_setup(RING_ENTRIES, &p);
+    if (ring.fd < 0) {
+        ring.fd = -1;
+        return ERR_IO;
+    }
+    if (!has_operations()) {
+        uring_close();
+        return ERR_IO;
+    }
+
+    ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_ring_size > ring.sq_ring_size) {
+            ring.sq_ring_size = ring.cq_ring_size;
+        }
+        ring.cq_ring_size = ring.sq_ring_size;
+    }
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED) {
+        uring_close();
+        return ERR_IO;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ring = ring.sq_ring;
+    } else {
+        ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ring == MAP_FAILED) {
+            uring_close();
+            return ERR_IO;
+        }
+    }
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        uring_close();
+        return ERR_IO;
+    }
+
+    char* sq = ring.sq_ring;
+    ring.sq_head = (unsigned*) (sq + p.sq_off.head);
+    ring.sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    ring.sq_mask = *(unsigned*) (sq + p.sq_off.ring_mask);
+    ring.sq_entries = p.sq_entries;
+    // the entries are used in order: the indirection array is the identity
+    unsigned* array = (unsigned*) (sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; ++i) {
+        array[i] = i;
+    }
+    char* cq = ring.cq_ring;
+    ring.cq_head = (unsigned*) (cq + p.cq_off.head);
+    ring.cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    ring.cq_mask = *(unsigned*) (cq + p.cq_off.ring_mask);
+    ring.cq_entries = p.cq_entries;
+    ring.cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    // both registrations are optimisations, but send() needs the buffers
+    int fds[URING_FIXED_FILES];
+    for (size_t i = 0; i < URING_FIXED_FILES; ++i) {
+        fds[i] = -1; // empty slot
+    }
+    ring.has_files = sys_register(IORING_REGISTER_FILES, fds, URING_FIXED_FILES) == 0;
+    if (imgfs_file != NULL && imgfs_file->file != NULL) {
+        (void) uring_add_file(imgfs_file);
+    }
+    ring.buffers = aligned_alloc(4096, (size_t) NB_BUFFERS * BUFFER_SIZE);
+    if (ring.buffers != NULL) {
+        struct iovec iov[NB_BUFFERS];
+        for (int i = 0; i < NB_BUFFERS; ++i) {
+            iov[i].iov_base = ring.buffers + (size_t) i * BUFFER_SIZE;
+            iov[i].iov_len = BUFFER_SIZE;
+        }
+        if (sys_register(IORING_REGISTER_BUFFERS, iov, NB_BUFFERS) == 0) {
+            ring.free_buffers = (1u << NB_BUFFERS) - 1;
+        } else {
+            free(ring.buffers);
+            ring.buffers = NULL;
+        }
+    }
+    return ERR_NONE;
+}
+
+const struct storage_ops uring_storage = {
+    "io_uring", uring_open, uring_close, uring_read, uring_write, uring_end, uring_flush, uring_sync,
+    uring_send, uring_add_file
+};
+
+#else // no io_uring
+
+static int uring_open(const struct imgfs_file* imgfs_file)
+{
+    (void) imgfs_file;
+    return ERR_IO;
+}
+
+const struct storage_ops uring_storage = {
+    "io_uring", uring_open, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+#endif
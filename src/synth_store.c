@@ -0,0 +1,332 @@
+/**
+ * @file synth_store.c
+ * @brief Writer of synthetic imgFS files, for imgfs-gen and imgfs-bench.
+ */
+
+#include "synth_store.h"
+#include "error.h"
+#include "image_content.h"
+#include "crc32c.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h> // off_t
+
+#define TRAILER_SIZE 8
+#define WRITE_BUFFER (8u << 20)
+
+/**********************************************************************
+ * Pseudo-random numbers (xorshift64*), the same from one run to the next.
+ ********************************************************************** */
+static uint64_t rng_state = 0x9e3779b97f4a7c15u;
+
+uint64_t synth_rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1du;
+}
+
+double synth_rng_unit(void)
+{
+    return (double) (synth_rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * @brief Draws the img_id of slot n: random characters, then "-" and n in
+ *        hexadecimal, which makes it unique
+ *
+ * @param config (const struct synth_config*): Given bounds of the length
+ * @param n (uint32_t): Given slot
+ * @param img_id (char*): Given buffer of MAX_IMG_ID + 1 chars
+ */
+static void make_img_id(const struct synth_config* config, uint32_t n, char* img_id)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    char suffix[16];
+    const int suffix_len = snprintf(suffix, sizeof(suffix), "-%x", n);
+    const uint32_t len = config->id_min + (uint32_t) (synth_rng_next() % (config->id_max - config->id_min + 1));
+
+    if (len <= (uint32_t) suffix_len) {
+        strcpy(img_id, suffix + 1); // too short for more than the number
+        return;
+    }
+    const uint32_t random_len = len - (uint32_t) suffix_len;
+    for (uint32_t i = 0; i < random_len; ++i) {
+        img_id[i] = chars[synth_rng_next() % (sizeof(chars) - 1)];
+    }
+    strcpy(img_id + random_len, suffix);
+}
+
+int synth_parse_share(const char* arg, double* share)
+{
+    M_REQUIRE_NON_NULL(arg);
+    M_REQUIRE_NON_NULL(share);
+    char* end = NULL;
+    *share = strtod(arg, &end);
+    return end == arg || *end != '\0' || *share < 0 || *share > 1 ? ERR_INVALID_ARGUMENT : ERR_NONE;
+}
+
+/**********************************************************************
+ * The header and the blobs every image is made of.
+ ********************************************************************** */
+void synth_header(const struct synth_config* config, struct imgfs_header* header)
+{
+    memset(header, 0, sizeof(*header));
+    strcpy(header->name, CAT_TXT);
+    header->max_files = config->slots;
+    header->resized_res[2 * THUMB_RES] = header->resized_res[2 * THUMB_RES + 1] = SYNTH_THUMB_SIZE;
+    header->resized_res[2 * SMALL_RES] = header->resized_res[2 * SMALL_RES + 1] = SYNTH_SMALL_SIZE;
+    header->flags = config->crc ? IMGFS_CRC32C : 0;
+}
+
+/**
+ * @brief Reads the JPEG and prepares the blobs of every image
+ *
+ * @param path (const char*): Given JPEG file
+ * @param header (const struct imgfs_header*): Given resolutions to create
+ * @param config (const struct synth_config*): Given shares of created resolutions
+ * @param model (struct synth_model*): Given blobs to fill
+ * @return (int): Error code
+ */
+int synth_prepare_model(const char* path, const struct imgfs_header* header,
+                        const struct synth_config* config, struct synth_model* model)
+{
+    M_REQUIRE_NON_NULL(path);
+    M_REQUIRE_NON_NULL(header);
+    M_REQUIRE_NON_NULL(config);
+    M_REQUIRE_NON_NULL(model);
+    memset(model, 0, sizeof(*model));
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return ERR_IO;
+    }
+    int ret = ERR_IO;
+    char* jpeg = NULL;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        const long len = ftell(file);
+        if (len > 0 && fseek(file, 0, SEEK_SET) == 0) {
+            jpeg = malloc((size_t) len);
+            ret = jpeg == NULL ? ERR_OUT_OF_MEMORY :
+                  fread(jpeg, (size_t) len, 1, file) == 1 ? ERR_NONE : ERR_IO;
+            model->jpeg_size = (size_t) len;
+        }
+    }
+    fclose(file);
+    model->jpeg = jpeg;
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    if (model->jpeg_size + TRAILER_SIZE > UINT32_MAX) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    ret = get_resolution(&model->orig_res[1], &model->orig_res[0], jpeg, model->jpeg_size);
+    for (int res = THUMB_RES; ret == ERR_NONE && res < ORIG_RES; ++res) {
+        if (config->created[res] > 0) {
+            ret = create_resized_img(jpeg, model->jpeg_size, header->resized_res[2 * res],
+                                     header->resized_res[2 * res + 1],
+                                     &model->resized[res], &model->resized_size[res]);
+            if (ret == ERR_NONE) {
+                model->resized_crc[res] = crc32c(0, model->resized[res], model->resized_size[res]);
+            }
+        }
+    }
+    model->crc_prefix = crc32c(0, jpeg, model->jpeg_size);
+
+    model->sha_prefix = EVP_MD_CTX_new();
+    if (ret == ERR_NONE && model->sha_prefix == NULL) {
+        ret = ERR_OUT_OF_MEMORY;
+    }
+    if (ret == ERR_NONE && (EVP_DigestInit_ex(model->sha_prefix, EVP_sha256(), NULL) != 1 ||
+                            EVP_DigestUpdate(model->sha_prefix, jpeg, model->jpeg_size) != 1)) {
+        ret = ERR_RUNTIME;
+    }
+    return ret;
+}
+
+void synth_free_model(struct synth_model* model)
+{
+    if (model == NULL) {
+        return;
+    }
+    free(model->jpeg);
+    for (int res = THUMB_RES; res < ORIG_RES; ++res) {
+        free_resized_img(model->resized[res]);
+    }
+    EVP_MD_CTX_free(model->sha_prefix);
+    memset(model, 0, sizeof(*model));
+}
+
+/**********************************************************************
+ * The store.
+ ********************************************************************** */
+static int write_blob(FILE* file, const void* blob, size_t size, uint64_t* end, uint64_t* offset)
+{
+    if (fwrite(blob, size, 1, file) != 1) {
+        return ERR_IO;
+    }
+    *offset = *end;
+    *end += size;
+    return ERR_NONE;
+}
+
+static int write_crc(FILE* file, uint32_t crc, uint64_t* end)
+{
+    unsigned char bytes[CRC32C_BYTES];
+    crc32c_put(crc, bytes);
+    uint64_t offset = 0;
+    return write_blob(file, bytes, CRC32C_BYTES, end, &offset);
+}
+
+/**
+ * @brief Writes a new image (its content and its created resolutions)
+ *        at the end of the store
+ *
+ * @param file (FILE*): Given store, positioned at `*end`
+ * @param config (const struct synth_config*): Given shares of created resolutions
+ * @param model (const struct synth_model*): Given blobs
+ * @param serial (uint64_t): Given number making the content unique
+ * @param end (uint64_t*): Given end of the store, moved past the blobs
+ * @param metadata (struct img_metadata*): Given metadata to fill (but img_id and is_valid)
+ * @return (int): Error code
+ */
+static int write_image(FILE* file, const struct synth_config* config, const struct synth_model* model,
+                       uint64_t serial, uint64_t* end, struct img_metadata* metadata)
+{
+    unsigned char trailer[TRAILER_SIZE];
+    for (size_t i = 0; i < TRAILER_SIZE; ++i) {
+        trailer[i] = (unsigned char) (serial >> (8 * i));
+    }
+
+    EVP_MD_CTX* sha = EVP_MD_CTX_new();
+    int ret = sha == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+    if (ret == ERR_NONE && (EVP_MD_CTX_copy_ex(sha, model->sha_prefix) != 1 ||
+                            EVP_DigestUpdate(sha, trailer, TRAILER_SIZE) != 1 ||
+                            EVP_DigestFinal_ex(sha, metadata->SHA, NULL) != 1)) {
+        ret = ERR_RUNTIME;
+    }
+    EVP_MD_CTX_free(sha);
+
+    metadata->orig_res[0] = model->orig_res[0];
+    metadata->orig_res[1] = model->orig_res[1];
+    metadata->size[ORIG_RES] = (uint32_t) (model->jpeg_size + TRAILER_SIZE);
+    if (ret == ERR_NONE) {
+        ret = write_blob(file, model->jpeg, model->jpeg_size, end, &metadata->offset[ORIG_RES]);
+    }
+    if (ret == ERR_NONE) {
+        uint64_t trailer_offset = 0;
+        ret = write_blob(file, trailer, TRAILER_SIZE, end, &trailer_offset);
+    }
+    if (ret == ERR_NONE && config->crc) {
+        ret = write_crc(file, crc32c(model->crc_prefix, trailer, TRAILER_SIZE), end);
+    }
+    for (int res = THUMB_RES; ret == ERR_NONE && res < ORIG_RES; ++res) {
+        if (synth_rng_unit() < config->created[res]) {
+            metadata->size[res] = (uint32_t) model->resized_size[res];
+            ret = write_blob(file, model->resized[res], model->resized_size[res], end, &metadata->offset[res]);
+            if (ret == ERR_NONE && config->crc) {
+                ret = write_crc(file, model->resized_crc[res], end);
+            }
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Writes the whole store
+ *
+ * @param config (const struct synth_config*): Given shape of the store
+ * @param header (struct imgfs_header*): Given header, whose counts are set
+ * @param model (const struct synth_model*): Given blobs
+ * @param path (const char*): Given file to write
+ * @param bytes (uint64_t*): Given pointer to write the size of the file to
+ * @return (int): Error code
+ */
+int synth_generate(const struct synth_config* config, struct imgfs_header* header,
+                   const struct synth_model* model, const char* path, uint64_t* bytes)
+{
+    M_REQUIRE_NON_NULL(config);
+    M_REQUIRE_NON_NULL(header);
+    M_REQUIRE_NON_NULL(model);
+    M_REQUIRE_NON_NULL(path);
+    M_REQUIRE_NON_NULL(bytes);
+    if (config->slots == 0 || config->id_min == 0 || config->id_min > config->id_max ||
+        config->id_max > MAX_IMG_ID || header->flags != (config->crc ? IMGFS_CRC32C : 0u)) {
+        // no other flag: the blobs would not be where the other flags expect them
+        return ERR_INVALID_ARGUMENT;
+    }
+    rng_state = config->seed * 0x9e3779b97f4a7c15u;
+
+    struct img_metadata* metadata = calloc(config->slots, sizeof(struct img_metadata));
+    uint32_t* sources = calloc(config->slots, sizeof(uint32_t)); // valid images, to duplicate
+    FILE* file = fopen(path, "wb");
+    int ret = metadata == NULL || sources == NULL ? ERR_OUT_OF_MEMORY : file == NULL ? ERR_IO : ERR_NONE;
+
+    // the blobs go after the metadata, which is written last, once complete
+    uint64_t end = sizeof(struct imgfs_header) + (uint64_t) config->slots * sizeof(struct img_metadata);
+    if (ret == ERR_NONE && (setvbuf(file, NULL, _IOFBF, WRITE_BUFFER) != 0 ||
+                            fseeko(file, (off_t) end, SEEK_SET) != 0)) {
+        ret = ERR_IO;
+    }
+
+    uint32_t nb_sources = 0;
+    uint64_t serial = 0;
+    for (uint32_t i = 0; ret == ERR_NONE && i < config->slots; ++i) {
+        if (synth_rng_unit() >= config->fill) {
+            continue;
+        }
+        make_img_id(config, i, metadata[i].img_id);
+        const int deleted = synth_rng_unit() < config->deleted;
+
+        if (nb_sources > 0 && synth_rng_unit() < config->dedup) {
+            const struct img_metadata* source = &metadata[sources[synth_rng_next() % nb_sources]];
+            memcpy(metadata[i].SHA, source->SHA, sizeof(metadata[i].SHA));
+            memcpy(metadata[i].orig_res, source->orig_res, sizeof(metadata[i].orig_res));
+            memcpy(metadata[i].size, source->size, sizeof(metadata[i].size));
+            memcpy(metadata[i].offset, source->offset, sizeof(metadata[i].offset));
+        } else {
+            ret = write_image(file, config, model, serial++, &end, &metadata[i]);
+            if (!deleted) {
+                sources[nb_sources++] = i;
+            }
+        }
+
+        // every insert and delete counts as one version, as in do_insert() and do_delete()
+        ++header->version;
+        if (deleted) {
+            ++header->version;
+        } else {
+            metadata[i].is_valid = NON_EMPTY;
+            ++header->nb_files;
+        }
+    }
+
+    // the last images are left as just inserted: their resized blobs are not referenced
+    uint32_t nb_cold = 0;
+    for (uint32_t i = config->slots; ret == ERR_NONE && nb_cold < config->nb_cold && i > 0; --i) {
+        struct img_metadata* const cold = &metadata[i - 1];
+        if (cold->is_valid == NON_EMPTY) {
+            cold->size[THUMB_RES] = cold->size[SMALL_RES] = 0;
+            cold->offset[THUMB_RES] = cold->offset[SMALL_RES] = 0;
+            ++nb_cold;
+        }
+    }
+
+    if (ret == ERR_NONE &&
+        (fseeko(file, 0, SEEK_SET) != 0 ||
+         fwrite(header, sizeof(*header), 1, file) != 1 ||
+         fwrite(metadata, sizeof(struct img_metadata), config->slots, file) != config->slots)) {
+        ret = ERR_IO;
+    }
+    if (file != NULL && fclose(file) != 0 && ret == ERR_NONE) {
+        ret = ERR_IO;
+    }
+    *bytes = end;
+    free(sources);
+    free(metadata);
+    return ret;
+}
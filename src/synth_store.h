@@ -0,0 +1,96 @@
+/**
+ * @file synth_store.h
+ * @brief Writer of synthetic imgFS files, for imgfs-gen and imgfs-bench.
+ *
+ * The blobs are written one after the other, then the header and the
+ * metadata, without going through do_insert(). Every image is a copy of the
+ * given JPEG with a distinct 8 byte trailer after its end of image marker,
+ * which decoders ignore: the contents (and their SHAs) differ without
+ * decoding or encoding anything. Duplicates share the blobs of the image
+ * they copy, as do_name_and_content_dedup() does. Deleted slots keep their
+ * metadata and blobs, only is_valid is cleared, as do_delete() leaves them.
+ * The stores written thus pass do_verify().
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <openssl/evp.h>
+
+#include "imgfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the lengths of the img_ids by default
+#define SYNTH_ID_MIN 8
+#define SYNTH_ID_MAX 32
+
+// the resolutions of `imgfscmd create` by default
+#define SYNTH_THUMB_SIZE 64
+#define SYNTH_SMALL_SIZE 256
+
+struct synth_config {
+    uint32_t slots;           // max_files of the store
+    double fill;              // share of the slots ever written
+    double deleted;           // share of the written slots deleted since
+    double dedup;             // share of the images with the content of an earlier one
+    uint32_t id_min;          // bounds of the length of the img_ids, uniformly drawn
+    uint32_t id_max;
+    double created[ORIG_RES]; // share of the images with their thumb / small version
+    uint64_t seed;            // of the pseudo-random choices
+    int crc;                  // whether to store a CRC-32C after each blob (IMGFS_CRC32C)
+    uint32_t nb_cold;         // last valid images left without any resized version
+};
+
+// the blobs every image is made of
+struct synth_model {
+    char* jpeg;
+    size_t jpeg_size;
+    uint32_t orig_res[ORIG_RES];
+    void* resized[ORIG_RES];
+    size_t resized_size[ORIG_RES];
+    EVP_MD_CTX* sha_prefix; // SHA-256 state after the JPEG, before the trailer
+    uint32_t crc_prefix;    // CRC-32C of the JPEG, before the trailer
+    uint32_t resized_crc[ORIG_RES];
+};
+
+/**
+ * @brief Parses a share of synth_config (a number in [0, 1]), for the options.
+ */
+int synth_parse_share(const char* arg, double* share);
+
+/**
+ * @brief Sets the header of a new store: name, max_files, resolutions
+ *        and flags, the counts being zero.
+ */
+void synth_header(const struct synth_config* config, struct imgfs_header* header);
+
+/**
+ * @brief Reads the JPEG and prepares the blobs of every image.
+ *        To be freed with synth_free_model(), even on error.
+ */
+int synth_prepare_model(const char* path, const struct imgfs_header* header,
+                        const struct synth_config* config, struct synth_model* model);
+
+void synth_free_model(struct synth_model* model);
+
+/**
+ * @brief Writes the whole store to path, setting the counts of header,
+ *        and its size to bytes. The pseudo-random numbers are seeded first.
+ */
+int synth_generate(const struct synth_config* config, struct imgfs_header* header,
+                   const struct synth_model* model, const char* path, uint64_t* bytes);
+
+/**
+ * @brief Pseudo-random numbers (xorshift64*), the same from one run to the
+ *        next: the ones synth_generate() draws, then the ones drawn after.
+ */
+uint64_t synth_rng_next(void);
+double synth_rng_unit(void); // in [0, 1)
+
+#ifdef __cplusplus
+}
+#endif
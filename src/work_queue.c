@@ -0,0 +1,147 @@
+/**
+ * @file work_queue.c
+ * @brief Bounded queue of jobs run by a fixed set of worker threads.
+ */
+
+#include <stdlib.h>
+
+#include "error.h"
+#include "work_queue.h"
+
+/**
+ * @brief Runs the queued jobs until the queue stops and is empty
+ *
+ * @param arg (void*): Given queue
+ * @return (void*): NULL
+ */
+static void* worker_loop(void* arg)
+{
+    struct work_queue* const queue = arg;
+
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        while (queue->queued == 0 && !queue->stopping) {
+            pthread_cond_wait(&queue->not_empty, &queue->lock);
+        }
+        if (queue->queued == 0) {
+            break;
+        }
+        void* const job = queue->jobs[queue->head];
+        queue->head = (queue->head + 1) % queue->max_queued;
+        --queue->queued;
+
+        pthread_mutex_unlock(&queue->lock);
+        queue->run(job);
+        pthread_mutex_lock(&queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    if (queue->thread_exit != NULL) {
+        queue->thread_exit();
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts the workers of a queue
+ *
+ * @param queue (struct work_queue*): Given queue
+ * @param nb_workers (size_t): Given number of jobs that may run at once
+ * @param max_queued (size_t): Given number of jobs that may wait for a worker
+ * @param run (JobRunner): Given function running a job
+ * @param thread_exit (void (*)(void)): Given function called by each worker when it ends
+ * @return (int): Error code
+ */
+int work_queue_init(struct work_queue* queue, size_t nb_workers, size_t max_queued,
+                    JobRunner run, void (*thread_exit)(void))
+{
+    M_REQUIRE_NON_NULL(queue);
+    M_REQUIRE_NON_NULL(run);
+    if (nb_workers == 0 || max_queued == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    queue->jobs = calloc(max_queued, sizeof(*queue->jobs));
+    queue->workers = calloc(nb_workers, sizeof(*queue->workers));
+    if (queue->jobs == NULL || queue->workers == NULL) {
+        free(queue->jobs);
+        free(queue->workers);
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (pthread_mutex_init(&queue->lock, NULL) != 0) {
+        free(queue->jobs);
+        free(queue->workers);
+        return ERR_THREADING;
+    }
+    if (pthread_cond_init(&queue->not_empty, NULL) != 0) {
+        pthread_mutex_destroy(&queue->lock);
+        free(queue->jobs);
+        free(queue->workers);
+        return ERR_THREADING;
+    }
+    queue->run = run;
+    queue->thread_exit = thread_exit;
+    queue->max_queued = max_queued;
+    queue->head = queue->queued = 0;
+    queue->stopping = 0;
+
+    for (queue->nb_workers = 0; queue->nb_workers < nb_workers; ++queue->nb_workers) {
+        if (pthread_create(&queue->workers[queue->nb_workers], NULL, worker_loop, queue) != 0) {
+            work_queue_destroy(queue);
+            return ERR_THREADING;
+        }
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Queues a job, or refuses it when the queue is full
+ *
+ * @param queue (struct work_queue*): Given queue
+ * @param job (void*): Given job
+ * @return (int): Error code, ERR_BUSY if the job is refused
+ */
+int work_queue_submit(struct work_queue* queue, void* job)
+{
+    M_REQUIRE_NON_NULL(queue);
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->stopping || queue->queued == queue->max_queued) {
+        pthread_mutex_unlock(&queue->lock);
+        return ERR_BUSY;
+    }
+    queue->jobs[(queue->head + queue->queued) % queue->max_queued] = job;
+    ++queue->queued;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Runs the jobs still queued, then stops the workers
+ *
+ * @param queue (struct work_queue*): Given queue
+ */
+void work_queue_destroy(struct work_queue* queue)
+{
+    if (queue == NULL || queue->workers == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+
+    for (size_t i = 0; i < queue->nb_workers; ++i) {
+        pthread_join(queue->workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->jobs);
+    queue->jobs = NULL;
+    free(queue->workers);
+    queue->workers = NULL;
+    queue->nb_workers = 0;
+}
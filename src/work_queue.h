@@ -0,0 +1,67 @@
+/**
+ * @file work_queue.h
+ * @brief Bounded queue of jobs run by a fixed set of worker threads.
+ *
+ * The queue is also the admission control of the work it runs: at most
+ * `nb_workers` jobs run at once, at most `max_queued` wait for a worker,
+ * and submitting more fails at once with ERR_BUSY, so that the caller can
+ * shed the request (e.g. with a 503) instead of letting the queue grow.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*JobRunner)(void* job);
+
+struct work_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    JobRunner run;           // runs (and owns) each job
+    void (*thread_exit)(void); // called by each worker before it ends, may be NULL
+    void** jobs;             // ring of max_queued jobs
+    size_t max_queued;
+    size_t head;             // oldest job
+    size_t queued;
+    pthread_t* workers;
+    size_t nb_workers;
+    int stopping;
+};
+
+/**
+ * @brief Starts the workers of a queue.
+ *
+ * @param queue The queue
+ * @param nb_workers How many jobs may run at once (at least 1)
+ * @param max_queued How many jobs may wait for a worker (at least 1)
+ * @param run The function running a job
+ * @param thread_exit Called by each worker when it ends (may be NULL)
+ * @return Some error code. 0 if no error.
+ */
+int work_queue_init(struct work_queue* queue, size_t nb_workers, size_t max_queued,
+                    JobRunner run, void (*thread_exit)(void));
+
+/**
+ * @brief Queues a job for the workers.
+ *
+ * @param queue The queue
+ * @param job The job, owned by the queue if it is accepted
+ * @return Some error code: ERR_BUSY if the queue is full. 0 if no error.
+ */
+int work_queue_submit(struct work_queue* queue, void* job);
+
+/**
+ * @brief Runs the jobs still queued, then stops the workers.
+ *
+ * @param queue The queue
+ */
+void work_queue_destroy(struct work_queue* queue);
+
+#ifdef __cplusplus
+}
+#endif
@@ -79,6 +79,8 @@ static const char *const ERR_NAMES[] = {"ERR_FIRST",
                                         "ERR_DUPLICATE_ID",
                                         "ERR_IMGLIB",
                                         "ERR_DEBUG",
+                                        "ERR_BUSY",
+                                        "ERR_CORRUPT_IMGFS",
                                         "ERR_LAST"
                                        };
 
@@ -0,0 +1,164 @@
+#include "arena.h"
+#include "buf_pool.h"
+#include "test.h"
+#include <check.h>
+#include <stdint.h>
+#include <string.h>
+
+// ======================================================================
+START_TEST(arena_null_params)
+{
+    start_test_print;
+
+    ck_assert_invalid_arg(arena_init(NULL, 64));
+    ck_assert_ptr_null(arena_alloc(NULL, 1));
+
+    // neither crashes
+    arena_reset(NULL);
+    arena_free(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(arena_alloc_aligned_until_full)
+{
+    start_test_print;
+
+    struct arena arena;
+    ck_assert_err_none(arena_init(&arena, 256));
+
+    char* const a = arena_alloc(&arena, 1);
+    char* const b = arena_alloc(&arena, 100);
+    ck_assert_ptr_nonnull(a);
+    ck_assert_ptr_nonnull(b);
+    ck_assert_uint_eq((uintptr_t) b % ARENA_ALIGN, 0);
+    ck_assert_ptr_eq(b, a + ARENA_ALIGN);
+
+    // 16 + 100, padded to 128: 128 bytes left
+    ck_assert_ptr_nonnull(arena_alloc(&arena, 128));
+    ck_assert_ptr_null(arena_alloc(&arena, 1));
+    ck_assert_ptr_null(arena_alloc(&arena, SIZE_MAX));
+
+    // everything comes back at once
+    arena_reset(&arena);
+    ck_assert_ptr_eq(arena_alloc(&arena, 256), a);
+
+    arena_free(&arena);
+    ck_assert_ptr_null(arena.base);
+    ck_assert_ptr_null(arena_alloc(&arena, 1));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(buf_pool_recycles_by_class)
+{
+    start_test_print;
+
+    // same class (8 KiB): the buffer given back is handed out again
+    char* const a = buf_pool_get(5000);
+    ck_assert_ptr_nonnull(a);
+    memset(a, 'a', 8192);
+    buf_pool_put(a, 5000);
+    ck_assert_ptr_eq(buf_pool_get(8192), a);
+
+    // another class: not that one
+    char* const b = buf_pool_get(8193);
+    ck_assert_ptr_nonnull(b);
+    ck_assert_ptr_ne(b, a);
+    memset(b, 'b', 16384);
+
+    buf_pool_put(a, 8192);
+    buf_pool_put(b, 8193);
+    buf_pool_put(NULL, 10);
+
+    // above the largest class: plain allocation
+    char* const big = buf_pool_get(BUF_POOL_MAX_SIZE + 1);
+    ck_assert_ptr_nonnull(big);
+    big[BUF_POOL_MAX_SIZE] = 'z';
+    buf_pool_put(big, BUF_POOL_MAX_SIZE + 1);
+
+    buf_pool_drain();
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(buf_pool_keeps_a_few)
+{
+    start_test_print;
+
+    void* bufs[BUF_POOL_KEEP + 2];
+    for (size_t i = 0; i < BUF_POOL_KEEP + 2; ++i) {
+        bufs[i] = buf_pool_get(BUF_POOL_MIN_SIZE);
+        ck_assert_ptr_nonnull(bufs[i]);
+    }
+    for (size_t i = 0; i < BUF_POOL_KEEP + 2; ++i) {
+        buf_pool_put(bufs[i], BUF_POOL_MIN_SIZE);
+    }
+
+    // only the first BUF_POOL_KEEP ones were kept, last given back first
+    for (size_t i = BUF_POOL_KEEP; i > 0; --i) {
+        ck_assert_ptr_eq(buf_pool_get(1), bufs[i - 1]);
+    }
+    for (size_t i = 0; i < BUF_POOL_KEEP; ++i) {
+        buf_pool_put(bufs[i], 1);
+    }
+
+    buf_pool_drain();
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(buf_pool_within_budget)
+{
+    start_test_print;
+
+    // room for two buffers of the smallest class: the third one is freed
+    buf_pool_set_budget(2 * BUF_POOL_MIN_SIZE);
+    void* bufs[3];
+    for (size_t i = 0; i < 3; ++i) {
+        bufs[i] = buf_pool_get(BUF_POOL_MIN_SIZE);
+        ck_assert_ptr_nonnull(bufs[i]);
+    }
+    for (size_t i = 0; i < 3; ++i) {
+        buf_pool_put(bufs[i], BUF_POOL_MIN_SIZE);
+    }
+    ck_assert_ptr_eq(buf_pool_get(1), bufs[1]);
+    ck_assert_ptr_eq(buf_pool_get(1), bufs[0]);
+
+    // taken out of the pool, they leave room again
+    buf_pool_put(bufs[0], 1);
+    buf_pool_put(bufs[1], 1);
+    ck_assert_ptr_eq(buf_pool_get(1), bufs[1]);
+    buf_pool_put(bufs[1], 1);
+
+    buf_pool_drain();
+    buf_pool_set_budget(SIZE_MAX);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *arena_test_suite()
+{
+    Suite *s = suite_create("Tests of the arena and of the buffer pool");
+
+    Add_Test(s, arena_null_params);
+    Add_Test(s, arena_alloc_aligned_until_full);
+
+    Add_Test(s, buf_pool_recycles_by_class);
+    Add_Test(s, buf_pool_keeps_a_few);
+    Add_Test(s, buf_pool_within_budget);
+
+    return s;
+}
+
+TEST_SUITE(arena_test_suite)
@@ -0,0 +1,295 @@
+#include "imgfs.h"
+#include "imgfs_async.h"
+#include "test.h"
+#include <check.h>
+#include <poll.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#define PAPILLON_SIZE 72876
+#define MAX_RESULTS 64
+
+struct result {
+    int called;
+    int err;
+    char* image;
+    uint32_t size;
+};
+
+static void on_read(void* arg, int err, char* image, uint32_t size)
+{
+    struct result* r = arg;
+    ++r->called;
+    r->err = err;
+    r->image = image;
+    r->size = size;
+}
+
+static void on_done(void* arg, int err)
+{
+    struct result* r = arg;
+    ++r->called;
+    r->err = err;
+}
+
+// runs the callbacks as an event loop would, until `expected` of them ran
+static void run_callbacks(struct imgfs_async* async, size_t expected)
+{
+    size_t run = 0;
+    while (run < expected) {
+        struct pollfd pfd = { imgfs_async_fd(async), POLLIN, 0 };
+        ck_assert_int_eq(poll(&pfd, 1, 10000), 1);
+        run += imgfs_async_complete(async);
+    }
+    ck_assert_uint_eq(run, expected);
+}
+
+// the same image, read synchronously once the asynchronous access ended
+static void assert_same_as_sync(const char* dump, const char* img_id, int res, const struct result* r)
+{
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    char* image = NULL;
+    uint32_t size = 0;
+    ck_assert_err_none(do_read(img_id, res, &image, &size, &file));
+    ck_assert_uint_eq(size, r->size);
+    ck_assert_mem_eq(image, r->image, size);
+    free(image);
+    do_close(&file);
+}
+
+// ======================================================================
+START_TEST(async_null_params)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    struct imgfs_async async;
+    struct result r = {0};
+    ck_assert_invalid_arg(imgfs_async_init(NULL, &file, 1, 1));
+    ck_assert_invalid_arg(imgfs_async_init(&async, NULL, 1, 1));
+    ck_assert_invalid_arg(imgfs_async_init(&async, &file, 0, 1));
+    ck_assert_invalid_arg(imgfs_async_init(&async, &file, 1, 0));
+
+    ck_assert_err_none(imgfs_async_init(&async, &file, 1, 1));
+    ck_assert_invalid_arg(do_read_async(NULL, "pic1", ORIG_RES, on_read, &r));
+    ck_assert_invalid_arg(do_read_async(&async, NULL, ORIG_RES, on_read, &r));
+    ck_assert_invalid_arg(do_read_async(&async, "pic1", ORIG_RES, NULL, &r));
+    ck_assert_err(do_read_async(&async, "pic1", NB_RES, on_read, &r), ERR_RESOLUTIONS);
+    ck_assert_invalid_arg(do_insert_async(&async, NULL, 1, "pic", on_done, &r));
+    ck_assert_invalid_arg(do_insert_async(&async, "x", 1, NULL, on_done, &r));
+    ck_assert_invalid_arg(do_delete_async(&async, "pic1", NULL, &r));
+
+    char long_id[MAX_IMG_ID + 2];
+    memset(long_id, 'a', sizeof(long_id) - 1);
+    long_id[sizeof(long_id) - 1] = '\0';
+    ck_assert_err(do_delete_async(&async, long_id, on_done, &r), ERR_INVALID_IMGID);
+
+    // nothing was started
+    ck_assert_uint_eq(imgfs_async_complete(&async), 0);
+    ck_assert_int_eq(r.called, 0);
+
+    imgfs_async_destroy(&async);
+    do_close(&file);
+
+    // does not crash
+    imgfs_async_destroy(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(async_read)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_uint_eq(file.metadata[0].offset[SMALL_RES], 0);
+
+    struct imgfs_async async;
+    ck_assert_err_none(imgfs_async_init(&async, &file, 2, 4));
+
+    struct result orig = {0}, small = {0}, missing = {0};
+    ck_assert_err_none(do_read_async(&async, "pic1", ORIG_RES, on_read, &orig));
+    ck_assert_err_none(do_read_async(&async, "pic1", SMALL_RES, on_read, &small));
+    ck_assert_err_none(do_read_async(&async, "nope", ORIG_RES, on_read, &missing));
+    // the callbacks only run in imgfs_async_complete()
+    ck_assert_int_eq(orig.called + small.called + missing.called, 0);
+    run_callbacks(&async, 3);
+
+    ck_assert_int_eq(orig.called, 1);
+    ck_assert_err_none(orig.err);
+    ck_assert_ptr_nonnull(orig.image);
+    ck_assert_uint_eq(orig.size, file.metadata[0].size[ORIG_RES]);
+
+    ck_assert_int_eq(small.called, 1);
+    ck_assert_err_none(small.err);
+    ck_assert_ptr_nonnull(small.image);
+    ck_assert_uint_ne(file.metadata[0].offset[SMALL_RES], 0);
+    ck_assert_uint_eq(small.size, file.metadata[0].size[SMALL_RES]);
+
+    ck_assert_int_eq(missing.called, 1);
+    ck_assert_err(missing.err, ERR_IMAGE_NOT_FOUND);
+    ck_assert_ptr_null(missing.image);
+    ck_assert_uint_eq(missing.size, 0);
+
+    imgfs_async_destroy(&async);
+    do_close(&file);
+
+    // the resolution created was written to the file
+    assert_same_as_sync(dump, "pic1", ORIG_RES, &orig);
+    assert_same_as_sync(dump, "pic1", SMALL_RES, &small);
+    free(orig.image);
+    free(small.image);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(async_insert_delete)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    const uint32_t nb_files = file.header.nb_files;
+
+    static char image[PAPILLON_SIZE];
+    read_file(image, DATA_DIR "/papillon.jpg", PAPILLON_SIZE);
+
+    struct imgfs_async async;
+    ck_assert_err_none(imgfs_async_init(&async, &file, 2, 4));
+
+    struct result insert = {0}, duplicate = {0};
+    ck_assert_err_none(do_insert_async(&async, image, PAPILLON_SIZE, "papillon", on_done, &insert));
+    run_callbacks(&async, 1);
+    ck_assert_err_none(insert.err);
+    ck_assert_err_none(do_insert_async(&async, image, PAPILLON_SIZE, "papillon", on_done, &duplicate));
+    run_callbacks(&async, 1);
+    ck_assert_err(duplicate.err, ERR_DUPLICATE_ID);
+
+    struct result read = {0};
+    ck_assert_err_none(do_read_async(&async, "papillon", ORIG_RES, on_read, &read));
+    run_callbacks(&async, 1);
+    ck_assert_err_none(read.err);
+    ck_assert_uint_eq(read.size, PAPILLON_SIZE);
+    ck_assert_mem_eq(read.image, image, PAPILLON_SIZE);
+    free(read.image);
+
+    struct result delete = {0}, delete_again = {0};
+    ck_assert_err_none(do_delete_async(&async, "pic1", on_done, &delete));
+    ck_assert_err_none(do_delete_async(&async, "pic1", on_done, &delete_again));
+    run_callbacks(&async, 2);
+    // run by two workers, in either order: only one of them finds the image
+    ck_assert_int_eq(delete.err + delete_again.err, ERR_IMAGE_NOT_FOUND);
+    ck_assert(delete.err == ERR_NONE || delete_again.err == ERR_NONE);
+
+    memset(&read, 0, sizeof(read));
+    ck_assert_err_none(do_read_async(&async, "pic1", THUMB_RES, on_read, &read));
+    run_callbacks(&async, 1);
+    ck_assert_err(read.err, ERR_IMAGE_NOT_FOUND);
+
+    imgfs_async_destroy(&async);
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.header.nb_files, nb_files);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(async_many_in_flight)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    struct imgfs_async async;
+    ck_assert_err_none(imgfs_async_init(&async, &file, 1, 2));
+
+    // the pool is soon full of resizes: the others are refused, not queued
+    static struct result thumbs[MAX_RESULTS];
+    memset(thumbs, 0, sizeof(thumbs));
+    size_t accepted = 0, busy = 0;
+    for (size_t i = 0; i < MAX_RESULTS; ++i) {
+        const int ret = do_read_async(&async, "pic2", THUMB_RES, on_read, &thumbs[i]);
+        if (ret == ERR_NONE) {
+            ++accepted;
+        } else {
+            ck_assert_err(ret, ERR_BUSY);
+            ++busy;
+        }
+    }
+    ck_assert_uint_ge(accepted, 2);
+    ck_assert_uint_eq(accepted + busy, MAX_RESULTS);
+    run_callbacks(&async, accepted);
+
+    // once created, the reads never wait for the resizes (nor are refused)
+    static struct result reads[MAX_RESULTS];
+    memset(reads, 0, sizeof(reads));
+    for (size_t i = 0; i < MAX_RESULTS; ++i) {
+        ck_assert_err_none(do_read_async(&async, "pic2", i % 2 ? THUMB_RES : ORIG_RES, on_read, &reads[i]));
+    }
+    run_callbacks(&async, MAX_RESULTS);
+
+    const struct result* first = NULL;
+    for (size_t i = 0; i < MAX_RESULTS; ++i) {
+        if (!thumbs[i].called) {
+            continue;
+        }
+        ck_assert_err_none(thumbs[i].err);
+        first = first != NULL ? first : &thumbs[i];
+        ck_assert_uint_eq(thumbs[i].size, first->size);
+        ck_assert_mem_eq(thumbs[i].image, first->image, first->size);
+    }
+    for (size_t i = 0; i < MAX_RESULTS; ++i) {
+        ck_assert_int_eq(reads[i].called, 1);
+        ck_assert_err_none(reads[i].err);
+        if (i % 2) {
+            ck_assert_uint_eq(reads[i].size, first->size);
+            ck_assert_mem_eq(reads[i].image, first->image, first->size);
+        }
+        free(reads[i].image);
+    }
+    for (size_t i = 0; i < MAX_RESULTS; ++i) {
+        free(thumbs[i].image);
+    }
+
+    imgfs_async_destroy(&async);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *async_test_suite()
+{
+    Suite *s = suite_create("Tests for the asynchronous API");
+
+    Add_Test(s, async_null_params);
+    Add_Test(s, async_read);
+    Add_Test(s, async_insert_delete);
+    Add_Test(s, async_many_in_flight);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(async_test_suite)
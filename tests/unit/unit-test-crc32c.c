@@ -0,0 +1,237 @@
+#include "imgfs.h"
+#include "imgfscmd_functions.h"
+#include "crc32c.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#define PAPILLON_SIZE 72876
+
+// one bit at a time, straight from the definition
+static uint32_t crc32c_bitwise(const unsigned char* data, size_t size)
+{
+    uint32_t crc = 0xffffffffu;
+    for (size_t i = 0; i < size; ++i) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; ++k) {
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+static uint64_t file_size(const char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    ck_assert_ptr_nonnull(f);
+    ck_assert_int_eq(fseek(f, 0, SEEK_END), 0);
+    const long size = ftell(f);
+    fclose(f);
+    return (uint64_t) size;
+}
+
+static void flip_byte(const char* filename, uint64_t offset)
+{
+    FILE* f = fopen(filename, "rb+");
+    ck_assert_ptr_nonnull(f);
+    ck_assert_int_eq(fseek(f, (long) offset, SEEK_SET), 0);
+    const int c = fgetc(f);
+    ck_assert_int_ne(c, EOF);
+    ck_assert_int_eq(fseek(f, (long) offset, SEEK_SET), 0);
+    ck_assert_int_ne(fputc(c ^ 0x40, f), EOF);
+    fclose(f);
+}
+
+// ======================================================================
+START_TEST(crc32c_known_values)
+{
+    start_test_print;
+
+    // RFC 3720, B.4
+    unsigned char bytes[32];
+    memset(bytes, 0, sizeof(bytes));
+    ck_assert_uint_eq(crc32c(0, bytes, sizeof(bytes)), 0x8A9136AA);
+    memset(bytes, 0xff, sizeof(bytes));
+    ck_assert_uint_eq(crc32c(0, bytes, sizeof(bytes)), 0x62A8AB43);
+    for (unsigned char i = 0; i < 32; ++i) {
+        bytes[i] = i;
+    }
+    ck_assert_uint_eq(crc32c(0, bytes, sizeof(bytes)), 0x46DD794E);
+
+    ck_assert_uint_eq(crc32c(0, "123456789", 9), 0xE3069283);
+    ck_assert_uint_eq(crc32c(0, "", 0), 0);
+    ck_assert_uint_eq(crc32c(0x1234, NULL, 0), 0x1234);
+
+    unsigned char crc[CRC32C_BYTES];
+    crc32c_put(0xE3069283, crc);
+    ck_assert_uint_eq(crc[0], 0x83);
+    ck_assert_uint_eq(crc[3], 0xE3);
+    ck_assert_uint_eq(crc32c_get(crc), 0xE3069283);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(crc32c_large_and_chained)
+{
+    start_test_print;
+
+    // long enough for the striped computation, at every alignment
+    static unsigned char image[PAPILLON_SIZE];
+    read_file(image, DATA_DIR "/papillon.jpg", PAPILLON_SIZE);
+
+    for (size_t start = 0; start < 8; ++start) {
+        const size_t size = PAPILLON_SIZE - start - 5;
+        const uint32_t expected = crc32c_bitwise(image + start, size);
+        ck_assert_uint_eq(crc32c(0, image + start, size), expected);
+
+        const size_t cut = size / 3 + start;
+        ck_assert_uint_eq(crc32c(crc32c(0, image + start, cut), image + start + cut, size - cut), expected);
+    }
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(crc32c_store)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char* argv[] = { dump, "-max_files", "10", "-crc32c" };
+    ck_assert_err_none(do_create_cmd(4, argv));
+
+    static char image[PAPILLON_SIZE];
+    read_file(image, DATA_DIR "/papillon.jpg", PAPILLON_SIZE);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_uint_eq(file.header.flags, IMGFS_CRC32C);
+    const uint64_t data_start = sizeof(struct imgfs_header) + 10 * sizeof(struct img_metadata);
+
+    ck_assert_err_none(do_insert(image, PAPILLON_SIZE, "pic1", &file));
+    ck_assert_err_none(do_insert(image, PAPILLON_SIZE, "pic2", &file)); // deduplicated
+
+    char* read = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_read("pic2", ORIG_RES, &read, &read_size, &file));
+    ck_assert_uint_eq(read_size, PAPILLON_SIZE);
+    ck_assert_mem_eq(read, image, PAPILLON_SIZE);
+    free(read);
+
+    // the resized blob has its CRC too
+    ck_assert_err_none(do_read("pic1", SMALL_RES, &read, &read_size, &file));
+    free(read);
+    ck_assert_uint_eq(file.metadata[0].offset[SMALL_RES], data_start + PAPILLON_SIZE + CRC32C_BYTES);
+    const uint32_t small_size = file.metadata[0].size[SMALL_RES];
+    do_close(&file);
+    ck_assert_uint_eq(file_size(dump), data_start + PAPILLON_SIZE + small_size + 2 * CRC32C_BYTES);
+
+    struct verify_report report;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_err_none(do_verify(&file, 2, 0, &report));
+    ck_assert_uint_eq(report.nb_valid, 2);
+    ck_assert_uint_eq(report.bad_crc + report.bad_sha + report.overlaps + report.out_of_bounds, 0);
+    ck_assert_uint_eq(report.bytes_hashed, PAPILLON_SIZE + small_size);
+    do_close(&file);
+
+    // a silent corruption of the resized blob, which has no SHA
+    flip_byte(dump, data_start + PAPILLON_SIZE + CRC32C_BYTES + small_size / 2);
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_err(do_read("pic1", SMALL_RES, &read, &read_size, &file), ERR_CORRUPT_IMGFS);
+    ck_assert_ptr_null(read);
+    ck_assert_err_none(do_read("pic1", ORIG_RES, &read, &read_size, &file));
+    free(read);
+    ck_assert_err_none(do_verify(&file, 2, 0, &report));
+    ck_assert_uint_eq(report.bad_crc, 1);
+    ck_assert_uint_eq(report.bad_sha, 0);
+    do_close(&file);
+
+    // and of the CRC of the original
+    flip_byte(dump, data_start + PAPILLON_SIZE);
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_err(do_read("pic2", ORIG_RES, &read, &read_size, &file), ERR_CORRUPT_IMGFS);
+    ck_assert_err_none(do_verify(&file, 1, 0, &report));
+    ck_assert_uint_eq(report.bad_crc, 2);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(crc32c_streamed_insert)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char* argv[] = { dump, "-max_files", "10", "-crc32c" };
+    ck_assert_err_none(do_create_cmd(4, argv));
+
+    static char image[PAPILLON_SIZE];
+    read_file(image, DATA_DIR "/papillon.jpg", PAPILLON_SIZE);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    struct insert_stream stream;
+    ck_assert_err_none(do_insert_begin(&file, &stream));
+    ck_assert_err_none(do_insert_chunk(&stream, image, 1000));
+    ck_assert_err_none(do_insert_chunk(&stream, image + 1000, PAPILLON_SIZE - 1000));
+    ck_assert_err_none(do_insert_commit(&stream, "pic1"));
+
+    char* read = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_read("pic1", ORIG_RES, &read, &read_size, &file));
+    ck_assert_mem_eq(read, image, PAPILLON_SIZE);
+    free(read);
+    do_close(&file);
+
+    ck_assert_uint_eq(file_size(dump), sizeof(struct imgfs_header) + 10 * sizeof(struct img_metadata) +
+                      PAPILLON_SIZE + CRC32C_BYTES);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(crc32c_unknown_flags)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    FILE* f = fopen(dump, "rb+");
+    ck_assert_ptr_nonnull(f);
+    struct imgfs_header header;
+    ck_assert_int_eq(fread(&header, sizeof(header), 1, f), 1);
+    header.flags = 0x2;
+    ck_assert_int_eq(fseek(f, 0, SEEK_SET), 0);
+    ck_assert_int_eq(fwrite(&header, sizeof(header), 1, f), 1);
+    fclose(f);
+
+    struct imgfs_file file;
+    ck_assert_err(do_open(dump, "rb", &file), ERR_CORRUPT_IMGFS);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *crc32c_test_suite()
+{
+    Suite *s = suite_create("Tests for the CRC-32C of the blobs");
+
+    Add_Test(s, crc32c_known_values);
+    Add_Test(s, crc32c_large_and_chained);
+    Add_Test(s, crc32c_store);
+    Add_Test(s, crc32c_streamed_insert);
+    Add_Test(s, crc32c_unknown_flags);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(crc32c_test_suite)
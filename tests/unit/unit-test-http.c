@@ -1,4 +1,5 @@
 #include "http_prot.h"
+#include "http_scan.h"
 #include "test.h"
 #include <check.h>
 
@@ -17,6 +18,20 @@ inline static void ck_assert_has_header(const struct http_message *msg, const ch
     ck_abort_msg("Missing header %s: %s", key, value);
 }
 
+// Deterministic pseudo-random numbers, so that a failing fuzz case can be replayed
+static uint32_t fuzz_state = 202;
+static uint32_t fuzz_next(void)
+{
+    fuzz_state = fuzz_state * 1103515245u + 12345u;
+    return fuzz_state >> 8;
+}
+
+inline static void ck_assert_same_http_str(const struct http_string *a, const struct http_string *b)
+{
+    ck_assert_ptr_eq(a->val, b->val);
+    ck_assert_uint_eq(a->len, b->len);
+}
+
 // ======================================================================
 START_TEST(http_match_uri_null_params)
 {
@@ -158,6 +173,56 @@ START_TEST(http_get_var_valid)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(http_get_var_decoded)
+{
+    start_test_print;
+
+    char buf[16];
+
+    const char *str = "/imgfs/read?xres=thumb&res=orig&img_id=my%20pic%2b1&bad=%4";
+    struct http_string http_str = {.val = str, .len = strlen(str)};
+
+    // only whole parameter names match
+    ck_assert_int_eq(http_get_var(&http_str, "res", buf, 15), 4);
+    ck_assert_str_eq(buf, "orig");
+
+    ck_assert_int_eq(http_get_var(&http_str, "img_id", buf, 15), 8);
+    ck_assert_str_eq(buf, "my pic+1");
+
+    ck_assert_err(http_get_var(&http_str, "img_id", buf, 7), ERR_RUNTIME);
+    ck_assert_invalid_arg(http_get_var(&http_str, "bad", buf, 15));
+    ck_assert_int_eq(http_get_var(&http_str, "id", buf, 15), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_url_decode_valid)
+{
+    start_test_print;
+
+    char buf[8];
+
+    const struct http_string plain = {.val = "abc", .len = 3};
+    ck_assert_int_eq(http_url_decode(&plain, buf, sizeof(buf)), 3);
+    ck_assert_str_eq(buf, "abc");
+
+    const struct http_string escaped = {.val = "%41%2fz%7E", .len = 10};
+    ck_assert_int_eq(http_url_decode(&escaped, buf, sizeof(buf)), 4);
+    ck_assert_str_eq(buf, "A/z~");
+
+    const struct http_string nul = {.val = "a%00", .len = 4};
+    ck_assert_invalid_arg(http_url_decode(&nul, buf, sizeof(buf)));
+
+    const struct http_string truncated = {.val = "a%4", .len = 3};
+    ck_assert_invalid_arg(http_url_decode(&truncated, buf, sizeof(buf)));
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(http_parse_message_null_params)
 {
@@ -279,6 +344,228 @@ START_TEST(http_parse_message_full_headers_full_content)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(http_parse_message_invalid)
+{
+    start_test_print;
+
+    struct http_message msg;
+    int content_len;
+
+    const char *no_version = "GET /imgfs/list" HTTP_HDR_END_DELIM;
+    ck_assert_int_lt(http_parse_message(no_version, strlen(no_version), &msg, &content_len), 0);
+
+    const char *no_colon = "GET /imgfs/list HTTP/1.1" HTTP_LINE_DELIM "Host localhost" HTTP_HDR_END_DELIM;
+    ck_assert_int_lt(http_parse_message(no_colon, strlen(no_colon), &msg, &content_len), 0);
+
+    const char *bad_length = "POST /imgfs/insert?name=a HTTP/1.1" HTTP_LINE_DELIM
+                             "content-length: 12a" HTTP_HDR_END_DELIM;
+    ck_assert_int_lt(http_parse_message(bad_length, strlen(bad_length), &msg, &content_len), 0);
+
+    // the length of the buffer is honoured, not its null-termination
+    const char *cut = "GET /imgfs/list HTTP/1.1" HTTP_HDR_END_DELIM;
+    ck_assert_int_eq(http_parse_message(cut, strlen(cut) - 1, &msg, &content_len), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_scan_delims_isas_agree)
+{
+    start_test_print;
+
+    static const char alphabet[] = "ab :\r\n";
+    static char buf[4096];
+    static struct http_delims ref, got;
+    const enum http_scan_isa isas[] = { HTTP_SCAN_SSE42, HTTP_SCAN_AVX2, HTTP_SCAN_AUTO };
+
+    for (int n = 0; n < 2000; ++n) {
+        // mostly short buffers, sometimes one with more delimiters than can be recorded
+        const size_t len = n % 100 ? fuzz_next() % 300 : sizeof(buf);
+        for (size_t i = 0; i < len; ++i) {
+            buf[i] = alphabet[fuzz_next() % (sizeof(alphabet) - 1)];
+        }
+
+        http_scan_delims(HTTP_SCAN_SCALAR, buf, len, &ref);
+        for (size_t j = 0; j < sizeof(isas) / sizeof(isas[0]); ++j) {
+            http_scan_delims(isas[j], buf, len, &got);
+            ck_assert_uint_eq(got.count, ref.count);
+            ck_assert_uint_eq(got.head_end, ref.head_end);
+            ck_assert_int_eq(got.truncated, ref.truncated);
+            ck_assert_mem_eq(got.pos, ref.pos, ref.count * sizeof(ref.pos[0]));
+        }
+    }
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parse_message_indexed_fuzz)
+{
+    start_test_print;
+
+    static const char *const seeds[] = {
+        "GET /imgfs/read?res=orig&img_id=pic1 HTTP/1.1" HTTP_LINE_DELIM "Host: localhost:8000" HTTP_LINE_DELIM
+        "User-Agent: curl/8.5.0" HTTP_LINE_DELIM "Accept: */*" HTTP_HDR_END_DELIM,
+        "POST /imgfs/insert?name=a.jpg HTTP/1.1" HTTP_LINE_DELIM "Host:localhost:8000" HTTP_LINE_DELIM
+        "Referer: http://localhost:8000/index.html" HTTP_LINE_DELIM "Content-Length: 12" HTTP_HDR_END_DELIM
+        "Hello world!",
+        "GET / HTTP/1.0\nX-Empty:\nX-Blanks:  \t a b \t\n\nbody"
+    };
+    static const char noise[] = "\r\n: \tx";
+    char buf[512];
+    struct http_message ref, got;
+
+    for (int n = 0; n < 20000; ++n) {
+        const char *seed = seeds[fuzz_next() % (sizeof(seeds) / sizeof(seeds[0]))];
+        size_t len = strlen(seed);
+        memcpy(buf, seed, len);
+
+        // a few random byte replacements, then a random cut
+        const uint32_t nb_mutations = fuzz_next() % 4;
+        for (uint32_t m = 0; m < nb_mutations; ++m) {
+            buf[fuzz_next() % len] = noise[fuzz_next() % (sizeof(noise) - 1)];
+        }
+        len = fuzz_next() % 2 ? len : fuzz_next() % (len + 1);
+
+        memset(&ref, 0, sizeof(ref));
+        memset(&got, 0, sizeof(got));
+        int ref_content_len = -1, got_content_len = -1;
+        const int ref_ret = http_parse_message(buf, len, &ref, &ref_content_len);
+        const int got_ret = http_parse_message_indexed(buf, len, &got, &got_content_len);
+
+        ck_assert_int_eq(got_ret, ref_ret);
+        ck_assert_int_eq(got_content_len, ref_content_len);
+        if (ref_ret < 0) {
+            continue;
+        }
+        ck_assert_same_http_str(&got.method, &ref.method);
+        ck_assert_same_http_str(&got.uri, &ref.uri);
+        ck_assert_uint_eq(got.num_headers, ref.num_headers);
+        for (size_t i = 0; i < ref.num_headers; ++i) {
+            ck_assert_same_http_str(&got.headers[i].key, &ref.headers[i].key);
+            ck_assert_same_http_str(&got.headers[i].value, &ref.headers[i].value);
+        }
+        ck_assert_same_http_str(&got.body, &ref.body);
+    }
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_get_header_case_insensitive)
+{
+    start_test_print;
+
+    const char *str = "GET /imgfs/read?res=orig&img_id=pic1 HTTP/1.1" HTTP_LINE_DELIM
+                      "Host: localhost:8000" HTTP_LINE_DELIM
+                      "if-none-match: \"abc-orig\"" HTTP_HDR_END_DELIM;
+    struct http_message msg;
+    int content_len;
+
+    ck_assert_int_eq(http_parse_message(str, strlen(str), &msg, &content_len), 1);
+
+    const struct http_string *value = http_get_header(&msg, "If-None-Match");
+    ck_assert_ptr_nonnull(value);
+    ck_assert_http_str_eq((*value), "\"abc-orig\"");
+
+    ck_assert_ptr_null(http_get_header(&msg, "If-Match"));
+    ck_assert_ptr_null(http_get_header(&msg, "Hos"));
+    ck_assert_ptr_null(http_get_header(NULL, "Host"));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parse_range_valid)
+{
+    start_test_print;
+
+    struct http_range ranges[MAX_RANGES];
+    const char *str = "bytes=0-9, 100-, -5, 2000-3000";
+    struct http_string value = {.val = str, .len = strlen(str)};
+
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, MAX_RANGES), 3);
+    ck_assert_uint_eq(ranges[0].start, 0);
+    ck_assert_uint_eq(ranges[0].len, 10);
+    ck_assert_uint_eq(ranges[1].start, 100);
+    ck_assert_uint_eq(ranges[1].len, 900);
+    ck_assert_uint_eq(ranges[2].start, 995);
+    ck_assert_uint_eq(ranges[2].len, 5);
+
+    const char *big = "bytes=10-99999";
+    struct http_string big_value = {.val = big, .len = strlen(big)};
+    ck_assert_int_eq(http_parse_range(&big_value, 20, ranges, MAX_RANGES), 1);
+    ck_assert_uint_eq(ranges[0].start, 10);
+    ck_assert_uint_eq(ranges[0].len, 10);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parse_range_invalid)
+{
+    start_test_print;
+
+    struct http_range ranges[MAX_RANGES];
+    const char *invalid[] = {"bytes=", "items=0-9", "bytes=9-0", "bytes=-", "bytes=a-b", "bytes=0-9;"};
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+        struct http_string value = {.val = invalid[i], .len = strlen(invalid[i])};
+        ck_assert_fails(http_parse_range(&value, 1000, ranges, MAX_RANGES));
+    }
+
+    const char *unsatisfiable = "bytes=1000-, -0";
+    struct http_string value = {.val = unsatisfiable, .len = strlen(unsatisfiable)};
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, MAX_RANGES), 0);
+
+    const char *too_many = "bytes=0-0,1-1,2-2";
+    struct http_string many_value = {.val = too_many, .len = strlen(too_many)};
+    ck_assert_fails(http_parse_range(&many_value, 1000, ranges, 2));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_uri_path_valid)
+{
+    start_test_print;
+
+    const char *uris[] = { "/imgfs/read?res=orig&img_id=pic1", "/imgfs/list", "/?", "" };
+    const size_t path_lens[] = { 11, 11, 1, 0 };
+
+    for (size_t i = 0; i < sizeof(uris) / sizeof(uris[0]); ++i) {
+        const struct http_string uri = { uris[i], strlen(uris[i]) };
+        const struct http_string path = http_uri_path(&uri);
+        ck_assert_ptr_eq(path.val, uris[i]);
+        ck_assert_uint_eq(path.len, path_lens[i]);
+    }
+    ck_assert_uint_eq(http_uri_path(NULL).len, 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_trace_off_by_default)
+{
+    start_test_print;
+
+    ck_assert_int_eq(http_trace_enabled(), 0);
+    http_set_trace(42);
+    ck_assert_int_eq(http_trace_enabled(), 1);
+    http_set_trace(0);
+    ck_assert_int_eq(http_trace_enabled(), 0);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *http_test_suite()
 {
@@ -290,16 +577,29 @@ Suite *http_test_suite()
     Add_Test(s, http_match_verb_null_params);
     Add_Test(s, http_match_verb_valid);
 
+    Add_Test(s, http_uri_path_valid);
+    Add_Test(s, http_trace_off_by_default);
+
     Add_Test(s, http_get_var_null_params);
     Add_Test(s, http_get_var_not_found);
     Add_Test(s, http_get_var_too_big);
     Add_Test(s, http_get_var_valid);
+    Add_Test(s, http_get_var_decoded);
+    Add_Test(s, http_url_decode_valid);
 
     Add_Test(s, http_parse_message_null_params);
     Add_Test(s, http_parse_message_partial_headers);
     Add_Test(s, http_parse_message_full_headers_no_content);
     Add_Test(s, http_parse_message_full_headers_partial_content);
     Add_Test(s, http_parse_message_full_headers_full_content);
+    Add_Test(s, http_parse_message_invalid);
+    Add_Test(s, http_scan_delims_isas_agree);
+    Add_Test(s, http_parse_message_indexed_fuzz);
+
+    Add_Test(s, http_get_header_case_insensitive);
+
+    Add_Test(s, http_parse_range_valid);
+    Add_Test(s, http_parse_range_invalid);
 
     return s;
 }
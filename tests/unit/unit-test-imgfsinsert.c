@@ -338,6 +338,98 @@ START_TEST(do_insert_write_initializes_metadata)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_insert_stream_valid)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[82234];
+    struct imgfs_file file;
+    struct insert_stream stream;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/brouillard.jpg", 82234);
+
+    // Same result as do_insert(), whatever the chunking
+    ck_assert_err_none(do_insert_begin(&file, &stream));
+    for (size_t done = 0; done < 82234; done += 10000) {
+        const size_t len = 82234 - done < 10000 ? 82234 - done : 10000;
+        ck_assert_err_none(do_insert_chunk(&stream, image + done, len));
+    }
+    ck_assert_err_none(do_insert_commit(&stream, "pic3"));
+
+    do_close(&file);
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    const struct img_metadata *md = NULL;
+    for (uint32_t i = 0; i < file.header.max_files; ++i) {
+        if (strcmp(file.metadata[i].img_id, "pic3") == 0) {
+            md = &file.metadata[i];
+            break;
+        }
+    }
+    ck_assert_msg(md != NULL, "the inserted metadata could not be found by image id");
+
+    unsigned char pic_sha[SHA256_DIGEST_LENGTH] = {0xf8, 0x88, 0xf0, 0xdd, 0xd4, 0xf8, 0x24, 0x75, 0x99, 0xf6, 0xde,
+                                                   0x79, 0x7e, 0x0a, 0x6f, 0x55, 0x76, 0xd3, 0xd1, 0xe7, 0x41, 0x97,
+                                                   0xd3, 0x3d, 0xac, 0x09, 0x08, 0x94, 0xdb, 0x07, 0xbf, 0x1e
+                                                  };
+    ck_assert_mem_eq(md->SHA, pic_sha, SHA256_DIGEST_LENGTH);
+    ck_assert_int_eq(md->orig_res[0], 600);
+    ck_assert_int_eq(md->orig_res[1], 400);
+    ck_assert_int_eq(md->size[ORIG_RES], 82234);
+    ck_assert_int_eq(md->offset[ORIG_RES], 192659);
+    ck_assert_int_eq(md->is_valid, NON_EMPTY);
+    ck_assert_int_eq(file.header.version, 3);
+    ck_assert_int_eq(file.header.nb_files, 3);
+
+    // Same content under another name: the spooled copy is dropped
+    ck_assert_err_none(do_insert_begin(&file, &stream));
+    ck_assert_err_none(do_insert_chunk(&stream, image, 82234));
+    ck_assert_err_none(do_insert_commit(&stream, "pic4"));
+    ck_assert_err_none(fseek(file.file, 0, SEEK_END));
+    ck_assert_int_eq(ftell(file.file), 192659 + 82234);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_stream_abort)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[82234];
+    struct imgfs_file file;
+    struct insert_stream stream;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/brouillard.jpg", 82234);
+
+    ck_assert_err_none(do_insert_begin(&file, &stream));
+    ck_assert_err_none(do_insert_chunk(&stream, image, 82234));
+    ck_assert_err(do_insert_commit(&stream, "pic1"), ERR_DUPLICATE_ID);
+
+    ck_assert_err_none(do_insert_begin(&file, &stream));
+    ck_assert_err_none(do_insert_chunk(&stream, image, 1000));
+    do_insert_abort(&stream);
+
+    ck_assert_err_none(fseek(file.file, 0, SEEK_END));
+    ck_assert_int_eq(ftell(file.file), 192659);
+    ck_assert_int_eq(file.header.nb_files, 2);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_content_test_suite()
 {
@@ -352,6 +444,8 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, do_insert_valid);
     Add_Test(s, do_insert_write_correct_metadata);
     Add_Test(s, do_insert_write_initializes_metadata);
+    Add_Test(s, do_insert_stream_valid);
+    Add_Test(s, do_insert_stream_abort);
 
     return s;
 }
@@ -1,5 +1,6 @@
 #include "imgfs.h"
 #include "imgfscmd_functions.h"
+#include "imgfs_index.h"
 #include "test.h"
 #include "util.h"
 #include <check.h>
@@ -92,6 +93,81 @@ START_TEST(do_list_json_non_emtpy)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_list_page_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    struct imgfs_index index;
+    struct list_page page = {0};
+    char *str = NULL;
+    ck_assert_invalid_arg(do_list_page(NULL, &index, JSON, &page, &str));
+    ck_assert_invalid_arg(do_list_page(&file, NULL, JSON, &page, &str));
+    ck_assert_invalid_arg(do_list_page(&file, &index, JSON, NULL, &str));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_list_page_cursor)
+{
+    start_test_print;
+
+    char *out = NULL;
+    struct imgfs_file file;
+    struct imgfs_index index;
+
+    ck_assert_err_none(do_open(IMGFS("test13"), "rb", &file));
+    ck_assert_err_none(index_build(&file, &index));
+
+    struct list_page page = { .limit = 2 };
+    ck_assert_err_none(do_list_page(&file, &index, JSON, &page, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"pic1\", \"pic2\" ], \"next_cursor\": \"pic2\" }");
+    free(out);
+
+    page.cursor = "pic2";
+    ck_assert_err_none(do_list_page(&file, &index, JSON, &page, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"pic3\", \"pic4\" ] }");
+    free(out);
+
+    index_free(&index);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_list_page_prefix)
+{
+    start_test_print;
+
+    char *out = NULL;
+    struct imgfs_file file;
+    struct imgfs_index index;
+
+    ck_assert_err_none(do_open(IMGFS("test13"), "rb", &file));
+    ck_assert_err_none(index_build(&file, &index));
+
+    struct list_page page = { .prefix = "pic3" };
+    ck_assert_err_none(do_list_page(&file, &index, JSON, &page, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"pic3\" ] }");
+    free(out);
+
+    page.prefix = "nope";
+    ck_assert_err_none(do_list_page(&file, &index, JSON, &page, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ ] }");
+    free(out);
+
+    index_free(&index);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_structures_test_suite()
 {
@@ -105,6 +181,10 @@ Suite *imgfs_structures_test_suite()
 
     Add_Test(s, do_list_json_emtpy);
     Add_Test(s, do_list_json_non_emtpy);
+
+    Add_Test(s, do_list_page_null_params);
+    Add_Test(s, do_list_page_cursor);
+    Add_Test(s, do_list_page_prefix);
     return s;
 }
 
@@ -0,0 +1,298 @@
+#include "imgfs.h"
+#include "imgfs_index.h"
+#include "imgfs_lock.h"
+#include "image_content.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <vips/vips.h>
+
+#define BROUILLARD_SIZE 82234
+#define MURE_SIZE 40861
+
+// the slots given to the refresher, which applies them
+struct refreshed {
+    struct imgfs_file* file;
+    uint32_t slots[16];
+    size_t nb_slots;
+};
+
+static void record_slot(void* arg, uint32_t slot, const struct img_metadata* metadata)
+{
+    struct refreshed* r = arg;
+    ck_assert_uint_lt(r->nb_slots, 16);
+    r->slots[r->nb_slots++] = slot;
+    r->file->metadata[slot] = *metadata;
+}
+
+static off_t file_size(const char* filename)
+{
+    struct stat st;
+    ck_assert_int_eq(stat(filename, &st), 0);
+    return st.st_size;
+}
+
+// ======================================================================
+START_TEST(lock_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+    struct img_metadata metadata;
+
+    ck_assert_invalid_arg(imgfs_write_lock(NULL, NULL, NULL));
+    ck_assert_invalid_arg(do_refresh(NULL, NULL, NULL));
+    ck_assert_invalid_arg(imgfs_read_lock(NULL));
+    ck_assert_invalid_arg(write_header(NULL));
+    ck_assert_invalid_arg(write_metadata(&file, 0, NULL));
+    ck_assert_invalid_arg(read_metadata(&file, 0, NULL));
+    ck_assert_invalid_arg(read_metadata(&file, file.header.max_files, &metadata));
+
+    // read only: no write lock, but the refreshes work
+    ck_assert_err(imgfs_write_lock(&file, NULL, NULL), ERR_IO);
+    ck_assert_err_none(do_refresh(&file, NULL, NULL));
+    ck_assert_err_none(read_metadata(&file, 1, &metadata));
+    ck_assert_mem_eq(&metadata, &file.metadata[1], sizeof(metadata));
+
+    // does not crash
+    imgfs_write_unlock(NULL);
+    imgfs_read_unlock(NULL);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(lock_refresh_changed_slots)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    static char image[BROUILLARD_SIZE];
+    read_file(image, DATA_DIR "/brouillard.jpg", BROUILLARD_SIZE);
+
+    // two processes, as far as the locks are concerned: two open files
+    struct imgfs_file writer, reader;
+    ck_assert_err_none(do_open(dump, "rb+", &writer));
+    ck_assert_err_none(do_open(dump, "rb", &reader));
+
+    ck_assert_err_none(do_insert(image, BROUILLARD_SIZE, "brouillard", &writer));
+    ck_assert_err_none(do_delete("pic1", &writer));
+    ck_assert_uint_ne(reader.header.version, writer.header.version);
+
+    // only the two slots changed are given to the refresher
+    struct refreshed r = { .file = &reader };
+    ck_assert_err_none(do_refresh(&reader, record_slot, &r));
+    ck_assert_uint_eq(r.nb_slots, 2);
+    ck_assert_uint_eq(r.slots[0], 0);
+    ck_assert_uint_eq(r.slots[1], 2);
+    ck_assert_mem_eq(&reader.header, &writer.header, sizeof(struct imgfs_header));
+    ck_assert_mem_eq(reader.metadata, writer.metadata,
+                     writer.header.max_files * sizeof(struct img_metadata));
+
+    // nothing changed since
+    r.nb_slots = 0;
+    ck_assert_err_none(do_refresh(&reader, record_slot, &r));
+    ck_assert_uint_eq(r.nb_slots, 0);
+
+    do_close(&reader);
+    do_close(&writer);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(lock_stale_writer)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    static char brouillard[BROUILLARD_SIZE];
+    read_file(brouillard, DATA_DIR "/brouillard.jpg", BROUILLARD_SIZE);
+    static char mure[MURE_SIZE];
+    read_file(mure, DATA_DIR "/mure.jpg", MURE_SIZE);
+
+    struct imgfs_file first, second;
+    ck_assert_err_none(do_open(dump, "rb+", &first));
+    ck_assert_err_none(do_open(dump, "rb+", &second));
+    ck_assert_err_none(do_insert(brouillard, BROUILLARD_SIZE, "brouillard", &first));
+
+    // the second brings its copy up to date before writing: no slot is given twice
+    ck_assert_err(do_insert(brouillard, BROUILLARD_SIZE, "brouillard", &second), ERR_DUPLICATE_ID);
+    ck_assert_err_none(do_insert(mure, MURE_SIZE, "mure", &second));
+    ck_assert_str_eq(second.metadata[2].img_id, "brouillard");
+    ck_assert_str_eq(second.metadata[3].img_id, "mure");
+    ck_assert_err_none(do_delete("brouillard", &second));
+
+    // nor is an image deleted twice
+    ck_assert_err(do_delete("brouillard", &first), ERR_IMAGE_NOT_FOUND);
+    do_close(&first);
+    do_close(&second);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.header.nb_files, 3);
+    ck_assert_uint_eq(file.metadata[2].is_valid, EMPTY);
+    ck_assert_str_eq(file.metadata[3].img_id, "mure");
+    ck_assert_uint_eq(file.metadata[3].size[ORIG_RES], MURE_SIZE);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(lock_resize_adopted)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    struct imgfs_file first, second;
+    ck_assert_err_none(do_open(dump, "rb+", &first));
+    ck_assert_err_none(do_open(dump, "rb+", &second));
+    ck_assert_err_none(lazily_resize(THUMB_RES, &first, 0));
+    ck_assert_uint_ne(first.metadata[0].offset[THUMB_RES], 0);
+    const off_t size = file_size(dump);
+
+    // a resize does not change the version: the one already in the file is taken
+    ck_assert_uint_eq(second.metadata[0].offset[THUMB_RES], 0);
+    ck_assert_err_none(lazily_resize(THUMB_RES, &second, 0));
+    ck_assert_uint_eq(second.metadata[0].offset[THUMB_RES], first.metadata[0].offset[THUMB_RES]);
+    ck_assert_uint_eq(second.metadata[0].size[THUMB_RES], first.metadata[0].size[THUMB_RES]);
+    ck_assert_int_eq(file_size(dump), size);
+
+    do_close(&first);
+    do_close(&second);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(lock_index_refresh_slot)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+    struct imgfs_index index;
+    ck_assert_err_none(index_build(&file, &index));
+    uint32_t slot = 0;
+
+    // pic1 moved to the slot of pic2, which was deleted; its former slot comes later
+    struct img_metadata moved = file.metadata[0];
+    ck_assert_err_none(index_refresh_slot(&file, &index, 1, &moved));
+    ck_assert_uint_eq(index.nb_slots, 1);
+    ck_assert_err_none(index_find(&file, &index, "pic1", &slot));
+    ck_assert_uint_eq(slot, 1);
+    ck_assert_err(index_find(&file, &index, "pic2", &slot), ERR_IMAGE_NOT_FOUND);
+
+    struct img_metadata empty;
+    memset(&empty, 0, sizeof(empty));
+    ck_assert_err_none(index_refresh_slot(&file, &index, 0, &empty));
+    ck_assert_uint_eq(index.nb_slots, 1);
+    ck_assert_err_none(index_find(&file, &index, "pic1", &slot));
+    ck_assert_uint_eq(slot, 1);
+
+    ck_assert_invalid_arg(index_refresh_slot(&file, &index, file.header.max_files, &empty));
+    ck_assert_invalid_arg(index_refresh_slot(&file, NULL, 0, &empty));
+
+    index_free(&index);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(lock_changelog)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file created = { .header.max_files = 10, .header.resized_res = { 64, 64, 256, 256 },
+                                  .header.flags = IMGFS_CHANGELOG };
+    ck_assert_err_none(do_create(dump, &created));
+    do_close(&created);
+    static char brouillard[BROUILLARD_SIZE];
+    read_file(brouillard, DATA_DIR "/brouillard.jpg", BROUILLARD_SIZE);
+    static char mure[MURE_SIZE];
+    read_file(mure, DATA_DIR "/mure.jpg", MURE_SIZE);
+
+    struct imgfs_file writer, reader;
+    ck_assert_err_none(do_open(dump, "rb+", &writer));
+    ck_assert_err_none(do_open(dump, "rb", &reader));
+    ck_assert_err_none(do_insert(brouillard, BROUILLARD_SIZE, "brouillard", &writer));
+    ck_assert_err_none(do_insert(mure, MURE_SIZE, "mure", &writer));
+    ck_assert_err_none(do_delete("brouillard", &writer));
+
+    // a slot written without a new version is not logged...
+    struct img_metadata unlogged = writer.metadata[1];
+    strcpy(unlogged.img_id, "unlogged");
+    unlogged.is_valid = EMPTY;
+    ck_assert_err_none(write_metadata(&writer, 5, &unlogged));
+
+    // ...nor read: only the slots of the three changes are
+    struct refreshed r = { .file = &reader };
+    ck_assert_err_none(do_refresh(&reader, record_slot, &r));
+    ck_assert_uint_eq(r.nb_slots, 2);
+    ck_assert_uint_eq(r.slots[0], 0);
+    ck_assert_uint_eq(r.slots[1], 1);
+    ck_assert_mem_eq(&reader.header, &writer.header, sizeof(struct imgfs_header));
+    ck_assert_mem_eq(reader.metadata, writer.metadata, 2 * sizeof(struct img_metadata));
+    ck_assert_uint_eq(reader.metadata[5].img_id[0], '\0');
+
+    // the entry of the next change overwritten: the whole metadata is read instead
+    ck_assert_err_none(do_delete("mure", &writer));
+    const struct changelog_entry overwritten = { .version = 0, .slot = 0 };
+    const long entry_offset = (long) (sizeof(struct imgfs_header) + 10 * sizeof(struct img_metadata) +
+                                      writer.header.version % CHANGELOG_ENTRIES * sizeof(overwritten));
+    ck_assert_int_eq(fseek(writer.file, entry_offset, SEEK_SET), 0);
+    ck_assert_uint_eq(fwrite(&overwritten, sizeof(overwritten), 1, writer.file), 1);
+    ck_assert_int_eq(fflush(writer.file), 0);
+
+    r.nb_slots = 0;
+    ck_assert_err_none(do_refresh(&reader, record_slot, &r));
+    ck_assert_uint_eq(r.nb_slots, 2);
+    ck_assert_uint_eq(r.slots[0], 1);
+    ck_assert_uint_eq(r.slots[1], 5);
+    ck_assert_str_eq(reader.metadata[5].img_id, "unlogged");
+
+    // the log is not mistaken for a blob
+    struct verify_report report;
+    ck_assert_err_none(do_verify(&reader, 1, 0, &report));
+    ck_assert_uint_eq(report.out_of_bounds, 0);
+    ck_assert_uint_eq(report.overlaps, 0);
+
+    do_close(&reader);
+    do_close(&writer);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *lock_test_suite()
+{
+    Suite *s = suite_create("Tests for the processes sharing an imgFS");
+
+    Add_Test(s, lock_null_params);
+    Add_Test(s, lock_refresh_changed_slots);
+    Add_Test(s, lock_stale_writer);
+    Add_Test(s, lock_resize_adopted);
+    Add_Test(s, lock_index_refresh_slot);
+    Add_Test(s, lock_changelog);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(lock_test_suite)
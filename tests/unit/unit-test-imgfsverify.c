@@ -0,0 +1,188 @@
+#include "imgfs.h"
+#include "imgfscmd_functions.h"
+#include "test.h"
+#include <check.h>
+
+static struct img_metadata* find_slot(struct imgfs_file* file, const char* img_id)
+{
+    for (uint32_t i = 0; i < file->header.max_files; ++i) {
+        if (file->metadata[i].is_valid && !strcmp(file->metadata[i].img_id, img_id)) {
+            return &file->metadata[i];
+        }
+    }
+    ck_abort_msg("%s not found", img_id);
+    return NULL;
+}
+
+static uint32_t nb_problems(const struct verify_report* report)
+{
+    return report->bad_nb_files + report->bad_ids + report->duplicate_ids +
+           report->out_of_bounds + report->overlaps + report->bad_sha;
+}
+
+// ======================================================================
+START_TEST(do_verify_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    struct verify_report report;
+    ck_assert_invalid_arg(do_verify(NULL, 1, 0, &report));
+    memset(&file, 0, sizeof(file));
+    ck_assert_invalid_arg(do_verify(&file, 1, 0, &report));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_verify_consistent)
+{
+    start_test_print;
+
+    // pic2 and pic4 share their blobs (deduplication)
+    struct imgfs_file file;
+    struct verify_report report;
+    ck_assert_err_none(do_open(IMGFS("test04"), "rb", &file));
+    ck_assert_err_none(do_verify(&file, 4, 0, &report));
+    ck_assert_uint_eq(report.nb_valid, 4);
+    ck_assert_uint_eq(nb_problems(&report), 0);
+    ck_assert_uint_eq(report.bytes_hashed, 72876 + 98119 + 369911);
+    do_close(&file);
+
+    ck_assert_err_none(do_open(IMGFS("empty"), "rb", &file));
+    ck_assert_err_none(do_verify(&file, 1, 0, &report));
+    ck_assert_uint_eq(report.nb_valid, 0);
+    ck_assert_uint_eq(nb_problems(&report), 0);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_verify_finds_problems)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    struct verify_report report;
+    ck_assert_err_none(do_open(IMGFS("test04"), "rb", &file));
+
+    // the checks only read the in-memory metadata and the blobs on disk
+    find_slot(&file, "pic1")->SHA[0] ^= 1;
+    ck_assert_err_none(do_verify(&file, 2, 0, &report));
+    ck_assert_uint_eq(report.bad_sha, 1);
+    ck_assert_uint_eq(nb_problems(&report), 1);
+    find_slot(&file, "pic1")->SHA[0] ^= 1;
+
+    strcpy(find_slot(&file, "pic3")->img_id, "pic2");
+    ck_assert_err_none(do_verify(&file, 2, 0, &report));
+    ck_assert_uint_eq(report.duplicate_ids, 1);
+    ck_assert_uint_eq(nb_problems(&report), 1);
+    do_close(&file);
+    ck_assert_err_none(do_open(IMGFS("test04"), "rb", &file));
+
+    struct img_metadata* pic3 = find_slot(&file, "pic3");
+    const uint64_t offset = pic3->offset[ORIG_RES];
+    pic3->offset[ORIG_RES] = UINT32_MAX;
+    ck_assert_err_none(do_verify(&file, 2, 0, &report));
+    ck_assert_uint_eq(report.out_of_bounds, 1);
+    ck_assert_uint_eq(nb_problems(&report), 1);
+
+    pic3->offset[ORIG_RES] = find_slot(&file, "pic1")->offset[ORIG_RES] + 1;
+    ck_assert_err_none(do_verify(&file, 2, 0, &report));
+    ck_assert_uint_ge(report.overlaps, 1);
+    ck_assert_uint_eq(report.bad_sha, 1);
+    pic3->offset[ORIG_RES] = offset;
+
+    // the same blob for two different contents
+    find_slot(&file, "pic4")->SHA[0] ^= 1;
+    ck_assert_err_none(do_verify(&file, 2, 0, &report));
+    ck_assert_uint_ge(report.overlaps, 1);
+    ck_assert_uint_eq(report.bad_sha, 1);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_verify_repairs_nb_files)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    struct verify_report report;
+    DUPLICATE_FILE(dump, IMGFS("test04"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    file.header.nb_files = 7;
+    ck_assert_err_none(do_verify(&file, 1, 0, &report));
+    ck_assert_uint_eq(report.bad_nb_files, 1);
+    ck_assert_uint_eq(report.repaired, 0);
+
+    ck_assert_err_none(do_verify(&file, 1, 1, &report));
+    ck_assert_uint_eq(report.bad_nb_files, 1);
+    ck_assert_uint_eq(report.repaired, 1);
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.header.nb_files, 4);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_verify_cmd_correct)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    ck_assert_invalid_arg(do_verify_cmd(0, NULL));
+
+    DUPLICATE_FILE(dump, IMGFS("test04"));
+    char* argv[] = { dump, "--repair" };
+    ck_assert_err(do_verify_cmd(0, argv), ERR_NOT_ENOUGH_ARGUMENTS);
+    ck_assert_err_none(do_verify_cmd(1, argv));
+    ck_assert_err_none(do_verify_cmd(2, argv));
+
+    char* bad_option[] = { dump, "--force" };
+    ck_assert_invalid_arg(do_verify_cmd(2, bad_option));
+
+    // an image count off by one, then repaired
+    FILE* f = fopen(dump, "rb+");
+    ck_assert_ptr_nonnull(f);
+    struct imgfs_header header;
+    ck_assert_int_eq(fread(&header, sizeof(header), 1, f), 1);
+    ++header.nb_files;
+    ck_assert_int_eq(fseek(f, 0, SEEK_SET), 0);
+    ck_assert_int_eq(fwrite(&header, sizeof(header), 1, f), 1);
+    fclose(f);
+
+    ck_assert_err(do_verify_cmd(1, argv), ERR_CORRUPT_IMGFS);
+    ck_assert_err_none(do_verify_cmd(2, argv));
+    ck_assert_err_none(do_verify_cmd(1, argv));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_do_verify_test_suite()
+{
+    Suite *s = suite_create("Tests for do_verify implementation");
+
+    Add_Test(s, do_verify_null_params);
+    Add_Test(s, do_verify_consistent);
+    Add_Test(s, do_verify_finds_problems);
+    Add_Test(s, do_verify_repairs_nb_files);
+    Add_Test(s, do_verify_cmd_correct);
+
+    return s;
+}
+
+TEST_SUITE(imgfs_do_verify_test_suite)
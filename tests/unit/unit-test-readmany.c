@@ -0,0 +1,206 @@
+#include "imgfs.h"
+#include "imgfscmd_functions.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#define PAPILLON_SIZE 72876
+
+static void flip_byte(const char* filename, uint64_t offset)
+{
+    FILE* f = fopen(filename, "rb+");
+    ck_assert_ptr_nonnull(f);
+    ck_assert_int_eq(fseek(f, (long) offset, SEEK_SET), 0);
+    const int c = fgetc(f);
+    ck_assert_int_ne(c, EOF);
+    ck_assert_int_eq(fseek(f, (long) offset, SEEK_SET), 0);
+    ck_assert_int_ne(fputc(c ^ 0x40, f), EOF);
+    fclose(f);
+}
+
+// the image of a batch is the one do_read() gives
+static void assert_same_as_read(const struct batch_image* image, int res, struct imgfs_file* file)
+{
+    char* read = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_read(image->img_id, res, &read, &read_size, file));
+    ck_assert_uint_eq(image->size, read_size);
+    ck_assert_ptr_nonnull(image->content);
+    ck_assert_mem_eq(image->content, read, read_size);
+    free(read);
+}
+
+// ======================================================================
+START_TEST(read_many_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+    struct batch_image images[1] = { { .img_id = "pic1" } };
+    char* buffer = NULL;
+
+    ck_assert_invalid_arg(do_read_many(NULL, 1, ORIG_RES, &file, &buffer));
+    ck_assert_invalid_arg(do_read_many(images, 1, ORIG_RES, NULL, &buffer));
+    ck_assert_invalid_arg(do_read_many(images, 1, ORIG_RES, &file, NULL));
+    ck_assert_err(do_read_many(images, 1, NB_RES, &file, &buffer), ERR_RESOLUTIONS);
+    ck_assert_err(do_read_many(images, 1, -1, &file, &buffer), ERR_RESOLUTIONS);
+    images[0].img_id = NULL;
+    ck_assert_invalid_arg(do_read_many(images, 1, ORIG_RES, &file, &buffer));
+
+    ck_assert_invalid_arg(read_batch(NULL, images, 1, &buffer));
+    ck_assert_invalid_arg(read_batch(&file, NULL, 1, &buffer));
+    ck_assert_invalid_arg(read_batch(&file, images, 1, NULL));
+
+    // an empty batch is no error
+    ck_assert_err_none(do_read_many(images, 0, ORIG_RES, &file, &buffer));
+    free(buffer);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(read_many_orig)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    // in no particular order, with duplicates and a missing image
+    struct batch_image images[] = {
+        { .img_id = "pic2" }, { .img_id = "nope" }, { .img_id = "pic1" },
+        { .img_id = "pic2" }, { .img_id = "pic0" }
+    };
+    const size_t nb_images = sizeof(images) / sizeof(images[0]);
+    char* buffer = NULL;
+    ck_assert_err_none(do_read_many(images, nb_images, ORIG_RES, &file, &buffer));
+    ck_assert_ptr_nonnull(buffer);
+
+    ck_assert_err_none(images[0].err);
+    ck_assert_err(images[1].err, ERR_IMAGE_NOT_FOUND);
+    ck_assert_ptr_null(images[1].content);
+    ck_assert_err_none(images[2].err);
+    ck_assert_err_none(images[3].err);
+    ck_assert_err(images[4].err, ERR_IMAGE_NOT_FOUND);
+    ck_assert_uint_eq(images[2].size, file.metadata[0].size[ORIG_RES]);
+    ck_assert_uint_eq(images[0].size, file.metadata[1].size[ORIG_RES]);
+    assert_same_as_read(&images[0], ORIG_RES, &file);
+    assert_same_as_read(&images[2], ORIG_RES, &file);
+    assert_same_as_read(&images[3], ORIG_RES, &file);
+
+    free(buffer);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(read_many_resize)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_uint_eq(file.metadata[0].offset[THUMB_RES], 0);
+    ck_assert_uint_eq(file.metadata[1].offset[THUMB_RES], 0);
+
+    struct batch_image images[] = { { .img_id = "pic1" }, { .img_id = "pic2" } };
+    char* buffer = NULL;
+    ck_assert_err_none(do_read_many(images, 2, THUMB_RES, &file, &buffer));
+
+    // both were created, and are read again as they were written
+    ck_assert_uint_ne(file.metadata[0].offset[THUMB_RES], 0);
+    ck_assert_uint_ne(file.metadata[1].offset[THUMB_RES], 0);
+    for (size_t i = 0; i < 2; ++i) {
+        ck_assert_err_none(images[i].err);
+        ck_assert_uint_eq(images[i].size, file.metadata[i].size[THUMB_RES]);
+        assert_same_as_read(&images[i], THUMB_RES, &file);
+    }
+    free(buffer);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(read_many_crc)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char* argv[] = { dump, "-max_files", "10", "-crc32c" };
+    ck_assert_err_none(do_create_cmd(4, argv));
+
+    static char image[PAPILLON_SIZE];
+    read_file(image, DATA_DIR "/papillon.jpg", PAPILLON_SIZE);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_insert(image, PAPILLON_SIZE, "pic1", &file));
+    char* read = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_read("pic1", THUMB_RES, &read, &read_size, &file));
+    free(read);
+    ck_assert_err_none(do_read("pic1", SMALL_RES, &read, &read_size, &file));
+    free(read);
+    const uint64_t thumb_offset = file.metadata[0].offset[THUMB_RES];
+    const uint32_t thumb_size = file.metadata[0].size[THUMB_RES];
+    do_close(&file);
+
+    // a corruption of the thumbnail only fails its image
+    flip_byte(dump, thumb_offset + thumb_size / 2);
+    ck_assert_err_none(do_open(dump, "rb", &file));
+
+    // the three blobs are adjacent: a single read gives each its content
+    struct batch_image images[] = {
+        { .img_id = "pic1", .offset = file.metadata[0].offset[SMALL_RES], .size = file.metadata[0].size[SMALL_RES] },
+        { .img_id = "pic1", .offset = file.metadata[0].offset[ORIG_RES], .size = file.metadata[0].size[ORIG_RES] },
+        { .img_id = "pic1", .offset = thumb_offset, .size = thumb_size },
+        { .img_id = "none", .err = ERR_IMAGE_NOT_FOUND }
+    };
+    char* buffer = NULL;
+    ck_assert_err_none(read_batch(&file, images, 4, &buffer));
+    ck_assert_err_none(images[0].err);
+    assert_same_as_read(&images[0], SMALL_RES, &file);
+    ck_assert_err_none(images[1].err);
+    ck_assert_mem_eq(images[1].content, image, PAPILLON_SIZE);
+    ck_assert_err(images[2].err, ERR_CORRUPT_IMGFS);
+    ck_assert_ptr_null(images[2].content);
+    ck_assert_err(images[3].err, ERR_IMAGE_NOT_FOUND);
+    ck_assert_ptr_null(images[3].content);
+    free(buffer);
+
+    struct batch_image thumb = { .img_id = "pic1" };
+    ck_assert_err_none(do_read_many(&thumb, 1, THUMB_RES, &file, &buffer));
+    ck_assert_err(thumb.err, ERR_CORRUPT_IMGFS);
+    free(buffer);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *read_many_test_suite()
+{
+    Suite *s = suite_create("Tests for the batch reads");
+
+    Add_Test(s, read_many_null_params);
+    Add_Test(s, read_many_orig);
+    Add_Test(s, read_many_resize);
+    Add_Test(s, read_many_crc);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(read_many_test_suite)
@@ -0,0 +1,158 @@
+#include "imgfs.h"
+#include "imgfs_index.h"
+#include "seqlock.h"
+#include "test.h"
+#include <check.h>
+#include <pthread.h>
+#include <string.h>
+
+#define NB_WRITES 200000
+#define NB_READERS 3
+
+// a value which is only consistent if both halves agree
+struct pair {
+    uint64_t value;
+    uint64_t complement;
+};
+
+struct shared_pair {
+    uint32_t seq;
+    struct pair pair;
+    int done;
+};
+
+static void* write_pairs(void* arg)
+{
+    struct shared_pair* const shared = arg;
+    for (uint64_t i = 1; i <= NB_WRITES; ++i) {
+        seq_write_begin(&shared->seq);
+        shared->pair.value = i;
+        shared->pair.complement = ~i;
+        seq_write_end(&shared->seq);
+    }
+    __atomic_store_n(&shared->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void* read_pairs(void* arg)
+{
+    struct shared_pair* const shared = arg;
+    uint64_t last = 0;
+    size_t torn = 0;
+    while (!__atomic_load_n(&shared->done, __ATOMIC_ACQUIRE)) {
+        struct pair pair;
+        seq_read_copy(&shared->seq, &pair, &shared->pair, sizeof(pair));
+        // never torn, never going back in time
+        torn += pair.complement != ~pair.value || pair.value < last;
+        last = pair.value;
+    }
+    return (void*) torn;
+}
+
+// ======================================================================
+START_TEST(seqlock_counter)
+{
+    start_test_print;
+
+    uint32_t seq = 0;
+    uint32_t start = seq_read_begin(&seq);
+    ck_assert_int_eq(seq_read_retry(&seq, start), 0);
+
+    seq_write_begin(&seq);
+    ck_assert_uint_eq(seq & 1, 1);
+    seq_write_end(&seq);
+    ck_assert_uint_eq(seq & 1, 0);
+    // a write happened since the start
+    ck_assert_int_eq(seq_read_retry(&seq, start), 1);
+
+    start = seq_read_begin(&seq);
+    ck_assert_uint_eq(start, 2);
+    ck_assert_int_eq(seq_read_retry(&seq, start), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(seqlock_concurrent_copies)
+{
+    start_test_print;
+
+    struct shared_pair shared = { .pair = { 0, ~(uint64_t) 0 } };
+    pthread_t readers[NB_READERS];
+    for (size_t i = 0; i < NB_READERS; ++i) {
+        ck_assert_int_eq(pthread_create(&readers[i], NULL, read_pairs, &shared), 0);
+    }
+    pthread_t writer;
+    ck_assert_int_eq(pthread_create(&writer, NULL, write_pairs, &shared), 0);
+
+    pthread_join(writer, NULL);
+    for (size_t i = 0; i < NB_READERS; ++i) {
+        void* torn = NULL;
+        pthread_join(readers[i], &torn);
+        ck_assert_ptr_null(torn);
+    }
+    ck_assert_uint_eq(shared.pair.value, NB_WRITES);
+    ck_assert_uint_eq(shared.seq, 2 * NB_WRITES);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(seqlock_index_find_unlocked)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+    struct imgfs_index index;
+    ck_assert_err_none(index_build(&file, &index));
+    ck_assert_err_none(index_reserve_all(&file, &index));
+    ck_assert_uint_eq(index.capacity, file.header.max_files);
+    ck_assert_uint_eq(index.nb_slots, 2);
+
+    uint32_t slot = 0;
+    ck_assert_err_none(index_find_unlocked(&file, &index, "pic1", &slot));
+    ck_assert_uint_eq(slot, 0);
+    ck_assert_err_none(index_find_unlocked(&file, &index, "pic2", &slot));
+    ck_assert_uint_eq(slot, 1);
+    ck_assert_err(index_find_unlocked(&file, &index, "pic", &slot), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err(index_find_unlocked(&file, &index, "pic3", &slot), ERR_IMAGE_NOT_FOUND);
+    ck_assert_invalid_arg(index_find_unlocked(NULL, &index, "pic1", &slot));
+    ck_assert_invalid_arg(index_find_unlocked(&file, &index, NULL, &slot));
+    ck_assert_invalid_arg(index_reserve_all(&file, NULL));
+
+    // an entry being shifted may be anything: it is never followed out of the metadata
+    index.slots[0] = file.header.max_files + 7;
+    ck_assert_err(index_find_unlocked(&file, &index, "pic1", &slot), ERR_IMAGE_NOT_FOUND);
+
+    // the array is not moved by the additions
+    const uint32_t* const slots = index.slots;
+    index.slots[0] = 0;
+    ck_assert_err_none(index_remove(&file, &index, "pic1"));
+    ck_assert_err_none(index_add(&file, &index, "pic1"));
+    ck_assert_ptr_eq(index.slots, slots);
+    ck_assert_err_none(index_find_unlocked(&file, &index, "pic1", &slot));
+    ck_assert_uint_eq(slot, 0);
+
+    index_free(&index);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *seqlock_test_suite()
+{
+    Suite *s = suite_create("Tests for the sequence counters");
+
+    Add_Test(s, seqlock_counter);
+    Add_Test(s, seqlock_concurrent_copies);
+    Add_Test(s, seqlock_index_find_unlocked);
+
+    return s;
+}
+
+TEST_SUITE(seqlock_test_suite)
@@ -0,0 +1,164 @@
+#include "imgfs.h"
+#include "imgfs_shards.h"
+#include "test.h"
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#define BROUILLARD_SIZE 82234
+#define NB_IDS 1000
+
+static void write_manifest(const char* manifest, const char* content)
+{
+    FILE* file = fopen(manifest, "w");
+    ck_assert_ptr_nonnull(file);
+    fputs(content, file);
+    fclose(file);
+}
+
+// ======================================================================
+START_TEST(shards_manifest)
+{
+    start_test_print;
+
+    struct imgfs_shards shards;
+    ck_assert_invalid_arg(shards_load(NULL, &shards));
+    ck_assert_invalid_arg(shards_load(IMGFS("test02"), NULL));
+    ck_assert_int_eq(shards_is_manifest(NULL), 0);
+    ck_assert_int_eq(shards_is_manifest(IMGFS("test02")), 0);
+    ck_assert_err(shards_load(IMGFS("test02"), &shards), ERR_INVALID_FILENAME);
+
+    const char* const manifest = DATA_DIR "dump-shards_manifest.shards";
+    write_manifest(manifest, SHARDS_MAGIC "\n");
+    ck_assert_int_eq(shards_is_manifest(manifest), 1);
+    ck_assert_err(shards_load(manifest, &shards), ERR_INVALID_FILENAME);
+
+    // relative to the directory of the manifest, unless absolute
+    write_manifest(manifest, SHARDS_MAGIC "\ntest02.imgfs\n\n/elsewhere/other.imgfs\n");
+    ck_assert_err_none(shards_load(manifest, &shards));
+    ck_assert_uint_eq(shards.nb_shards, 2);
+    ck_assert_str_eq(shards.paths[0], DATA_DIR "test02.imgfs");
+    ck_assert_str_eq(shards.paths[1], "/elsewhere/other.imgfs");
+    shards_free(&shards);
+    ck_assert_uint_eq(shards.nb_shards, 0);
+    remove(manifest);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(shards_locate_consistent)
+{
+    start_test_print;
+
+    const char* const manifest = DATA_DIR "dump-shards_locate_consistent.shards";
+    struct imgfs_shards two, three;
+    write_manifest(manifest, SHARDS_MAGIC "\na.imgfs\nb.imgfs\n");
+    ck_assert_err_none(shards_load(manifest, &two));
+    write_manifest(manifest, SHARDS_MAGIC "\na.imgfs\nb.imgfs\nc.imgfs\n");
+    ck_assert_err_none(shards_load(manifest, &three));
+    remove(manifest);
+
+    // a shard added only takes images: the others stay where they were
+    size_t per_shard[3] = {0};
+    char img_id[MAX_IMG_ID + 1];
+    for (int i = 0; i < NB_IDS; ++i) {
+        snprintf(img_id, sizeof(img_id), "image-%d", i);
+        const size_t before = shards_locate(&two, img_id);
+        const size_t after = shards_locate(&three, img_id);
+        ck_assert_uint_lt(before, 2);
+        ck_assert(after == before || after == 2);
+        ++per_shard[after];
+    }
+    for (size_t s = 0; s < 3; ++s) {
+        ck_assert_uint_gt(per_shard[s], NB_IDS / 6);
+        ck_assert_uint_lt(per_shard[s], NB_IDS / 2);
+    }
+
+    shards_free(&two);
+    shards_free(&three);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(shards_add_moves)
+{
+    start_test_print;
+
+    DECLARE_DUMP_PREFIXED(0);
+    DECLARE_DUMP_PREFIXED(1);
+    DUPLICATE_FILE(dump0, IMGFS("test02"));
+    DUPLICATE_FILE(dump1, IMGFS("empty"));
+    static char image[BROUILLARD_SIZE];
+    read_file(image, DATA_DIR "/brouillard.jpg", BROUILLARD_SIZE);
+
+    // a single shard to start with
+    const char* const manifest = DATA_DIR "dump-shards_add_moves.shards";
+    char content[256];
+    snprintf(content, sizeof(content), SHARDS_MAGIC "\n%s\n", dump0 + strlen(DATA_DIR));
+    write_manifest(manifest, content);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump0, "rb+", &file));
+    char img_id[MAX_IMG_ID + 1];
+    for (int i = 0; i < 6; ++i) {
+        snprintf(img_id, sizeof(img_id), "img%d", i);
+        ck_assert_err_none(do_insert(image, BROUILLARD_SIZE, img_id, &file));
+    }
+    do_close(&file);
+
+    size_t moved = 0;
+    ck_assert_invalid_arg(shards_add(NULL, dump1, &moved));
+    ck_assert_err_none(shards_add(manifest, dump1, &moved));
+
+    struct imgfs_shards shards;
+    ck_assert_err_none(shards_load(manifest, &shards));
+    ck_assert_uint_eq(shards.nb_shards, 2);
+    struct imgfs_file files[2];
+    ck_assert_err_none(shards_open(&shards, "rb", files));
+
+    // every image in its owner, none lost
+    ck_assert_uint_eq(files[0].header.nb_files + files[1].header.nb_files, 8);
+    ck_assert_uint_eq(files[1].header.nb_files, moved);
+    const char* const ids[] = {"pic1", "pic2", "img0", "img1", "img2", "img3", "img4", "img5"};
+    for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); ++i) {
+        size_t shard = 0;
+        uint32_t slot = 0;
+        ck_assert_err_none(shards_find(&shards, files, ids[i], &shard, &slot));
+        ck_assert_uint_eq(shard, shards_locate(&shards, ids[i]));
+    }
+    size_t shard = 0;
+    uint32_t slot = 0;
+    ck_assert_err(shards_find(&shards, files, "nope", &shard, &slot), ERR_IMAGE_NOT_FOUND);
+    shards_close(files, shards.nb_shards);
+    shards_free(&shards);
+
+    // already there: nothing else to move
+    ck_assert_err_none(shards_add(manifest, dump1, &moved));
+    ck_assert_uint_eq(moved, 0);
+    ck_assert_err_none(shards_load(manifest, &shards));
+    ck_assert_uint_eq(shards.nb_shards, 2);
+    shards_free(&shards);
+    remove(manifest);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *shards_test_suite()
+{
+    Suite *s = suite_create("Tests for the sets of shards");
+
+    Add_Test(s, shards_manifest);
+    Add_Test(s, shards_locate_consistent);
+    Add_Test(s, shards_add_moves);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(shards_test_suite)
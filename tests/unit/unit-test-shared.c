@@ -0,0 +1,248 @@
+#include "imgfs.h"
+#include "imgfs_lock.h"
+#include "imgfs_shared.h"
+#include "seqlock.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#define BROUILLARD_SIZE 82234
+
+// ======================================================================
+START_TEST(shared_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+    struct imgfs_shared shared;
+    uint32_t slot = 0;
+
+    ck_assert_invalid_arg(imgfs_shared_attach(NULL, &file));
+    ck_assert_invalid_arg(imgfs_shared_attach(&shared, NULL));
+    ck_assert_invalid_arg(imgfs_shared_find(NULL, &file, "pic1", &slot));
+    ck_assert_invalid_arg(imgfs_shared_sync(NULL, &file));
+    struct list_page all = {0};
+    struct imgfs_index index;
+    ck_assert_invalid_arg(imgfs_shared_page(NULL, &file, &all, &index));
+
+    // read only: the write lock cannot be taken, nothing is attached
+    ck_assert_err(imgfs_shared_attach(&shared, &file), ERR_IO);
+    ck_assert_ptr_null(shared.segment);
+    ck_assert_invalid_arg(imgfs_shared_find(&shared, &file, "pic1", &slot));
+    ck_assert_int_eq(imgfs_shared_changed(&shared), 0);
+
+    // does not crash
+    imgfs_shared_detach(&shared, &file);
+    imgfs_shared_detach(NULL, &file);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(shared_seen_at_once)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    static char image[BROUILLARD_SIZE];
+    read_file(image, DATA_DIR "/brouillard.jpg", BROUILLARD_SIZE);
+
+    // two processes, as far as the locks are concerned: two open files
+    struct imgfs_file first, second;
+    ck_assert_err_none(do_open(dump, "rb+", &first));
+    ck_assert_err_none(do_open(dump, "rb+", &second));
+    struct imgfs_shared first_shared, second_shared;
+    ck_assert_err_none(imgfs_shared_attach(&first_shared, &first));
+    ck_assert_err_none(imgfs_shared_attach(&second_shared, &second));
+
+    uint32_t slot = 0;
+    ck_assert_err_none(imgfs_shared_find(&second_shared, &second, "pic2", &slot));
+    ck_assert_uint_eq(slot, 1);
+
+    // inserted by the first: the second finds it without reading anything
+    ck_assert_err_none(imgfs_write_lock_mapped(&first));
+    ck_assert_err_none(imgfs_shared_sync(&first_shared, &first));
+    seq_write_begin(first_shared.index_seq);
+    ck_assert_err_none(do_insert(image, BROUILLARD_SIZE, "brouillard", &first));
+    ck_assert_err_none(imgfs_shared_add(&first_shared, &first, "brouillard"));
+    ck_assert_err(imgfs_shared_add(&first_shared, &first, "brouillard"), ERR_DUPLICATE_ID);
+    seq_write_end(first_shared.index_seq);
+    imgfs_write_unlock(&first);
+
+    ck_assert_int_eq(imgfs_shared_changed(&second_shared), 0);
+    ck_assert_err_none(imgfs_shared_find(&second_shared, &second, "brouillard", &slot));
+    ck_assert_uint_eq(slot, 2);
+    ck_assert_uint_eq(second.metadata[slot].size[ORIG_RES], BROUILLARD_SIZE);
+
+    // and so for a delete
+    ck_assert_err_none(imgfs_write_lock_mapped(&second));
+    seq_write_begin(second_shared.index_seq);
+    ck_assert_err_none(do_delete("pic1", &second));
+    ck_assert_err_none(imgfs_shared_remove(&second_shared, &second, 0));
+    seq_write_end(second_shared.index_seq);
+    imgfs_write_unlock(&second);
+
+    ck_assert_int_eq(imgfs_shared_changed(&first_shared), 0);
+    ck_assert_err(imgfs_shared_find(&first_shared, &first, "pic1", &slot), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(imgfs_shared_find(&first_shared, &first, "pic2", &slot));
+
+    // detached, each gets back a copy of its own, up to date
+    imgfs_shared_detach(&second_shared, &second);
+    ck_assert_ptr_null(second_shared.segment);
+    ck_assert_uint_eq(second.metadata[0].is_valid, EMPTY);
+    ck_assert_str_eq(second.metadata[2].img_id, "brouillard");
+    do_close(&second);
+    imgfs_shared_detach(&first_shared, &first);
+    do_close(&first);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.header.nb_files, 2);
+    ck_assert_str_eq(file.metadata[2].img_id, "brouillard");
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(shared_unattached_writer)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    static char image[BROUILLARD_SIZE];
+    read_file(image, DATA_DIR "/brouillard.jpg", BROUILLARD_SIZE);
+
+    struct imgfs_file attached, other;
+    ck_assert_err_none(do_open(dump, "rb+", &attached));
+    ck_assert_err_none(do_open(dump, "rb+", &other));
+    struct imgfs_shared shared;
+    ck_assert_err_none(imgfs_shared_attach(&shared, &attached));
+
+    // written as usual (e.g. by imgfscmd): the table is built again
+    ck_assert_err_none(do_insert(image, BROUILLARD_SIZE, "brouillard", &other));
+    ck_assert_err_none(do_delete("pic2", &other));
+    ck_assert_int_eq(imgfs_shared_changed(&shared), 1);
+
+    uint32_t slot = 0;
+    ck_assert_err_none(imgfs_write_lock_mapped(&attached));
+    ck_assert_err_none(imgfs_shared_sync(&shared, &attached));
+    imgfs_write_unlock(&attached);
+    ck_assert_int_eq(imgfs_shared_changed(&shared), 0);
+    ck_assert_uint_eq(attached.header.version, other.header.version);
+    ck_assert_err_none(imgfs_shared_find(&shared, &attached, "brouillard", &slot));
+    ck_assert_uint_eq(slot, 2);
+    ck_assert_err(imgfs_shared_find(&shared, &attached, "pic2", &slot), ERR_IMAGE_NOT_FOUND);
+
+    imgfs_shared_detach(&shared, &attached);
+    do_close(&attached);
+    do_close(&other);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(shared_ordered_pages)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    static char image[BROUILLARD_SIZE];
+    read_file(image, DATA_DIR "/brouillard.jpg", BROUILLARD_SIZE);
+
+    struct imgfs_file first, second, other;
+    ck_assert_err_none(do_open(dump, "rb+", &first));
+    ck_assert_err_none(do_open(dump, "rb+", &second));
+    struct imgfs_shared first_shared, second_shared;
+    ck_assert_err_none(imgfs_shared_attach(&first_shared, &first));
+    ck_assert_err_none(imgfs_shared_attach(&second_shared, &second));
+
+    // inserted by the first: in order in the pages of the second
+    ck_assert_err_none(imgfs_write_lock_mapped(&first));
+    seq_write_begin(first_shared.index_seq);
+    ck_assert_err_none(do_insert(image, BROUILLARD_SIZE, "brouillard", &first));
+    ck_assert_err_none(imgfs_shared_add(&first_shared, &first, "brouillard"));
+    seq_write_end(first_shared.index_seq);
+    imgfs_write_unlock(&first);
+
+    struct imgfs_index index;
+    const struct list_page all = {0};
+    ck_assert_err_none(imgfs_shared_page(&second_shared, &second, &all, &index));
+    ck_assert_uint_eq(index.nb_slots, 3);
+    ck_assert_uint_eq(index.slots[0], 2); // brouillard
+    ck_assert_uint_eq(index.slots[1], 0); // pic1
+    ck_assert_uint_eq(index.slots[2], 1); // pic2
+    index_free(&index);
+
+    // from the cursor on, and no more than the page needs
+    const struct list_page after = { .cursor = "pic1", .limit = 1 };
+    ck_assert_err_none(imgfs_shared_page(&second_shared, &second, &after, &index));
+    ck_assert_uint_eq(index.nb_slots, 2);
+    ck_assert_uint_eq(index.slots[0], 0);
+    ck_assert_uint_eq(index.slots[1], 1);
+    index_free(&index);
+    const struct list_page prefixed = { .prefix = "pic", .limit = 1 };
+    ck_assert_err_none(imgfs_shared_page(&second_shared, &second, &prefixed, &index));
+    ck_assert_uint_eq(index.nb_slots, 2);
+    ck_assert_uint_eq(index.slots[0], 0);
+    index_free(&index);
+
+    // deleted by the second
+    ck_assert_err_none(imgfs_write_lock_mapped(&second));
+    seq_write_begin(second_shared.index_seq);
+    ck_assert_err_none(do_delete("pic1", &second));
+    ck_assert_err_none(imgfs_shared_remove(&second_shared, &second, 0));
+    seq_write_end(second_shared.index_seq);
+    imgfs_write_unlock(&second);
+
+    ck_assert_err_none(imgfs_shared_page(&first_shared, &first, &all, &index));
+    ck_assert_uint_eq(index.nb_slots, 2);
+    ck_assert_uint_eq(index.slots[0], 2);
+    ck_assert_uint_eq(index.slots[1], 1);
+    index_free(&index);
+
+    // written by a process not attached: ordered again by the sync
+    ck_assert_err_none(do_open(dump, "rb+", &other));
+    ck_assert_err_none(do_delete("brouillard", &other));
+    do_close(&other);
+    ck_assert_err_none(imgfs_write_lock_mapped(&first));
+    ck_assert_err_none(imgfs_shared_sync(&first_shared, &first));
+    imgfs_write_unlock(&first);
+    ck_assert_err_none(imgfs_shared_page(&second_shared, &second, &all, &index));
+    ck_assert_uint_eq(index.nb_slots, 1);
+    ck_assert_uint_eq(index.slots[0], 1);
+    index_free(&index);
+
+    imgfs_shared_detach(&second_shared, &second);
+    do_close(&second);
+    imgfs_shared_detach(&first_shared, &first);
+    do_close(&first);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *shared_test_suite()
+{
+    Suite *s = suite_create("Tests for the metadata shared by several processes");
+
+    Add_Test(s, shared_null_params);
+    Add_Test(s, shared_seen_at_once);
+    Add_Test(s, shared_unattached_writer);
+    Add_Test(s, shared_ordered_pages);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(shared_test_suite)
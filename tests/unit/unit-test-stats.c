@@ -0,0 +1,107 @@
+#include "stats.h"
+#include "error.h"
+#include "test.h"
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ======================================================================
+START_TEST(stats_counts_requests)
+{
+    start_test_print;
+
+    static struct stats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    stats_record(&stats, STATS_INSERT, 100, 1000, 50, ERR_NONE);
+    stats_record(&stats, STATS_INSERT, 300, 2000, 60, ERR_DUPLICATE_ID);
+    stats_record(&stats, STATS_READ_SMALL, 10, 0, 4096, ERR_BUSY);
+    // ignored
+    stats_record(NULL, STATS_LIST, 1, 1, 1, ERR_NONE);
+    stats_record(&stats, NB_STATS_OPS, 1, 1, 1, ERR_NONE);
+
+    ck_assert_uint_eq(stats.ops[STATS_INSERT].requests, 2);
+    ck_assert_uint_eq(stats.ops[STATS_INSERT].errors, 1);
+    ck_assert_uint_eq(stats.ops[STATS_INSERT].bytes_in, 3000);
+    ck_assert_uint_eq(stats.ops[STATS_INSERT].bytes_out, 110);
+    ck_assert_uint_eq(stats.ops[STATS_INSERT].latency_sum, 400);
+    ck_assert_uint_eq(stats.ops[STATS_INSERT].latency_max, 300);
+    ck_assert_uint_eq(stats.ops[STATS_LIST].requests, 0);
+    ck_assert_uint_eq(stats.errors_by_code[ERR_DUPLICATE_ID - ERR_FIRST], 1);
+    ck_assert_uint_eq(stats.errors_by_code[ERR_BUSY - ERR_FIRST], 1);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(stats_percentiles_within_precision)
+{
+    start_test_print;
+
+    static struct stats stats;
+    memset(&stats, 0, sizeof(stats));
+    ck_assert_uint_eq(stats_percentile(&stats, STATS_LIST, 0.5), 0);
+
+    // 1..10000 us, once each
+    for (uint64_t i = 1; i <= 10000; ++i) {
+        stats_record(&stats, STATS_LIST, i, 0, 0, ERR_NONE);
+    }
+
+    const double quantiles[] = { 0.5, 0.99, 0.999, 1.0 };
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i) {
+        const double expected = quantiles[i] * 10000;
+        const uint64_t got = stats_percentile(&stats, STATS_LIST, quantiles[i]);
+        ck_assert_msg(got >= expected && got <= expected * (1 + 1.0 / STATS_SUB_BUCKETS) + 1,
+                      "p%g: %lu instead of about %g", quantiles[i] * 100, (unsigned long) got, expected);
+    }
+    // small values are exact; huge ones are clamped, not lost
+    stats_record(&stats, STATS_DELETE, 7, 0, 0, ERR_NONE);
+    ck_assert_uint_eq(stats_percentile(&stats, STATS_DELETE, 0.5), 7);
+    stats_record(&stats, STATS_OTHER, UINT64_MAX, 0, 0, ERR_NONE);
+    ck_assert_uint_gt(stats_percentile(&stats, STATS_OTHER, 0.5), (uint64_t) 1 << STATS_MAX_SHIFT);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(stats_prometheus_text)
+{
+    start_test_print;
+
+    static struct stats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats_record(&stats, STATS_READ_THUMB, 42, 0, 1234, ERR_NONE);
+    stats_record(&stats, STATS_DELETE, 5, 0, 10, ERR_IMAGE_NOT_FOUND);
+
+    ck_assert_invalid_arg(stats_to_prometheus(NULL, NULL));
+
+    char* text = NULL;
+    ck_assert_err_none(stats_to_prometheus(&stats, &text));
+    ck_assert_ptr_nonnull(text);
+    ck_assert_ptr_nonnull(strstr(text, "# TYPE imgfs_requests_total counter\n"));
+    ck_assert_ptr_nonnull(strstr(text, "imgfs_requests_total{op=\"read_thumb\"} 1\n"));
+    ck_assert_ptr_nonnull(strstr(text, "imgfs_sent_bytes_total{op=\"read_thumb\"} 1234\n"));
+    ck_assert_ptr_nonnull(strstr(text, "imgfs_request_latency_microseconds{op=\"read_thumb\",quantile=\"0.99\"} 42\n"));
+    ck_assert_ptr_nonnull(strstr(text, "imgfs_request_latency_microseconds_count{op=\"delete\"} 1\n"));
+    ck_assert_ptr_nonnull(strstr(text, "imgfs_errors_total{code=\"ERR_IMAGE_NOT_FOUND\"} 1\n"));
+    free(text);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *stats_test_suite()
+{
+    Suite *s = suite_create("Tests of the request metrics");
+
+    Add_Test(s, stats_counts_requests);
+    Add_Test(s, stats_percentiles_within_precision);
+    Add_Test(s, stats_prometheus_text);
+
+    return s;
+}
+
+TEST_SUITE(stats_test_suite)
@@ -0,0 +1,294 @@
+#include "imgfs.h"
+#include "imgfscmd_functions.h"
+#include "storage.h"
+#include "test.h"
+#include <check.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+#define PAPILLON_SIZE 72876
+
+/**
+ * Switches to io_uring, which some kernels (or sandboxes) do not have:
+ * the tests using it then only check that stdio is still in use.
+ */
+static int use_uring(const struct imgfs_file* file)
+{
+    const int ret = storage_use("io_uring", file);
+    if (ret != ERR_NONE) {
+        ck_assert_err(ret, ERR_IO);
+        ck_assert_str_eq(storage_current()->name, "stdio");
+        printf("io_uring not available: skipped\n");
+        return 0;
+    }
+    ck_assert_str_eq(storage_current()->name, "io_uring");
+    return 1;
+}
+
+// ======================================================================
+START_TEST(storage_choice)
+{
+    start_test_print;
+
+    ck_assert_str_eq(storage_current()->name, "stdio");
+    ck_assert_invalid_arg(storage_use("floppy", NULL));
+    ck_assert_str_eq(storage_current()->name, "stdio");
+    ck_assert_err_none(storage_use(NULL, NULL));
+    ck_assert_str_eq(storage_current()->name, "stdio");
+
+    char byte = 0;
+    uint64_t end = 0;
+    ck_assert_invalid_arg(storage_read(NULL, 0, &byte, 1));
+    ck_assert_invalid_arg(storage_write(NULL, 0, &byte, 1));
+    ck_assert_invalid_arg(storage_end(NULL, &end));
+    ck_assert_invalid_arg(storage_flush(NULL));
+    ck_assert_invalid_arg(storage_sync(NULL));
+    ck_assert_invalid_arg(storage_register(NULL));
+
+    // does not crash
+    storage_release();
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(storage_read_write)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    for (int uring = 0; uring < 2; ++uring) {
+        struct imgfs_file file;
+        ck_assert_err_none(do_open(dump, "rb+", &file));
+        if (uring && !use_uring(&file)) {
+            do_close(&file);
+            break;
+        }
+
+        uint64_t end = 0;
+        ck_assert_err_none(storage_end(&file, &end));
+        const char text[] = "appended by the storage backend";
+        ck_assert_err_none(storage_write(&file, end, text, sizeof(text)));
+        uint64_t new_end = 0;
+        ck_assert_err_none(storage_end(&file, &new_end));
+        ck_assert_uint_eq(new_end, end + sizeof(text));
+
+        // the writes are read back, before and after a flush
+        char read[sizeof(text)];
+        ck_assert_err_none(storage_read(&file, end, read, sizeof(read)));
+        ck_assert_mem_eq(read, text, sizeof(text));
+        ck_assert_err_none(storage_flush(&file));
+        ck_assert_err_none(storage_sync(&file));
+
+        struct imgfs_header header;
+        ck_assert_err_none(storage_read(&file, 0, &header, sizeof(header)));
+        ck_assert_str_eq(header.name, file.header.name);
+
+        // reading past the end is an error
+        ck_assert_err(storage_read(&file, new_end - 1, read, 2), ERR_IO);
+
+        storage_release();
+        do_close(&file);
+    }
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(storage_uring_files)
+{
+    start_test_print;
+
+    DECLARE_DUMP_PREFIXED(1);
+    DECLARE_DUMP_PREFIXED(2);
+    DUPLICATE_FILE(dump1, IMGFS("test02"));
+    DUPLICATE_FILE(dump2, IMGFS("test02"));
+
+    struct imgfs_file files[2];
+    ck_assert_err_none(do_open(dump1, "rb+", &files[0]));
+    ck_assert_err_none(do_open(dump2, "rb+", &files[1]));
+    if (!use_uring(&files[0])) {
+        do_close(&files[0]);
+        do_close(&files[1]);
+        return;
+    }
+    // whether the kernel took them or not, the files are served
+    const int ret = storage_register(&files[1]);
+    ck_assert(ret == ERR_NONE || ret == ERR_IO);
+    ck_assert_int_eq(storage_register(&files[1]), ret);
+    (void) storage_register(&files[0]); // registered twice
+
+    for (size_t i = 0; i < 2; ++i) {
+        uint64_t end = 0;
+        ck_assert_err_none(storage_end(&files[i], &end));
+        const char text[] = "appended to a registered file";
+        ck_assert_err_none(storage_write(&files[i], end, text, sizeof(text)));
+        char read[sizeof(text)];
+        ck_assert_err_none(storage_read(&files[i], end, read, sizeof(read)));
+        ck_assert_mem_eq(read, text, sizeof(text));
+
+        struct imgfs_header header;
+        ck_assert_err_none(storage_read(&files[i], 0, &header, sizeof(header)));
+        ck_assert_str_eq(header.name, files[i].header.name);
+    }
+
+    storage_release();
+    // back to stdio: nothing to register
+    ck_assert_err_none(storage_register(&files[1]));
+    do_close(&files[0]);
+    do_close(&files[1]);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(storage_uring_library)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char* argv[] = { dump, "-max_files", "10", "-crc32c" };
+    ck_assert_err_none(do_create_cmd(4, argv));
+
+    static char image[PAPILLON_SIZE];
+    read_file(image, DATA_DIR "/papillon.jpg", PAPILLON_SIZE);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    if (!use_uring(&file)) {
+        do_close(&file);
+        return;
+    }
+
+    ck_assert_err_none(do_insert(image, PAPILLON_SIZE, "pic1", &file));
+    struct insert_stream stream;
+    ck_assert_err_none(do_insert_begin(&file, &stream));
+    ck_assert_err_none(do_insert_chunk(&stream, image, 1000));
+    ck_assert_err_none(do_insert_chunk(&stream, image + 1000, PAPILLON_SIZE - 1000));
+    ck_assert_err_none(do_insert_commit(&stream, "pic2")); // deduplicated
+
+    char* read = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_read("pic2", ORIG_RES, &read, &read_size, &file));
+    ck_assert_uint_eq(read_size, PAPILLON_SIZE);
+    ck_assert_mem_eq(read, image, PAPILLON_SIZE);
+    free(read);
+    ck_assert_err_none(do_read("pic1", SMALL_RES, &read, &read_size, &file));
+    free(read);
+    ck_assert_err_none(do_delete("pic2", &file));
+
+    storage_release();
+    do_close(&file);
+
+    // all of it reached the file
+    struct verify_report report;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.header.nb_files, 1);
+    ck_assert_err_none(do_verify(&file, 1, 0, &report));
+    ck_assert_uint_eq(report.nb_valid, 1);
+    ck_assert_uint_eq(report.bad_crc + report.bad_sha + report.overlaps + report.out_of_bounds, 0);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+struct receiver {
+    int socket;
+    char* buf;
+    size_t size;
+};
+
+static void* receive_all(void* arg)
+{
+    struct receiver* r = arg;
+    size_t got = 0;
+    while (got < r->size) {
+        const ssize_t n = read(r->socket, r->buf + got, r->size - got);
+        if (n <= 0) {
+            break;
+        }
+        got += (size_t) n;
+    }
+    r->size = got;
+    return NULL;
+}
+
+START_TEST(storage_uring_send)
+{
+    start_test_print;
+
+    // several times the size of the buffers of the ring
+    DECLARE_DUMP;
+    const size_t size = 3 * 1024 * 1024 + 123;
+    char* content = malloc(size);
+    ck_assert_ptr_nonnull(content);
+    for (size_t i = 0; i < size; ++i) {
+        content[i] = (char) (i * 7 + i / 4096);
+    }
+    FILE* f = fopen(dump, "wb+");
+    ck_assert_ptr_nonnull(f);
+    ck_assert_int_eq(fwrite(content, size, 1, f), 1);
+    fflush(f);
+
+    struct imgfs_file file;
+    memset(&file, 0, sizeof(file));
+    file.file = f;
+    if (!use_uring(&file)) {
+        fclose(f);
+        free(content);
+        return;
+    }
+    ck_assert_ptr_nonnull(storage_current()->send);
+
+    int sockets[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+    const size_t offset = 1001;
+    struct receiver r = { sockets[1], malloc(size), size - offset };
+    ck_assert_ptr_nonnull(r.buf);
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, receive_all, &r), 0);
+
+    ck_assert_err_none(storage_current()->send(sockets[0], fileno(f), (off_t) offset, size - offset));
+    close(sockets[0]);
+    pthread_join(thread, NULL);
+    ck_assert_uint_eq(r.size, size - offset);
+    ck_assert_mem_eq(r.buf, content + offset, size - offset);
+
+    // past the end of the file
+    ck_assert_err(storage_current()->send(sockets[1], fileno(f), (off_t) size - 10, 20), ERR_IO);
+
+    close(sockets[1]);
+    storage_release();
+    fclose(f);
+    free(r.buf);
+    free(content);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *storage_test_suite()
+{
+    Suite *s = suite_create("Tests for the storage backends");
+
+    Add_Test(s, storage_choice);
+    Add_Test(s, storage_read_write);
+    Add_Test(s, storage_uring_files);
+    Add_Test(s, storage_uring_library);
+    Add_Test(s, storage_uring_send);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(storage_test_suite)
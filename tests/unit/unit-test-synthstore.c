@@ -0,0 +1,135 @@
+#include "imgfs.h"
+#include "synth_store.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#define PAPILLON DATA_DIR "papillon.jpg"
+
+static const struct synth_config small_store = {
+    .slots = 200, .fill = 0.8, .deleted = 0.1, .dedup = 0.3,
+    .id_min = 4, .id_max = MAX_IMG_ID, .created = { 0.5, 1 }, .seed = 7, .crc = 1, .nb_cold = 10
+};
+
+static int generate(const struct synth_config* config, const char* path, struct imgfs_header* header)
+{
+    synth_header(config, header);
+    struct synth_model model;
+    int ret = synth_prepare_model(PAPILLON, header, config, &model);
+    uint64_t bytes = 0;
+    if (ret == ERR_NONE) {
+        ret = synth_generate(config, header, &model, path, &bytes);
+    }
+    synth_free_model(&model);
+    return ret;
+}
+
+// ======================================================================
+START_TEST(synth_null_params)
+{
+    start_test_print;
+
+    struct imgfs_header header;
+    struct synth_model model;
+    uint64_t bytes = 0;
+    double share = 0;
+    synth_header(&small_store, &header);
+    ck_assert_invalid_arg(synth_prepare_model(NULL, &header, &small_store, &model));
+    ck_assert_invalid_arg(synth_prepare_model(PAPILLON, NULL, &small_store, &model));
+    ck_assert_invalid_arg(synth_generate(NULL, &header, &model, "x", &bytes));
+    ck_assert_invalid_arg(synth_generate(&small_store, &header, &model, NULL, &bytes));
+    ck_assert_invalid_arg(synth_parse_share(NULL, &share));
+
+    ck_assert_err_none(synth_parse_share("0.25", &share));
+    ck_assert(share == 0.25);
+    ck_assert_invalid_arg(synth_parse_share("1.5", &share));
+    ck_assert_invalid_arg(synth_parse_share("half", &share));
+
+    // the flags must be the ones of the config: the others move the blobs
+    ck_assert_err_none(synth_prepare_model(PAPILLON, &header, &small_store, &model));
+    header.flags |= IMGFS_CHANGELOG;
+    ck_assert_invalid_arg(synth_generate(&small_store, &header, &model, "x", &bytes));
+    synth_free_model(&model);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(synth_store_verifies)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_header header;
+    ck_assert_err_none(generate(&small_store, dump, &header));
+
+    struct imgfs_file file;
+    struct verify_report report;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.header.flags, IMGFS_CRC32C);
+    ck_assert_uint_eq(file.header.nb_files, header.nb_files);
+    ck_assert_uint_gt(file.header.nb_files, 0);
+    // one version per insert, one more per delete
+    ck_assert_uint_ge(file.header.version, file.header.nb_files);
+    ck_assert_err_none(do_verify(&file, 2, 0, &report));
+    ck_assert_uint_eq(report.nb_valid, file.header.nb_files);
+    ck_assert_uint_eq(report.bad_nb_files + report.bad_ids + report.duplicate_ids +
+                      report.out_of_bounds + report.overlaps + report.bad_sha + report.bad_crc, 0);
+
+    // the last valid images have no resized version
+    uint32_t nb_cold = 0;
+    for (uint32_t i = file.header.max_files; i > 0 && nb_cold < small_store.nb_cold; --i) {
+        const struct img_metadata* metadata = &file.metadata[i - 1];
+        if (metadata->is_valid == NON_EMPTY) {
+            ck_assert_uint_eq(metadata->size[THUMB_RES], 0);
+            ck_assert_uint_eq(metadata->size[SMALL_RES], 0);
+            ++nb_cold;
+        }
+    }
+    ck_assert_uint_eq(nb_cold, small_store.nb_cold);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(synth_store_same_seed)
+{
+    start_test_print;
+    DECLARE_DUMP_PREFIXED(1);
+    DECLARE_DUMP_PREFIXED(2);
+
+    struct imgfs_header header1, header2;
+    ck_assert_err_none(generate(&small_store, dump1, &header1));
+    // the numbers drawn in between do not matter
+    (void) synth_rng_next();
+    ck_assert_err_none(generate(&small_store, dump2, &header2));
+    ck_assert_mem_eq(&header1, &header2, sizeof(header1));
+
+    struct imgfs_file file1, file2;
+    ck_assert_err_none(do_open(dump1, "rb", &file1));
+    ck_assert_err_none(do_open(dump2, "rb", &file2));
+    ck_assert_mem_eq(file1.metadata, file2.metadata, small_store.slots * sizeof(struct img_metadata));
+    do_close(&file1);
+    do_close(&file2);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *synth_store_test_suite()
+{
+    Suite *s = suite_create("Tests for the synthetic stores");
+
+    Add_Test(s, synth_null_params);
+    Add_Test(s, synth_store_verifies);
+    Add_Test(s, synth_store_same_seed);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(synth_store_test_suite)
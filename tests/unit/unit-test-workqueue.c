@@ -0,0 +1,110 @@
+#include "work_queue.h"
+#include "error.h"
+#include "test.h"
+#include "util.h" // _unused
+#include <check.h>
+#include <pthread.h>
+#include <unistd.h>
+
+static void count_job(void* arg)
+{
+    __atomic_add_fetch((int*) arg, 1, __ATOMIC_SEQ_CST);
+}
+
+// ======================================================================
+START_TEST(work_queue_null_params)
+{
+    start_test_print;
+
+    struct work_queue queue;
+    ck_assert_invalid_arg(work_queue_init(NULL, 1, 1, count_job, NULL));
+    ck_assert_invalid_arg(work_queue_init(&queue, 1, 1, NULL, NULL));
+    ck_assert_invalid_arg(work_queue_init(&queue, 0, 1, count_job, NULL));
+    ck_assert_invalid_arg(work_queue_init(&queue, 1, 0, count_job, NULL));
+    ck_assert_invalid_arg(work_queue_submit(NULL, NULL));
+
+    // does not crash
+    work_queue_destroy(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(work_queue_runs_every_job)
+{
+    start_test_print;
+
+    struct work_queue queue;
+    int count = 0;
+    ck_assert_err_none(work_queue_init(&queue, 3, 8, count_job, NULL));
+
+    int submitted = 0;
+    for (int i = 0; i < 100; ++i) {
+        // the workers may lag behind: a full queue refuses the job
+        if (work_queue_submit(&queue, &count) == ERR_NONE) {
+            ++submitted;
+        }
+    }
+    ck_assert_int_gt(submitted, 0);
+
+    // the jobs still queued are run before the workers stop
+    work_queue_destroy(&queue);
+    ck_assert_int_eq(count, submitted);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+static pthread_mutex_t job_gate = PTHREAD_MUTEX_INITIALIZER;
+static int started = 0;
+
+static void blocked_job(void* arg _unused)
+{
+    __atomic_add_fetch(&started, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&job_gate);
+    pthread_mutex_unlock(&job_gate);
+}
+
+START_TEST(work_queue_sheds_when_full)
+{
+    start_test_print;
+
+    struct work_queue queue;
+    ck_assert_err_none(work_queue_init(&queue, 1, 2, blocked_job, NULL));
+
+    pthread_mutex_lock(&job_gate);
+    // the worker takes the first job and blocks on it
+    ck_assert_err_none(work_queue_submit(&queue, NULL));
+    for (int i = 0; i < 1000 && __atomic_load_n(&started, __ATOMIC_SEQ_CST) == 0; ++i) {
+        usleep(1000);
+    }
+    ck_assert_int_eq(started, 1);
+
+    // two more may wait, the next one is refused
+    ck_assert_err_none(work_queue_submit(&queue, NULL));
+    ck_assert_err_none(work_queue_submit(&queue, NULL));
+    ck_assert_int_eq(work_queue_submit(&queue, NULL), ERR_BUSY);
+
+    pthread_mutex_unlock(&job_gate);
+    work_queue_destroy(&queue);
+    ck_assert_int_eq(started, 3);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *work_queue_test_suite()
+{
+    Suite *s = suite_create("Tests of the work queue");
+
+    Add_Test(s, work_queue_null_params);
+    Add_Test(s, work_queue_runs_every_job);
+    Add_Test(s, work_queue_sheds_when_full);
+
+    return s;
+}
+
+TEST_SUITE(work_queue_test_suite)